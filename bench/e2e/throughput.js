@@ -0,0 +1,260 @@
+// End-to-end throughput of the addon against the simulated scanner, or a
+// recorded session: transfer, encoding, marshalling into the scan() result
+// and consumption by JavaScript. Each batch size and output mode runs in
+// its own process so peak RSS is per run.
+//
+//   node bench/e2e/throughput.js [--batches=10,100,1000] [--outputs=base64,buffer]
+//       [--dpi=200] [--bit-depth=1] [--ppm=0] [--json=results.json]
+//       [--replay=session.twrec] [--replay-speed=0]
+//
+// With --replay the pages, format and pacing come from the recording.
+const { spawnSync } = require("child_process");
+const fs = require("fs");
+const os = require("os");
+const path = require("path");
+const { performance, monitorEventLoopDelay } = require("perf_hooks");
+
+const A4_WIDTH_INCHES = 210 / 25.4;
+const A4_HEIGHT_INCHES = 297 / 25.4;
+
+function parseArgs(argv) {
+  const args = {
+    batches: [10, 100, 1000],
+    outputs: ["base64", "buffer"],
+    dpi: 200,
+    bitDepth: 1,
+    ppm: 0,
+    json: null,
+    result: null,
+    replay: null,
+    replaySpeed: 0,
+  };
+  for (const arg of argv) {
+    const [key, value] = arg.replace(/^--/, "").split("=");
+    switch (key) {
+      case "batches":
+        args.batches = value.split(",").map(Number);
+        break;
+      case "outputs":
+        args.outputs = value.split(",");
+        break;
+      case "dpi":
+        args.dpi = Number(value);
+        break;
+      case "bit-depth":
+        args.bitDepth = Number(value);
+        break;
+      case "ppm":
+        args.ppm = Number(value);
+        break;
+      case "json":
+        args.json = value;
+        break;
+      case "result":
+        args.result = value;
+        break;
+      case "replay":
+        args.replay = value;
+        break;
+      case "replay-speed":
+        args.replaySpeed = Number(value);
+        break;
+      default:
+        throw new Error(`Unknown option ${arg}`);
+    }
+  }
+  if (args.replay) {
+    args.batches = [0];
+  }
+  return args;
+}
+
+function loadScanner() {
+  const root = path.join(__dirname, "..", "..");
+  for (const config of ["Release", "Debug"]) {
+    const addon = path.join(root, "build", config, "scanner.node");
+    if (fs.existsSync(addon)) {
+      return require(addon).Scanner;
+    }
+  }
+  throw new Error("scanner.node not found; build it with: npm run build:addon");
+}
+
+function percentile(sorted, p) {
+  if (sorted.length === 0) {
+    return 0;
+  }
+  const index = Math.min(sorted.length - 1, Math.ceil((p / 100) * sorted.length) - 1);
+  return sorted[Math.max(0, index)];
+}
+
+// What a consumer does with a page: get at the BMP bytes
+function consume(image) {
+  const bytes = typeof image === "string" ? Buffer.from(image, "base64") : image;
+  return bytes.length;
+}
+
+async function runChild(args) {
+  const batch = args.batches[0];
+  const output = args.outputs[0];
+  const Scanner = loadScanner();
+  const scanner = new Scanner();
+
+  if (args.replay) {
+    const replay = await scanner.useReplay(args.replay, { speed: args.replaySpeed });
+    if (!replay.success) {
+      throw new Error(`useReplay() failed: ${replay.errorMessage}`);
+    }
+  } else {
+    scanner.useSimulator({
+      pageWidth: Math.round(A4_WIDTH_INCHES * args.dpi),
+      pageHeight: Math.round(A4_HEIGHT_INCHES * args.dpi),
+      resolution: args.dpi,
+      bitDepth: args.bitDepth,
+      pagesPerMinute: args.ppm,
+      sheetCount: batch,
+    });
+  }
+  const init = await scanner.initialize();
+  if (!init.success) {
+    throw new Error(`initialize() failed: ${init.message}`);
+  }
+
+  // Main-thread time is what the scan costs the event loop between the
+  // call and the last page being usable
+  const delay = monitorEventLoopDelay({ resolution: 1 });
+  const eluStart = performance.eventLoopUtilization();
+  delay.enable();
+  const start = performance.now();
+
+  const result = await scanner.scan({ showUI: false, output });
+  const deliveredMs = performance.now() - start;
+  if (!result.success) {
+    throw new Error(`scan() failed: ${result.errorMessage}`);
+  }
+
+  const consumeStart = performance.now();
+  let bytes = 0;
+  for (const image of result.images) {
+    bytes += consume(image);
+  }
+  const consumeMs = performance.now() - consumeStart;
+  const totalMs = performance.now() - start;
+
+  delay.disable();
+  const elu = performance.eventLoopUtilization(eluStart);
+  await scanner.cleanup();
+
+  const pageMs = result.timings.pageMs.slice().sort((a, b) => a - b);
+  const pages = result.images.length;
+  return {
+    batch,
+    output,
+    pages,
+    pagesPerMinute: pages / (totalMs / 60000),
+    firstPageMs: result.timings.firstPageMs,
+    firstDeliveredMs: deliveredMs,
+    pageP50Ms: percentile(pageMs, 50),
+    pageP99Ms: percentile(pageMs, 99),
+    nativeMs: result.timings.totalMs,
+    marshalMs: deliveredMs - result.timings.totalMs,
+    consumeMs,
+    mainThreadBlockedMs: elu.active,
+    maxEventLoopDelayMs: delay.max / 1e6,
+    bytesPerPage: pages ? bytes / pages : 0,
+    peakRssBytes: process.resourceUsage().maxRSS * 1024,
+  };
+}
+
+function formatMiB(bytes) {
+  return (bytes / (1024 * 1024)).toFixed(1);
+}
+
+function printTable(results) {
+  const columns = [
+    ["batch", "Pages", (r) => r.pages],
+    ["output", "Output", (r) => r.output],
+    ["ppm", "Pages/min", (r) => r.pagesPerMinute.toFixed(0)],
+    ["ttfp", "1st page ms", (r) => r.firstPageMs.toFixed(1)],
+    ["delivered", "Delivered ms", (r) => r.firstDeliveredMs.toFixed(1)],
+    ["p50", "p50 ms", (r) => r.pageP50Ms.toFixed(2)],
+    ["p99", "p99 ms", (r) => r.pageP99Ms.toFixed(2)],
+    ["marshal", "Marshal ms", (r) => r.marshalMs.toFixed(1)],
+    ["consume", "Consume ms", (r) => r.consumeMs.toFixed(1)],
+    ["blocked", "Blocked ms", (r) => r.mainThreadBlockedMs.toFixed(1)],
+    ["rss", "Peak RSS MiB", (r) => formatMiB(r.peakRssBytes)],
+  ];
+  const rows = results.map((r) => columns.map(([, , cell]) => String(cell(r))));
+  const widths = columns.map(([, title], i) =>
+    Math.max(title.length, ...rows.map((row) => row[i].length))
+  );
+  const line = (cells) => cells.map((cell, i) => cell.padStart(widths[i])).join("  ");
+  console.log(line(columns.map(([, title]) => title)));
+  for (const row of rows) {
+    console.log(line(row));
+  }
+}
+
+// The addon logs to stdout, so a child reports through a file
+function runParent(args) {
+  const results = [];
+  const resultFile = path.join(os.tmpdir(), `scanner-throughput-${process.pid}.json`);
+  for (const batch of args.batches) {
+    for (const output of args.outputs) {
+      const child = spawnSync(
+        process.execPath,
+        [
+          __filename,
+          `--result=${resultFile}`,
+          `--batches=${batch}`,
+          `--outputs=${output}`,
+          `--dpi=${args.dpi}`,
+          `--bit-depth=${args.bitDepth}`,
+          `--ppm=${args.ppm}`,
+          ...(args.replay ? [`--replay=${args.replay}`, `--replay-speed=${args.replaySpeed}`] : []),
+        ],
+        { encoding: "utf8", stdio: ["ignore", "ignore", "pipe"] }
+      );
+      if (child.status !== 0 || !fs.existsSync(resultFile)) {
+        process.stderr.write(child.stderr || "");
+        throw new Error(`Run failed for ${batch} pages, ${output} output`);
+      }
+      results.push(JSON.parse(fs.readFileSync(resultFile, "utf8")));
+      fs.unlinkSync(resultFile);
+    }
+  }
+
+  printTable(results);
+  if (args.json) {
+    const report = {
+      context: {
+        date: new Date().toISOString(),
+        node: process.version,
+        platform: `${process.platform}-${process.arch}`,
+        dpi: args.dpi,
+        bitDepth: args.bitDepth,
+        pagesPerMinute: args.ppm,
+        replay: args.replay,
+        replaySpeed: args.replay ? args.replaySpeed : undefined,
+      },
+      results,
+    };
+    fs.writeFileSync(args.json, JSON.stringify(report, null, 2));
+  }
+}
+
+const args = parseArgs(process.argv.slice(2));
+if (args.result) {
+  runChild(args).then(
+    (result) => {
+      fs.writeFileSync(args.result, JSON.stringify(result));
+      process.exit(0);
+    },
+    (error) => {
+      console.error(error.message);
+      process.exit(1);
+    }
+  );
+} else {
+  runParent(args);
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <vector>
+
+// Minimal benchmark harness. Output follows the Google Benchmark JSON
+// layout so existing comparison tools can read it.
+
+// Work done by one iteration, used for the derived per-page rates
+struct BenchCounters {
+    double bytesIn;
+    double bytesOut;
+    double bytesMoved;  // Read and written in page-sized buffers, worked out from the code; 0 when not given
+    double pages;
+
+    BenchCounters() : bytesIn(0), bytesOut(0), bytesMoved(0), pages(0) {}
+};
+
+struct Benchmark {
+    std::string name;              // "<kernel>/<page>", e.g. "base64/a4_300dpi_24bit"
+    std::function<void(BenchCounters&)> setup;  // Untimed; reports the work per iteration
+    std::function<void()> run;                  // One timed iteration
+    std::function<void()> teardown;
+};
+
+class BenchRegistry {
+public:
+    typedef void (*Registrar)(std::vector<Benchmark>& benchmarks);
+
+    static void AddRegistrar(Registrar registrar);
+    static std::vector<Benchmark> Collect();
+};
+
+// Keeps a result alive so the optimizer cannot drop the work
+void BenchKeep(const void* data, size_t size);
+
+#define BENCH_REGISTRAR(fn) \
+    static const bool fn##_registered = (BenchRegistry::AddRegistrar(fn), true)
@@ -0,0 +1,592 @@
+#include "bench.h"
+#include "page_fixture.h"
+#include "../../src/cpp/imaging/auto_crop.h"
+#include "../../src/cpp/imaging/base64.h"
+#include "../../src/cpp/imaging/bitmap.h"
+#include "../../src/cpp/imaging/colour_dropout.h"
+#include "../../src/cpp/imaging/blank_page.h"
+#include "../../src/cpp/imaging/deskew.h"
+#include "../../src/cpp/imaging/despeckle.h"
+#include "../../src/cpp/imaging/page_hash.h"
+#include "../../src/cpp/imaging/page_stats.h"
+#include "../../src/cpp/imaging/perceptual_hash.h"
+#include "../../src/cpp/imaging/resample.h"
+#include "../../src/cpp/imaging/rotate.h"
+#include "../../src/cpp/imaging/strip_pipeline.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+namespace {
+
+// Scatters speckle noise over a 1 or 8 bit page, the same for every run:
+// dark specks of one to three pixels over about 0.1% of a bitonal page,
+// and black or white impulses on 1% of a grey one
+void AddSpeckles(const DibLayout& layout, BYTE* bits) {
+    size_t width = (size_t)layout.header->biWidth;
+    size_t height = (size_t)std::abs(layout.header->biHeight);
+    uint32_t seed = 12345;
+    auto next = [&seed](size_t range) {
+        seed = seed * 1664525u + 1013904223u;
+        return (size_t)(seed >> 8) % range;
+    };
+    if (layout.header->biBitCount == 8) {
+        for (size_t i = width * height / 100; i > 0; i--) {
+            bits[next(height) * layout.stride + next(width)] = next(2) ? 0xFF : 0x00;
+        }
+        return;
+    }
+    // Ink is the darker palette entry, as DespeckleStripStage takes it
+    const RGBQUAD* palette = (const RGBQUAD*)((const BYTE*)layout.header + layout.headerSize);
+    bool inkIsOne = layout.paletteSize >= 2 * sizeof(RGBQUAD) &&
+        palette[0].rgbRed + palette[0].rgbGreen + palette[0].rgbBlue >
+        palette[1].rgbRed + palette[1].rgbGreen + palette[1].rgbBlue;
+    for (size_t i = width * height / 2000; i > 0; i--) {
+        size_t x = next(width - 1), y = next(height - 1);
+        size_t pixels = 1 + next(3);
+        for (size_t p = 0; p < pixels; p++) {
+            size_t px = x + (p & 1), py = y + (p >> 1);
+            BYTE& byte = bits[py * layout.stride + px / 8];
+            BYTE mask = (BYTE)(0x80 >> (px & 7));
+            byte = inkIsOne ? (BYTE)(byte | mask) : (BYTE)(byte & ~mask);
+        }
+    }
+}
+
+// Order-0 entropy of the page's bytes less the byte to their left, PNG's
+// Sub filter, as a stand-in for its compressed size: the pages themselves
+// go out as uncompressed .bmp
+double CompressedEstimate(const DibLayout& layout) {
+    size_t rowBytes = ((size_t)layout.header->biWidth * layout.header->biBitCount + 7) / 8;
+    size_t height = (size_t)std::abs(layout.header->biHeight);
+    std::vector<double> counts(256, 0);
+    for (size_t y = 0; y < height; y++) {
+        const BYTE* row = layout.bits + y * layout.stride;
+        BYTE left = 0;
+        for (size_t x = 0; x < rowBytes; x++) {
+            counts[(BYTE)(row[x] - left)]++;
+            left = row[x];
+        }
+    }
+    double total = (double)(rowBytes * height), bits = 0;
+    for (size_t i = 0; i < 256; i++) {
+        if (counts[i] > 0) {
+            bits -= counts[i] * std::log2(counts[i] / total);
+        }
+    }
+    return std::ceil(bits / 8);
+}
+
+// Fixture plus the outputs of the earlier stages, so each benchmark times
+// only its own stage
+struct ImagingState {
+    TW_UINT16 resolution;
+    TW_UINT16 bitDepth;
+    const PageFixture* page;
+    DibLayout layout;
+    std::vector<BYTE> bmp;
+    std::string base64;
+    std::vector<BYTE> rotated;
+    std::vector<BYTE> turned;
+    std::vector<BYTE> cropped;
+    CropRect crop;  // A 5% platen border, as auto-crop would find it
+    std::vector<BYTE> noisy;  // The page with AddSpeckles' noise, for the despeckle benchmarks only
+    DibLayout noisyLayout;
+
+    ImagingState(TW_UINT16 res, TW_UINT16 bits) : resolution(res), bitDepth(bits), page(nullptr) {}
+
+    void Prepare() {
+        std::string error;
+        page = &GetPageFixture(resolution, bitDepth);
+        if (!ReadDibLayout(page->dib.data(), page->dib.size(), layout, error)) {
+            throw std::runtime_error(error);
+        }
+        AssembleBmp(layout, bmp);
+        EncodeBase64(bmp.data(), bmp.size(), base64);
+        uint32_t width = (uint32_t)layout.header->biWidth;
+        uint32_t height = (uint32_t)std::abs(layout.header->biHeight);
+        crop = CropRect(width / 20 / 8 * 8, height / 20, width - width / 20 / 8 * 8 * 2, height - height / 20 * 2);
+    }
+
+    void PrepareNoisy() {
+        std::string error;
+        noisy = page->dib;
+        if (!ReadDibLayout(noisy.data(), noisy.size(), noisyLayout, error)) {
+            throw std::runtime_error(error);
+        }
+        AddSpeckles(noisyLayout, &noisy[noisyLayout.bits - noisy.data()]);
+    }
+
+    double CroppedBytes() const {
+        return (double)((((size_t)crop.width * bitDepth + 31) / 32) * 4 * crop.height);
+    }
+};
+
+Benchmark MakeBenchmark(const std::string& name, const std::shared_ptr<ImagingState>& state,
+    double (*bytesIn)(const ImagingState&), double (*bytesOut)(const ImagingState&),
+    std::function<void()> run, double (*bytesMoved)(const ImagingState&) = nullptr) {
+    Benchmark benchmark;
+    benchmark.name = name;
+    benchmark.setup = [state, bytesIn, bytesOut, bytesMoved](BenchCounters& counters) {
+        state->Prepare();
+        counters.bytesIn = bytesIn(*state);
+        counters.bytesOut = bytesOut(*state);
+        counters.bytesMoved = bytesMoved ? bytesMoved(*state) : 0;
+        counters.pages = 1;
+    };
+    benchmark.run = run;
+    return benchmark;
+}
+
+double DibBytes(const ImagingState& state) { return (double)state.page->dib.size(); }
+double BmpBytes(const ImagingState& state) { return (double)state.bmp.size(); }
+double Base64Bytes(const ImagingState& state) { return (double)state.base64.size(); }
+double NoBytes(const ImagingState&) { return 0; }
+
+const double kPipelineSkew = 1.5;
+
+// Crop copies the rows kept in and out; deskew zero-fills its output,
+// reads the page and writes it, then copies it back; assembly copies it
+// into the .bmp; Base64 reads that and writes 4/3 of it
+double StagedBytesMoved(const ImagingState& state) {
+    double page = state.CroppedBytes();
+    return 2 * page + 3 * page + 2 * page + 2 * page + page + page * 4 / 3;
+}
+
+double CroppedBase64Bytes(const ImagingState& state) {
+    double bmp = sizeof(BITMAPFILEHEADER) + state.layout.headerSize + state.layout.paletteSize + state.CroppedBytes();
+    return std::ceil(bmp / 3) * 4;
+}
+
+// The rows kept are read once; everything else stays in cache but the text
+double FusedBytesMoved(const ImagingState& state) {
+    double page = state.CroppedBytes();
+    return page + page * 4 / 3;
+}
+
+// The Base64 text of the page as a grey or bitonal .bmp, against the
+// colour page's Base64Bytes
+double GreyBase64Bytes(const ImagingState& state, WORD bitCount) {
+    size_t width = (size_t)state.layout.header->biWidth;
+    size_t height = (size_t)std::abs(state.layout.header->biHeight);
+    double bmp = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + ((size_t)1 << bitCount) * sizeof(RGBQUAD) +
+        ((width * bitCount + 31) / 32) * 4 * height;
+    return std::ceil(bmp / 3) * 4;
+}
+
+double DroppedBase64Bytes(const ImagingState& state) { return GreyBase64Bytes(state, 8); }
+double BitonalBase64Bytes(const ImagingState& state) { return GreyBase64Bytes(state, 1); }
+
+// Dropout of the fixture's red stamp, encoded as EncodePage does
+void EncodeDropped(const ImagingState& state, const ColourDropoutOptions& options, std::string& base64) {
+    DibStripSource source;
+    ColourDropoutStripStage dropout(source);
+    ThresholdStripStage threshold(dropout);
+    if (source.Open(state.layout) && dropout.Open(options)) {
+        bool bitonal = options.outputBits == 1 && threshold.Open(options.threshold);
+        WriteBmpStrips(bitonal ? (StripStage&)threshold : (StripStage&)dropout, nullptr, &base64);
+    }
+}
+
+// Despeckling of the noisy page in the encoding pass
+void EncodeDespeckled(const ImagingState& state, std::vector<BYTE>* bmp, std::string* base64) {
+    DibStripSource source;
+    DespeckleStripStage despeckle(source);
+    if (source.Open(state.noisyLayout) && despeckle.Open(DespeckleOptions())) {
+        WriteBmpStrips(despeckle, bmp, base64);
+    }
+}
+
+// Reports the noisy page's estimated compressed size in and the
+// despeckled page's out, their difference being what despeckling saves
+Benchmark MakeDespeckleBenchmark(const std::string& name, const std::shared_ptr<ImagingState>& state) {
+    Benchmark benchmark;
+    benchmark.name = name;
+    benchmark.setup = [state](BenchCounters& counters) {
+        state->Prepare();
+        state->PrepareNoisy();
+        std::vector<BYTE> bmp;
+        DibLayout cleaned;
+        std::string error;
+        EncodeDespeckled(*state, &bmp, nullptr);
+        if (bmp.size() < sizeof(BITMAPFILEHEADER) ||
+            !ReadDibLayout(bmp.data() + sizeof(BITMAPFILEHEADER), bmp.size() - sizeof(BITMAPFILEHEADER), cleaned, error)) {
+            throw std::runtime_error("despeckle refused " + PageFixtureName(state->resolution, state->bitDepth));
+        }
+        counters.bytesIn = CompressedEstimate(state->noisyLayout);
+        counters.bytesOut = CompressedEstimate(cleaned);
+        counters.pages = 1;
+    };
+    benchmark.run = [state]() {
+        std::string base64;
+        EncodeDespeckled(*state, nullptr, &base64);
+        BenchKeep(base64.data(), base64.size());
+    };
+    benchmark.teardown = [state]() { std::vector<BYTE>().swap(state->noisy); };
+    return benchmark;
+}
+
+// CropDib's work, out of place so the fixture survives
+void CropCopy(const DibLayout& layout, const CropRect& rect, std::vector<BYTE>& out) {
+    size_t head = layout.headerSize + layout.paletteSize;
+    int bitCount = layout.header->biBitCount;
+    size_t height = (size_t)std::abs(layout.header->biHeight);
+    size_t stride = (((size_t)rect.width * bitCount + 31) / 32) * 4;
+    size_t rowBytes = ((size_t)rect.width * bitCount + 7) / 8;
+    bool bottomUp = layout.header->biHeight > 0;
+    size_t firstRow = bottomUp ? height - rect.top - rect.height : rect.top;
+    out.resize(head + stride * rect.height);
+    memcpy(out.data(), layout.header, head);
+    BITMAPINFOHEADER* header = (BITMAPINFOHEADER*)out.data();
+    header->biWidth = (LONG)rect.width;
+    header->biHeight = bottomUp ? (LONG)rect.height : -(LONG)rect.height;
+    header->biSizeImage = (DWORD)(stride * rect.height);
+    for (size_t row = 0; row < rect.height; row++) {
+        BYTE* to = out.data() + head + row * stride;
+        memcpy(to, layout.bits + (firstRow + row) * layout.stride + (size_t)rect.left * bitCount / 8, rowBytes);
+        memset(to + rowBytes, 0, stride - rowBytes);
+    }
+}
+
+// A pixel at a time, writing the output in order and reading down the
+// source columns: what RotateDib's blocked transposes are measured against
+void NaiveQuarterTurn(const DibLayout& layout, std::vector<BYTE>& out) {
+    const BITMAPINFOHEADER* header = layout.header;
+    size_t width = (size_t)header->biWidth;
+    size_t height = (size_t)(header->biHeight < 0 ? -header->biHeight : header->biHeight);
+    int bitCount = header->biBitCount;
+    size_t outStride = ((height * bitCount + 31) / 32) * 4;
+    out.assign(outStride * width, 0);
+    for (size_t y = 0; y < width; y++) {
+        BYTE* row = out.data() + y * outStride;
+        size_t column = width - 1 - y;
+        for (size_t x = 0; x < height; x++) {
+            const BYTE* from = layout.bits + x * layout.stride;
+            if (bitCount == 1) {
+                if ((from[column >> 3] >> (7 - (column & 7))) & 1) {
+                    row[x >> 3] |= (BYTE)(0x80 >> (x & 7));
+                }
+            } else {
+                size_t bytes = bitCount / 8;
+                memcpy(row + x * bytes, from + column * bytes, bytes);
+            }
+        }
+    }
+}
+
+// Every stage of the per-page encode in ProcessImage, plus the whole of it.
+// Benchmarks for one page are registered together so the fixture is
+// rendered once per page.
+// Known answers from the xxhash and hashlib reference implementations
+// for KnownAnswerInput, around XXH3's 16, 128 and 240 byte boundaries
+// and past its 1 KiB blocks
+struct HashKnownAnswer {
+    size_t size;
+    const char* xxh3;
+    const char* sha256;
+};
+
+const HashKnownAnswer kHashKnownAnswers[] = {
+    { 0, "2d06800538d394c2", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+    { 1, "dd02fbe6d2c66464", "35af2d15ebde4d67b29569ec19749e813c76f02286afc5a2a9871c2bfbdaab32" },
+    { 3, "feea62717a65f4b9", "64e7dbd1c9287ef40bcbeb3a385983e6ef31bb60e1214e9a896125bc1b7a1d4a" },
+    { 16, "726c0d7e2ce27907", "b0b14baae99bf7f8a542b28187781cef089bf4fc1ba4f735ce9ca3a81d76c648" },
+    { 17, "48c881938b08bf45", "e848f3ea56f86e64aac3496eb5adf6778e25161992e7bebb527e7904b80648bf" },
+    { 128, "3764bcdb112e17fa", "f11bdef60d01f2f2490dbe03479f6395a8ca071e81a11958cad38c500e9a71e9" },
+    { 129, "3eb30581b3d9c562", "ba39c45d98d13628c46b5c7ea808f40208c0fd24c6a0f8dc5398366ebb385d2a" },
+    { 240, "3cac406073fb6376", "926bd4ba5705bf3385c3daec8d763a0b8c8d180321140796ba61c0be149159df" },
+    { 241, "6deb1ae71a8a8bec", "ab9bc64fda588a16aeac17430f0d2a7407e3b53f66640e8c884ea4b48da77811" },
+    { 1060921, "34ebf3024eedd983", "2c85a20815043a69b12662c9f7e9cee9cb3ab1ff0829558d36108580eb5b2620" },
+};
+
+// Byte i is the top byte of 0x9E3779B1 * (i + 1), modulo 2^32
+std::vector<BYTE> KnownAnswerInput(size_t size) {
+    std::vector<BYTE> input(size);
+    for (size_t i = 0; i < size; i++) {
+        input[i] = (BYTE)((0x9E3779B1u * (uint32_t)(i + 1)) >> 24);
+    }
+    return input;
+}
+
+// Inputs past a megabyte are also fed in odd-sized chunks, which cross
+// the hashers' buffer and stripe boundaries at every offset
+void CheckHashKnownAnswers() {
+    static const size_t chunks[] = { 1, 3, 17, 63, 129, 241, 1023, 4093, 65521 };
+    const size_t chunkCount = sizeof(chunks) / sizeof(chunks[0]);
+
+    for (const HashKnownAnswer& answer : kHashKnownAnswers) {
+        std::vector<BYTE> input = KnownAnswerInput(answer.size);
+        std::vector<PageDigests> results;
+
+        PageHasher whole(kPageHashFastAndSha256);
+        whole.Update(input.data(), input.size());
+        results.push_back(whole.Finish());
+
+        if (answer.size > (1 << 20)) {
+            PageHasher chunked(kPageHashFastAndSha256);
+            size_t offset = 0;
+            for (size_t i = 0; offset < input.size(); i++) {
+                size_t size = std::min(chunks[i % chunkCount], input.size() - offset);
+                chunked.Update(input.data() + offset, size);
+                offset += size;
+            }
+            results.push_back(chunked.Finish());
+        }
+
+        for (const PageDigests& digests : results) {
+            if (digests.xxh3 != answer.xxh3 || digests.sha256 != answer.sha256) {
+                throw std::runtime_error("page hash of " + std::to_string(answer.size) + " known bytes is " +
+                    digests.xxh3 + " / " + digests.sha256 + ", expected " + answer.xxh3 + " / " + answer.sha256);
+            }
+        }
+    }
+}
+
+// Adds the known-answer checks to the setup
+Benchmark WithHashCheck(Benchmark benchmark) {
+    std::function<void(BenchCounters&)> setup = benchmark.setup;
+    benchmark.setup = [setup](BenchCounters& counters) {
+        CheckHashKnownAnswers();
+        setup(counters);
+    };
+    return benchmark;
+}
+
+// Crop, deskew, assembly and Base64 a stage at a time, each over the
+// whole page
+void EncodeStaged(ImagingState& state, std::vector<BYTE>& bmp, std::string& base64) {
+    DibLayout cropped;
+    std::string error;
+    std::vector<BYTE> rotated;
+    CropCopy(state.layout, state.crop, state.cropped);
+    if (ReadDibLayout(state.cropped.data(), state.cropped.size(), cropped, error) &&
+        RotatePixels(cropped, kPipelineSkew, rotated)) {
+        memcpy((BYTE*)cropped.bits, rotated.data(), rotated.size());
+        AssembleBmp(cropped, bmp);
+        EncodeBase64(bmp.data(), bmp.size(), base64);
+    }
+}
+
+// The same in the strip pipeline EncodePage runs them in; exactly one of
+// bmp and base64 is given, as to WriteBmpStrips
+void EncodeFused(const ImagingState& state, std::vector<BYTE>* bmp, std::string* base64) {
+    DibStripSource source;
+    DeskewStripStage deskew(source);
+    if (source.Open(state.layout, &state.crop) && deskew.Open(kPipelineSkew)) {
+        WriteBmpStrips(deskew, bmp, base64);
+    }
+}
+
+// Adds to the setup a check that both pipelines write the same .bmp and
+// Base64 for the page, so a fused pipeline gone wrong fails the run
+// instead of timing different work
+Benchmark WithPipelineCheck(Benchmark benchmark, const std::shared_ptr<ImagingState>& state) {
+    std::function<void(BenchCounters&)> setup = benchmark.setup;
+    benchmark.setup = [setup, state](BenchCounters& counters) {
+        setup(counters);
+        std::vector<BYTE> stagedBmp, fusedBmp;
+        std::string stagedBase64, fusedBase64;
+        EncodeStaged(*state, stagedBmp, stagedBase64);
+        EncodeFused(*state, &fusedBmp, nullptr);
+        EncodeFused(*state, nullptr, &fusedBase64);
+        std::string page = PageFixtureName(state->resolution, state->bitDepth);
+        if (stagedBmp.empty() || stagedBmp.size() != fusedBmp.size() ||
+            memcmp(stagedBmp.data(), fusedBmp.data(), stagedBmp.size()) != 0) {
+            throw std::runtime_error("staged and fused pipelines wrote different .bmp files for " + page);
+        }
+        if (stagedBase64.size() != fusedBase64.size() ||
+            memcmp(stagedBase64.data(), fusedBase64.data(), stagedBase64.size()) != 0) {
+            throw std::runtime_error("staged and fused pipelines wrote different Base64 for " + page);
+        }
+    };
+    return benchmark;
+}
+
+void RegisterImaging(std::vector<Benchmark>& benchmarks) {
+    for (size_t r = 0; r < kFixtureResolutionCount; r++) {
+        for (size_t b = 0; b < kFixtureBitDepthCount; b++) {
+            std::shared_ptr<ImagingState> state(new ImagingState(kFixtureResolutions[r], kFixtureBitDepths[b]));
+            std::string page = PageFixtureName(state->resolution, state->bitDepth);
+
+            benchmarks.push_back(MakeBenchmark("dib_layout/" + page, state, DibBytes, NoBytes, [state]() {
+                DibLayout parsed;
+                std::string error;
+                ReadDibLayout(state->page->dib.data(), state->page->dib.size(), parsed, error);
+                BenchKeep(parsed.bits, parsed.imageSize);
+            }));
+
+            benchmarks.push_back(MakeBenchmark("bmp_assemble/" + page, state, DibBytes, BmpBytes, [state]() {
+                AssembleBmp(state->layout, state->bmp);
+                BenchKeep(state->bmp.data(), state->bmp.size());
+            }));
+
+            // Assembly with the page hashes fused in, against bmp_assemble
+            const PageHashMode modes[] = { kPageHashFast, kPageHashFastAndSha256 };
+            const char* modeNames[] = { "bmp_assemble_xxh3/", "bmp_assemble_sha256/" };
+            for (int m = 0; m < 2; m++) {
+                PageHashMode mode = modes[m];
+                benchmarks.push_back(WithHashCheck(MakeBenchmark(modeNames[m] + page, state, DibBytes, BmpBytes, [state, mode]() {
+                    PageHasher pixels(mode), file(mode);
+                    AssembleBmp(state->layout, state->bmp, &pixels, &file);
+                    PageDigests digests = file.Finish();
+                    BenchKeep(digests.xxh3.data(), digests.xxh3.size());
+                })));
+            }
+
+            benchmarks.push_back(MakeBenchmark("crop_bounds/" + page, state, DibBytes, NoBytes, [state]() {
+                CropRect rect;
+                FindDocumentBounds(state->layout, AutoCropOptions(), rect);
+                BenchKeep(&rect, sizeof(rect));
+            }));
+
+            benchmarks.push_back(MakeBenchmark("blank_detect/" + page, state, DibBytes, NoBytes, [state]() {
+                BlankPageAnalysis analysis;
+                AnalyzeBlankPage(state->layout, BlankPageOptions(), analysis);
+                BenchKeep(&analysis, sizeof(analysis));
+            }));
+
+            benchmarks.push_back(MakeBenchmark("perceptual_hash/" + page, state, DibBytes, NoBytes, [state]() {
+                uint64_t hash = 0;
+                PerceptualHash(state->layout, hash);
+                BenchKeep(&hash, sizeof(hash));
+            }));
+
+            // The fixture is straight, so the search covers the full range
+            // without an early answer; rotation is by a typical feeder skew
+            benchmarks.push_back(MakeBenchmark("deskew_estimate/" + page, state, DibBytes, NoBytes, [state]() {
+                double angle = 0;
+                EstimateSkew(state->layout, DeskewOptions().maxAngle, angle);
+                BenchKeep(&angle, sizeof(angle));
+            }));
+
+            benchmarks.push_back(MakeBenchmark("deskew_rotate/" + page, state, DibBytes, DibBytes, [state]() {
+                RotatePixels(state->layout, 2.0, state->rotated);
+                BenchKeep(state->rotated.data(), state->rotated.size());
+            }));
+
+            // Back sides turned the right way up, and a quarter turn both
+            // blocked and naive
+            benchmarks.push_back(MakeBenchmark("rotate180/" + page, state, DibBytes, DibBytes, [state]() {
+                state->turned.resize(RotatedDibSize(state->layout, 180));
+                RotateDib(state->layout, 180, state->turned.data());
+                BenchKeep(state->turned.data(), state->turned.size());
+            }));
+
+            benchmarks.push_back(MakeBenchmark("rotate90/" + page, state, DibBytes, DibBytes, [state]() {
+                state->turned.resize(RotatedDibSize(state->layout, 90));
+                RotateDib(state->layout, 90, state->turned.data());
+                BenchKeep(state->turned.data(), state->turned.size());
+            }));
+
+            benchmarks.push_back(MakeBenchmark("rotate90_naive/" + page, state, DibBytes, DibBytes, [state]() {
+                NaiveQuarterTurn(state->layout, state->turned);
+                BenchKeep(state->turned.data(), state->turned.size());
+            }));
+
+            // Down to two thirds of the fixture resolution, as from 300 to 200
+            // dpi, with each filter
+            const ResampleFilter filters[] = { kResampleLanczos, kResampleArea };
+            const char* filterNames[] = { "resample_lanczos/", "resample_area/" };
+            for (int f = 0; f < 2; f++) {
+                ResampleFilter filter = filters[f];
+                benchmarks.push_back(MakeBenchmark(filterNames[f] + page, state, DibBytes, NoBytes, [state, filter]() {
+                    size_t width = (size_t)state->layout.header->biWidth * 2 / 3;
+                    size_t height = (size_t)std::abs(state->layout.header->biHeight) * 2 / 3;
+                    state->turned.resize(ResampledDibSize(state->layout, width, height));
+                    ResampleDib(state->layout, width, height, filter, state->turned.data());
+                    BenchKeep(state->turned.data(), state->turned.size());
+                }));
+            }
+
+            benchmarks.push_back(MakeBenchmark("base64/" + page, state, BmpBytes, Base64Bytes, [state]() {
+                EncodeBase64(state->bmp.data(), state->bmp.size(), state->base64);
+                BenchKeep(state->base64.data(), state->base64.size());
+            }));
+
+            // Crop, deskew, assembly and Base64 of a page a stage at a time,
+            // each over the whole page, against the strip pipeline
+            // EncodePage runs them in
+            benchmarks.push_back(WithPipelineCheck(MakeBenchmark("pipeline_staged/" + page, state, DibBytes, CroppedBase64Bytes, [state]() {
+                std::vector<BYTE> bmp;
+                std::string base64;
+                EncodeStaged(*state, bmp, base64);
+                BenchKeep(base64.data(), base64.size());
+            }, StagedBytesMoved), state));
+
+            benchmarks.push_back(WithPipelineCheck(MakeBenchmark("pipeline_fused/" + page, state, DibBytes, CroppedBase64Bytes, [state]() {
+                std::string base64;
+                EncodeFused(*state, nullptr, &base64);
+                BenchKeep(base64.data(), base64.size());
+            }, FusedBytesMoved), state));
+
+            // Colour dropout in the encoding pass, whose output against
+            // encode_page's is the size saved
+            if (state->bitDepth == 24) {
+                ColourDropoutOptions channel, hue, bitonal;
+                channel.mode = kDropoutRed;
+                hue.mode = bitonal.mode = kDropoutHueRange;
+                bitonal.outputBits = 1;
+                benchmarks.push_back(MakeBenchmark("colour_dropout_channel/" + page, state, DibBytes, DroppedBase64Bytes,
+                    [state, channel]() {
+                    std::string base64;
+                    EncodeDropped(*state, channel, base64);
+                    BenchKeep(base64.data(), base64.size());
+                }));
+                benchmarks.push_back(MakeBenchmark("colour_dropout_hue/" + page, state, DibBytes, DroppedBase64Bytes,
+                    [state, hue]() {
+                    std::string base64;
+                    EncodeDropped(*state, hue, base64);
+                    BenchKeep(base64.data(), base64.size());
+                }));
+                benchmarks.push_back(MakeBenchmark("colour_dropout_bw/" + page, state, DibBytes, BitonalBase64Bytes,
+                    [state, bitonal]() {
+                    std::string base64;
+                    EncodeDropped(*state, bitonal, base64);
+                    BenchKeep(base64.data(), base64.size());
+                }));
+            }
+
+            // Despeckling of a noisy copy of the page in the encoding pass,
+            // against encode_page
+            if (state->bitDepth == 1 || state->bitDepth == 8) {
+                benchmarks.push_back(MakeDespeckleBenchmark(
+                    (state->bitDepth == 1 ? "despeckle_bitonal/" : "despeckle_grey/") + page, state));
+            }
+
+            // Same sequence as TwainScanner::EncodePage, with fresh buffers
+            // for each page as in a real scan
+            benchmarks.push_back(MakeBenchmark("encode_page/" + page, state, DibBytes, Base64Bytes, [state]() {
+                DibLayout parsed;
+                std::string error;
+                std::string base64;
+                DibStripSource source;
+                if (ReadDibLayout(state->page->dib.data(), state->page->dib.size(), parsed, error) &&
+                    source.Open(parsed)) {
+                    WriteBmpStrips(source, nullptr, &base64);
+                }
+                BenchKeep(base64.data(), base64.size());
+            }));
+
+            // encode_page with the page statistics tallied as rows go by,
+            // against encode_page
+            benchmarks.push_back(MakeBenchmark("page_stats/" + page, state, DibBytes, Base64Bytes, [state]() {
+                std::string base64;
+                DibStripSource source;
+                PageStatsStripStage tally(source);
+                PageStats stats;
+                if (source.Open(state->layout) && tally.Open()) {
+                    WriteBmpStrips(tally, nullptr, &base64);
+                    stats = tally.Finish();
+                }
+                BenchKeep(stats.histograms.data(), stats.histograms.size() * sizeof(uint32_t));
+            }));
+        }
+    }
+}
+
+}  // namespace
+
+BENCH_REGISTRAR(RegisterImaging);
@@ -0,0 +1,305 @@
+#include "bench.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+std::vector<BenchRegistry::Registrar>& Registrars() {
+    static std::vector<BenchRegistry::Registrar> registrars;
+    return registrars;
+}
+
+volatile size_t g_Sink = 0;
+
+struct Options {
+    std::string filter;
+    std::string format;
+    std::string out;
+    double minTime;
+    int minIterations;
+    bool list;
+
+    Options() : format("console"), minTime(0.5), minIterations(3), list(false) {}
+};
+
+struct Result {
+    std::string name;
+    size_t iterations;
+    double medianNs;
+    double meanNs;
+    double minNs;
+    double stddevNs;
+    double cpuNs;
+    BenchCounters counters;
+};
+
+bool StartsWith(const char* arg, const char* prefix, const char*& value) {
+    size_t length = strlen(prefix);
+    if (strncmp(arg, prefix, length) != 0) {
+        return false;
+    }
+    value = arg + length;
+    return true;
+}
+
+bool ParseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        const char* value = nullptr;
+        if (StartsWith(argv[i], "--benchmark_filter=", value)) {
+            options.filter = value;
+        } else if (StartsWith(argv[i], "--benchmark_format=", value)) {
+            options.format = value;
+        } else if (StartsWith(argv[i], "--benchmark_out=", value)) {
+            options.out = value;
+        } else if (StartsWith(argv[i], "--benchmark_min_time=", value)) {
+            options.minTime = atof(value);
+        } else if (StartsWith(argv[i], "--benchmark_min_iters=", value)) {
+            options.minIterations = std::max(1, atoi(value));
+        } else if (strcmp(argv[i], "--benchmark_list_tests") == 0) {
+            options.list = true;
+        } else {
+            fprintf(stderr,
+                "usage: %s [--benchmark_filter=<substring>] [--benchmark_format=console|json]\n"
+                "          [--benchmark_out=<file>] [--benchmark_min_time=<seconds>]\n"
+                "          [--benchmark_min_iters=<n>] [--benchmark_list_tests]\n", argv[0]);
+            return false;
+        }
+    }
+    return options.format == "console" || options.format == "json";
+}
+
+// Comma-separated substrings; a benchmark runs if any of them matches
+bool Matches(const std::string& name, const std::string& filter) {
+    if (filter.empty()) {
+        return true;
+    }
+    std::stringstream parts(filter);
+    std::string part;
+    while (std::getline(parts, part, ',')) {
+        if (!part.empty() && name.find(part) != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+Result Run(Benchmark& benchmark, const Options& options) {
+    typedef std::chrono::steady_clock Clock;
+
+    BenchCounters counters;
+    if (benchmark.setup) {
+        benchmark.setup(counters);
+    }
+    benchmark.run();  // Warm caches and allocations
+
+    std::vector<double> samples;
+    double elapsed = 0;
+    std::clock_t cpuStart = std::clock();
+    while (elapsed < options.minTime || (int)samples.size() < options.minIterations) {
+        auto start = Clock::now();
+        benchmark.run();
+        double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        samples.push_back(ns);
+        elapsed += ns / 1e9;
+        if (samples.size() >= 1000000) {
+            break;
+        }
+    }
+    double cpuNs = (double)(std::clock() - cpuStart) / CLOCKS_PER_SEC * 1e9;
+
+    if (benchmark.teardown) {
+        benchmark.teardown();
+    }
+
+    Result result;
+    result.name = benchmark.name;
+    result.iterations = samples.size();
+    result.counters = counters;
+
+    std::vector<double> sorted = samples;
+    std::sort(sorted.begin(), sorted.end());
+    size_t n = sorted.size();
+    result.medianNs = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    result.minNs = sorted.front();
+
+    double sum = 0;
+    for (double sample : samples) sum += sample;
+    result.meanNs = sum / n;
+    double variance = 0;
+    for (double sample : samples) variance += (sample - result.meanNs) * (sample - result.meanNs);
+    result.stddevNs = n > 1 ? std::sqrt(variance / (n - 1)) : 0;
+    result.cpuNs = cpuNs / n;
+    return result;
+}
+
+std::string JsonString(const std::string& value) {
+    std::string escaped = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        escaped += c;
+    }
+    return escaped + "\"";
+}
+
+std::string Number(double value) {
+    char text[64];
+    snprintf(text, sizeof(text), "%.6g", value);
+    return text;
+}
+
+std::string CompilerName() {
+#if defined(_MSC_VER)
+    return "msvc " + std::to_string(_MSC_VER);
+#elif defined(__clang__)
+    return std::string("clang ") + __clang_version__;
+#elif defined(__GNUC__)
+    return std::string("gcc ") + __VERSION__;
+#else
+    return "unknown";
+#endif
+}
+
+// Rates use the median iteration time, which is steadier than the mean
+// on a shared build machine
+std::string ToJson(const std::vector<Result>& results, const char* executable, const Options& options) {
+    char date[64];
+    std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+
+    std::ostringstream json;
+    json << "{\n  \"context\": {\n";
+    json << "    \"date\": " << JsonString(date) << ",\n";
+    json << "    \"executable\": " << JsonString(executable) << ",\n";
+    json << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n";
+#ifdef NDEBUG
+    json << "    \"library_build_type\": \"release\",\n";
+#else
+    json << "    \"library_build_type\": \"debug\",\n";
+#endif
+    json << "    \"compiler\": " << JsonString(CompilerName()) << ",\n";
+    json << "    \"min_time\": " << Number(options.minTime) << "\n";
+    json << "  },\n  \"benchmarks\": [";
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        double seconds = r.medianNs / 1e9;
+        json << (i ? ",\n" : "\n") << "    {\n";
+        json << "      \"name\": " << JsonString(r.name) << ",\n";
+        json << "      \"run_name\": " << JsonString(r.name) << ",\n";
+        json << "      \"run_type\": \"iteration\",\n";
+        json << "      \"iterations\": " << r.iterations << ",\n";
+        json << "      \"real_time\": " << Number(r.medianNs) << ",\n";
+        json << "      \"cpu_time\": " << Number(r.cpuNs) << ",\n";
+        json << "      \"time_unit\": \"ns\",\n";
+        json << "      \"real_time_mean\": " << Number(r.meanNs) << ",\n";
+        json << "      \"real_time_min\": " << Number(r.minNs) << ",\n";
+        json << "      \"real_time_stddev\": " << Number(r.stddevNs) << ",\n";
+        json << "      \"bytes_per_second\": " << Number(r.counters.bytesIn / seconds) << ",\n";
+        json << "      \"items_per_second\": " << Number(r.counters.pages / seconds) << ",\n";
+        json << "      \"pages_per_second\": " << Number(r.counters.pages / seconds) << ",\n";
+        json << "      \"bytes_in_per_page\": " << Number(r.counters.pages ? r.counters.bytesIn / r.counters.pages : 0) << ",\n";
+        json << "      \"bytes_per_page\": " << Number(r.counters.pages ? r.counters.bytesOut / r.counters.pages : 0) << ",\n";
+        json << "      \"bytes_moved_per_page\": " << Number(r.counters.pages ? r.counters.bytesMoved / r.counters.pages : 0) << "\n";
+        json << "    }";
+    }
+    json << "\n  ]\n}\n";
+    return json.str();
+}
+
+void PrintConsoleHeader() {
+    printf("%-44s %14s %14s %10s %12s %14s %14s\n",
+        "Benchmark", "Median (us)", "Stddev (us)", "Iters", "Pages/s", "Bytes/page", "Moved/page");
+}
+
+void PrintConsoleRow(const Result& r) {
+    double seconds = r.medianNs / 1e9;
+    printf("%-44s %14.3f %14.3f %10zu %12.2f %14.0f %14.0f\n",
+        r.name.c_str(), r.medianNs / 1e3, r.stddevNs / 1e3, r.iterations,
+        r.counters.pages / seconds, r.counters.pages ? r.counters.bytesOut / r.counters.pages : 0,
+        r.counters.pages ? r.counters.bytesMoved / r.counters.pages : 0);
+    fflush(stdout);
+}
+
+}  // namespace
+
+void BenchRegistry::AddRegistrar(Registrar registrar) {
+    Registrars().push_back(registrar);
+}
+
+std::vector<Benchmark> BenchRegistry::Collect() {
+    std::vector<Benchmark> benchmarks;
+    for (Registrar registrar : Registrars()) {
+        registrar(benchmarks);
+    }
+    return benchmarks;
+}
+
+void BenchKeep(const void* data, size_t size) {
+    g_Sink += size + (data ? *(const unsigned char*)data : 0);
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        return 1;
+    }
+
+    std::vector<Benchmark> benchmarks = BenchRegistry::Collect();
+    if (options.list) {
+        for (const auto& benchmark : benchmarks) {
+            if (Matches(benchmark.name, options.filter)) {
+                printf("%s\n", benchmark.name.c_str());
+            }
+        }
+        return 0;
+    }
+
+    // Progress goes to stderr in JSON mode so stdout stays parseable
+    bool console = options.format == "console";
+    if (console) {
+        PrintConsoleHeader();
+    }
+
+    std::vector<Result> results;
+    for (auto& benchmark : benchmarks) {
+        if (!Matches(benchmark.name, options.filter)) {
+            continue;
+        }
+        if (!console) {
+            fprintf(stderr, "%s\n", benchmark.name.c_str());
+        }
+        try {
+            results.push_back(Run(benchmark, options));
+        } catch (const std::exception& e) {
+            fprintf(stderr, "%s failed: %s\n", benchmark.name.c_str(), e.what());
+            return 1;
+        }
+        if (console) {
+            PrintConsoleRow(results.back());
+        }
+    }
+
+    std::string json = ToJson(results, argv[0], options);
+    if (!options.out.empty()) {
+        std::ofstream file(options.out.c_str(), std::ios::binary);
+        file << json;
+        if (!file) {
+            fprintf(stderr, "Failed to write %s\n", options.out.c_str());
+            return 1;
+        }
+    }
+    if (!console) {
+        fputs(json.c_str(), stdout);
+    }
+    return 0;
+}
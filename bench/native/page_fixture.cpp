@@ -0,0 +1,81 @@
+#include "page_fixture.h"
+#include "../../src/cpp/sim/simulated_dsm.h"
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+const TW_UINT16 kFixtureResolutions[] = { 150, 200, 300, 600 };
+const size_t kFixtureResolutionCount = sizeof(kFixtureResolutions) / sizeof(kFixtureResolutions[0]);
+const TW_UINT16 kFixtureBitDepths[] = { 1, 8, 24 };
+const size_t kFixtureBitDepthCount = sizeof(kFixtureBitDepths) / sizeof(kFixtureBitDepths[0]);
+
+namespace {
+
+// A4 is 210 x 297 mm
+const double kA4WidthInches = 210.0 / 25.4;
+const double kA4HeightInches = 297.0 / 25.4;
+
+void Check(TW_UINT16 rc, TW_UINT16 expected, const char* step) {
+    if (rc != expected) {
+        throw std::runtime_error(std::string("Simulated transfer failed at ") + step);
+    }
+}
+
+void RenderFixture(PageFixture& page) {
+    SimulatedScannerConfig config;
+    config.pageWidth = (TW_UINT32)(kA4WidthInches * page.resolution + 0.5);
+    config.pageHeight = (TW_UINT32)(kA4HeightInches * page.resolution + 0.5);
+    config.resolution = page.resolution;
+    config.bitDepth = page.bitDepth;
+    SimulatedDsm::Configure(config);
+
+    TW_IDENTITY app;
+    memset(&app, 0, sizeof(TW_IDENTITY));
+    app.SupportedGroups = DF_APP2 | DG_IMAGE | DG_CONTROL;
+    TW_IDENTITY source;
+    memset(&source, 0, sizeof(TW_IDENTITY));
+    HWND parent = NULL;
+
+    Check(SimulatedDsm::Entry(&app, nullptr, DG_CONTROL, DAT_PARENT, MSG_OPENDSM, (TW_MEMREF)&parent), TWRC_SUCCESS, "MSG_OPENDSM");
+    Check(SimulatedDsm::Entry(&app, nullptr, DG_CONTROL, DAT_IDENTITY, MSG_OPENDS, &source), TWRC_SUCCESS, "MSG_OPENDS");
+
+    TW_USERINTERFACE ui;
+    memset(&ui, 0, sizeof(TW_USERINTERFACE));
+    Check(SimulatedDsm::Entry(&app, &source, DG_CONTROL, DAT_USERINTERFACE, MSG_ENABLEDS, &ui), TWRC_SUCCESS, "MSG_ENABLEDS");
+
+    TW_HANDLE handle = NULL;
+    Check(SimulatedDsm::Entry(&app, &source, DG_IMAGE, DAT_IMAGENATIVEXFER, MSG_GET, &handle), TWRC_XFERDONE, "DAT_IMAGENATIVEXFER");
+    const BYTE* dib = (const BYTE*)GlobalLock(handle);
+    page.dib.assign(dib, dib + GlobalSize(handle));
+    GlobalUnlock(handle);
+    GlobalFree(handle);
+
+    TW_PENDINGXFERS pending;
+    memset(&pending, 0, sizeof(TW_PENDINGXFERS));
+    SimulatedDsm::Entry(&app, &source, DG_CONTROL, DAT_PENDINGXFERS, MSG_ENDXFER, &pending);
+    SimulatedDsm::Entry(&app, &source, DG_CONTROL, DAT_USERINTERFACE, MSG_DISABLEDS, &ui);
+    SimulatedDsm::Entry(&app, nullptr, DG_CONTROL, DAT_IDENTITY, MSG_CLOSEDS, &source);
+    SimulatedDsm::Entry(&app, nullptr, DG_CONTROL, DAT_PARENT, MSG_CLOSEDSM, (TW_MEMREF)&parent);
+}
+
+}  // namespace
+
+std::string PageFixtureName(TW_UINT16 resolution, TW_UINT16 bitDepth) {
+    char name[64];
+    snprintf(name, sizeof(name), "a4_%udpi_%ubit", (unsigned)resolution, (unsigned)bitDepth);
+    return name;
+}
+
+const PageFixture& GetPageFixture(TW_UINT16 resolution, TW_UINT16 bitDepth) {
+    static std::unique_ptr<PageFixture> cached;
+    if (!cached || cached->resolution != resolution || cached->bitDepth != bitDepth) {
+        cached.reset();
+        std::unique_ptr<PageFixture> page(new PageFixture());
+        page->resolution = resolution;
+        page->bitDepth = bitDepth;
+        RenderFixture(*page);
+        cached = std::move(page);
+    }
+    return *cached;
+}
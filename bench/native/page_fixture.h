@@ -0,0 +1,24 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "../../src/cpp/twain/windows_wrapper.h"
+#include "twain.h"
+
+// A4 page as delivered by a native transfer from the simulated source
+struct PageFixture {
+    TW_UINT16 resolution;
+    TW_UINT16 bitDepth;
+    std::vector<BYTE> dib;
+};
+
+// "a4_300dpi_24bit"
+std::string PageFixtureName(TW_UINT16 resolution, TW_UINT16 bitDepth);
+
+// Renders the page through SimulatedDsm. The last page is cached, so
+// benchmarks for the same page should run back to back.
+const PageFixture& GetPageFixture(TW_UINT16 resolution, TW_UINT16 bitDepth);
+
+extern const TW_UINT16 kFixtureResolutions[];
+extern const size_t kFixtureResolutionCount;
+extern const TW_UINT16 kFixtureBitDepths[];
+extern const size_t kFixtureBitDepthCount;
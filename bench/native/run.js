@@ -0,0 +1,18 @@
+// Runs the native micro-benchmarks built with `node-gyp rebuild -- -Dbuild_bench=1`.
+// Arguments are passed through, e.g. --benchmark_filter=base64 --benchmark_format=json
+const { spawnSync } = require("child_process");
+const fs = require("fs");
+const path = require("path");
+
+const exe = process.platform === "win32" ? "scanner_bench.exe" : "scanner_bench";
+const binary = ["Release", "Debug"]
+  .map((config) => path.join(__dirname, "..", "..", "build", config, exe))
+  .find((candidate) => fs.existsSync(candidate));
+
+if (!binary) {
+  console.error(`${exe} not found; build it with: node-gyp rebuild -- -Dbuild_bench=1`);
+  process.exit(1);
+}
+
+const result = spawnSync(binary, process.argv.slice(2), { stdio: "inherit" });
+process.exit(result.status === null ? 1 : result.status);
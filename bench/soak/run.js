@@ -0,0 +1,18 @@
+// Runs the soak test built with `node-gyp rebuild -- -Dbuild_soak=1`.
+// Arguments are passed through, e.g. --iterations=20000 --json=soak.json
+const { spawnSync } = require("child_process");
+const fs = require("fs");
+const path = require("path");
+
+const exe = process.platform === "win32" ? "scanner_soak.exe" : "scanner_soak";
+const binary = ["Release", "Debug"]
+  .map((config) => path.join(__dirname, "..", "..", "build", config, exe))
+  .find((candidate) => fs.existsSync(candidate));
+
+if (!binary) {
+  console.error(`${exe} not found; build it with: node-gyp rebuild -- -Dbuild_soak=1`);
+  process.exit(1);
+}
+
+const result = spawnSync(binary, process.argv.slice(2), { stdio: "inherit" });
+process.exit(result.status === null ? 1 : result.status);
@@ -0,0 +1,461 @@
+// Soak test of the scanner core against the simulated DSM. Runs thousands
+// of scans, injects a DSM failure at a random step into a share of them,
+// and samples native heap, OS handles, windows and TWAIN global memory
+// plus per-page latency every window of iterations. Then checks that a
+// persistent session opens the source once across scans. Exits non-zero
+// when a resource grows, latency drifts past its limit or the session
+// check fails.
+//
+//   scanner_soak [--iterations=5000] [--window=250] [--failure-rate=0.3]
+//       [--sheets=3] [--reinit-every=100] [--seed=1]
+//       [--max-heap-growth=256] [--max-latency-drift=0.5] [--json=soak.json]
+#include "log.h"
+#include "scanner.h"
+#include "sim/simulated_dsm.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include "platform/win32_compat.h"
+#include <dirent.h>
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+#endif
+
+namespace {
+
+struct Options {
+    int iterations;
+    int window;
+    double failureRate;
+    int sheets;
+    int reinitEvery;
+    unsigned seed;
+    double maxHeapGrowth;     // Bytes per iteration
+    double maxLatencyDrift;   // Fraction over the baseline p50
+    std::string json;
+    bool verbose;
+
+    Options()
+        : iterations(5000), window(250), failureRate(0.3), sheets(3), reinitEvery(100)
+        , seed(1), maxHeapGrowth(256), maxLatencyDrift(0.5), verbose(false) {}
+};
+
+// A DSM call the scanner makes, and where in a scan it makes it
+struct Step {
+    const char* name;
+    TW_UINT16 dat;
+    TW_UINT16 msg;
+    bool perPage;   // Made once per transferred page
+    bool init;      // Made by Initialize rather than Scan
+};
+
+// MSG_CLOSEDS and MSG_CLOSEDSM are left out: the simulator would then
+// keep the source open, which is a wedged driver rather than a leak
+const Step kSteps[] = {
+    { "openDsm", DAT_PARENT, MSG_OPENDSM, false, true },
+    { "firstSource", DAT_IDENTITY, MSG_GETFIRST, false, true },
+    { "openSource", DAT_IDENTITY, MSG_OPENDS, false, false },
+    { "enableSource", DAT_USERINTERFACE, MSG_ENABLEDS, false, false },
+    { "imageInfo", DAT_IMAGEINFO, MSG_GET, true, false },
+    { "transfer", DAT_IMAGENATIVEXFER, MSG_GET, true, false },
+    { "endTransfer", DAT_PENDINGXFERS, MSG_ENDXFER, true, false },
+    { "disableSource", DAT_USERINTERFACE, MSG_DISABLEDS, false, false },
+};
+const size_t kStepCount = sizeof(kSteps) / sizeof(kSteps[0]);
+
+struct Resources {
+    uint64_t heapBytes;
+    uint64_t handles;        // File descriptors, or kernel handles on Windows
+    uint64_t windows;
+    uint64_t globalBlocks;   // Live GlobalAlloc handles; not tracked on Windows
+    uint64_t invalidFrees;
+
+    Resources() : heapBytes(0), handles(0), windows(0), globalBlocks(0), invalidFrees(0) {}
+};
+
+struct WindowSample {
+    int iteration;
+    int scans;
+    int failedScans;
+    int injected;
+    int unexpected;          // Failed scans with nothing injected, or short ones
+    double p50Ms;
+    double p99Ms;
+    Resources resources;
+};
+
+bool StartsWith(const char* arg, const char* prefix, const char*& value) {
+    size_t length = strlen(prefix);
+    if (strncmp(arg, prefix, length) != 0) {
+        return false;
+    }
+    value = arg + length;
+    return true;
+}
+
+bool ParseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        const char* value = nullptr;
+        if (StartsWith(argv[i], "--iterations=", value)) {
+            options.iterations = atoi(value);
+        } else if (StartsWith(argv[i], "--window=", value)) {
+            options.window = std::max(1, atoi(value));
+        } else if (StartsWith(argv[i], "--failure-rate=", value)) {
+            options.failureRate = atof(value);
+        } else if (StartsWith(argv[i], "--sheets=", value)) {
+            options.sheets = std::max(1, atoi(value));
+        } else if (StartsWith(argv[i], "--reinit-every=", value)) {
+            options.reinitEvery = atoi(value);
+        } else if (StartsWith(argv[i], "--seed=", value)) {
+            options.seed = (unsigned)strtoul(value, nullptr, 10);
+        } else if (StartsWith(argv[i], "--max-heap-growth=", value)) {
+            options.maxHeapGrowth = atof(value);
+        } else if (StartsWith(argv[i], "--max-latency-drift=", value)) {
+            options.maxLatencyDrift = atof(value);
+        } else if (StartsWith(argv[i], "--json=", value)) {
+            options.json = value;
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            options.verbose = true;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+Resources SampleResources() {
+    Resources resources;
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS_EX memory;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&memory, sizeof(memory))) {
+        resources.heapBytes = memory.PrivateUsage;
+    }
+    DWORD handles = 0;
+    if (GetProcessHandleCount(GetCurrentProcess(), &handles)) {
+        resources.handles = handles;
+    }
+    resources.windows = GetGuiResources(GetCurrentProcess(), GR_USEROBJECTS);
+#else
+#if defined(__APPLE__)
+    malloc_statistics_t stats;
+    malloc_zone_statistics(NULL, &stats);
+    resources.heapBytes = stats.size_in_use;
+#elif defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    resources.heapBytes = mallinfo2().uordblks;
+#else
+    resources.heapBytes = (unsigned)mallinfo().uordblks;
+#endif
+
+#ifdef __APPLE__
+    const char* fdDir = "/dev/fd";
+#else
+    const char* fdDir = "/proc/self/fd";
+#endif
+    if (DIR* dir = opendir(fdDir)) {
+        while (struct dirent* entry = readdir(dir)) {
+            if (entry->d_name[0] != '.') {
+                resources.handles++;
+            }
+        }
+        closedir(dir);
+        resources.handles--;  // The directory stream itself
+    }
+
+    Win32CompatUsage usage = GetWin32CompatUsage();
+    resources.windows = usage.windows;
+    resources.globalBlocks = usage.globalBlocks;
+    resources.invalidFrees = usage.invalidFrees;
+#endif
+    return resources;
+}
+
+double Percentile(std::vector<double>& values, double percentile) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t index = (size_t)(percentile / 100.0 * values.size());
+    return values[std::min(index, values.size() - 1)];
+}
+
+// Least-squares slope of heap bytes over iterations
+double HeapSlope(const std::vector<WindowSample>& samples, size_t first) {
+    size_t count = samples.size() - first;
+    if (count < 2) {
+        return 0;
+    }
+    double meanX = 0, meanY = 0;
+    for (size_t i = first; i < samples.size(); i++) {
+        meanX += samples[i].iteration;
+        meanY += (double)samples[i].resources.heapBytes;
+    }
+    meanX /= count;
+    meanY /= count;
+    double covariance = 0, variance = 0;
+    for (size_t i = first; i < samples.size(); i++) {
+        double dx = samples[i].iteration - meanX;
+        covariance += dx * ((double)samples[i].resources.heapBytes - meanY);
+        variance += dx * dx;
+    }
+    return variance > 0 ? covariance / variance : 0;
+}
+
+void PrintSample(const WindowSample& sample) {
+    printf("%9d  %6d  %6d  %8d  %10d  %8.2f  %8.2f  %10.1f  %7llu  %7llu  %6llu\n",
+        sample.iteration, sample.scans, sample.failedScans, sample.injected, sample.unexpected,
+        sample.p50Ms, sample.p99Ms, sample.resources.heapBytes / 1024.0,
+        (unsigned long long)sample.resources.handles, (unsigned long long)sample.resources.windows,
+        (unsigned long long)sample.resources.globalBlocks);
+}
+
+void WriteJson(const Options& options, const std::vector<WindowSample>& samples,
+    const std::vector<std::string>& failures) {
+    FILE* file = fopen(options.json.c_str(), "wb");
+    if (!file) {
+        fprintf(stderr, "Cannot write %s\n", options.json.c_str());
+        return;
+    }
+    fprintf(file, "{\n  \"context\": {\"iterations\": %d, \"window\": %d, \"failureRate\": %g, "
+        "\"sheets\": %d, \"reinitEvery\": %d, \"seed\": %u},\n  \"windows\": [",
+        options.iterations, options.window, options.failureRate, options.sheets,
+        options.reinitEvery, options.seed);
+    for (size_t i = 0; i < samples.size(); i++) {
+        const WindowSample& s = samples[i];
+        fprintf(file, "%s\n    {\"iteration\": %d, \"scans\": %d, \"failedScans\": %d, \"injected\": %d, "
+            "\"unexpected\": %d, \"pageP50Ms\": %.4f, \"pageP99Ms\": %.4f, \"heapBytes\": %llu, "
+            "\"handles\": %llu, \"windows\": %llu, \"globalBlocks\": %llu, \"invalidFrees\": %llu}",
+            i ? "," : "", s.iteration, s.scans, s.failedScans, s.injected, s.unexpected, s.p50Ms, s.p99Ms,
+            (unsigned long long)s.resources.heapBytes, (unsigned long long)s.resources.handles,
+            (unsigned long long)s.resources.windows, (unsigned long long)s.resources.globalBlocks,
+            (unsigned long long)s.resources.invalidFrees);
+    }
+    fprintf(file, "\n  ],\n  \"failures\": [");
+    for (size_t i = 0; i < failures.size(); i++) {
+        fprintf(file, "%s\n    \"%s\"", i ? "," : "", failures[i].c_str());
+    }
+    fprintf(file, "\n  ],\n  \"passed\": %s\n}\n", failures.empty() ? "true" : "false");
+    fclose(file);
+}
+
+// Two back-to-back scans in a persistent session must select and open
+// the source once, and so must the next two after the session expired
+void CheckPersistentSession(const ScanOptions& scanOptions, std::vector<std::string>& failures) {
+    const DWORD idleTimeoutMs = 200;
+    char message[256];
+
+    TwainScanner scanner;
+    if (!scanner.Initialize().success) {
+        failures.push_back("Persistent session check could not initialize");
+        return;
+    }
+    scanner.SetSessionOptions(true, idleTimeoutMs);
+
+    for (int round = 0; round < 2; round++) {
+        const char* when = round == 0 ? "" : " after the idle timeout";
+        if (round == 1) {
+            Sleep(idleTimeoutMs + 50);
+            scanner.OnIdle();
+            if (scanner.IsSessionOpen()) {
+                failures.push_back("Persistent session stayed open past its idle timeout");
+            }
+        }
+
+        SimulatedDsm::ResetCallCounts();
+        for (int scan = 0; scan < 2; scan++) {
+            ScannerResult result = scanner.Scan(scanOptions);
+            if (!result.success) {
+                snprintf(message, sizeof(message), "Persistent session scan failed%s: %s",
+                    when, result.errorMessage.c_str());
+                failures.push_back(message);
+            }
+        }
+
+        TW_UINT32 selects = SimulatedDsm::CallCount(DAT_IDENTITY, MSG_GETFIRST);
+        TW_UINT32 opens = SimulatedDsm::CallCount(DAT_IDENTITY, MSG_OPENDS);
+        if (selects != 1 || opens != 1) {
+            snprintf(message, sizeof(message),
+                "Two scans in a persistent session%s made %u MSG_GETFIRST and %u MSG_OPENDS calls, expected one of each",
+                when, (unsigned)selects, (unsigned)opens);
+            failures.push_back(message);
+        }
+    }
+    scanner.Cleanup();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        return 2;
+    }
+
+    // Injected failures are expected; keep their warnings off the report
+    Logger::Options log;
+    log.level = options.verbose ? kLogDebug : kLogOff;
+    std::string error;
+    Logger::Configure(log, error);
+
+    SimulatedScannerConfig config;
+    config.pageWidth = 600;
+    config.pageHeight = 800;
+    config.resolution = 100;
+    config.bitDepth = 8;
+    config.sheetCount = (TW_UINT32)options.sheets;
+    SimulatedDsm::Configure(config);
+    SimulatedDsm::Enable(true);
+
+    std::mt19937 random(options.seed);
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+    auto pick = [&random](int count) { return (int)(random() % (unsigned)count); };
+
+    TwainScanner scanner;
+    bool initialized = false;
+    ScanOptions scanOptions;
+    scanOptions.showUI = false;
+    scanOptions.base64 = false;
+
+    std::vector<WindowSample> samples;
+    WindowSample current = WindowSample();
+    std::vector<double> pageMs;
+
+    printf("iteration   scans  failed  injected  unexpected   p50 ms    p99 ms    heap KiB  handles  windows  blocks\n");
+    for (int i = 1; i <= options.iterations; i++) {
+        if (options.reinitEvery > 0 && i % options.reinitEvery == 0 && initialized) {
+            scanner.Cleanup();
+            initialized = false;
+        }
+
+        const Step* injected = nullptr;
+        if (chance(random) < options.failureRate) {
+            const Step* step = &kSteps[pick((int)kStepCount)];
+            if (!step->init || !initialized) {
+                injected = step;
+                TW_UINT32 nth = step->perPage ? 1 + pick(options.sheets) : 1;
+                SimulatedDsm::FailCall(step->dat, step->msg, nth);
+                current.injected++;
+            }
+        }
+
+        if (!initialized) {
+            initialized = scanner.Initialize().success;
+            if (!initialized && !injected) {
+                current.unexpected++;
+            }
+        }
+
+        if (initialized) {
+            ScannerResult result = scanner.Scan(scanOptions);
+            current.scans++;
+            if (!result.success) {
+                current.failedScans++;
+                if (!injected) {
+                    current.unexpected++;
+                    if (options.verbose) {
+                        fprintf(stderr, "Scan %d failed: %s\n", i, result.errorMessage.c_str());
+                    }
+                }
+            } else if (!injected && result.bmpImages.size() != config.sheetCount) {
+                current.unexpected++;
+            }
+
+            // The first page includes the wait for MSG_XFERREADY, so only
+            // whole scans keep the mix of pages the same in every window
+            if (result.success && result.timings.pageMs.size() == config.sheetCount) {
+                pageMs.insert(pageMs.end(), result.timings.pageMs.begin(), result.timings.pageMs.end());
+            }
+        }
+        SimulatedDsm::ClearFailures();
+
+        // Sampled with no scan result alive
+        if (i % options.window == 0 || i == options.iterations) {
+            current.iteration = i;
+            current.p50Ms = Percentile(pageMs, 50);
+            current.p99Ms = Percentile(pageMs, 99);
+            current.resources = SampleResources();
+            samples.push_back(current);
+            PrintSample(current);
+            current = WindowSample();
+            pageMs.clear();
+        }
+    }
+    scanner.Cleanup();
+
+    // The first window warms caches and lazily allocated buffers
+    std::vector<std::string> failures;
+    char message[256];
+    CheckPersistentSession(scanOptions, failures);
+    size_t baselineIndex = samples.size() > 2 ? 1 : 0;
+    if (samples.empty()) {
+        failures.push_back("No iterations ran");
+    } else {
+        const WindowSample& baseline = samples[baselineIndex];
+        const WindowSample& last = samples.back();
+
+        int unexpected = 0;
+        for (const WindowSample& sample : samples) {
+            unexpected += sample.unexpected;
+        }
+        if (unexpected) {
+            snprintf(message, sizeof(message), "%d scans failed or came back short with nothing injected", unexpected);
+            failures.push_back(message);
+        }
+        if (last.resources.invalidFrees) {
+            snprintf(message, sizeof(message), "%llu GlobalFree calls on handles that were not live (double free)",
+                (unsigned long long)last.resources.invalidFrees);
+            failures.push_back(message);
+        }
+        if (last.resources.globalBlocks > baseline.resources.globalBlocks) {
+            snprintf(message, sizeof(message), "Global memory handles grew from %llu to %llu",
+                (unsigned long long)baseline.resources.globalBlocks, (unsigned long long)last.resources.globalBlocks);
+            failures.push_back(message);
+        }
+        if (last.resources.windows > baseline.resources.windows) {
+            snprintf(message, sizeof(message), "Windows grew from %llu to %llu",
+                (unsigned long long)baseline.resources.windows, (unsigned long long)last.resources.windows);
+            failures.push_back(message);
+        }
+        if (last.resources.handles > baseline.resources.handles + 2) {
+            snprintf(message, sizeof(message), "Handles grew from %llu to %llu",
+                (unsigned long long)baseline.resources.handles, (unsigned long long)last.resources.handles);
+            failures.push_back(message);
+        }
+        double slope = HeapSlope(samples, baselineIndex);
+        if (slope > options.maxHeapGrowth) {
+            snprintf(message, sizeof(message), "Heap grows by %.0f bytes per iteration (limit %.0f)",
+                slope, options.maxHeapGrowth);
+            failures.push_back(message);
+        }
+        // Half a millisecond of slack keeps timer noise on tiny pages out
+        double latencyLimit = baseline.p50Ms * (1 + options.maxLatencyDrift) + 0.5;
+        if (last.p50Ms > latencyLimit) {
+            snprintf(message, sizeof(message), "Page p50 drifted from %.2f ms to %.2f ms (limit %.2f ms)",
+                baseline.p50Ms, last.p50Ms, latencyLimit);
+            failures.push_back(message);
+        }
+    }
+
+    if (!options.json.empty()) {
+        WriteJson(options, samples, failures);
+    }
+    for (const std::string& failure : failures) {
+        printf("FAIL: %s\n", failure.c_str());
+    }
+    if (failures.empty()) {
+        printf("PASS: %d iterations, no resource growth or latency drift\n", options.iterations);
+    }
+    Logger::Shutdown();
+    return failures.empty() ? 0 : 1;
+}
@@ -1,9 +1,38 @@
 {
+  "variables": {
+    "build_bench%": 0,
+    "build_soak%": 0
+  },
   "targets": [{
     "target_name": "scanner",
     "sources": [
+      "src/cpp/capabilities.cpp",
+      "src/cpp/capability_cache.cpp",
+      "src/cpp/imaging/auto_crop.cpp",
+      "src/cpp/imaging/base64.cpp",
+      "src/cpp/imaging/bitmap.cpp",
+      "src/cpp/imaging/blank_page.cpp",
+      "src/cpp/imaging/deskew.cpp",
+      "src/cpp/imaging/rotate.cpp",
+      "src/cpp/imaging/resample.cpp",
+      "src/cpp/imaging/page_hash.cpp",
+      "src/cpp/imaging/perceptual_hash.cpp",
+      "src/cpp/imaging/strip_pipeline.cpp",
+      "src/cpp/imaging/colour_dropout.cpp",
+      "src/cpp/imaging/despeckle.cpp",
+      "src/cpp/imaging/page_stats.cpp",
+      "src/cpp/imaging/grey_rows.cpp",
+      "src/cpp/imaging/parallel.cpp",
+      "src/cpp/log.cpp",
+      "src/cpp/platform/win32_compat.cpp",
+      "src/cpp/scan_stats.cpp",
       "src/cpp/scanner.cpp",
-      "src/cpp/scanner_addon.cpp"
+      "src/cpp/scanner_addon.cpp",
+      "src/cpp/sim/dsm_recording.cpp",
+      "src/cpp/sim/replay_dsm.cpp",
+      "src/cpp/sim/simulated_dsm.cpp",
+      "src/cpp/tracing.cpp",
+      "src/cpp/twain_thread.cpp"
     ],
     "include_dirs": [
       "<!@(node -p \"require('node-addon-api').include\")",
@@ -42,7 +71,147 @@
           "oleaut32.lib",
           "uuid.lib"
         ]
+      }],
+      ["OS!='win'", {
+        "cflags_cc!": ["-fno-exceptions"],
+        "cflags_cc": ["-std=c++17"],
+        "xcode_settings": {
+          "GCC_ENABLE_CPP_EXCEPTIONS": "YES"
+        }
       }]
     ]
-  }]
-}
\ No newline at end of file
+  }],
+  "conditions": [
+    ["build_bench==1", {
+      "targets": [{
+        "target_name": "scanner_bench",
+        "type": "executable",
+        "sources": [
+          "bench/native/bench_imaging.cpp",
+          "bench/native/bench_main.cpp",
+          "bench/native/page_fixture.cpp",
+          "src/cpp/imaging/auto_crop.cpp",
+          "src/cpp/imaging/base64.cpp",
+          "src/cpp/imaging/bitmap.cpp",
+          "src/cpp/imaging/blank_page.cpp",
+          "src/cpp/imaging/deskew.cpp",
+          "src/cpp/imaging/rotate.cpp",
+          "src/cpp/imaging/resample.cpp",
+          "src/cpp/imaging/page_hash.cpp",
+          "src/cpp/imaging/perceptual_hash.cpp",
+          "src/cpp/imaging/strip_pipeline.cpp",
+          "src/cpp/imaging/colour_dropout.cpp",
+          "src/cpp/imaging/despeckle.cpp",
+          "src/cpp/imaging/page_stats.cpp",
+          "src/cpp/imaging/grey_rows.cpp",
+          "src/cpp/imaging/parallel.cpp",
+          "src/cpp/platform/win32_compat.cpp",
+          "src/cpp/sim/simulated_dsm.cpp"
+        ],
+        "include_dirs": [
+          "src/cpp/twain"
+        ],
+        "defines": [
+          "NDEBUG",
+          "UNICODE",
+          "_UNICODE"
+        ],
+        "msvs_settings": {
+          "VCCLCompilerTool": {
+            "ExceptionHandling": 1,
+            "AdditionalOptions": ["/EHsc"]
+          }
+        },
+        "conditions": [
+          ["OS=='win'", {
+            "defines": [
+              "_WIN32",
+              "WIN32"
+            ],
+            "libraries": [
+              "kernel32.lib",
+              "user32.lib"
+            ]
+          }],
+          ["OS!='win'", {
+            "cflags_cc!": ["-fno-exceptions"],
+            "cflags_cc": ["-std=c++17", "-O2"],
+            "libraries": ["-lpthread"],
+            "xcode_settings": {
+              "GCC_ENABLE_CPP_EXCEPTIONS": "YES"
+            }
+          }]
+        ]
+      }]
+    }],
+    ["build_soak==1", {
+      "targets": [{
+        "target_name": "scanner_soak",
+        "type": "executable",
+        "sources": [
+          "bench/soak/soak_main.cpp",
+          "src/cpp/capabilities.cpp",
+          "src/cpp/capability_cache.cpp",
+          "src/cpp/imaging/auto_crop.cpp",
+          "src/cpp/imaging/base64.cpp",
+          "src/cpp/imaging/bitmap.cpp",
+          "src/cpp/imaging/blank_page.cpp",
+          "src/cpp/imaging/deskew.cpp",
+          "src/cpp/imaging/rotate.cpp",
+          "src/cpp/imaging/resample.cpp",
+          "src/cpp/imaging/page_hash.cpp",
+          "src/cpp/imaging/perceptual_hash.cpp",
+          "src/cpp/imaging/strip_pipeline.cpp",
+          "src/cpp/imaging/colour_dropout.cpp",
+          "src/cpp/imaging/despeckle.cpp",
+          "src/cpp/imaging/page_stats.cpp",
+          "src/cpp/imaging/grey_rows.cpp",
+          "src/cpp/imaging/parallel.cpp",
+          "src/cpp/log.cpp",
+          "src/cpp/platform/win32_compat.cpp",
+          "src/cpp/scan_stats.cpp",
+          "src/cpp/scanner.cpp",
+          "src/cpp/sim/dsm_recording.cpp",
+          "src/cpp/sim/replay_dsm.cpp",
+          "src/cpp/sim/simulated_dsm.cpp",
+          "src/cpp/tracing.cpp"
+        ],
+        "include_dirs": [
+          "src/cpp",
+          "src/cpp/twain"
+        ],
+        "defines": [
+          "UNICODE",
+          "_UNICODE"
+        ],
+        "msvs_settings": {
+          "VCCLCompilerTool": {
+            "ExceptionHandling": 1,
+            "AdditionalOptions": ["/EHsc"]
+          }
+        },
+        "conditions": [
+          ["OS=='win'", {
+            "defines": [
+              "_WIN32",
+              "WIN32"
+            ],
+            "libraries": [
+              "kernel32.lib",
+              "user32.lib",
+              "psapi.lib"
+            ]
+          }],
+          ["OS!='win'", {
+            "cflags_cc!": ["-fno-exceptions"],
+            "cflags_cc": ["-std=c++17", "-O2"],
+            "libraries": ["-lpthread"],
+            "xcode_settings": {
+              "GCC_ENABLE_CPP_EXCEPTIONS": "YES"
+            }
+          }]
+        ]
+      }]
+    }]
+  ]
+}
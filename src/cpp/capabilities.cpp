@@ -0,0 +1,459 @@
+#include "capabilities.h"
+#include <cstring>
+
+const TW_UINT16 kProbedCapabilities[] = {
+    CAP_DUPLEX,
+    CAP_DUPLEXENABLED,
+    CAP_FEEDERENABLED,
+    ICAP_XFERMECH,
+    ICAP_PIXELTYPE,
+    ICAP_BITDEPTH,
+    ICAP_XRESOLUTION,
+    ICAP_YRESOLUTION,
+    ICAP_COMPRESSION,
+    ICAP_PHYSICALWIDTH,
+    ICAP_PHYSICALHEIGHT,
+    ICAP_AUTODISCARDBLANKPAGES,
+    ICAP_AUTOMATICDESKEW,
+    ICAP_UNDEFINEDIMAGESIZE,
+    ICAP_AUTOMATICBORDERDETECTION,
+    ICAP_FILTER,
+};
+const size_t kProbedCapabilityCount = sizeof(kProbedCapabilities) / sizeof(kProbedCapabilities[0]);
+
+#define CAPABILITY_NAME(cap) { cap, #cap }
+
+const CapabilityName kStandardCapabilities[] = {
+    CAPABILITY_NAME(CAP_XFERCOUNT),
+    CAPABILITY_NAME(ICAP_COMPRESSION),
+    CAPABILITY_NAME(ICAP_PIXELTYPE),
+    CAPABILITY_NAME(ICAP_UNITS),
+    CAPABILITY_NAME(ICAP_XFERMECH),
+    CAPABILITY_NAME(CAP_AUTHOR),
+    CAPABILITY_NAME(CAP_CAPTION),
+    CAPABILITY_NAME(CAP_FEEDERENABLED),
+    CAPABILITY_NAME(CAP_FEEDERLOADED),
+    CAPABILITY_NAME(CAP_TIMEDATE),
+    CAPABILITY_NAME(CAP_SUPPORTEDCAPS),
+    CAPABILITY_NAME(CAP_EXTENDEDCAPS),
+    CAPABILITY_NAME(CAP_AUTOFEED),
+    CAPABILITY_NAME(CAP_CLEARPAGE),
+    CAPABILITY_NAME(CAP_FEEDPAGE),
+    CAPABILITY_NAME(CAP_REWINDPAGE),
+    CAPABILITY_NAME(CAP_INDICATORS),
+    CAPABILITY_NAME(CAP_PAPERDETECTABLE),
+    CAPABILITY_NAME(CAP_UICONTROLLABLE),
+    CAPABILITY_NAME(CAP_DEVICEONLINE),
+    CAPABILITY_NAME(CAP_AUTOSCAN),
+    CAPABILITY_NAME(CAP_THUMBNAILSENABLED),
+    CAPABILITY_NAME(CAP_DUPLEX),
+    CAPABILITY_NAME(CAP_DUPLEXENABLED),
+    CAPABILITY_NAME(CAP_ENABLEDSUIONLY),
+    CAPABILITY_NAME(CAP_CUSTOMDSDATA),
+    CAPABILITY_NAME(CAP_ENDORSER),
+    CAPABILITY_NAME(CAP_JOBCONTROL),
+    CAPABILITY_NAME(CAP_ALARMS),
+    CAPABILITY_NAME(CAP_ALARMVOLUME),
+    CAPABILITY_NAME(CAP_AUTOMATICCAPTURE),
+    CAPABILITY_NAME(CAP_TIMEBEFOREFIRSTCAPTURE),
+    CAPABILITY_NAME(CAP_TIMEBETWEENCAPTURES),
+    CAPABILITY_NAME(CAP_MAXBATCHBUFFERS),
+    CAPABILITY_NAME(CAP_DEVICETIMEDATE),
+    CAPABILITY_NAME(CAP_POWERSUPPLY),
+    CAPABILITY_NAME(CAP_CAMERAPREVIEWUI),
+    CAPABILITY_NAME(CAP_DEVICEEVENT),
+    CAPABILITY_NAME(CAP_SERIALNUMBER),
+    CAPABILITY_NAME(CAP_PRINTER),
+    CAPABILITY_NAME(CAP_PRINTERENABLED),
+    CAPABILITY_NAME(CAP_PRINTERINDEX),
+    CAPABILITY_NAME(CAP_PRINTERMODE),
+    CAPABILITY_NAME(CAP_PRINTERSTRING),
+    CAPABILITY_NAME(CAP_PRINTERSUFFIX),
+    CAPABILITY_NAME(CAP_LANGUAGE),
+    CAPABILITY_NAME(CAP_FEEDERALIGNMENT),
+    CAPABILITY_NAME(CAP_FEEDERORDER),
+    CAPABILITY_NAME(CAP_REACQUIREALLOWED),
+    CAPABILITY_NAME(CAP_BATTERYMINUTES),
+    CAPABILITY_NAME(CAP_BATTERYPERCENTAGE),
+    CAPABILITY_NAME(CAP_CAMERASIDE),
+    CAPABILITY_NAME(CAP_SEGMENTED),
+    CAPABILITY_NAME(CAP_CAMERAENABLED),
+    CAPABILITY_NAME(CAP_CAMERAORDER),
+    CAPABILITY_NAME(CAP_MICRENABLED),
+    CAPABILITY_NAME(CAP_FEEDERPREP),
+    CAPABILITY_NAME(CAP_FEEDERPOCKET),
+    CAPABILITY_NAME(CAP_AUTOMATICSENSEMEDIUM),
+    CAPABILITY_NAME(CAP_CUSTOMINTERFACEGUID),
+    CAPABILITY_NAME(CAP_SUPPORTEDCAPSSEGMENTUNIQUE),
+    CAPABILITY_NAME(CAP_SUPPORTEDDATS),
+    CAPABILITY_NAME(CAP_DOUBLEFEEDDETECTION),
+    CAPABILITY_NAME(CAP_DOUBLEFEEDDETECTIONLENGTH),
+    CAPABILITY_NAME(CAP_DOUBLEFEEDDETECTIONSENSITIVITY),
+    CAPABILITY_NAME(CAP_DOUBLEFEEDDETECTIONRESPONSE),
+    CAPABILITY_NAME(CAP_PAPERHANDLING),
+    CAPABILITY_NAME(CAP_INDICATORSMODE),
+    CAPABILITY_NAME(CAP_PRINTERVERTICALOFFSET),
+    CAPABILITY_NAME(CAP_POWERSAVETIME),
+    CAPABILITY_NAME(CAP_PRINTERCHARROTATION),
+    CAPABILITY_NAME(CAP_PRINTERFONTSTYLE),
+    CAPABILITY_NAME(CAP_PRINTERINDEXLEADCHAR),
+    CAPABILITY_NAME(CAP_PRINTERINDEXMAXVALUE),
+    CAPABILITY_NAME(CAP_PRINTERINDEXNUMDIGITS),
+    CAPABILITY_NAME(CAP_PRINTERINDEXSTEP),
+    CAPABILITY_NAME(CAP_PRINTERINDEXTRIGGER),
+    CAPABILITY_NAME(CAP_PRINTERSTRINGPREVIEW),
+    CAPABILITY_NAME(CAP_SHEETCOUNT),
+    CAPABILITY_NAME(CAP_IMAGEADDRESSENABLED),
+    CAPABILITY_NAME(CAP_IAFIELDA_LEVEL),
+    CAPABILITY_NAME(CAP_IAFIELDB_LEVEL),
+    CAPABILITY_NAME(CAP_IAFIELDC_LEVEL),
+    CAPABILITY_NAME(CAP_IAFIELDD_LEVEL),
+    CAPABILITY_NAME(CAP_IAFIELDE_LEVEL),
+    CAPABILITY_NAME(CAP_IAFIELDA_PRINTFORMAT),
+    CAPABILITY_NAME(CAP_IAFIELDB_PRINTFORMAT),
+    CAPABILITY_NAME(CAP_IAFIELDC_PRINTFORMAT),
+    CAPABILITY_NAME(CAP_IAFIELDD_PRINTFORMAT),
+    CAPABILITY_NAME(CAP_IAFIELDE_PRINTFORMAT),
+    CAPABILITY_NAME(CAP_IAFIELDA_VALUE),
+    CAPABILITY_NAME(CAP_IAFIELDB_VALUE),
+    CAPABILITY_NAME(CAP_IAFIELDC_VALUE),
+    CAPABILITY_NAME(CAP_IAFIELDD_VALUE),
+    CAPABILITY_NAME(CAP_IAFIELDE_VALUE),
+    CAPABILITY_NAME(CAP_IAFIELDA_LASTPAGE),
+    CAPABILITY_NAME(CAP_IAFIELDB_LASTPAGE),
+    CAPABILITY_NAME(CAP_IAFIELDC_LASTPAGE),
+    CAPABILITY_NAME(CAP_IAFIELDD_LASTPAGE),
+    CAPABILITY_NAME(CAP_IAFIELDE_LASTPAGE),
+    CAPABILITY_NAME(ICAP_AUTOBRIGHT),
+    CAPABILITY_NAME(ICAP_BRIGHTNESS),
+    CAPABILITY_NAME(ICAP_CONTRAST),
+    CAPABILITY_NAME(ICAP_CUSTHALFTONE),
+    CAPABILITY_NAME(ICAP_EXPOSURETIME),
+    CAPABILITY_NAME(ICAP_FILTER),
+    CAPABILITY_NAME(ICAP_FLASHUSED),
+    CAPABILITY_NAME(ICAP_GAMMA),
+    CAPABILITY_NAME(ICAP_HALFTONES),
+    CAPABILITY_NAME(ICAP_HIGHLIGHT),
+    CAPABILITY_NAME(ICAP_IMAGEFILEFORMAT),
+    CAPABILITY_NAME(ICAP_LAMPSTATE),
+    CAPABILITY_NAME(ICAP_LIGHTSOURCE),
+    CAPABILITY_NAME(ICAP_ORIENTATION),
+    CAPABILITY_NAME(ICAP_PHYSICALWIDTH),
+    CAPABILITY_NAME(ICAP_PHYSICALHEIGHT),
+    CAPABILITY_NAME(ICAP_SHADOW),
+    CAPABILITY_NAME(ICAP_FRAMES),
+    CAPABILITY_NAME(ICAP_XNATIVERESOLUTION),
+    CAPABILITY_NAME(ICAP_YNATIVERESOLUTION),
+    CAPABILITY_NAME(ICAP_XRESOLUTION),
+    CAPABILITY_NAME(ICAP_YRESOLUTION),
+    CAPABILITY_NAME(ICAP_MAXFRAMES),
+    CAPABILITY_NAME(ICAP_TILES),
+    CAPABILITY_NAME(ICAP_BITORDER),
+    CAPABILITY_NAME(ICAP_CCITTKFACTOR),
+    CAPABILITY_NAME(ICAP_LIGHTPATH),
+    CAPABILITY_NAME(ICAP_PIXELFLAVOR),
+    CAPABILITY_NAME(ICAP_PLANARCHUNKY),
+    CAPABILITY_NAME(ICAP_ROTATION),
+    CAPABILITY_NAME(ICAP_SUPPORTEDSIZES),
+    CAPABILITY_NAME(ICAP_THRESHOLD),
+    CAPABILITY_NAME(ICAP_XSCALING),
+    CAPABILITY_NAME(ICAP_YSCALING),
+    CAPABILITY_NAME(ICAP_BITORDERCODES),
+    CAPABILITY_NAME(ICAP_PIXELFLAVORCODES),
+    CAPABILITY_NAME(ICAP_JPEGPIXELTYPE),
+    CAPABILITY_NAME(ICAP_TIMEFILL),
+    CAPABILITY_NAME(ICAP_BITDEPTH),
+    CAPABILITY_NAME(ICAP_BITDEPTHREDUCTION),
+    CAPABILITY_NAME(ICAP_UNDEFINEDIMAGESIZE),
+    CAPABILITY_NAME(ICAP_IMAGEDATASET),
+    CAPABILITY_NAME(ICAP_EXTIMAGEINFO),
+    CAPABILITY_NAME(ICAP_MINIMUMHEIGHT),
+    CAPABILITY_NAME(ICAP_MINIMUMWIDTH),
+    CAPABILITY_NAME(ICAP_AUTODISCARDBLANKPAGES),
+    CAPABILITY_NAME(ICAP_FLIPROTATION),
+    CAPABILITY_NAME(ICAP_BARCODEDETECTIONENABLED),
+    CAPABILITY_NAME(ICAP_SUPPORTEDBARCODETYPES),
+    CAPABILITY_NAME(ICAP_BARCODEMAXSEARCHPRIORITIES),
+    CAPABILITY_NAME(ICAP_BARCODESEARCHPRIORITIES),
+    CAPABILITY_NAME(ICAP_BARCODESEARCHMODE),
+    CAPABILITY_NAME(ICAP_BARCODEMAXRETRIES),
+    CAPABILITY_NAME(ICAP_BARCODETIMEOUT),
+    CAPABILITY_NAME(ICAP_ZOOMFACTOR),
+    CAPABILITY_NAME(ICAP_PATCHCODEDETECTIONENABLED),
+    CAPABILITY_NAME(ICAP_SUPPORTEDPATCHCODETYPES),
+    CAPABILITY_NAME(ICAP_PATCHCODEMAXSEARCHPRIORITIES),
+    CAPABILITY_NAME(ICAP_PATCHCODESEARCHPRIORITIES),
+    CAPABILITY_NAME(ICAP_PATCHCODESEARCHMODE),
+    CAPABILITY_NAME(ICAP_PATCHCODEMAXRETRIES),
+    CAPABILITY_NAME(ICAP_PATCHCODETIMEOUT),
+    CAPABILITY_NAME(ICAP_FLASHUSED2),
+    CAPABILITY_NAME(ICAP_IMAGEFILTER),
+    CAPABILITY_NAME(ICAP_NOISEFILTER),
+    CAPABILITY_NAME(ICAP_OVERSCAN),
+    CAPABILITY_NAME(ICAP_AUTOMATICBORDERDETECTION),
+    CAPABILITY_NAME(ICAP_AUTOMATICDESKEW),
+    CAPABILITY_NAME(ICAP_AUTOMATICROTATE),
+    CAPABILITY_NAME(ICAP_JPEGQUALITY),
+    CAPABILITY_NAME(ICAP_FEEDERTYPE),
+    CAPABILITY_NAME(ICAP_ICCPROFILE),
+    CAPABILITY_NAME(ICAP_AUTOSIZE),
+    CAPABILITY_NAME(ICAP_AUTOMATICCROPUSESFRAME),
+    CAPABILITY_NAME(ICAP_AUTOMATICLENGTHDETECTION),
+    CAPABILITY_NAME(ICAP_AUTOMATICCOLORENABLED),
+    CAPABILITY_NAME(ICAP_AUTOMATICCOLORNONCOLORPIXELTYPE),
+    CAPABILITY_NAME(ICAP_COLORMANAGEMENTENABLED),
+    CAPABILITY_NAME(ICAP_IMAGEMERGE),
+    CAPABILITY_NAME(ICAP_IMAGEMERGEHEIGHTTHRESHOLD),
+    CAPABILITY_NAME(ICAP_SUPPORTEDEXTIMAGEINFO),
+    CAPABILITY_NAME(ICAP_FILMTYPE),
+    CAPABILITY_NAME(ICAP_MIRROR),
+    CAPABILITY_NAME(ICAP_JPEGSUBSAMPLING),
+};
+const size_t kStandardCapabilityCount = sizeof(kStandardCapabilities) / sizeof(kStandardCapabilities[0]);
+
+#undef CAPABILITY_NAME
+
+double Fix32ToDouble(TW_FIX32 fix) {
+    return fix.Whole + fix.Frac / 65536.0;
+}
+
+namespace {
+
+size_t ItemSize(TW_UINT16 itemType) {
+    switch (itemType) {
+        case TWTY_INT8:
+        case TWTY_UINT8: return 1;
+        case TWTY_INT16:
+        case TWTY_UINT16:
+        case TWTY_BOOL: return 2;
+        case TWTY_INT32:
+        case TWTY_UINT32:
+        case TWTY_FIX32: return 4;
+        case TWTY_FRAME: return sizeof(TW_FRAME);
+        case TWTY_STR32: return sizeof(TW_STR32);
+        case TWTY_STR64: return sizeof(TW_STR64);
+        case TWTY_STR128: return sizeof(TW_STR128);
+        case TWTY_STR255: return sizeof(TW_STR255);
+        case TWTY_STR1024: return sizeof(TW_STR1024);
+        case TWTY_UNI512: return sizeof(TW_UNI512);
+        case TWTY_HANDLE: return sizeof(TW_HANDLE);
+        default: return 0;
+    }
+}
+
+bool IsNumeric(TW_UINT16 itemType) {
+    return itemType <= TWTY_FIX32;
+}
+
+// Reads one packed item from an enumeration or array list
+double ReadItem(const TW_UINT8* p, TW_UINT16 itemType) {
+    switch (itemType) {
+        case TWTY_INT8: return *(const TW_INT8*)p;
+        case TWTY_UINT8: return *p;
+        case TWTY_INT16: { TW_INT16 v; memcpy(&v, p, sizeof(v)); return v; }
+        case TWTY_UINT16:
+        case TWTY_BOOL: { TW_UINT16 v; memcpy(&v, p, sizeof(v)); return v; }
+        case TWTY_INT32: { TW_INT32 v; memcpy(&v, p, sizeof(v)); return v; }
+        case TWTY_UINT32: { TW_UINT32 v; memcpy(&v, p, sizeof(v)); return v; }
+        case TWTY_FIX32: { TW_FIX32 v; memcpy(&v, p, sizeof(v)); return Fix32ToDouble(v); }
+        default: return 0;
+    }
+}
+
+// TW_ONEVALUE and TW_RANGE keep every item in a 32-bit slot
+double ReadSlot(TW_UINT32 slot, TW_UINT16 itemType) {
+    TW_UINT8 bytes[sizeof(TW_UINT32)];
+    memcpy(bytes, &slot, sizeof(slot));
+    return ReadItem(bytes, itemType);
+}
+
+}  // namespace
+
+bool CapabilityInfo::operator==(const CapabilityInfo& other) const {
+    return cap == other.cap
+        && conType == other.conType
+        && itemType == other.itemType
+        && currentValue == other.currentValue
+        && defaultValue == other.defaultValue
+        && minValue == other.minValue
+        && maxValue == other.maxValue
+        && stepValue == other.stepValue
+        && values == other.values
+        && supportFlags == other.supportFlags;
+}
+
+bool DecodeCapability(const TW_CAPABILITY& cap, CapabilityInfo& info) {
+    if (!cap.hContainer) {
+        return false;
+    }
+
+    TW_MEMREF pContainer = GlobalLock(cap.hContainer);
+    if (!pContainer) {
+        return false;
+    }
+
+    info.cap = cap.Cap;
+    info.conType = cap.ConType;
+    info.values.clear();
+    bool decoded = true;
+
+    switch (cap.ConType) {
+        case TWON_ONEVALUE: {
+            pTW_ONEVALUE pVal = (pTW_ONEVALUE)pContainer;
+            info.itemType = pVal->ItemType;
+            if (IsNumeric(info.itemType)) {
+                info.currentValue = ReadSlot(pVal->Item, info.itemType);
+                info.defaultValue = info.currentValue;
+            }
+            break;
+        }
+        case TWON_ENUMERATION: {
+            pTW_ENUMERATION pEnum = (pTW_ENUMERATION)pContainer;
+            info.itemType = pEnum->ItemType;
+            size_t itemSize = ItemSize(info.itemType);
+            if (IsNumeric(info.itemType) && itemSize) {
+                for (TW_UINT32 i = 0; i < pEnum->NumItems; i++) {
+                    info.values.push_back(ReadItem(pEnum->ItemList + i * itemSize, info.itemType));
+                }
+                if (pEnum->CurrentIndex < info.values.size()) {
+                    info.currentValue = info.values[pEnum->CurrentIndex];
+                }
+                if (pEnum->DefaultIndex < info.values.size()) {
+                    info.defaultValue = info.values[pEnum->DefaultIndex];
+                }
+            }
+            break;
+        }
+        case TWON_RANGE: {
+            pTW_RANGE pRange = (pTW_RANGE)pContainer;
+            info.itemType = pRange->ItemType;
+            if (IsNumeric(info.itemType)) {
+                info.minValue = ReadSlot(pRange->MinValue, info.itemType);
+                info.maxValue = ReadSlot(pRange->MaxValue, info.itemType);
+                info.stepValue = ReadSlot(pRange->StepSize, info.itemType);
+                info.defaultValue = ReadSlot(pRange->DefaultValue, info.itemType);
+                info.currentValue = ReadSlot(pRange->CurrentValue, info.itemType);
+            }
+            break;
+        }
+        case TWON_ARRAY: {
+            pTW_ARRAY pArray = (pTW_ARRAY)pContainer;
+            info.itemType = pArray->ItemType;
+            size_t itemSize = ItemSize(info.itemType);
+            if (IsNumeric(info.itemType) && itemSize) {
+                for (TW_UINT32 i = 0; i < pArray->NumItems; i++) {
+                    info.values.push_back(ReadItem(pArray->ItemList + i * itemSize, info.itemType));
+                }
+            }
+            break;
+        }
+        default:
+            decoded = false;
+            break;
+    }
+
+    GlobalUnlock(cap.hContainer);
+    return decoded;
+}
+
+bool CapabilityInfo::Offers(double value) const {
+    switch (conType) {
+        case TWON_ENUMERATION:
+        case TWON_ARRAY:
+            for (double v : values) {
+                if (v == value) {
+                    return true;
+                }
+            }
+            return false;
+        case TWON_RANGE:
+            return value >= minValue && value <= maxValue;
+        default:
+            return currentValue == value;
+    }
+}
+
+const char* CapabilityNameOf(TW_UINT16 cap) {
+    for (size_t i = 0; i < kStandardCapabilityCount; i++) {
+        if (kStandardCapabilities[i].cap == cap) {
+            return kStandardCapabilities[i].name;
+        }
+    }
+    return nullptr;
+}
+
+const char* ContainerNameOf(TW_UINT16 conType) {
+    switch (conType) {
+        case TWON_ONEVALUE: return "oneValue";
+        case TWON_ENUMERATION: return "enumeration";
+        case TWON_RANGE: return "range";
+        case TWON_ARRAY: return "array";
+        default: return "unknown";
+    }
+}
+
+const char* ItemTypeNameOf(TW_UINT16 itemType) {
+    switch (itemType) {
+        case TWTY_INT8: return "int8";
+        case TWTY_INT16: return "int16";
+        case TWTY_INT32: return "int32";
+        case TWTY_UINT8: return "uint8";
+        case TWTY_UINT16: return "uint16";
+        case TWTY_UINT32: return "uint32";
+        case TWTY_BOOL: return "bool";
+        case TWTY_FIX32: return "fix32";
+        case TWTY_FRAME: return "frame";
+        case TWTY_STR32:
+        case TWTY_STR64:
+        case TWTY_STR128:
+        case TWTY_STR255:
+        case TWTY_STR1024: return "string";
+        case TWTY_UNI512: return "unicode";
+        case TWTY_HANDLE: return "handle";
+        default: return "unknown";
+    }
+}
+
+CapabilityFastPaths DescribeFastPaths(const std::vector<CapabilityInfo>& caps) {
+    CapabilityFastPaths fastPaths;
+
+    const CapabilityInfo* compression = FindCapability(caps, ICAP_COMPRESSION);
+    if (compression) {
+        for (double value : compression->values) {
+            if (value != TWCP_NONE) {
+                fastPaths.compression = true;
+                break;
+            }
+        }
+    }
+
+    const CapabilityInfo* xferMech = FindCapability(caps, ICAP_XFERMECH);
+    if (xferMech) {
+        fastPaths.memoryTransfer = xferMech->Offers(TWSX_MEMORY);
+        fastPaths.fileTransfer = xferMech->Offers(TWSX_FILE);
+    }
+
+    const CapabilityInfo* discard = FindCapability(caps, ICAP_AUTODISCARDBLANKPAGES);
+    fastPaths.blankPageDiscard = discard && discard->IsSettable();
+
+    const CapabilityInfo* deskew = FindCapability(caps, ICAP_AUTOMATICDESKEW);
+    fastPaths.automaticDeskew = deskew && deskew->IsSettable();
+
+    const CapabilityInfo* border = FindCapability(caps, ICAP_AUTOMATICBORDERDETECTION);
+    fastPaths.automaticBorderDetection = border && border->IsSettable();
+
+    const CapabilityInfo* filter = FindCapability(caps, ICAP_FILTER);
+    fastPaths.colourDropout = filter && filter->IsSettable() &&
+        (filter->Offers(TWFT_RED) || filter->Offers(TWFT_GREEN) || filter->Offers(TWFT_BLUE));
+
+    return fastPaths;
+}
+
+const CapabilityInfo* FindCapability(const std::vector<CapabilityInfo>& caps, TW_UINT16 cap) {
+    for (const auto& info : caps) {
+        if (info.cap == cap) {
+            return &info;
+        }
+    }
+    return nullptr;
+}
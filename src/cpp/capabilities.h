@@ -0,0 +1,76 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "twain/windows_wrapper.h"
+#include "twain.h"
+
+// Decoded copy of a capability container returned by MSG_GET.
+// Numeric items (including TW_FIX32) are widened to double; string and
+// frame items keep only their container and item type.
+struct CapabilityInfo {
+    TW_UINT16 cap;
+    TW_UINT16 conType;
+    TW_UINT16 itemType;
+    double currentValue;
+    double defaultValue;
+    double minValue;
+    double maxValue;
+    double stepValue;
+    std::vector<double> values;
+    TW_INT32 supportFlags;  // TWQC_* from MSG_QUERYSUPPORT, 0 when not reported
+    double elapsedMs;       // Time spent querying; not persisted or compared
+
+    CapabilityInfo()
+        : cap(0), conType(TWON_DONTCARE16), itemType(0)
+        , currentValue(0), defaultValue(0)
+        , minValue(0), maxValue(0), stepValue(0)
+        , supportFlags(0), elapsedMs(0) {}
+
+    bool IsSettable() const { return supportFlags == 0 || (supportFlags & TWQC_SET) != 0; }
+    bool Offers(double value) const;
+
+    bool operator==(const CapabilityInfo& other) const;
+    bool operator!=(const CapabilityInfo& other) const { return !(*this == other); }
+};
+
+// Capabilities read when a source is first initialized
+extern const TW_UINT16 kProbedCapabilities[];
+extern const size_t kProbedCapabilityCount;
+
+// Every standard CAP_/ICAP_ code, used for full discovery
+struct CapabilityName {
+    TW_UINT16 cap;
+    const char* name;
+};
+extern const CapabilityName kStandardCapabilities[];
+extern const size_t kStandardCapabilityCount;
+
+const char* CapabilityNameOf(TW_UINT16 cap);
+const char* ContainerNameOf(TW_UINT16 conType);
+const char* ItemTypeNameOf(TW_UINT16 itemType);
+double Fix32ToDouble(TW_FIX32 fix);
+
+// Device-side shortcuts worth negotiating instead of doing the work on
+// the host, derived from a probed capability set
+struct CapabilityFastPaths {
+    bool compression;
+    bool memoryTransfer;
+    bool fileTransfer;
+    bool blankPageDiscard;
+    bool automaticDeskew;
+    bool automaticBorderDetection;
+    bool colourDropout;  // ICAP_FILTER offers a red, green or blue channel
+
+    CapabilityFastPaths()
+        : compression(false), memoryTransfer(false), fileTransfer(false)
+        , blankPageDiscard(false), automaticDeskew(false)
+        , automaticBorderDetection(false), colourDropout(false) {}
+};
+
+CapabilityFastPaths DescribeFastPaths(const std::vector<CapabilityInfo>& caps);
+
+// Decodes cap.hContainer (TWON_ONEVALUE, TWON_ENUMERATION, TWON_RANGE or
+// TWON_ARRAY) into info. The container is not freed.
+bool DecodeCapability(const TW_CAPABILITY& cap, CapabilityInfo& info);
+
+const CapabilityInfo* FindCapability(const std::vector<CapabilityInfo>& caps, TW_UINT16 cap);
@@ -0,0 +1,180 @@
+#include "capability_cache.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+namespace {
+
+const char kMagic[4] = { 'T', 'W', 'C', 'C' };
+
+void WriteU32(std::ofstream& out, TW_UINT32 value) {
+    out.write((const char*)&value, sizeof(value));
+}
+
+void WriteDouble(std::ofstream& out, double value) {
+    out.write((const char*)&value, sizeof(value));
+}
+
+void WriteString(std::ofstream& out, const std::string& value) {
+    WriteU32(out, (TW_UINT32)value.size());
+    out.write(value.data(), value.size());
+}
+
+bool ReadU32(std::ifstream& in, TW_UINT32& value) {
+    return (bool)in.read((char*)&value, sizeof(value));
+}
+
+bool ReadDouble(std::ifstream& in, double& value) {
+    return (bool)in.read((char*)&value, sizeof(value));
+}
+
+bool ReadString(std::ifstream& in, std::string& value) {
+    TW_UINT32 length;
+    if (!ReadU32(in, length) || length > 4096) {
+        return false;
+    }
+    value.resize(length);
+    return length == 0 || (bool)in.read(&value[0], length);
+}
+
+}  // namespace
+
+std::string CapabilityCache::KeyFor(const TW_IDENTITY& source) {
+    return std::string(source.Manufacturer) + "|" + source.ProductFamily + "|" + source.ProductName;
+}
+
+std::string CapabilityCache::DriverVersionOf(const TW_IDENTITY& source) {
+    return std::to_string(source.Version.MajorNum) + "." +
+           std::to_string(source.Version.MinorNum) + " " + source.Version.Info;
+}
+
+bool CapabilityCache::Load() {
+    m_Entries.clear();
+    if (m_Path.empty()) {
+        return false;
+    }
+
+    std::ifstream in(m_Path.c_str(), std::ios::binary);
+    if (!in) {
+        return false;
+    }
+
+    char magic[4];
+    TW_UINT32 version, entryCount;
+    if (!in.read(magic, sizeof(magic)) || memcmp(magic, kMagic, sizeof(kMagic)) != 0 ||
+        !ReadU32(in, version) || version != kFormatVersion ||
+        !ReadU32(in, entryCount)) {
+        return false;
+    }
+
+    std::map<std::string, Entry> entries;
+    for (TW_UINT32 i = 0; i < entryCount; i++) {
+        std::string key;
+        Entry entry;
+        TW_UINT32 complete, capCount;
+        if (!ReadString(in, key) || !ReadString(in, entry.driverVersion) ||
+            !ReadU32(in, complete) || !ReadU32(in, capCount)) {
+            return false;
+        }
+        entry.complete = complete != 0;
+
+        for (TW_UINT32 j = 0; j < capCount; j++) {
+            CapabilityInfo info;
+            TW_UINT32 cap, conType, itemType, supportFlags, valueCount;
+            if (!ReadU32(in, cap) || !ReadU32(in, conType) || !ReadU32(in, itemType) ||
+                !ReadU32(in, supportFlags) ||
+                !ReadDouble(in, info.currentValue) || !ReadDouble(in, info.defaultValue) ||
+                !ReadDouble(in, info.minValue) || !ReadDouble(in, info.maxValue) ||
+                !ReadDouble(in, info.stepValue) || !ReadU32(in, valueCount) || valueCount > 65536) {
+                return false;
+            }
+            info.cap = (TW_UINT16)cap;
+            info.conType = (TW_UINT16)conType;
+            info.itemType = (TW_UINT16)itemType;
+            info.supportFlags = (TW_INT32)supportFlags;
+            info.values.resize(valueCount);
+            for (TW_UINT32 k = 0; k < valueCount; k++) {
+                if (!ReadDouble(in, info.values[k])) {
+                    return false;
+                }
+            }
+            entry.caps.push_back(info);
+        }
+        entries[key] = entry;
+    }
+
+    m_Entries.swap(entries);
+    return true;
+}
+
+bool CapabilityCache::Save() const {
+    if (m_Path.empty()) {
+        return false;
+    }
+
+    // Write a sibling file and swap it in so a crash never leaves a torn cache
+    std::string tempPath = m_Path + ".tmp";
+    {
+        std::ofstream out(tempPath.c_str(), std::ios::binary | std::ios::trunc);
+        if (!out) {
+            return false;
+        }
+
+        out.write(kMagic, sizeof(kMagic));
+        WriteU32(out, kFormatVersion);
+        WriteU32(out, (TW_UINT32)m_Entries.size());
+
+        for (const auto& item : m_Entries) {
+            WriteString(out, item.first);
+            WriteString(out, item.second.driverVersion);
+            WriteU32(out, item.second.complete ? 1 : 0);
+            WriteU32(out, (TW_UINT32)item.second.caps.size());
+            for (const auto& info : item.second.caps) {
+                WriteU32(out, info.cap);
+                WriteU32(out, info.conType);
+                WriteU32(out, info.itemType);
+                WriteU32(out, (TW_UINT32)info.supportFlags);
+                WriteDouble(out, info.currentValue);
+                WriteDouble(out, info.defaultValue);
+                WriteDouble(out, info.minValue);
+                WriteDouble(out, info.maxValue);
+                WriteDouble(out, info.stepValue);
+                WriteU32(out, (TW_UINT32)info.values.size());
+                for (double value : info.values) {
+                    WriteDouble(out, value);
+                }
+            }
+        }
+
+        if (!out) {
+            return false;
+        }
+    }
+
+    std::remove(m_Path.c_str());
+    return std::rename(tempPath.c_str(), m_Path.c_str()) == 0;
+}
+
+bool CapabilityCache::Lookup(const TW_IDENTITY& source, std::vector<CapabilityInfo>& caps, bool& complete) {
+    auto it = m_Entries.find(KeyFor(source));
+    if (it == m_Entries.end()) {
+        return false;
+    }
+
+    // A driver update can change what the source reports
+    if (it->second.driverVersion != DriverVersionOf(source)) {
+        m_Entries.erase(it);
+        return false;
+    }
+
+    caps = it->second.caps;
+    complete = it->second.complete;
+    return true;
+}
+
+void CapabilityCache::Store(const TW_IDENTITY& source, const std::vector<CapabilityInfo>& caps, bool complete) {
+    Entry& entry = m_Entries[KeyFor(source)];
+    entry.driverVersion = DriverVersionOf(source);
+    entry.complete = complete;
+    entry.caps = caps;
+}
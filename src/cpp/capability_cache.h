@@ -0,0 +1,40 @@
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+#include "capabilities.h"
+
+// On-disk cache of each source's capability set, keyed by the
+// TW_IDENTITY manufacturer and product. Entries remember the driver
+// version they were probed with and are dropped when it changes.
+class CapabilityCache {
+public:
+    // Bump when the file layout changes; older files are ignored
+    static const TW_UINT32 kFormatVersion = 2;
+
+    void SetPath(const std::string& path) { m_Path = path; }
+    const std::string& GetPath() const { return m_Path; }
+
+    bool Load();
+    bool Save() const;
+
+    // complete is true when the set came from a full discovery pass
+    // rather than the short probe done by Initialize
+    bool Lookup(const TW_IDENTITY& source, std::vector<CapabilityInfo>& caps, bool& complete);
+    void Store(const TW_IDENTITY& source, const std::vector<CapabilityInfo>& caps, bool complete);
+
+private:
+    struct Entry {
+        std::string driverVersion;
+        bool complete;
+        std::vector<CapabilityInfo> caps;
+
+        Entry() : complete(false) {}
+    };
+
+    static std::string KeyFor(const TW_IDENTITY& source);
+    static std::string DriverVersionOf(const TW_IDENTITY& source);
+
+    std::string m_Path;
+    std::map<std::string, Entry> m_Entries;
+};
@@ -0,0 +1,267 @@
+#include "auto_crop.h"
+#include "grey_rows.h"
+#include "parallel.h"
+#include "simd.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+const size_t kProxyWidth = 1024;
+
+struct LineSum {
+    uint64_t sum;
+    uint64_t sumSquares;
+    uint32_t count;
+
+    LineSum() : sum(0), sumSquares(0), count(0) {}
+
+    void Add(uint8_t grey) {
+        sum += grey;
+        sumSquares += (uint32_t)grey * grey;
+        count++;
+    }
+
+    // A run of up to 256K greys
+    void Add(const uint8_t* grey, size_t length) {
+        size_t i = 0;
+#ifdef SCANNER_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        __m128i sums = zero, squares = zero;
+        for (; i + 16 <= length; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(grey + i));
+            __m128i low = _mm_unpacklo_epi8(v, zero), high = _mm_unpackhi_epi8(v, zero);
+            sums = _mm_add_epi64(sums, _mm_sad_epu8(v, zero));
+            squares = _mm_add_epi32(squares, _mm_add_epi32(_mm_madd_epi16(low, low), _mm_madd_epi16(high, high)));
+        }
+        uint64_t sumLanes[2];
+        uint32_t squareLanes[4];
+        _mm_storeu_si128((__m128i*)sumLanes, sums);
+        _mm_storeu_si128((__m128i*)squareLanes, squares);
+        sum += sumLanes[0] + sumLanes[1];
+        sumSquares += (uint64_t)squareLanes[0] + squareLanes[1] + squareLanes[2] + squareLanes[3];
+#endif
+        for (; i < length; i++) {
+            sum += grey[i];
+            sumSquares += (uint32_t)grey[i] * grey[i];
+        }
+        count += (uint32_t)length;
+    }
+};
+
+// Adds a row into per-column sums and sums of squares
+void AddColumns(const uint8_t* row, size_t width, uint32_t* sums, uint32_t* squares) {
+    size_t x = 0;
+#ifdef SCANNER_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= width; x += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+        __m128i halves[2] = { _mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero) };
+        for (int h = 0; h < 2; h++) {
+            // 255 squared still fits an unsigned 16 bit lane
+            __m128i squared = _mm_mullo_epi16(halves[h], halves[h]);
+            __m128i* sum = (__m128i*)(sums + x + h * 8);
+            __m128i* square = (__m128i*)(squares + x + h * 8);
+            _mm_storeu_si128(sum, _mm_add_epi32(_mm_loadu_si128(sum), _mm_unpacklo_epi16(halves[h], zero)));
+            _mm_storeu_si128(sum + 1, _mm_add_epi32(_mm_loadu_si128(sum + 1), _mm_unpackhi_epi16(halves[h], zero)));
+            _mm_storeu_si128(square, _mm_add_epi32(_mm_loadu_si128(square), _mm_unpacklo_epi16(squared, zero)));
+            _mm_storeu_si128(square + 1, _mm_add_epi32(_mm_loadu_si128(square + 1), _mm_unpackhi_epi16(squared, zero)));
+        }
+    }
+#endif
+    for (; x < width; x++) {
+        sums[x] += row[x];
+        squares[x] += (uint32_t)row[x] * row[x];
+    }
+}
+
+bool IsBorder(const LineSum& line, const AutoCropOptions& options) {
+    if (line.count == 0) {
+        return true;
+    }
+    double mean = (double)line.sum / line.count;
+    double variance = (double)line.sumSquares / line.count - mean * mean;
+    return mean < options.borderLevel && variance < options.maxDeviation * options.maxDeviation;
+}
+
+}  // namespace
+
+bool FindDocumentBounds(const DibLayout& layout, const AutoCropOptions& options, CropRect& rect) {
+    GreyRowReader reader;
+    if (!reader.Open(layout)) {
+        return false;
+    }
+    size_t width = reader.Width(), height = reader.Height();
+    rect = CropRect(0, 0, (uint32_t)width, (uint32_t)height);
+    if (width == 0 || height == 0) {
+        return false;
+    }
+
+    // Point samples every factor pixels each way, which keeps the
+    // variance of the lines they cross
+    size_t factor = std::max<size_t>(1, (width + kProxyWidth - 1) / kProxyWidth);
+    size_t proxyWidth = (width + factor - 1) / factor;
+    size_t proxyHeight = (height + factor - 1) / factor;
+    std::vector<uint8_t> proxy(proxyWidth * proxyHeight);
+    ParallelFor(proxyHeight, 64, [&](size_t begin, size_t end) {
+        GreyRowReader rows;
+        rows.Open(layout);
+        for (size_t py = begin; py < end; py++) {
+            const uint8_t* grey = rows.ReadSampled(py * factor, factor);
+            memcpy(proxy.data() + py * proxyWidth, grey, proxyWidth);
+        }
+    });
+
+    // Outermost proxy rows, then columns across those rows, that are not
+    // border. Rows are in storage order until the end.
+    std::vector<LineSum> rowSums(proxyHeight);
+    for (size_t py = 0; py < proxyHeight; py++) {
+        rowSums[py].Add(proxy.data() + py * proxyWidth, proxyWidth);
+    }
+    size_t top = 0, bottom = proxyHeight - 1;
+    while (top < proxyHeight && IsBorder(rowSums[top], options)) {
+        top++;
+    }
+    if (top == proxyHeight) {
+        return false;
+    }
+    while (IsBorder(rowSums[bottom], options)) {
+        bottom--;
+    }
+
+    // The 32 bit lanes hold 65536 rows of 255 squared, so the columns of
+    // tall, narrow pages are folded into 64 bit sums a batch at a time
+    const size_t kColumnBatch = 65536;
+    std::vector<uint32_t> columnSum(proxyWidth), columnSquares(proxyWidth);
+    std::vector<LineSum> columnSums(proxyWidth);
+    for (size_t first = top; first <= bottom; first += kColumnBatch) {
+        size_t last = std::min(bottom + 1, first + kColumnBatch);
+        std::fill(columnSum.begin(), columnSum.end(), 0);
+        std::fill(columnSquares.begin(), columnSquares.end(), 0);
+        for (size_t py = first; py < last; py++) {
+            AddColumns(proxy.data() + py * proxyWidth, proxyWidth, columnSum.data(), columnSquares.data());
+        }
+        for (size_t px = 0; px < proxyWidth; px++) {
+            columnSums[px].sum += columnSum[px];
+            columnSums[px].sumSquares += columnSquares[px];
+            columnSums[px].count += (uint32_t)(last - first);
+        }
+    }
+    size_t left = 0, right = proxyWidth - 1;
+    while (left < proxyWidth && IsBorder(columnSums[left], options)) {
+        left++;
+    }
+    if (left == proxyWidth) {
+        return false;
+    }
+    while (IsBorder(columnSums[right], options)) {
+        right--;
+    }
+
+    // Each edge lies between the last border sample and the first
+    // document one; walk out to it at full resolution
+    size_t x0 = left * factor, x1 = std::min(width, right * factor + 1);
+    auto rowIsBorder = [&](size_t y) {
+        LineSum line;
+        line.Add(reader.Read(y, x0, x1), x1 - x0);
+        return IsBorder(line, options);
+    };
+    size_t firstRow = top * factor, lastRow = bottom * factor;
+    while (firstRow > 0 && firstRow + factor > top * factor + 1 && !rowIsBorder(firstRow - 1)) {
+        firstRow--;
+    }
+    size_t rowLimit = std::min(height, (bottom + 1) * factor);
+    while (lastRow + 1 < rowLimit && !rowIsBorder(lastRow + 1)) {
+        lastRow++;
+    }
+
+    // Columns between samples, over every factor-th document row
+    size_t leftFrom = left > 0 ? (left - 1) * factor + 1 : 0;
+    size_t rightTo = std::min(width, (right + 1) * factor);
+    std::vector<LineSum> leftSums(x0 - leftFrom), rightSums(rightTo - (right * factor + 1));
+    for (size_t y = firstRow; y <= lastRow; y += factor) {
+        if (!leftSums.empty()) {
+            const uint8_t* grey = reader.Read(y, leftFrom, x0);
+            for (size_t i = 0; i < leftSums.size(); i++) {
+                leftSums[i].Add(grey[i]);
+            }
+        }
+        if (!rightSums.empty()) {
+            const uint8_t* grey = reader.Read(y, right * factor + 1, rightTo);
+            for (size_t i = 0; i < rightSums.size(); i++) {
+                rightSums[i].Add(grey[i]);
+            }
+        }
+    }
+    size_t firstColumn = x0, lastColumn = x1 - 1;
+    while (firstColumn > leftFrom && !IsBorder(leftSums[firstColumn - 1 - leftFrom], options)) {
+        firstColumn--;
+    }
+    while (lastColumn + 1 < rightTo && !IsBorder(rightSums[lastColumn - right * factor], options)) {
+        lastColumn++;
+    }
+
+    // Whole bytes of 1 and 4 bit rows
+    int bitCount = layout.header->biBitCount;
+    if (bitCount < 8) {
+        size_t perByte = 8 / bitCount;
+        firstColumn -= firstColumn % perByte;
+    }
+
+    size_t keptWidth = lastColumn - firstColumn + 1, keptHeight = lastRow - firstRow + 1;
+    if (keptWidth < width * options.minSize || keptHeight < height * options.minSize) {
+        return true;
+    }
+    size_t viewedTop = reader.BottomUp() ? height - 1 - lastRow : firstRow;
+    rect = CropRect((uint32_t)firstColumn, (uint32_t)viewedTop, (uint32_t)keptWidth, (uint32_t)keptHeight);
+    return true;
+}
+
+bool CropDib(const DibLayout& layout, const CropRect& rect) {
+    BITMAPINFOHEADER* header = const_cast<BITMAPINFOHEADER*>(layout.header);
+    BYTE* bits = const_cast<BYTE*>(layout.bits);
+    if (!header || !bits || (header->biCompression != BI_RGB && header->biCompression != BI_BITFIELDS)) {
+        return false;
+    }
+
+    int bitCount = header->biBitCount;
+    bool bottomUp = header->biHeight > 0;
+    size_t width = (size_t)header->biWidth;
+    size_t height = (size_t)(bottomUp ? header->biHeight : -header->biHeight);
+    if (rect.width == 0 || rect.height == 0 || rect.left + (size_t)rect.width > width ||
+        rect.top + (size_t)rect.height > height || ((size_t)rect.left * bitCount) % 8 != 0 ||
+        layout.imageSize < layout.stride * height) {
+        return false;
+    }
+    if (rect.width == width && rect.height == height) {
+        return true;
+    }
+
+    size_t stride = layout.stride;
+    size_t newStride = (((size_t)rect.width * bitCount + 31) / 32) * 4;
+    size_t firstRow = bottomUp ? height - rect.top - rect.height : rect.top;
+    size_t leftBytes = (size_t)rect.left * bitCount / 8;
+
+    if (newStride == stride && leftBytes == 0) {
+        // Same rows, fewer of them: one move, or none when the rows kept
+        // are stored first
+        if (firstRow > 0) {
+            memmove(bits, bits + firstRow * stride, rect.height * stride);
+        }
+    } else {
+        // Each row moves down to its narrower slot, never past a row
+        // still to be read
+        size_t rowBytes = ((size_t)rect.width * bitCount + 7) / 8;
+        for (size_t row = 0; row < rect.height; row++) {
+            BYTE* to = bits + row * newStride;
+            memmove(to, bits + (firstRow + row) * stride + leftBytes, rowBytes);
+            memset(to + rowBytes, 0, newStride - rowBytes);
+        }
+    }
+
+    header->biWidth = (LONG)rect.width;
+    header->biHeight = bottomUp ? (LONG)rect.height : -(LONG)rect.height;
+    header->biSizeImage = (DWORD)(newStride * rect.height);
+    return true;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include "bitmap.h"
+
+// Rows and columns of platen around the document are dark and even;
+// those of the document are bright paper or vary with its content
+struct AutoCropOptions {
+    uint8_t borderLevel;   // Lines darker on average than this may be border
+    double maxDeviation;   // and must vary less than this (grey standard deviation)
+    double minSize;        // Smallest document kept, as a fraction of the width and height
+
+    AutoCropOptions() : borderLevel(96), maxDeviation(24), minSize(0.1) {}
+};
+
+// Pixels from the top-left corner of the page as viewed
+struct CropRect {
+    uint32_t left;
+    uint32_t top;
+    uint32_t width;
+    uint32_t height;
+
+    CropRect() : left(0), top(0), width(0), height(0) {}
+    CropRect(uint32_t l, uint32_t t, uint32_t w, uint32_t h) : left(l), top(t), width(w), height(h) {}
+};
+
+// Scans the row and column statistics of a copy downsampled to about 1000
+// pixels across, then settles each edge at full resolution. rect is the
+// whole page when no border is found; 1 and 4 bit pages are cropped on
+// whole bytes, so left may stop short of the border. False for layouts
+// GreyRowReader cannot read and for pages that are all border.
+bool FindDocumentBounds(const DibLayout& layout, const AutoCropOptions& options, CropRect& rect);
+
+// Cuts the DIB down to rect where it lies, fixing up the header. Rows are
+// moved up in place to the narrower stride; cropping only rows that are
+// stored last moves nothing. The DIB must be writable and rect must start
+// on a whole byte.
+bool CropDib(const DibLayout& layout, const CropRect& rect);
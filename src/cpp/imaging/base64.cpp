@@ -0,0 +1,42 @@
+#include "base64.h"
+
+namespace {
+
+const char kBase64Chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+}  // namespace
+
+void EncodeBase64Groups(const uint8_t* data, size_t size, char* out) {
+    // Whole 3-byte groups without per-byte bounds checks
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t b = ((uint32_t)data[i] << 16) | ((uint32_t)data[i + 1] << 8) | data[i + 2];
+        out[0] = kBase64Chars[(b >> 18) & 0x3F];
+        out[1] = kBase64Chars[(b >> 12) & 0x3F];
+        out[2] = kBase64Chars[(b >> 6) & 0x3F];
+        out[3] = kBase64Chars[b & 0x3F];
+        out += 4;
+    }
+}
+
+void EncodeBase64(const uint8_t* data, size_t size, std::string& out) {
+    out.resize(((size + 2) / 3) * 4);
+    if (size == 0) {
+        return;
+    }
+    char* dest = &out[0];
+
+    size_t whole = size - size % 3;
+    EncodeBase64Groups(data, whole, dest);
+    dest += whole / 3 * 4;
+
+    size_t remaining = size - whole;
+    if (remaining) {
+        uint32_t b = (uint32_t)data[whole] << 16;
+        if (remaining == 2) b |= (uint32_t)data[whole + 1] << 8;
+        dest[0] = kBase64Chars[(b >> 18) & 0x3F];
+        dest[1] = kBase64Chars[(b >> 12) & 0x3F];
+        dest[2] = remaining == 2 ? kBase64Chars[(b >> 6) & 0x3F] : '=';
+        dest[3] = '=';
+    }
+}
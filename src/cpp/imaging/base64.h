@@ -0,0 +1,11 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Standard base64 with '=' padding. out is resized, not appended to.
+void EncodeBase64(const uint8_t* data, size_t size, std::string& out);
+
+// Whole 3-byte groups without padding, for a stream encoded a piece at a
+// time: size must be a multiple of 3 and out must have room for size / 3 * 4
+void EncodeBase64Groups(const uint8_t* data, size_t size, char* out);
@@ -0,0 +1,109 @@
+#include "bitmap.h"
+#include "page_hash.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+// Bytes copied between hash updates, small enough to be hashed from cache
+const size_t kHashBandBytes = 64 * 1024;
+
+}  // namespace
+
+bool ReadDibLayout(const void* dib, size_t available, DibLayout& layout, std::string& error) {
+    const BITMAPINFOHEADER* header = (const BITMAPINFOHEADER*)dib;
+    if (!header || (available && available < sizeof(BITMAPINFOHEADER))) {
+        error = "Image is smaller than a bitmap header";
+        return false;
+    }
+    if (header->biSize < sizeof(BITMAPINFOHEADER) || header->biWidth <= 0 || header->biHeight == 0) {
+        error = "Unsupported bitmap header";
+        return false;
+    }
+
+    WORD bitCount = header->biBitCount;
+    if (bitCount != 1 && bitCount != 4 && bitCount != 8 && bitCount != 16 &&
+        bitCount != 24 && bitCount != 32) {
+        error = "Unsupported bit depth: " + std::to_string(bitCount);
+        return false;
+    }
+
+    size_t height = (size_t)(header->biHeight < 0 ? -(long long)header->biHeight : header->biHeight);
+    size_t stride = (((size_t)header->biWidth * bitCount + 31) / 32) * 4;
+
+    layout.header = header;
+    layout.headerSize = header->biSize;
+    // Three colour masks follow a plain BITMAPINFOHEADER for BI_BITFIELDS
+    if (header->biCompression == 3 && header->biSize == sizeof(BITMAPINFOHEADER)) {
+        layout.headerSize += 3 * sizeof(DWORD);
+    }
+
+    size_t colours = header->biClrUsed;
+    if (colours == 0 && bitCount <= 8) {
+        colours = (size_t)1 << bitCount;
+    }
+    layout.paletteSize = colours * sizeof(RGBQUAD);
+    layout.stride = stride;
+
+    // Uncompressed sources may leave biSizeImage at 0 or get it wrong
+    bool uncompressed = header->biCompression == BI_RGB || header->biCompression == 3;
+    layout.imageSize = uncompressed || header->biSizeImage == 0 ? stride * height : header->biSizeImage;
+    layout.bits = (const BYTE*)dib + layout.headerSize + layout.paletteSize;
+
+    if (available && layout.TotalSize() > available) {
+        error = "Image data is truncated";
+        return false;
+    }
+    return true;
+}
+
+void AssembleBmp(const DibLayout& layout, std::vector<BYTE>& out, PageHasher* pixels, PageHasher* file) {
+    size_t dibSize = layout.TotalSize();
+
+    BITMAPFILEHEADER fileHeader;
+    memset(&fileHeader, 0, sizeof(BITMAPFILEHEADER));
+    fileHeader.bfType = 0x4D42; // "BM"
+    fileHeader.bfSize = (DWORD)(sizeof(BITMAPFILEHEADER) + dibSize);
+    fileHeader.bfOffBits = (DWORD)(sizeof(BITMAPFILEHEADER) + layout.headerSize + layout.paletteSize);
+
+    out.resize(sizeof(BITMAPFILEHEADER) + dibSize);
+    memcpy(out.data(), &fileHeader, sizeof(BITMAPFILEHEADER));
+    if (!pixels && !file) {
+        // Header, colour table and pixels are contiguous in a packed DIB
+        memcpy(out.data() + sizeof(BITMAPFILEHEADER), layout.header, dibSize);
+        return;
+    }
+
+    size_t headBytes = layout.headerSize + layout.paletteSize;
+    memcpy(out.data() + sizeof(BITMAPFILEHEADER), layout.header, headBytes);
+    if (file) {
+        file->Update(out.data(), sizeof(BITMAPFILEHEADER) + headBytes);
+    }
+
+    // Pixels a band of whole rows at a time, each hashed from the source
+    // and the copy while they are still in cache
+    const BYTE* from = layout.bits;
+    BYTE* to = out.data() + sizeof(BITMAPFILEHEADER) + headBytes;
+    DWORD compression = layout.header->biCompression;
+    bool rowsKnown = (compression == BI_RGB || compression == BI_BITFIELDS) && layout.stride > 0;
+    size_t height = (size_t)std::abs((long long)layout.header->biHeight);
+    size_t rows = rowsKnown ? std::min(height, layout.imageSize / layout.stride) : 0;
+    size_t rowBytes = ((size_t)layout.header->biWidth * layout.header->biBitCount + 7) / 8;
+    size_t band = rowsKnown ? std::max<size_t>(1, kHashBandBytes / layout.stride) * layout.stride : kHashBandBytes;
+    for (size_t at = 0; at < layout.imageSize; at += band) {
+        size_t size = std::min(band, layout.imageSize - at);
+        memcpy(to + at, from + at, size);
+        if (pixels && rowsKnown) {
+            size_t end = std::min(rows, (at + size) / layout.stride);
+            for (size_t row = at / layout.stride; row < end; row++) {
+                pixels->Update(from + row * layout.stride, rowBytes);
+            }
+        } else if (pixels) {
+            pixels->Update(from + at, size);
+        }
+        if (file) {
+            file->Update(to + at, size);
+        }
+    }
+}
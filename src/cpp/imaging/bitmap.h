@@ -0,0 +1,34 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "../twain/windows_wrapper.h"
+
+class PageHasher;
+
+// Where the parts of a packed DIB (as returned by a native transfer) live.
+// Sizes are normalized: a missing biSizeImage is computed from the row
+// stride and the colour table length follows biClrUsed or the bit depth.
+struct DibLayout {
+    const BITMAPINFOHEADER* header;
+    size_t headerSize;    // biSize plus BI_BITFIELDS masks
+    size_t paletteSize;   // Colour table bytes
+    size_t stride;        // Bytes per row, padded to 4
+    size_t imageSize;     // Pixel bytes
+    const BYTE* bits;
+
+    DibLayout()
+        : header(nullptr), headerSize(0), paletteSize(0)
+        , stride(0), imageSize(0), bits(nullptr) {}
+
+    size_t TotalSize() const { return headerSize + paletteSize + imageSize; }
+};
+
+// Validates dib against available bytes (0 when the size is unknown)
+bool ReadDibLayout(const void* dib, size_t available, DibLayout& layout, std::string& error);
+
+// Prepends a BITMAPFILEHEADER, producing a complete .bmp file. Hashers
+// given are fed as the bytes are copied: pixels with each stored row short
+// of its padding (all the pixel bytes when compressed), file with the
+// .bmp as written.
+void AssembleBmp(const DibLayout& layout, std::vector<BYTE>& out,
+    PageHasher* pixels = nullptr, PageHasher* file = nullptr);
@@ -0,0 +1,74 @@
+#include "blank_page.h"
+#include "grey_rows.h"
+#include "simd.h"
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+
+// Counts pixels darker than inkLevel and neighbouring pairs at least
+// edgeLevel apart in grey[0..count)
+void CountRow(const uint8_t* grey, size_t count, uint8_t inkLevel, uint8_t edgeLevel,
+    uint64_t& ink, uint64_t& edges) {
+    size_t i = 0;
+#ifdef SCANNER_SSE2
+    const __m128i inkMax = _mm_set1_epi8((char)(inkLevel - 1));
+    const __m128i edgeMax = _mm_set1_epi8((char)(edgeLevel - 1));
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i inkSum = zero;
+    __m128i edgeSum = zero;
+    for (; i + 17 <= count; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(grey + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(grey + i + 1));
+        __m128i isInk = _mm_cmpeq_epi8(_mm_min_epu8(a, inkMax), a);
+        __m128i step = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+        __m128i isFlat = _mm_cmpeq_epi8(_mm_subs_epu8(step, edgeMax), zero);
+        // Lanes are 0 or 1, so the sums of absolute differences are counts
+        inkSum = _mm_add_epi64(inkSum, _mm_sad_epu8(_mm_and_si128(isInk, one), zero));
+        edgeSum = _mm_add_epi64(edgeSum, _mm_sad_epu8(_mm_andnot_si128(isFlat, one), zero));
+    }
+    ink += (uint32_t)_mm_cvtsi128_si32(inkSum) + (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(inkSum, 8));
+    edges += (uint32_t)_mm_cvtsi128_si32(edgeSum) + (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(edgeSum, 8));
+#endif
+    for (; i < count; i++) {
+        ink += grey[i] < inkLevel;
+        if (i + 1 < count) {
+            edges += abs((int)grey[i] - (int)grey[i + 1]) >= edgeLevel;
+        }
+    }
+}
+
+}  // namespace
+
+bool AnalyzeBlankPage(const DibLayout& layout, const BlankPageOptions& options, BlankPageAnalysis& analysis) {
+    analysis = BlankPageAnalysis();
+    GreyRowReader reader;
+    if (!reader.Open(layout)) {
+        return false;
+    }
+
+    size_t width = reader.Width();
+    size_t height = reader.Height();
+    double margin = std::min(std::max(options.margin, 0.0), 0.45);
+    size_t x0 = (size_t)(width * margin), x1 = width - x0;
+    size_t y0 = (size_t)(height * margin), y1 = height - y0;
+    if (x1 < x0 + 2 || y1 <= y0) {
+        return false;
+    }
+
+    uint8_t inkLevel = std::max<uint8_t>(options.inkLevel, 1);
+    uint8_t edgeLevel = std::max<uint8_t>(options.edgeLevel, 1);
+    size_t count = x1 - x0;
+    size_t rowStep = (y1 - y0 + kBlankPageSampleRows - 1) / kBlankPageSampleRows;
+    uint64_t ink = 0, edges = 0, rows = 0;
+    for (size_t y = y0; y < y1; y += rowStep, rows++) {
+        CountRow(reader.Read(y, x0, x1), count, inkLevel, edgeLevel, ink, edges);
+    }
+
+    analysis.sampledPixels = rows * count;
+    analysis.inkCoverage = (double)ink / analysis.sampledPixels;
+    analysis.edgeDensity = (double)edges / (rows * (count - 1));
+    analysis.blank = analysis.inkCoverage <= options.threshold && analysis.edgeDensity <= options.threshold;
+    return true;
+}
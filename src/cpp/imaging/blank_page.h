@@ -0,0 +1,29 @@
+#pragma once
+#include <cstdint>
+#include "bitmap.h"
+
+// Ink coverage and edge density of a page inside its margins, measured on
+// a grey rendering of up to kBlankPageSampleRows evenly spaced rows
+struct BlankPageOptions {
+    double threshold;   // Highest ink coverage and edge density still counted blank
+    double margin;      // Fraction of the width and height ignored on each side
+    uint8_t inkLevel;   // Grey below this is ink
+    uint8_t edgeLevel;  // Grey step between neighbours that counts as an edge
+
+    BlankPageOptions() : threshold(0.001), margin(0.05), inkLevel(128), edgeLevel(64) {}
+};
+
+struct BlankPageAnalysis {
+    double inkCoverage;     // Fraction of sampled pixels that are ink
+    double edgeDensity;     // Fraction of neighbouring pairs that are edges
+    uint64_t sampledPixels;
+    bool blank;
+
+    BlankPageAnalysis() : inkCoverage(0), edgeDensity(0), sampledPixels(0), blank(false) {}
+};
+
+const uint32_t kBlankPageSampleRows = 800;
+
+// False for layouts it cannot read (compressed or 16 bit); such pages
+// are never blank
+bool AnalyzeBlankPage(const DibLayout& layout, const BlankPageOptions& options, BlankPageAnalysis& analysis);
@@ -0,0 +1,298 @@
+#include "colour_dropout.h"
+#include "grey_rows.h"
+#include "parallel.h"
+#include "simd.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+const double kPi = 3.14159265358979323846;
+
+// Rows per ParallelFor chunk: a few hundred KiB of colour input
+const size_t kGrainRows = 16;
+
+// Hue coefficients are fixed point at 12 bits, so the cross products stay
+// well inside 32 bits and the coefficients inside 16
+const double kHueScale = 4096;
+
+struct DropoutJob {
+    DropoutMode mode;
+    int pixelBytes;
+    bool allHues;
+    bool wide;
+    int16_t from[2];
+    int16_t to[2];
+    int minChroma;
+};
+
+inline uint32_t Load4(const BYTE* p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+// The hue test against the chroma vector (2R-G-B, sqrt(3)(G-B)): whether
+// it lies anticlockwise of the range's start and clockwise of its end
+inline bool InRange(const DropoutJob& job, int r, int g, int b) {
+    int across = g - b, along = 2 * r - g - b;
+    bool afterFrom = job.from[0] * across + job.from[1] * along >= 0;
+    bool beforeTo = job.to[0] * across + job.to[1] * along >= 0;
+    return job.wide ? afterFrom || beforeTo : afterFrom && beforeTo;
+}
+
+inline BYTE DropPixel(const DropoutJob& job, int b, int g, int r) {
+    switch (job.mode) {
+    case kDropoutRed:
+        return (BYTE)r;
+    case kDropoutGreen:
+        return (BYTE)g;
+    case kDropoutBlue:
+        return (BYTE)b;
+    default:
+        break;
+    }
+    int chroma = std::max(r, std::max(g, b)) - std::min(r, std::min(g, b));
+    if (chroma >= job.minChroma && (job.allHues || InRange(job, r, g, b))) {
+        return 255;
+    }
+    return GreyOf((uint8_t)r, (uint8_t)g, (uint8_t)b);
+}
+
+#ifdef SCANNER_SSE2
+// Eight pixels as B, G and R lanes of 16 bits
+inline void LoadPixels(const BYTE* p, int pixelBytes, __m128i& b, __m128i& g, __m128i& r) {
+    __m128i low, high;
+    if (pixelBytes == 4) {
+        low = _mm_loadu_si128((const __m128i*)p);
+        high = _mm_loadu_si128((const __m128i*)(p + 16));
+    } else {
+        low = _mm_set_epi32((int)Load4(p + 9), (int)Load4(p + 6), (int)Load4(p + 3), (int)Load4(p));
+        high = _mm_set_epi32((int)Load4(p + 21), (int)Load4(p + 18), (int)Load4(p + 15), (int)Load4(p + 12));
+    }
+    const __m128i byteMask = _mm_set1_epi32(0xFF);
+    b = _mm_packs_epi32(_mm_and_si128(low, byteMask), _mm_and_si128(high, byteMask));
+    g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(low, 8), byteMask), _mm_and_si128(_mm_srli_epi32(high, 8), byteMask));
+    r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(low, 16), byteMask), _mm_and_si128(_mm_srli_epi32(high, 16), byteMask));
+}
+
+// Lanes whose cross product with the (across, along) pairs is not negative
+inline __m128i CrossNotNegative(__m128i low, __m128i high, __m128i coefficients) {
+    const __m128i minusOne = _mm_set1_epi32(-1);
+    __m128i lowSide = _mm_cmpgt_epi32(_mm_madd_epi16(low, coefficients), minusOne);
+    __m128i highSide = _mm_cmpgt_epi32(_mm_madd_epi16(high, coefficients), minusOne);
+    return _mm_packs_epi32(lowSide, highSide);
+}
+
+inline __m128i DropPixels(const DropoutJob& job, __m128i b, __m128i g, __m128i r) {
+    if (job.mode == kDropoutRed) {
+        return r;
+    }
+    if (job.mode == kDropoutGreen) {
+        return g;
+    }
+    if (job.mode == kDropoutBlue) {
+        return b;
+    }
+
+    // The weights sum to 256, so the luminance fits 16 unsigned bits
+    __m128i grey = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(77)),
+        _mm_mullo_epi16(g, _mm_set1_epi16(150))), _mm_mullo_epi16(b, _mm_set1_epi16(29)));
+    grey = _mm_srli_epi16(grey, 8);
+    __m128i chroma = _mm_sub_epi16(_mm_max_epi16(r, _mm_max_epi16(g, b)), _mm_min_epi16(r, _mm_min_epi16(g, b)));
+    __m128i drop = _mm_cmpgt_epi16(chroma, _mm_set1_epi16((short)(job.minChroma - 1)));
+    if (!job.allHues) {
+        __m128i across = _mm_sub_epi16(g, b);
+        __m128i along = _mm_sub_epi16(_mm_add_epi16(r, r), _mm_add_epi16(g, b));
+        __m128i low = _mm_unpacklo_epi16(across, along), high = _mm_unpackhi_epi16(across, along);
+        __m128i afterFrom = CrossNotNegative(low, high,
+            _mm_set1_epi32((int)(((uint32_t)(uint16_t)job.from[1] << 16) | (uint16_t)job.from[0])));
+        __m128i beforeTo = CrossNotNegative(low, high,
+            _mm_set1_epi32((int)(((uint32_t)(uint16_t)job.to[1] << 16) | (uint16_t)job.to[0])));
+        drop = _mm_and_si128(drop, job.wide ? _mm_or_si128(afterFrom, beforeTo) : _mm_and_si128(afterFrom, beforeTo));
+    }
+    return _mm_or_si128(_mm_and_si128(drop, _mm_set1_epi16(255)), _mm_andnot_si128(drop, grey));
+}
+#endif
+
+void DropRow(const DropoutJob& job, const BYTE* in, BYTE* out, size_t width) {
+    size_t x = 0;
+#ifdef SCANNER_SSE2
+    // 24 bit pixels are read four bytes at a time, so the last is left to
+    // the scalar tail
+    size_t vectorEnd = width >= 9 ? width - (job.pixelBytes == 3 ? 9 : 8) + 1 : 0;
+    for (; x < vectorEnd; x += 8) {
+        __m128i b, g, r;
+        LoadPixels(in + x * job.pixelBytes, job.pixelBytes, b, g, r);
+        __m128i grey = DropPixels(job, b, g, r);
+        _mm_storel_epi64((__m128i*)(out + x), _mm_packus_epi16(grey, grey));
+    }
+#endif
+    for (; x < width; x++) {
+        const BYTE* p = in + x * job.pixelBytes;
+        out[x] = DropPixel(job, p[0], p[1], p[2]);
+    }
+}
+
+// Output bits, most significant first, of a movemask's bits
+struct BitReverse {
+    uint8_t table[256];
+
+    BitReverse() {
+        for (int i = 0; i < 256; i++) {
+            int reversed = 0;
+            for (int bit = 0; bit < 8; bit++) {
+                reversed |= ((i >> bit) & 1) << (7 - bit);
+            }
+            table[i] = (uint8_t)reversed;
+        }
+    }
+};
+
+const BitReverse kBitReverse;
+
+void ThresholdRow(const BYTE* in, BYTE* out, size_t width, uint8_t level) {
+    size_t x = 0;
+#ifdef SCANNER_SSE2
+    // Signed compares on levels shifted by 128 order them as unsigned
+    const __m128i flip = _mm_set1_epi8((char)0x80);
+    const __m128i below = _mm_set1_epi8((char)(level ^ 0x80));
+    for (; x + 16 <= width; x += 16) {
+        __m128i grey = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + x)), flip);
+        int white = ~_mm_movemask_epi8(_mm_cmplt_epi8(grey, below)) & 0xFFFF;
+        out[x / 8] = kBitReverse.table[white & 0xFF];
+        out[x / 8 + 1] = kBitReverse.table[white >> 8];
+    }
+#endif
+    for (; x < width; x += 8) {
+        int bits = 0;
+        for (size_t i = 0; i < 8; i++) {
+            bits = (bits << 1) | (x + i < width && in[x + i] >= level ? 1 : 0);
+        }
+        out[x / 8] = (BYTE)bits;
+    }
+}
+
+}  // namespace
+
+void MakeGreyFormat(const StripFormat& format, WORD bitCount, StripFormat& grey) {
+    size_t entries = (size_t)1 << bitCount;
+    grey.width = format.width;
+    grey.height = format.height;
+    grey.bitCount = bitCount;
+    grey.bottomUp = format.bottomUp;
+    grey.rowBytes = (format.width * bitCount + 7) / 8;
+    grey.stride = ((format.width * bitCount + 31) / 32) * 4;
+    grey.head.assign(sizeof(BITMAPINFOHEADER) + entries * sizeof(RGBQUAD), 0);
+
+    const BITMAPINFOHEADER* from = (const BITMAPINFOHEADER*)format.head.data();
+    BITMAPINFOHEADER* header = (BITMAPINFOHEADER*)grey.head.data();
+    header->biSize = sizeof(BITMAPINFOHEADER);
+    header->biWidth = (LONG)format.width;
+    header->biHeight = format.bottomUp ? (LONG)format.height : -(LONG)format.height;
+    header->biPlanes = 1;
+    header->biBitCount = bitCount;
+    header->biCompression = BI_RGB;
+    header->biSizeImage = (DWORD)(grey.stride * format.height);
+    header->biXPelsPerMeter = from->biXPelsPerMeter;
+    header->biYPelsPerMeter = from->biYPelsPerMeter;
+    header->biClrUsed = (DWORD)entries;
+    RGBQUAD* palette = (RGBQUAD*)(grey.head.data() + sizeof(BITMAPINFOHEADER));
+    for (size_t i = 0; i < entries; i++) {
+        BYTE level = (BYTE)(i * 255 / (entries - 1));
+        palette[i].rgbRed = palette[i].rgbGreen = palette[i].rgbBlue = level;
+    }
+}
+
+ColourDropoutStripStage::ColourDropoutStripStage(StripStage& input)
+    : WindowedStripStage(input), m_Mode(kDropoutNone), m_PixelBytes(0), m_AllHues(false), m_Wide(false),
+      m_MinChroma(0) {
+    m_From[0] = m_From[1] = m_To[0] = m_To[1] = 0;
+}
+
+bool ColourDropoutStripStage::Open(const ColourDropoutOptions& options) {
+    const StripFormat& input = m_Input.Format();
+    if (options.mode == kDropoutNone || input.head.size() < sizeof(BITMAPINFOHEADER)) {
+        return false;
+    }
+    const BITMAPINFOHEADER* header = (const BITMAPINFOHEADER*)input.head.data();
+    if (header->biCompression == BI_BITFIELDS) {
+        const DWORD* masks = (const DWORD*)(input.head.data() + header->biSize);
+        if (input.bitCount != 32 || header->biSize != sizeof(BITMAPINFOHEADER) ||
+            input.head.size() < header->biSize + 3 * sizeof(DWORD) ||
+            masks[0] != 0xFF0000 || masks[1] != 0xFF00 || masks[2] != 0xFF) {
+            return false;
+        }
+    } else if (header->biCompression != BI_RGB || (input.bitCount != 24 && input.bitCount != 32)) {
+        return false;
+    }
+
+    m_Mode = options.mode;
+    m_PixelBytes = input.bitCount / 8;
+    m_MinChroma = options.minChroma;
+    double span = options.hueTo - options.hueFrom;
+    m_AllHues = span >= 360;
+    span = std::fmod(span, 360.0);
+    if (span < 0) {
+        span += 360;
+    }
+    m_Wide = span > 180;
+    double from = options.hueFrom * kPi / 180, to = options.hueTo * kPi / 180;
+    m_From[0] = (int16_t)std::lround(std::cos(from) * std::sqrt(3.0) * kHueScale);
+    m_From[1] = (int16_t)-std::lround(std::sin(from) * kHueScale);
+    m_To[0] = (int16_t)-std::lround(std::cos(to) * std::sqrt(3.0) * kHueScale);
+    m_To[1] = (int16_t)std::lround(std::sin(to) * kHueScale);
+    MakeGreyFormat(input, 8, m_Format);
+    return true;
+}
+
+void ColourDropoutStripStage::InputSpan(size_t first, size_t last, size_t& inFirst, size_t& inLast) const {
+    inFirst = first;
+    inLast = last;
+}
+
+void ColourDropoutStripStage::Make(const BYTE* input, size_t pitch, size_t inFirst, size_t first, size_t last, BYTE* out) {
+    DropoutJob job;
+    job.mode = m_Mode;
+    job.pixelBytes = m_PixelBytes;
+    job.allHues = m_AllHues;
+    job.wide = m_Wide;
+    memcpy(job.from, m_From, sizeof(job.from));
+    memcpy(job.to, m_To, sizeof(job.to));
+    job.minChroma = m_MinChroma;
+    const BYTE* rows = input + (first - inFirst) * pitch;
+    size_t stride = m_Format.stride, width = m_Format.width;
+    ParallelFor(last - first, kGrainRows, [&job, rows, pitch, out, stride, width](size_t begin, size_t end) {
+        for (size_t y = begin; y < end; y++) {
+            DropRow(job, rows + y * pitch, out + y * stride, width);
+        }
+    });
+}
+
+ThresholdStripStage::ThresholdStripStage(StripStage& input) : WindowedStripStage(input), m_Level(128) {}
+
+bool ThresholdStripStage::Open(uint8_t level) {
+    if (!HasGreyRamp(m_Input.Format())) {
+        return false;
+    }
+    m_Level = level;
+    MakeGreyFormat(m_Input.Format(), 1, m_Format);
+    return true;
+}
+
+void ThresholdStripStage::InputSpan(size_t first, size_t last, size_t& inFirst, size_t& inLast) const {
+    inFirst = first;
+    inLast = last;
+}
+
+void ThresholdStripStage::Make(const BYTE* input, size_t pitch, size_t inFirst, size_t first, size_t last, BYTE* out) {
+    const BYTE* rows = input + (first - inFirst) * pitch;
+    size_t stride = m_Format.stride, width = m_Format.width;
+    uint8_t level = m_Level;
+    ParallelFor(last - first, kGrainRows * 4, [rows, pitch, out, stride, width, level](size_t begin, size_t end) {
+        for (size_t y = begin; y < end; y++) {
+            ThresholdRow(rows + y * pitch, out + y * stride, width, level);
+        }
+    });
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <cstdint>
+#include "strip_pipeline.h"
+
+enum DropoutMode {
+    kDropoutNone,
+    kDropoutRed,      // The page as seen through a red filter: red ink reads as paper
+    kDropoutGreen,
+    kDropoutBlue,
+    kDropoutHueRange  // Pixels of a hue range turn white, the rest keep their grey
+};
+
+// Hues are in degrees with red at 0, green at 120 and blue at 240
+struct ColourDropoutOptions {
+    DropoutMode mode;
+    double hueFrom;      // The range runs from hueFrom round to hueTo, increasing
+    double hueTo;
+    uint8_t minChroma;   // Pixels whose channels spread less than this are grey, whatever their hue
+    int outputBits;      // 8 for grey, 1 for black and white
+    uint8_t threshold;   // Grey levels below this are black in 1 bit output
+
+    ColourDropoutOptions()
+        : mode(kDropoutNone), hueFrom(-30), hueTo(30), minChroma(48), outputBits(8), threshold(128) {}
+};
+
+// Turns 24 and 32 bit rows into 8 bit grey rows with a grey ramp palette:
+// one channel of each pixel, or its luminance with the hue range dropped
+// to white. SSE2 four pixels at a time.
+class ColourDropoutStripStage : public WindowedStripStage {
+public:
+    explicit ColourDropoutStripStage(StripStage& input);
+
+    // False when the input is not 24 bit, or 32 bit BI_RGB or 8-8-8 masks,
+    // or the mode is kDropoutNone
+    bool Open(const ColourDropoutOptions& options);
+
+protected:
+    void InputSpan(size_t first, size_t last, size_t& inFirst, size_t& inLast) const;
+    void Make(const BYTE* input, size_t pitch, size_t inFirst, size_t first, size_t last, BYTE* out);
+
+private:
+    DropoutMode m_Mode;
+    int m_PixelBytes;
+    bool m_AllHues;
+    bool m_Wide;         // The range spans more than half the circle
+    int16_t m_From[2];   // Cross product coefficients of the range ends
+    int16_t m_To[2];
+    int m_MinChroma;
+};
+
+// Thresholds 8 bit grey ramp rows to 1 bit rows, black below level
+class ThresholdStripStage : public WindowedStripStage {
+public:
+    explicit ThresholdStripStage(StripStage& input);
+
+    // False unless the input is 8 bit with a grey ramp palette
+    bool Open(uint8_t level);
+
+protected:
+    void InputSpan(size_t first, size_t last, size_t& inFirst, size_t& inLast) const;
+    void Make(const BYTE* input, size_t pitch, size_t inFirst, size_t first, size_t last, BYTE* out);
+
+private:
+    uint8_t m_Level;
+};
+
+// Starts the head of a paletted format the size of format's rows: a plain
+// BITMAPINFOHEADER for bitCount bits with a black to white ramp
+void MakeGreyFormat(const StripFormat& format, WORD bitCount, StripFormat& grey);
@@ -0,0 +1,401 @@
+#include "deskew.h"
+#include "grey_rows.h"
+#include "parallel.h"
+#include "simd.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+enum RotateKind {
+    kRotateGrey,     // 8 bit grey ramp, bilinear
+    kRotateColour,   // 24 or 32 bit, bilinear
+    kRotateIndexed   // Other paletted pages, nearest
+};
+
+struct RotateJob {
+    const BYTE* src;      // Stored row srcFirstRow
+    BYTE* dst;            // Stored row dstFirstRow
+    size_t srcStride;
+    size_t dstStride;
+    int srcFirstRow;
+    int dstFirstRow;
+    int width;
+    int height;
+    int bitCount;
+    RotateKind kind;
+    BYTE background;  // Grey level or palette index of white
+    int cosine;       // 16.16
+    int sine;
+    int centreX;
+    int centreY;
+};
+
+namespace {
+
+const size_t kProxyWidth = 1024;
+const uint8_t kInkLevel = 128;
+const size_t kMinPoints = 200;
+const double kCoarseStep = 0.2;
+const double kFineStep = 0.02;
+const double kPi = 3.14159265358979323846;
+
+// Output is rotated in bands of rows, each walked in tiles of columns so
+// the source rows a tile reads stay in cache
+const size_t kBandRows = 32;
+const size_t kTileColumns = 256;
+
+// 16.16 fixed point coordinates
+const int kMaxSide = 16000;
+
+struct ProxyPoint {
+    int x;
+    int y;
+};
+
+// Sum of squared bin counts of the points projected along angle; peaks
+// when the bins line up with the text lines
+uint64_t ProjectionScore(const std::vector<ProxyPoint>& points, double angle, int offset, size_t bins) {
+    std::vector<uint32_t> histogram(bins, 0);
+    int slope = (int)std::lround(std::tan(angle * kPi / 180) * 65536);
+    for (const ProxyPoint& point : points) {
+        int bin = point.y + ((point.x * slope + 32768) >> 16) + offset;
+        if (bin >= 0 && (size_t)bin < bins) {
+            histogram[bin]++;
+        }
+    }
+    uint64_t score = 0;
+    for (uint32_t count : histogram) {
+        score += (uint64_t)count * count;
+    }
+    return score;
+}
+
+// Best of count angles from first in steps of step
+double SearchAngles(const std::vector<ProxyPoint>& points, double first, double step, size_t count,
+    int offset, size_t bins) {
+    std::vector<uint64_t> scores(count);
+    ParallelFor(count, 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            scores[i] = ProjectionScore(points, first + i * step, offset, bins);
+        }
+    });
+    // Near the true angle several steps move no point to another bin and
+    // score the same; the middle of that run is the best guess
+    size_t best = std::max_element(scores.begin(), scores.end()) - scores.begin();
+    size_t last = best;
+    while (last + 1 < count && scores[last + 1] == scores[best]) {
+        last++;
+    }
+    return first + (best + last) / 2.0 * step;
+}
+
+inline uint32_t Load3(const BYTE* p) {
+    return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+}
+
+inline uint32_t Load4(const BYTE* p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+// Bilinear blend of four pixels of up to four 8 bit channels, with 8 bit
+// weights fx and fy towards p01/p11 and p10/p11
+inline uint32_t Blend(uint32_t p00, uint32_t p01, uint32_t p10, uint32_t p11, int fx, int fy) {
+#ifdef SCANNER_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wx = _mm_set1_epi32((fx << 16) | (256 - fx));
+    const __m128i wy = _mm_set1_epi32((fy << 16) | (256 - fy));
+    // Channels of the left and right pixel interleaved as 16 bit pairs
+    __m128i top = _mm_unpacklo_epi8(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)p00), _mm_cvtsi32_si128((int)p01)), zero);
+    __m128i bottom = _mm_unpacklo_epi8(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)p10), _mm_cvtsi32_si128((int)p11)), zero);
+    top = _mm_srli_epi32(_mm_madd_epi16(top, wx), 8);
+    bottom = _mm_srli_epi32(_mm_madd_epi16(bottom, wx), 8);
+    __m128i blended = _mm_madd_epi16(_mm_or_si128(top, _mm_slli_epi32(bottom, 16)), wy);
+    blended = _mm_srli_epi32(_mm_add_epi32(blended, _mm_set1_epi32(128)), 8);
+    blended = _mm_packs_epi32(blended, blended);
+    return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(blended, blended));
+#else
+    uint32_t result = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t top = ((p00 >> shift) & 255) * (256 - fx) + ((p01 >> shift) & 255) * fx;
+        uint32_t bottom = ((p10 >> shift) & 255) * (256 - fx) + ((p11 >> shift) & 255) * fx;
+        result |= (((top >> 8) * (256 - fy) + (bottom >> 8) * fy + 128) >> 8) << shift;
+    }
+    return result;
+#endif
+}
+
+inline int ReadIndex(const BYTE* row, int x, int bitCount) {
+    if (bitCount == 8) {
+        return row[x];
+    }
+    if (bitCount == 4) {
+        return (row[x >> 1] >> (x & 1 ? 0 : 4)) & 0x0F;
+    }
+    return (row[x >> 3] >> (7 - (x & 7))) & 1;
+}
+
+// Output starts zeroed, so indexes are ORed in
+inline void WriteIndex(BYTE* row, int x, int bitCount, int index) {
+    if (bitCount == 8) {
+        row[x] = (BYTE)index;
+    } else if (bitCount == 4) {
+        row[x >> 1] |= (BYTE)(index << (x & 1 ? 0 : 4));
+    } else if (index) {
+        row[x >> 3] |= (BYTE)(0x80 >> (x & 7));
+    }
+}
+
+// Pixel of (sx, sy) nearest, for the indexed kind everywhere and for the
+// others along the last row and column where bilinear has no neighbours
+template <int kKind, int kPixelBytes>
+inline void RotateNearest(const RotateJob& job, BYTE* out, int x, int sx, int sy) {
+    int nx = (sx + 32768) >> 16, ny = (sy + 32768) >> 16;
+    bool inside = (unsigned)nx < (unsigned)job.width && (unsigned)ny < (unsigned)job.height;
+    const BYTE* row = inside ? job.src + (size_t)(ny - job.srcFirstRow) * job.srcStride : nullptr;
+    if (kKind == kRotateIndexed) {
+        WriteIndex(out, x, job.bitCount, inside ? ReadIndex(row, nx, job.bitCount) : job.background);
+    } else if (!inside) {
+        memset(out + x * kPixelBytes, job.background, kPixelBytes);
+    } else {
+        memcpy(out + x * kPixelBytes, row + nx * kPixelBytes, kPixelBytes);
+    }
+}
+
+template <int kKind, int kPixelBytes>
+void RotateTile(const RotateJob& job, int y0, int y1, int x0, int x1) {
+    const size_t stride = job.srcStride;
+    const unsigned lastX = (unsigned)(job.width - 1), lastY = (unsigned)(job.height - 1);
+
+    for (int y = y0; y < y1; y++) {
+        BYTE* out = job.dst + (size_t)(y - job.dstFirstRow) * job.dstStride;
+        // Source of (x, y) is the centre plus the offset rotated by the angle
+        int64_t dx = (int64_t)x0 * 65536 - job.centreX, dy = (int64_t)y * 65536 - job.centreY;
+        int sx = job.centreX + (int)((dx * job.cosine + dy * job.sine) >> 16);
+        int sy = job.centreY + (int)((dy * job.cosine - dx * job.sine) >> 16);
+
+        for (int x = x0; x < x1; x++, sx += job.cosine, sy -= job.sine) {
+            int ix = sx >> 16, iy = sy >> 16;
+            if (kKind == kRotateIndexed || (unsigned)ix >= lastX || (unsigned)iy >= lastY) {
+                RotateNearest<kKind, kPixelBytes>(job, out, x, sx, sy);
+                continue;
+            }
+
+            int fx = (sx >> 8) & 255, fy = (sy >> 8) & 255;
+            const BYTE* p = job.src + (size_t)(iy - job.srcFirstRow) * stride + (size_t)ix * kPixelBytes;
+            if (kPixelBytes == 1) {
+                uint32_t top = p[0] * (256 - fx) + p[1] * fx;
+                uint32_t bottom = p[stride] * (256 - fx) + p[stride + 1] * fx;
+                out[x] = (BYTE)((top * (256 - fy) + bottom * fy + 32768) >> 16);
+            } else if (kPixelBytes == 4) {
+                uint32_t value = Blend(Load4(p), Load4(p + 4), Load4(p + stride), Load4(p + stride + 4), fx, fy);
+                memcpy(out + x * 4, &value, 4);
+            } else {
+                // A 4 byte load of a 3 byte pixel is safe short of the last column
+                bool wide = (unsigned)ix + 2 < lastX + 1;
+                uint32_t value = wide
+                    ? Blend(Load4(p), Load4(p + 3), Load4(p + stride), Load4(p + stride + 3), fx, fy)
+                    : Blend(Load3(p), Load3(p + 3), Load3(p + stride), Load3(p + stride + 3), fx, fy);
+                out[x * 3] = (BYTE)value;
+                out[x * 3 + 1] = (BYTE)(value >> 8);
+                out[x * 3 + 2] = (BYTE)(value >> 16);
+            }
+        }
+    }
+}
+
+typedef void (*RotateTileFn)(const RotateJob& job, int y0, int y1, int x0, int x1);
+
+RotateTileFn RotateTileFor(const RotateJob& job) {
+    if (job.kind == kRotateIndexed) {
+        return RotateTile<kRotateIndexed, 1>;
+    }
+    if (job.kind == kRotateGrey) {
+        return RotateTile<kRotateGrey, 1>;
+    }
+    return job.bitCount == 32 ? RotateTile<kRotateColour, 4> : RotateTile<kRotateColour, 3>;
+}
+
+
+// Everything of the job but where the rows are
+bool PrepareRotation(const DibLayout& layout, double angle, RotateJob& job) {
+    const BITMAPINFOHEADER* header = layout.header;
+    if (!header || header->biCompression != BI_RGB) {
+        return false;
+    }
+
+    job.width = (int)header->biWidth;
+    job.height = (int)(header->biHeight < 0 ? -header->biHeight : header->biHeight);
+    job.bitCount = header->biBitCount;
+    if (job.width > kMaxSide || job.height > kMaxSide) {
+        return false;
+    }
+
+    if (job.bitCount == 24 || job.bitCount == 32) {
+        job.kind = kRotateColour;
+        job.background = 255;
+    } else if (job.bitCount == 1 || job.bitCount == 4 || job.bitCount == 8) {
+        // The brightest palette entry stands in for white
+        size_t entries = std::min<size_t>(layout.paletteSize / sizeof(RGBQUAD), (size_t)1 << job.bitCount);
+        const RGBQUAD* palette = (const RGBQUAD*)((const BYTE*)header + layout.headerSize);
+        bool ramp = job.bitCount == 8 && entries == 256;
+        int brightest = -1;
+        job.background = 0;
+        for (size_t i = 0; i < entries; i++) {
+            int grey = GreyOf(palette[i].rgbRed, palette[i].rgbGreen, palette[i].rgbBlue);
+            if (grey > brightest) {
+                brightest = grey;
+                job.background = (BYTE)i;
+            }
+            ramp = ramp && palette[i].rgbRed == i && palette[i].rgbGreen == i && palette[i].rgbBlue == i;
+        }
+        job.kind = ramp ? kRotateGrey : kRotateIndexed;
+    } else {
+        return false;
+    }
+
+    // The source moves against the rotation; rows stored bottom-up see
+    // the angle flipped
+    double radians = (header->biHeight > 0 ? -angle : angle) * kPi / 180;
+    job.cosine = (int)std::lround(std::cos(radians) * 65536);
+    job.sine = (int)std::lround(std::sin(radians) * 65536);
+    job.centreX = (job.width - 1) * 32768;
+    job.centreY = (job.height - 1) * 32768;
+    return true;
+}
+
+// Output rows [y0, y1) in bands spread over the pool, thinner than
+// kBandRows when there are too few rows to go round
+void RotateRows(const RotateJob& job, int y0, int y1) {
+    RotateTileFn rotateTile = RotateTileFor(job);
+    int threads = (int)ParallelThreads();
+    int bandRows = std::max(1, std::min((int)kBandRows, (y1 - y0 + threads - 1) / threads));
+    size_t bands = (size_t)((y1 - y0 + bandRows - 1) / bandRows);
+    ParallelFor(bands, 1, [&job, rotateTile, y0, y1, bandRows](size_t begin, size_t end) {
+        for (size_t band = begin; band < end; band++) {
+            int top = y0 + (int)band * bandRows;
+            int bottom = std::min(y1, top + bandRows);
+            for (int x0 = 0; x0 < job.width; x0 += (int)kTileColumns) {
+                rotateTile(job, top, bottom, x0, std::min(job.width, x0 + (int)kTileColumns));
+            }
+        }
+    });
+}
+
+}  // namespace
+
+bool EstimateSkew(const DibLayout& layout, double maxAngle, double& angle) {
+    angle = 0;
+    GreyRowReader probe;
+    if (!probe.Open(layout) || maxAngle <= 0) {
+        return false;
+    }
+
+    // Inside a 5% margin, clear of scanner borders and punch holes
+    size_t width = probe.Width(), height = probe.Height();
+    size_t x0 = width / 20, y0 = height / 20;
+    size_t factor = std::max<size_t>(1, (width - 2 * x0 + kProxyWidth - 1) / kProxyWidth);
+    size_t proxyWidth = (width - 2 * x0) / factor;
+    size_t proxyHeight = (height - 2 * y0) / factor;
+    if (proxyWidth < 16 || proxyHeight < 16) {
+        return false;
+    }
+
+    // Bitonal proxy: one row in factor, each pixel ink when any of the
+    // factor pixels it covers is
+    std::vector<uint8_t> proxy(proxyWidth * proxyHeight);
+    ParallelFor(proxyHeight, 64, [&](size_t begin, size_t end) {
+        GreyRowReader reader;
+        reader.Open(layout);
+        for (size_t py = begin; py < end; py++) {
+            const uint8_t* grey = reader.Read(y0 + py * factor, x0, x0 + proxyWidth * factor);
+            uint8_t* out = proxy.data() + py * proxyWidth;
+            for (size_t px = 0; px < proxyWidth; px++) {
+                const uint8_t* block = grey + px * factor;
+                out[px] = *std::min_element(block, block + factor) < kInkLevel;
+            }
+        }
+    });
+
+    // Lower edges of the ink, which trace the baselines
+    std::vector<ProxyPoint> points;
+    for (size_t py = 0; py + 1 < proxyHeight; py++) {
+        const uint8_t* row = proxy.data() + py * proxyWidth;
+        for (size_t px = 0; px < proxyWidth; px++) {
+            if (row[px] && !row[px + proxyWidth]) {
+                ProxyPoint point = { (int)px, (int)py };
+                points.push_back(point);
+            }
+        }
+    }
+    if (points.size() < kMinPoints) {
+        return false;
+    }
+
+    maxAngle = std::min(maxAngle, 30.0);
+    int offset = (int)std::ceil(proxyWidth * std::tan(maxAngle * kPi / 180)) + 2;
+    size_t bins = proxyHeight + 2 * offset;
+    size_t coarse = (size_t)(2 * maxAngle / kCoarseStep) + 1;
+    double best = SearchAngles(points, -maxAngle, kCoarseStep, coarse, offset, bins);
+    size_t fine = (size_t)(2 * kCoarseStep / kFineStep) + 1;
+    best = SearchAngles(points, best - kCoarseStep, kFineStep, fine, offset, bins);
+
+    // Rows are stored bottom-up unless biHeight is negative, which flips
+    // the angle as seen
+    angle = probe.BottomUp() ? -best : best;
+    return true;
+}
+
+bool RotatePixels(const DibLayout& layout, double angle, std::vector<BYTE>& out) {
+    RotateJob job;
+    if (!layout.bits || !PrepareRotation(layout, angle, job) || layout.imageSize < layout.stride * job.height) {
+        return false;
+    }
+    job.src = layout.bits;
+    job.srcStride = layout.stride;
+    job.srcFirstRow = 0;
+
+    out.assign(layout.imageSize, 0);
+    job.dst = out.data();
+    job.dstStride = layout.stride;
+    job.dstFirstRow = 0;
+    RotateRows(job, 0, job.height);
+    return true;
+}
+
+DeskewStripStage::DeskewStripStage(StripStage& input) : WindowedStripStage(input) {}
+
+DeskewStripStage::~DeskewStripStage() {}
+
+bool DeskewStripStage::Open(double angle) {
+    m_Format = m_Input.Format();
+    m_Job.reset(new RotateJob());
+    return PrepareRotation(m_Format.View(nullptr, m_Format.stride), angle, *m_Job);
+}
+
+void DeskewStripStage::InputSpan(size_t first, size_t last, size_t& inFirst, size_t& inLast) const {
+    // A row's source runs along a line through the rotated row; its ends
+    // bound the band, with a row to spare for rounding and one for bilinear
+    const RotateJob& job = *m_Job;
+    double cosine = job.cosine / 65536.0, sine = std::fabs(job.sine / 65536.0);
+    double centreX = job.centreX / 65536.0, centreY = job.centreY / 65536.0;
+    double top = centreY + (first - centreY) * cosine - centreX * sine;
+    double bottom = centreY + (last - 1 - centreY) * cosine + centreX * sine;
+    inFirst = (size_t)std::max(0.0, std::min((double)job.height, std::floor(top) - 2));
+    inLast = (size_t)std::max((double)inFirst, std::min((double)job.height, std::ceil(bottom) + 3));
+}
+
+void DeskewStripStage::Make(const BYTE* input, size_t pitch, size_t inFirst, size_t first, size_t last, BYTE* out) {
+    RotateJob job = *m_Job;
+    job.src = input;
+    job.srcStride = pitch;
+    job.srcFirstRow = (int)inFirst;
+    job.dst = out;
+    job.dstStride = m_Format.stride;
+    job.dstFirstRow = (int)first;
+    if (job.kind == kRotateIndexed) {
+        memset(out, 0, (last - first) * m_Format.stride);
+    }
+    RotateRows(job, (int)first, (int)last);
+}
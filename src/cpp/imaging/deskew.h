@@ -0,0 +1,44 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include "bitmap.h"
+#include "strip_pipeline.h"
+
+struct RotateJob;
+
+// Angles are in degrees as the page is viewed, positive when text lines
+// rise to the right
+struct DeskewOptions {
+    double maxAngle;  // Widest skew searched for
+    double minAngle;  // Smaller skews are left alone
+
+    DeskewOptions() : maxAngle(5), minAngle(0.1) {}
+};
+
+// Projection-profile search over the text baselines of a bitonal proxy
+// about 1000 pixels wide. False when the page has too little text to tell.
+bool EstimateSkew(const DibLayout& layout, double maxAngle, double& angle);
+
+// Rotates the pixels by -angle about the page centre into out, which gets
+// the layout's imageSize bytes in the same format. Uncovered corners are
+// white. Bilinear for grey and colour, nearest for other paletted pages.
+// Runs in tiles across the ParallelFor pool.
+bool RotatePixels(const DibLayout& layout, double angle, std::vector<BYTE>& out);
+
+// RotatePixels as a stage of a strip pipeline: each strip is turned from
+// the band of input rows it reaches into, about the centre of the page
+class DeskewStripStage : public WindowedStripStage {
+public:
+    explicit DeskewStripStage(StripStage& input);
+    ~DeskewStripStage();
+
+    // False for the pages RotatePixels cannot turn
+    bool Open(double angle);
+
+protected:
+    void InputSpan(size_t first, size_t last, size_t& inFirst, size_t& inLast) const;
+    void Make(const BYTE* input, size_t pitch, size_t inFirst, size_t first, size_t last, BYTE* out);
+
+private:
+    std::unique_ptr<RotateJob> m_Job;
+};
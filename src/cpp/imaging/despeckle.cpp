@@ -0,0 +1,310 @@
+#include "despeckle.h"
+#include "grey_rows.h"
+#include "parallel.h"
+#include "simd.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+// Specks are looked for this many rows either side of each band, so the
+// size is capped to keep the margin small against the band
+const int kMaxSpeckle = 64;
+
+// Bitonal bands are at least this tall, so margins add little labelling
+const size_t kMinBandRows = 64;
+
+const size_t kGreyGrainRows = 16;
+
+// Ink run of a row, and a node of the union-find over them
+struct Run {
+    int x0;      // Columns [x0, x1)
+    int x1;
+    int parent;  // Itself at a root
+    int size;    // Pixels of the component, at a root
+};
+
+int FindRoot(std::vector<Run>& runs, int i) {
+    while (runs[i].parent != i) {
+        runs[i].parent = runs[runs[i].parent].parent;
+        i = runs[i].parent;
+    }
+    return i;
+}
+
+void Join(std::vector<Run>& runs, int a, int b) {
+    a = FindRoot(runs, a);
+    b = FindRoot(runs, b);
+    if (a == b) {
+        return;
+    }
+    if (runs[a].size < runs[b].size) {
+        std::swap(a, b);
+    }
+    runs[b].parent = a;
+    runs[a].size += runs[b].size;
+}
+
+// Appends the runs of ink of a packed 1 bit row, skipping paper a word at
+// a time
+void FindRuns(const BYTE* row, size_t width, BYTE ink, std::vector<Run>& runs) {
+    size_t bytes = (width + 7) / 8;
+    const BYTE paper = ink ? 0x00 : 0xFF;
+    const uint64_t paperWord = ink ? 0 : ~0ULL;
+    int start = -1;
+    for (size_t i = 0; i < bytes; i++) {
+        if (start < 0) {
+            uint64_t word;
+            while (i + 8 < bytes && (memcpy(&word, row + i, 8), word == paperWord)) {
+                i += 8;
+            }
+            if (row[i] == paper) {
+                continue;
+            }
+        } else if (row[i] == (BYTE)~paper && (i + 1) * 8 <= width) {
+            continue;
+        }
+        for (int bit = 0; bit < 8; bit++) {
+            int x = (int)(i * 8) + bit;
+            if ((size_t)x >= width) {
+                break;
+            }
+            bool isInk = ((row[i] >> (7 - bit)) & 1) == ink;
+            if (isInk && start < 0) {
+                start = x;
+            } else if (!isInk && start >= 0) {
+                Run run = { start, x, 0, 0 };
+                runs.push_back(run);
+                start = -1;
+            }
+        }
+    }
+    if (start >= 0) {
+        Run run = { start, (int)width, 0, 0 };
+        runs.push_back(run);
+    }
+}
+
+struct BitonalBand {
+    const BYTE* input;    // Row inFirst
+    size_t pitch;
+    size_t inFirst;
+    size_t width;
+    size_t height;        // Of the page, to tell its ends from the window's
+    BYTE ink;
+    int maxSpeckle;
+    BYTE* out;            // Row first
+    size_t stride;
+    size_t first;
+};
+
+// Labels the 8-connected runs of window rows [w0, w1) and writes rows
+// [y0, y1) with the small components painted out. Runs on a window end
+// that is not the page's belong to components reaching past the window,
+// which are at least a margin tall, so count as large.
+void DespeckleBand(const BitonalBand& band, size_t w0, size_t w1, size_t y0, size_t y1) {
+    std::vector<Run> runs;
+    std::vector<size_t> rowStart(w1 - w0 + 1);
+    for (size_t r = w0; r < w1; r++) {
+        size_t begin = runs.size();
+        rowStart[r - w0] = begin;
+        FindRuns(band.input + (r - band.inFirst) * band.pitch, band.width, band.ink, runs);
+        bool cut = (r == w0 && w0 > 0) || (r + 1 == w1 && w1 < band.height);
+        for (size_t i = begin; i < runs.size(); i++) {
+            runs[i].parent = (int)i;
+            runs[i].size = runs[i].x1 - runs[i].x0 + (cut ? band.maxSpeckle + 1 : 0);
+        }
+        if (r == w0) {
+            continue;
+        }
+        // Runs of the row above touching each run, diagonals included
+        size_t p = rowStart[r - w0 - 1];
+        for (size_t c = begin; c < runs.size(); c++) {
+            while (p < begin && runs[p].x1 < runs[c].x0) {
+                p++;
+            }
+            for (size_t q = p; q < begin && runs[q].x0 <= runs[c].x1; q++) {
+                Join(runs, (int)c, (int)q);
+            }
+        }
+    }
+    rowStart[w1 - w0] = runs.size();
+
+    size_t rowBytes = (band.width + 7) / 8;
+    for (size_t y = y0; y < y1; y++) {
+        BYTE* row = band.out + (y - band.first) * band.stride;
+        memcpy(row, band.input + (y - band.inFirst) * band.pitch, rowBytes);
+        for (size_t i = rowStart[y - w0]; i < rowStart[y - w0 + 1]; i++) {
+            if (runs[FindRoot(runs, (int)i)].size > band.maxSpeckle) {
+                continue;
+            }
+            for (int x = runs[i].x0; x < runs[i].x1; x++) {
+                BYTE mask = (BYTE)(0x80 >> (x & 7));
+                row[x >> 3] = band.ink ? (BYTE)(row[x >> 3] & ~mask) : (BYTE)(row[x >> 3] | mask);
+            }
+        }
+    }
+}
+
+inline int MinOf(int a, int b) { return a < b ? a : b; }
+inline int MaxOf(int a, int b) { return a < b ? b : a; }
+#ifdef SCANNER_SSE2
+inline __m128i MinOf(__m128i a, __m128i b) { return _mm_min_epu8(a, b); }
+inline __m128i MaxOf(__m128i a, __m128i b) { return _mm_max_epu8(a, b); }
+#endif
+
+template <typename T>
+inline void Order(T& a, T& b) {
+    T low = MinOf(a, b);
+    b = MaxOf(a, b);
+    a = low;
+}
+
+// Median of nine in 19 exchanges (Paeth's network), for single pixels
+// and for sixteen at once
+template <typename T>
+inline T Median9(T* p) {
+    Order(p[1], p[2]); Order(p[4], p[5]); Order(p[7], p[8]);
+    Order(p[0], p[1]); Order(p[3], p[4]); Order(p[6], p[7]);
+    Order(p[1], p[2]); Order(p[4], p[5]); Order(p[7], p[8]);
+    Order(p[0], p[3]); Order(p[5], p[8]); Order(p[4], p[7]);
+    Order(p[3], p[6]); Order(p[1], p[4]); Order(p[2], p[5]);
+    Order(p[4], p[7]); Order(p[4], p[2]); Order(p[6], p[4]);
+    Order(p[4], p[2]);
+    return p[4];
+}
+
+// A pixel further than the threshold from its 3x3 median, darker or
+// lighter, is noise when no more than one neighbour stands out the same
+// way; a thin stroke has two, so keeps its pixels
+inline BYTE FilterGreyPixel(const int* window, int threshold) {
+    int sorted[9];
+    std::copy(window, window + 9, sorted);
+    int median = Median9(sorted);
+    int centre = window[4];
+    bool dark = median - centre > threshold;
+    if (!dark && centre - median <= threshold) {
+        return (BYTE)centre;
+    }
+    int alike = 0;
+    for (int i = 0; i < 9; i++) {
+        alike += i != 4 && (dark ? median - window[i] : window[i] - median) > threshold;
+    }
+    return (BYTE)(alike <= 1 ? median : centre);
+}
+
+// One grey row from it and its neighbours above and below, the page's
+// edge pixels standing in for those beyond it
+void FilterGreyRow(const BYTE* above, const BYTE* row, const BYTE* below, BYTE* out, size_t width, int threshold) {
+    auto filterPixel = [=](size_t x) {
+        size_t left = x > 0 ? x - 1 : 0, right = x + 1 < width ? x + 1 : width - 1;
+        int window[9] = { above[left], above[x], above[right], row[left], row[x], row[right],
+            below[left], below[x], below[right] };
+        out[x] = FilterGreyPixel(window, threshold);
+    };
+    size_t x = 0;
+    if (width > 0) {
+        filterPixel(x++);
+    }
+#ifdef SCANNER_SSE2
+    const __m128i limit = _mm_set1_epi8((char)threshold);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alikeLimit = _mm_set1_epi8(-6);
+    for (; x + 17 <= width; x += 16) {
+        __m128i window[9], sorted[9];
+        const BYTE* rows[3] = { above, row, below };
+        for (int r = 0; r < 3; r++) {
+            window[r * 3] = _mm_loadu_si128((const __m128i*)(rows[r] + x - 1));
+            window[r * 3 + 1] = _mm_loadu_si128((const __m128i*)(rows[r] + x));
+            window[r * 3 + 2] = _mm_loadu_si128((const __m128i*)(rows[r] + x + 1));
+        }
+        std::copy(window, window + 9, sorted);
+        __m128i centre = window[4];
+        __m128i median = Median9(sorted);
+        // Masks are 0xFF where a pixel does not stand out, so the sum of
+        // the neighbours' is minus the number that do not
+        __m128i darkSum = zero, lightSum = zero;
+        for (int i = 0; i < 9; i++) {
+            if (i != 4) {
+                darkSum = _mm_add_epi8(darkSum, _mm_cmpeq_epi8(_mm_subs_epu8(_mm_subs_epu8(median, window[i]), limit), zero));
+                lightSum = _mm_add_epi8(lightSum, _mm_cmpeq_epi8(_mm_subs_epu8(_mm_subs_epu8(window[i], median), limit), zero));
+            }
+        }
+        __m128i darkNoise = _mm_andnot_si128(
+            _mm_cmpeq_epi8(_mm_subs_epu8(_mm_subs_epu8(median, centre), limit), zero), _mm_cmplt_epi8(darkSum, alikeLimit));
+        __m128i lightNoise = _mm_andnot_si128(
+            _mm_cmpeq_epi8(_mm_subs_epu8(_mm_subs_epu8(centre, median), limit), zero), _mm_cmplt_epi8(lightSum, alikeLimit));
+        __m128i replace = _mm_or_si128(darkNoise, lightNoise);
+        _mm_storeu_si128((__m128i*)(out + x), _mm_or_si128(_mm_andnot_si128(replace, centre), _mm_and_si128(replace, median)));
+    }
+#endif
+    for (; x < width; x++) {
+        filterPixel(x);
+    }
+}
+
+}  // namespace
+
+DespeckleStripStage::DespeckleStripStage(StripStage& input) : WindowedStripStage(input), m_Margin(0), m_Ink(0) {}
+
+bool DespeckleStripStage::Open(const DespeckleOptions& options) {
+    const StripFormat& input = m_Input.Format();
+    m_Options = options;
+    if (input.bitCount == 8) {
+        if (!HasGreyRamp(input)) {
+            return false;
+        }
+        m_Margin = 1;
+    } else if (input.bitCount == 1 && options.maxSpeckle >= 1) {
+        // Ink is whichever entry is darker; a page without a colour table
+        // has black at 0
+        const BITMAPINFOHEADER* header = (const BITMAPINFOHEADER*)input.head.data();
+        m_Ink = 0;
+        if (input.head.size() >= header->biSize + 2 * sizeof(RGBQUAD)) {
+            const RGBQUAD* palette = (const RGBQUAD*)(input.head.data() + header->biSize);
+            m_Ink = GreyOf(palette[0].rgbRed, palette[0].rgbGreen, palette[0].rgbBlue) >
+                GreyOf(palette[1].rgbRed, palette[1].rgbGreen, palette[1].rgbBlue) ? 1 : 0;
+        }
+        m_Options.maxSpeckle = std::min(options.maxSpeckle, kMaxSpeckle);
+        m_Margin = (size_t)m_Options.maxSpeckle;
+    } else {
+        return false;
+    }
+    m_Format = input;
+    return true;
+}
+
+void DespeckleStripStage::InputSpan(size_t first, size_t last, size_t& inFirst, size_t& inLast) const {
+    inFirst = first > m_Margin ? first - m_Margin : 0;
+    inLast = std::min(m_Format.height, last + m_Margin);
+}
+
+void DespeckleStripStage::Make(const BYTE* input, size_t pitch, size_t inFirst, size_t first, size_t last, BYTE* out) {
+    const size_t height = m_Format.height, width = m_Format.width, stride = m_Format.stride;
+    if (m_Format.bitCount == 8) {
+        int threshold = m_Options.greyThreshold;
+        ParallelFor(last - first, kGreyGrainRows, [=](size_t begin, size_t end) {
+            for (size_t y = first + begin; y < first + end; y++) {
+                size_t above = y > 0 ? y - 1 : 0, below = y + 1 < height ? y + 1 : height - 1;
+                FilterGreyRow(input + (above - inFirst) * pitch, input + (y - inFirst) * pitch,
+                    input + (below - inFirst) * pitch, out + (y - first) * stride, width, threshold);
+            }
+        });
+        return;
+    }
+
+    // Each band labels its own window, so bands share nothing
+    BitonalBand band = { input, pitch, inFirst, width, height, m_Ink, m_Options.maxSpeckle, out, stride, first };
+    size_t rows = last - first, margin = m_Margin;
+    size_t threads = ParallelThreads();
+    size_t bandRows = std::max(kMinBandRows, (rows + threads - 1) / threads);
+    size_t bands = (rows + bandRows - 1) / bandRows;
+    ParallelFor(bands, 1, [&band, first, last, bandRows, margin, height](size_t begin, size_t end) {
+        for (size_t b = begin; b < end; b++) {
+            size_t y0 = first + b * bandRows, y1 = std::min(last, y0 + bandRows);
+            size_t w0 = y0 > margin ? y0 - margin : 0, w1 = std::min(height, y1 + margin);
+            DespeckleBand(band, w0, w1, y0, y1);
+        }
+    });
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <cstdint>
+#include "strip_pipeline.h"
+
+struct DespeckleOptions {
+    int maxSpeckle;         // Largest dark specks removed from 1 bit pages, in 8-connected pixels
+    uint8_t greyThreshold;  // 8 bit pixels further than this from their 3x3 median can be set to it
+
+    DespeckleOptions() : maxSpeckle(4), greyThreshold(40) {}
+};
+
+// Removes speckle noise as rows pass. On 1 bit pages, dark specks of up
+// to maxSpeckle pixels are found by labelling the runs of a band of rows
+// with maxSpeckle rows either side, and painted white. On 8 bit grey
+// pages, pixels that stand out from their 3x3 median with at most one
+// neighbour doing the same take the median, which clears salt and pepper
+// noise but keeps strokes a pixel wide; SSE2 sixteen pixels at a time.
+// Bands of rows are filtered across the ParallelFor pool.
+class DespeckleStripStage : public WindowedStripStage {
+public:
+    explicit DespeckleStripStage(StripStage& input);
+
+    // False for pages other than 1 bit and 8 bit grey ramp ones
+    bool Open(const DespeckleOptions& options);
+
+protected:
+    void InputSpan(size_t first, size_t last, size_t& inFirst, size_t& inLast) const;
+    void Make(const BYTE* input, size_t pitch, size_t inFirst, size_t first, size_t last, BYTE* out);
+
+private:
+    DespeckleOptions m_Options;
+    size_t m_Margin;  // Input rows read above and below the rows made
+    BYTE m_Ink;       // Bit value of black on 1 bit pages
+};
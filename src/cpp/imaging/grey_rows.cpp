@@ -0,0 +1,112 @@
+#include "grey_rows.h"
+#include <algorithm>
+#include <cstring>
+
+GreyRowReader::GreyRowReader()
+    : m_Layout(nullptr), m_Width(0), m_Height(0), m_BottomUp(true), m_Identity(false) {}
+
+bool GreyRowReader::Open(const DibLayout& layout) {
+    m_Layout = nullptr;
+    const BITMAPINFOHEADER* header = layout.header;
+    if (!header || !layout.bits) {
+        return false;
+    }
+
+    WORD bitCount = header->biBitCount;
+    bool paletted = bitCount == 1 || bitCount == 4 || bitCount == 8;
+    if (header->biCompression == 3) {
+        const DWORD* masks = (const DWORD*)((const BYTE*)header + header->biSize);
+        if (bitCount != 32 || header->biSize != sizeof(BITMAPINFOHEADER) ||
+            masks[0] != 0xFF0000 || masks[1] != 0xFF00 || masks[2] != 0xFF) {
+            return false;
+        }
+    } else if (header->biCompression != BI_RGB || (!paletted && bitCount != 24 && bitCount != 32)) {
+        return false;
+    }
+
+    m_Layout = &layout;
+    m_Width = (size_t)header->biWidth;
+    m_Height = (size_t)(header->biHeight < 0 ? -(long long)header->biHeight : header->biHeight);
+    m_BottomUp = header->biHeight > 0;
+    m_Identity = bitCount == 8;
+    if (paletted) {
+        size_t entries = std::min<size_t>(layout.paletteSize / sizeof(RGBQUAD), (size_t)1 << bitCount);
+        const RGBQUAD* palette = (const RGBQUAD*)((const BYTE*)header + layout.headerSize);
+        for (size_t i = 0; i < 256; i++) {
+            m_GreyOf[i] = i < entries ? GreyOf(palette[i].rgbRed, palette[i].rgbGreen, palette[i].rgbBlue) : 0;
+            m_Identity = m_Identity && i < entries &&
+                palette[i].rgbRed == i && palette[i].rgbGreen == i && palette[i].rgbBlue == i;
+        }
+    }
+    if (bitCount == 1) {
+        for (int byte = 0; byte < 256; byte++) {
+            for (int bit = 0; bit < 8; bit++) {
+                m_Expanded[byte][bit] = m_GreyOf[(byte >> (7 - bit)) & 1];
+            }
+        }
+    }
+    m_Row.resize(m_Width + 16);
+    return true;
+}
+
+const uint8_t* GreyRowReader::Read(size_t y, size_t x0, size_t x1) {
+    const BYTE* row = m_Layout->bits + y * m_Layout->stride;
+    WORD bitCount = m_Layout->header->biBitCount;
+    uint8_t* grey = m_Row.data();
+    size_t count = x1 - x0;
+
+    if (m_Identity) {
+        return row + x0;
+    }
+    if (bitCount == 8) {
+        for (size_t x = 0; x < count; x++) {
+            grey[x] = m_GreyOf[row[x0 + x]];
+        }
+    } else if (bitCount == 4) {
+        for (size_t x = 0; x < count; x++) {
+            size_t column = x0 + x;
+            grey[x] = m_GreyOf[(row[column >> 1] >> (column & 1 ? 0 : 4)) & 0x0F];
+        }
+    } else if (bitCount == 1) {
+        // From the byte holding x0, so the samples start x0 % 8 in
+        for (size_t byte = x0 >> 3, out = 0; byte < (x1 + 7) >> 3; byte++, out += 8) {
+            memcpy(grey + out, m_Expanded[row[byte]], 8);
+        }
+        return grey + (x0 & 7);
+    } else {
+        size_t pixelBytes = bitCount / 8;
+        const BYTE* pixel = row + x0 * pixelBytes;
+        for (size_t x = 0; x < count; x++, pixel += pixelBytes) {
+            grey[x] = GreyOf(pixel[2], pixel[1], pixel[0]);
+        }
+    }
+    return grey;
+}
+
+const uint8_t* GreyRowReader::ReadSampled(size_t y, size_t step) {
+    const BYTE* row = m_Layout->bits + y * m_Layout->stride;
+    WORD bitCount = m_Layout->header->biBitCount;
+    uint8_t* grey = m_Row.data();
+    size_t count = (m_Width + step - 1) / step;
+
+    if (bitCount == 8) {
+        for (size_t i = 0, x = 0; i < count; i++, x += step) {
+            grey[i] = m_Identity ? row[x] : m_GreyOf[row[x]];
+        }
+    } else if (bitCount == 4) {
+        for (size_t i = 0, x = 0; i < count; i++, x += step) {
+            grey[i] = m_GreyOf[(row[x >> 1] >> (x & 1 ? 0 : 4)) & 0x0F];
+        }
+    } else if (bitCount == 1) {
+        for (size_t i = 0, x = 0; i < count; i++, x += step) {
+            grey[i] = m_GreyOf[(row[x >> 3] >> (7 - (x & 7))) & 1];
+        }
+    } else {
+        size_t pixelStep = step * (bitCount / 8);
+        const BYTE* pixel = row;
+        for (size_t i = 0; i < count; i++, pixel += pixelStep) {
+            grey[i] = GreyOf(pixel[2], pixel[1], pixel[0]);
+        }
+    }
+    return grey;
+}
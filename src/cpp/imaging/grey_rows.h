@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "bitmap.h"
+
+// Reads the rows of a DIB as 8 bit grey, whatever its pixel format
+class GreyRowReader {
+public:
+    GreyRowReader();
+
+    // False for layouts it cannot read: compressed, 16 bit, or
+    // BI_BITFIELDS with other than 8 bits per channel
+    bool Open(const DibLayout& layout);
+
+    size_t Width() const { return m_Width; }
+    size_t Height() const { return m_Height; }
+    bool BottomUp() const { return m_BottomUp; }
+
+    // Grey of columns [x0, x1) of stored row y. The pointer is valid until
+    // the next call and may point into the DIB itself.
+    const uint8_t* Read(size_t y, size_t x0, size_t x1);
+
+    // Grey of every step-th column of stored row y, from column 0
+    const uint8_t* ReadSampled(size_t y, size_t step);
+
+private:
+    const DibLayout* m_Layout;
+    size_t m_Width;
+    size_t m_Height;
+    bool m_BottomUp;
+    bool m_Identity;            // 8 bit with a plain grey ramp, read in place
+    uint8_t m_GreyOf[256];      // Palette index to grey
+    uint8_t m_Expanded[256][8]; // Eight samples per byte of a 1 bit row
+    std::vector<uint8_t> m_Row;
+};
+
+inline uint8_t GreyOf(uint8_t r, uint8_t g, uint8_t b) {
+    return (uint8_t)((r * 77 + g * 150 + b * 29) >> 8);
+}
@@ -0,0 +1,419 @@
+#include "page_hash.h"
+#include "simd.h"
+#include <algorithm>
+#include <cstring>
+
+// Both hashes read their input as little-endian words, which every target
+// of the addon is
+
+namespace {
+
+const size_t kStripeSize = 64;
+const size_t kSecretSize = 192;
+const size_t kStripesPerBlock = (kSecretSize - kStripeSize) / 8;
+const size_t kBufferSize = 256;
+const size_t kShortMax = 240;
+
+const uint32_t kPrime32_1 = 0x9E3779B1U;
+const uint32_t kPrime32_2 = 0x85EBCA77U;
+const uint32_t kPrime32_3 = 0xC2B2AE3DU;
+const uint64_t kPrime64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t kPrime64_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t kPrime64_3 = 0x165667B19E3779F9ULL;
+const uint64_t kPrime64_4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t kPrime64_5 = 0x27D4EB2F165667C5ULL;
+const uint64_t kPrimeMx1 = 0x165667919E3779F9ULL;
+const uint64_t kPrimeMx2 = 0x9FB21C651E98DF25ULL;
+
+alignas(16) const uint8_t kSecret[kSecretSize] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+uint32_t Read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint64_t Read64(const uint8_t* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint64_t Swap64(uint64_t x) {
+    x = ((x & 0x00FF00FF00FF00FFULL) << 8) | ((x >> 8) & 0x00FF00FF00FF00FFULL);
+    x = ((x & 0x0000FFFF0000FFFFULL) << 16) | ((x >> 16) & 0x0000FFFF0000FFFFULL);
+    return (x << 32) | (x >> 32);
+}
+
+uint64_t Rotl64(uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+}
+
+// Low and high halves of the 128 bit product, xored
+uint64_t Mul128Fold64(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t loLo = (uint64_t)(uint32_t)a * (uint32_t)b;
+    uint64_t hiLo = (a >> 32) * (uint32_t)b;
+    uint64_t loHi = (uint64_t)(uint32_t)a * (b >> 32);
+    uint64_t hiHi = (a >> 32) * (b >> 32);
+    uint64_t cross = (loLo >> 32) + (uint32_t)hiLo + loHi;
+    uint64_t upper = (hiLo >> 32) + (cross >> 32) + hiHi;
+    uint64_t lower = (cross << 32) | (uint32_t)loLo;
+    return lower ^ upper;
+#endif
+}
+
+uint64_t Xxh64Avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= kPrime64_2;
+    h ^= h >> 29;
+    h *= kPrime64_3;
+    return h ^ (h >> 32);
+}
+
+uint64_t Avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= kPrimeMx1;
+    return h ^ (h >> 32);
+}
+
+uint64_t Mix16(const uint8_t* input, const uint8_t* secret) {
+    return Mul128Fold64(Read64(input) ^ Read64(secret), Read64(input + 8) ^ Read64(secret + 8));
+}
+
+// Whole inputs of up to kShortMax bytes, which never reach the stripes
+uint64_t HashShort(const uint8_t* input, size_t size) {
+    if (size > 128) {
+        uint64_t acc = size * kPrime64_1;
+        for (size_t i = 0; i < 8; i++) {
+            acc += Mix16(input + 16 * i, kSecret + 16 * i);
+        }
+        acc = Avalanche(acc);
+        for (size_t i = 8; i < size / 16; i++) {
+            acc += Mix16(input + 16 * i, kSecret + 16 * (i - 8) + 3);
+        }
+        acc += Mix16(input + size - 16, kSecret + 136 - 17);
+        return Avalanche(acc);
+    }
+    if (size > 16) {
+        uint64_t acc = size * kPrime64_1;
+        if (size > 32) {
+            if (size > 64) {
+                if (size > 96) {
+                    acc += Mix16(input + 48, kSecret + 96);
+                    acc += Mix16(input + size - 64, kSecret + 112);
+                }
+                acc += Mix16(input + 32, kSecret + 64);
+                acc += Mix16(input + size - 48, kSecret + 80);
+            }
+            acc += Mix16(input + 16, kSecret + 32);
+            acc += Mix16(input + size - 32, kSecret + 48);
+        }
+        acc += Mix16(input, kSecret);
+        acc += Mix16(input + size - 16, kSecret + 16);
+        return Avalanche(acc);
+    }
+    if (size > 8) {
+        uint64_t low = Read64(input) ^ (Read64(kSecret + 24) ^ Read64(kSecret + 32));
+        uint64_t high = Read64(input + size - 8) ^ (Read64(kSecret + 40) ^ Read64(kSecret + 48));
+        return Avalanche(size + Swap64(low) + high + Mul128Fold64(low, high));
+    }
+    if (size >= 4) {
+        uint64_t joined = Read32(input + size - 4) + ((uint64_t)Read32(input) << 32);
+        uint64_t h = joined ^ (Read64(kSecret + 8) ^ Read64(kSecret + 16));
+        h ^= Rotl64(h, 49) ^ Rotl64(h, 24);
+        h *= kPrimeMx2;
+        h ^= (h >> 35) + size;
+        h *= kPrimeMx2;
+        return h ^ (h >> 28);
+    }
+    if (size > 0) {
+        uint32_t joined = ((uint32_t)input[0] << 16) | ((uint32_t)input[size >> 1] << 24) | input[size - 1] |
+            ((uint32_t)size << 8);
+        return Xxh64Avalanche(joined ^ (uint64_t)(Read32(kSecret) ^ Read32(kSecret + 4)));
+    }
+    return Xxh64Avalanche(Read64(kSecret + 56) ^ Read64(kSecret + 64));
+}
+
+void Accumulate512(uint64_t acc[8], const uint8_t* input, const uint8_t* secret) {
+#ifdef SCANNER_SSE2
+    // Two lanes a register: the 32x32 bit product of each keyed word's
+    // halves, plus the neighbouring lane's input
+    __m128i* lanes = (__m128i*)acc;
+    for (int i = 0; i < 4; i++) {
+        __m128i data = _mm_loadu_si128((const __m128i*)(input + 16 * i));
+        __m128i keyed = _mm_xor_si128(data, _mm_loadu_si128((const __m128i*)(secret + 16 * i)));
+        __m128i product = _mm_mul_epu32(keyed, _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        lanes[i] = _mm_add_epi64(product, _mm_add_epi64(lanes[i], swapped));
+    }
+#else
+    for (int i = 0; i < 8; i++) {
+        uint64_t data = Read64(input + 8 * i);
+        uint64_t keyed = data ^ Read64(secret + 8 * i);
+        acc[i ^ 1] += data;
+        acc[i] += (uint64_t)(uint32_t)keyed * (keyed >> 32);
+    }
+#endif
+}
+
+void Scramble(uint64_t acc[8], const uint8_t* secret) {
+#ifdef SCANNER_SSE2
+    __m128i* lanes = (__m128i*)acc;
+    const __m128i prime = _mm_set1_epi32((int)kPrime32_1);
+    for (int i = 0; i < 4; i++) {
+        __m128i lane = _mm_xor_si128(lanes[i], _mm_srli_epi64(lanes[i], 47));
+        __m128i keyed = _mm_xor_si128(lane, _mm_loadu_si128((const __m128i*)(secret + 16 * i)));
+        __m128i low = _mm_mul_epu32(keyed, prime);
+        __m128i high = _mm_mul_epu32(_mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+        lanes[i] = _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+    }
+#else
+    for (int i = 0; i < 8; i++) {
+        uint64_t lane = acc[i] ^ (acc[i] >> 47);
+        acc[i] = (lane ^ Read64(secret + 8 * i)) * kPrime32_1;
+    }
+#endif
+}
+
+// Stripes that are known not to be the last of the input, scrambling at
+// the end of each block
+void ConsumeStripes(uint64_t acc[8], size_t& stripesInBlock, const uint8_t* input, size_t count) {
+    while (count > 0) {
+        size_t run = std::min(count, kStripesPerBlock - stripesInBlock);
+        for (size_t i = 0; i < run; i++) {
+            Accumulate512(acc, input + i * kStripeSize, kSecret + (stripesInBlock + i) * 8);
+        }
+        input += run * kStripeSize;
+        count -= run;
+        stripesInBlock += run;
+        if (stripesInBlock == kStripesPerBlock) {
+            Scramble(acc, kSecret + kSecretSize - kStripeSize);
+            stripesInBlock = 0;
+        }
+    }
+}
+
+uint64_t MergeAccumulators(const uint64_t acc[8], uint64_t start) {
+    uint64_t result = start;
+    for (int i = 0; i < 4; i++) {
+        const uint8_t* secret = kSecret + 11 + 16 * i;
+        result += Mul128Fold64(acc[2 * i] ^ Read64(secret), acc[2 * i + 1] ^ Read64(secret + 8));
+    }
+    return Avalanche(result);
+}
+
+const uint32_t kRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+uint32_t Rotr32(uint32_t x, int bits) {
+    return (x >> bits) | (x << (32 - bits));
+}
+
+void Sha256Blocks(uint32_t state[8], const uint8_t* input, size_t blocks) {
+    for (; blocks > 0; blocks--, input += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = ((uint32_t)input[4 * i] << 24) | ((uint32_t)input[4 * i + 1] << 16) |
+                ((uint32_t)input[4 * i + 2] << 8) | input[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = Rotr32(w[i - 15], 7) ^ Rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = Rotr32(w[i - 2], 17) ^ Rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (Rotr32(e, 6) ^ Rotr32(e, 11) ^ Rotr32(e, 25)) + ((e & f) ^ (~e & g)) +
+                kRoundConstants[i] + w[i];
+            uint32_t t2 = (Rotr32(a, 2) ^ Rotr32(a, 13) ^ Rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+std::string Hex(const uint8_t* bytes, size_t size) {
+    static const char kDigits[] = "0123456789abcdef";
+    std::string text(size * 2, '0');
+    for (size_t i = 0; i < size; i++) {
+        text[2 * i] = kDigits[bytes[i] >> 4];
+        text[2 * i + 1] = kDigits[bytes[i] & 15];
+    }
+    return text;
+}
+
+}  // namespace
+
+Xxh3Hash::Xxh3Hash() : m_TotalSize(0), m_Stripes(0), m_BufferedSize(0) {
+    const uint64_t initial[8] = {
+        kPrime32_3, kPrime64_1, kPrime64_2, kPrime64_3, kPrime64_4, kPrime32_2, kPrime64_5, kPrime32_1
+    };
+    memcpy(m_Acc, initial, sizeof(m_Acc));
+}
+
+void Xxh3Hash::Update(const void* data, size_t size) {
+    const uint8_t* input = (const uint8_t*)data;
+    m_TotalSize += size;
+    if (m_BufferedSize + size <= kBufferSize) {
+        memcpy(m_Buffer + m_BufferedSize, input, size);
+        m_BufferedSize += size;
+        return;
+    }
+
+    // At least one byte is always held back, so the last stripe of the
+    // input is only taken by Digest
+    if (m_BufferedSize > 0) {
+        size_t fill = kBufferSize - m_BufferedSize;
+        memcpy(m_Buffer + m_BufferedSize, input, fill);
+        input += fill;
+        size -= fill;
+        ConsumeStripes(m_Acc, m_Stripes, m_Buffer, kBufferSize / kStripeSize);
+        m_BufferedSize = 0;
+    }
+    if (size > kBufferSize) {
+        size_t stripes = (size - 1) / kStripeSize;
+        ConsumeStripes(m_Acc, m_Stripes, input, stripes);
+        input += stripes * kStripeSize;
+        size -= stripes * kStripeSize;
+        memcpy(m_Buffer + kBufferSize - kStripeSize, input - kStripeSize, kStripeSize);
+    }
+    memcpy(m_Buffer, input, size);
+    m_BufferedSize = size;
+}
+
+uint64_t Xxh3Hash::Digest() const {
+    if (m_TotalSize <= kShortMax) {
+        return HashShort(m_Buffer, (size_t)m_TotalSize);
+    }
+
+    uint64_t acc[8];
+    memcpy(acc, m_Acc, sizeof(acc));
+    size_t stripes = m_Stripes;
+    const uint8_t* lastSecret = kSecret + kSecretSize - kStripeSize - 7;
+    if (m_BufferedSize >= kStripeSize) {
+        ConsumeStripes(acc, stripes, m_Buffer, (m_BufferedSize - 1) / kStripeSize);
+        Accumulate512(acc, m_Buffer + m_BufferedSize - kStripeSize, lastSecret);
+    } else {
+        // The last stripe starts in bytes already consumed
+        uint8_t last[kStripeSize];
+        size_t carried = kStripeSize - m_BufferedSize;
+        memcpy(last, m_Buffer + kBufferSize - carried, carried);
+        memcpy(last + carried, m_Buffer, m_BufferedSize);
+        Accumulate512(acc, last, lastSecret);
+    }
+    return MergeAccumulators(acc, m_TotalSize * kPrime64_1);
+}
+
+Sha256Hash::Sha256Hash() : m_TotalSize(0), m_BufferedSize(0) {
+    const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(m_State, initial, sizeof(m_State));
+}
+
+void Sha256Hash::Update(const void* data, size_t size) {
+    const uint8_t* input = (const uint8_t*)data;
+    m_TotalSize += size;
+    if (m_BufferedSize > 0) {
+        size_t fill = std::min(size, sizeof(m_Buffer) - m_BufferedSize);
+        memcpy(m_Buffer + m_BufferedSize, input, fill);
+        m_BufferedSize += fill;
+        input += fill;
+        size -= fill;
+        if (m_BufferedSize < sizeof(m_Buffer)) {
+            return;
+        }
+        Sha256Blocks(m_State, m_Buffer, 1);
+        m_BufferedSize = 0;
+    }
+    Sha256Blocks(m_State, input, size / 64);
+    memcpy(m_Buffer, input + size / 64 * 64, size % 64);
+    m_BufferedSize = size % 64;
+}
+
+void Sha256Hash::Digest(uint8_t digest[32]) const {
+    uint32_t state[8];
+    memcpy(state, m_State, sizeof(state));
+
+    // One bit, zeros, then the bit length in the last 8 bytes
+    uint8_t tail[128] = {};
+    memcpy(tail, m_Buffer, m_BufferedSize);
+    tail[m_BufferedSize] = 0x80;
+    size_t tailSize = m_BufferedSize < 56 ? 64 : 128;
+    uint64_t bits = m_TotalSize * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[tailSize - 1 - i] = (uint8_t)(bits >> (8 * i));
+    }
+    Sha256Blocks(state, tail, tailSize / 64);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (uint8_t)(state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)state[i];
+    }
+}
+
+PageHasher::PageHasher(PageHashMode mode) : m_Sha256(mode == kPageHashFastAndSha256) {}
+
+void PageHasher::Update(const void* data, size_t size) {
+    m_Xxh3.Update(data, size);
+    if (m_Sha256) {
+        m_Sha.Update(data, size);
+    }
+}
+
+PageDigests PageHasher::Finish() const {
+    PageDigests digests;
+    uint64_t xxh3 = m_Xxh3.Digest();
+    uint8_t bytes[32];
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = (uint8_t)(xxh3 >> (56 - 8 * i));
+    }
+    digests.xxh3 = Hex(bytes, 8);
+    if (m_Sha256) {
+        m_Sha.Digest(bytes);
+        digests.sha256 = Hex(bytes, 32);
+    }
+    return digests;
+}
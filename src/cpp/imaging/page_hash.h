@@ -0,0 +1,70 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+enum PageHashMode {
+    kPageHashNone,
+    kPageHashFast,           // XXH3-64
+    kPageHashFastAndSha256   // XXH3-64 and SHA-256
+};
+
+// Lowercase hex digests, in the byte order the reference tools print
+struct PageDigests {
+    std::string xxh3;
+    std::string sha256;  // Empty unless asked for
+};
+
+// What is hashed of each returned page: the pixel rows as stored, without
+// their padding, and the BMP file as returned or before Base64
+struct PageHashes {
+    PageDigests pixels;
+    PageDigests file;
+};
+
+// Streaming XXH3-64 with seed 0 and the default secret, giving the same
+// value as XXH3_64bits over the concatenated input
+class Xxh3Hash {
+public:
+    Xxh3Hash();
+
+    void Update(const void* data, size_t size);
+    uint64_t Digest() const;
+
+private:
+    uint64_t m_Acc[8];
+    uint64_t m_TotalSize;
+    size_t m_Stripes;       // Of the current block
+    size_t m_BufferedSize;
+    // Input not yet consumed; once some has been, the last 64 bytes
+    // consumed stay at the end
+    alignas(16) uint8_t m_Buffer[256];
+};
+
+class Sha256Hash {
+public:
+    Sha256Hash();
+
+    void Update(const void* data, size_t size);
+    void Digest(uint8_t digest[32]) const;
+
+private:
+    uint32_t m_State[8];
+    uint64_t m_TotalSize;
+    size_t m_BufferedSize;
+    uint8_t m_Buffer[64];
+};
+
+// The digests asked for by a PageHashMode over one stream of bytes
+class PageHasher {
+public:
+    explicit PageHasher(PageHashMode mode);
+
+    void Update(const void* data, size_t size);
+    PageDigests Finish() const;
+
+private:
+    bool m_Sha256;
+    Xxh3Hash m_Xxh3;
+    Sha256Hash m_Sha;
+};
@@ -0,0 +1,340 @@
+#include "page_stats.h"
+#include "grey_rows.h"
+#include "parallel.h"
+#include "simd.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+// Fewest rows a thread tallies
+const size_t kGrainRows = 16;
+
+// Same bar as ColourDropoutOptions::minChroma's default: below it, scanner
+// noise on grey paper
+const int kColourChroma = 48;
+
+const int kInkLevel = 128;
+
+inline uint32_t Load4(const BYTE* p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+#ifdef SCANNER_SSE2
+// Eight pixels as B, G and R lanes of 16 bits
+inline void LoadPixels(const BYTE* p, int pixelBytes, __m128i& b, __m128i& g, __m128i& r) {
+    __m128i low, high;
+    if (pixelBytes == 4) {
+        low = _mm_loadu_si128((const __m128i*)p);
+        high = _mm_loadu_si128((const __m128i*)(p + 16));
+    } else {
+        low = _mm_set_epi32((int)Load4(p + 9), (int)Load4(p + 6), (int)Load4(p + 3), (int)Load4(p));
+        high = _mm_set_epi32((int)Load4(p + 21), (int)Load4(p + 18), (int)Load4(p + 15), (int)Load4(p + 12));
+    }
+    const __m128i byteMask = _mm_set1_epi32(0xFF);
+    b = _mm_packs_epi32(_mm_and_si128(low, byteMask), _mm_and_si128(high, byteMask));
+    g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(low, 8), byteMask), _mm_and_si128(_mm_srli_epi32(high, 8), byteMask));
+    r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(low, 16), byteMask), _mm_and_si128(_mm_srli_epi32(high, 16), byteMask));
+}
+
+inline uint32_t SumLanes(__m128i counts) {
+    __m128i sums = _mm_madd_epi16(counts, _mm_set1_epi16(1));
+    sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, _MM_SHUFFLE(1, 0, 3, 2)));
+    sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (uint32_t)_mm_cvtsi128_si32(sums);
+}
+#endif
+
+// Ones in a word, for 1 bit rows
+inline uint32_t CountOnes(uint64_t word) {
+    word = word - ((word >> 1) & 0x5555555555555555ULL);
+    word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (uint32_t)((word * 0x0101010101010101ULL) >> 56);
+}
+
+// Histogram copies a tally spreads its counts over, so that a run of one
+// value, such as paper, does not wait on a single counter
+const int kCopies = 4;
+
+// One ParallelFor chunk's counts. Direct pixels fill three histograms of
+// 256 in each copy, blue first; paletted ones the first 256 with indices.
+struct Tally {
+    uint32_t histograms[kCopies][3 * 256];
+    uint32_t dark;
+    uint32_t light;
+    uint32_t colour;
+    uint32_t ink;
+
+    Tally() : dark(0), light(0), colour(0), ink(0) { memset(histograms, 0, sizeof(histograms)); }
+};
+
+void TallyDirectRow(const BYTE* row, size_t width, int pixelBytes, Tally& tally) {
+    size_t x = 0;
+#ifdef SCANNER_SSE2
+    // 24 bit pixels are read four bytes at a time, so the last is left to
+    // the scalar tail. Lane counts stay within a row, far below 16 bits.
+    size_t vectorEnd = width >= 9 ? width - (pixelBytes == 3 ? 9 : 8) + 1 : 0;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i white = _mm_set1_epi16(255);
+    const __m128i chromaBar = _mm_set1_epi16(kColourChroma - 1);
+    const __m128i inkBar = _mm_set1_epi16(kInkLevel);
+    __m128i darkLanes = zero, lightLanes = zero, colourLanes = zero, inkLanes = zero;
+    for (; x < vectorEnd; x += 8) {
+        const BYTE* p = row + x * pixelBytes;
+        __m128i b, g, r;
+        LoadPixels(p, pixelBytes, b, g, r);
+        __m128i low = _mm_min_epi16(r, _mm_min_epi16(g, b));
+        __m128i high = _mm_max_epi16(r, _mm_max_epi16(g, b));
+        // The weights sum to 256, so the luminance fits 16 unsigned bits
+        __m128i grey = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(77)),
+            _mm_mullo_epi16(g, _mm_set1_epi16(150))), _mm_mullo_epi16(b, _mm_set1_epi16(29)));
+        grey = _mm_srli_epi16(grey, 8);
+        // Masks are -1, so subtracting them counts
+        darkLanes = _mm_sub_epi16(darkLanes, _mm_cmpeq_epi16(low, zero));
+        lightLanes = _mm_sub_epi16(lightLanes, _mm_cmpeq_epi16(high, white));
+        colourLanes = _mm_sub_epi16(colourLanes, _mm_cmpgt_epi16(_mm_sub_epi16(high, low), chromaBar));
+        inkLanes = _mm_sub_epi16(inkLanes, _mm_cmplt_epi16(grey, inkBar));
+
+        // Eight pixels of one colour, as on paper, count at once
+        __m128i same = _mm_and_si128(_mm_and_si128(
+            _mm_cmpeq_epi16(b, _mm_shuffle_epi32(_mm_shufflelo_epi16(b, 0), 0)),
+            _mm_cmpeq_epi16(g, _mm_shuffle_epi32(_mm_shufflelo_epi16(g, 0), 0))),
+            _mm_cmpeq_epi16(r, _mm_shuffle_epi32(_mm_shufflelo_epi16(r, 0), 0)));
+        if (_mm_movemask_epi8(same) == 0xFFFF) {
+            uint32_t* counts = tally.histograms[(x / 8) % kCopies];
+            counts[p[0]] += 8;
+            counts[256 + p[1]] += 8;
+            counts[512 + p[2]] += 8;
+            continue;
+        }
+        for (int i = 0; i < 8; i++) {
+            uint32_t* counts = tally.histograms[i % kCopies];
+            counts[p[i * pixelBytes]]++;
+            counts[256 + p[i * pixelBytes + 1]]++;
+            counts[512 + p[i * pixelBytes + 2]]++;
+        }
+    }
+    tally.dark += SumLanes(darkLanes);
+    tally.light += SumLanes(lightLanes);
+    tally.colour += SumLanes(colourLanes);
+    tally.ink += SumLanes(inkLanes);
+#endif
+    for (; x < width; x++) {
+        const BYTE* p = row + x * pixelBytes;
+        int b = p[0], g = p[1], r = p[2];
+        uint32_t* counts = tally.histograms[x % kCopies];
+        counts[b]++;
+        counts[256 + g]++;
+        counts[512 + r]++;
+        int low = std::min(r, std::min(g, b)), high = std::max(r, std::max(g, b));
+        tally.dark += low == 0;
+        tally.light += high == 255;
+        tally.colour += high - low >= kColourChroma;
+        tally.ink += GreyOf((uint8_t)r, (uint8_t)g, (uint8_t)b) < kInkLevel;
+    }
+}
+
+// Index counts of a paletted row; 1 bit rows count their ones into entry
+// 1 and leave the zeros to Finish
+void TallyIndexRow(const BYTE* row, size_t width, WORD bitCount, Tally& tally) {
+    if (bitCount == 8) {
+        size_t x = 0;
+#ifdef SCANNER_SSE2
+        for (; x + 16 <= width; x += 16) {
+            __m128i bytes = _mm_loadu_si128((const __m128i*)(row + x));
+            __m128i first = _mm_set1_epi8((char)row[x]);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, first)) == 0xFFFF) {
+                tally.histograms[(x / 16) % kCopies][row[x]] += 16;
+                continue;
+            }
+            for (size_t i = 0; i < 16; i++) {
+                tally.histograms[i % kCopies][row[x + i]]++;
+            }
+        }
+#endif
+        for (; x < width; x++) {
+            tally.histograms[x % kCopies][row[x]]++;
+        }
+    } else if (bitCount == 4) {
+        for (size_t x = 0; x < width; x += 2) {
+            tally.histograms[0][row[x / 2] >> 4]++;
+            if (x + 1 < width) {
+                tally.histograms[1][row[x / 2] & 0x0F]++;
+            }
+        }
+    } else {
+        size_t whole = width / 8, i = 0;
+        uint32_t ones = 0;
+        for (; i + 8 <= whole; i += 8) {
+            uint64_t word;
+            memcpy(&word, row + i, 8);
+            ones += CountOnes(word);
+        }
+        for (; i < whole; i++) {
+            ones += CountOnes(row[i]);
+        }
+        if (width % 8) {
+            ones += CountOnes(row[whole] & (BYTE)(0xFF00 >> (width % 8)));
+        }
+        tally.histograms[0][1] += ones;
+    }
+}
+
+}  // namespace
+
+PageStatsStripStage::PageStatsStripStage(StripStage& input)
+    : m_Input(input), m_Next(0), m_Direct(false), m_PixelBytes(0)
+    , m_Dark(0), m_Light(0), m_Colour(0), m_Ink(0) {}
+
+bool PageStatsStripStage::Open() {
+    const StripFormat& input = m_Input.Format();
+    if (input.head.size() < sizeof(BITMAPINFOHEADER)) {
+        return false;
+    }
+    const BITMAPINFOHEADER* header = (const BITMAPINFOHEADER*)input.head.data();
+    if (header->biCompression == BI_BITFIELDS) {
+        const DWORD* masks = (const DWORD*)(input.head.data() + header->biSize);
+        if (input.bitCount != 32 || header->biSize != sizeof(BITMAPINFOHEADER) ||
+            input.head.size() < header->biSize + 3 * sizeof(DWORD) ||
+            masks[0] != 0xFF0000 || masks[1] != 0xFF00 || masks[2] != 0xFF) {
+            return false;
+        }
+    } else if (header->biCompression != BI_RGB) {
+        return false;
+    }
+
+    m_Direct = input.bitCount == 24 || input.bitCount == 32;
+    if (!m_Direct && input.bitCount != 1 && input.bitCount != 4 && input.bitCount != 8) {
+        return false;
+    }
+    m_PixelBytes = input.bitCount / 8;
+    m_Palette.clear();
+    if (!m_Direct) {
+        // Indices past the colour table read as black; a page without one
+        // is taken as a black to white ramp
+        size_t entries = (size_t)1 << input.bitCount;
+        size_t stored = std::min(entries, (input.head.size() - header->biSize) / sizeof(RGBQUAD));
+        const RGBQUAD* table = (const RGBQUAD*)(input.head.data() + header->biSize);
+        m_Palette.resize(entries);
+        for (size_t i = 0; i < entries; i++) {
+            if (stored == 0) {
+                BYTE level = (BYTE)(i * 255 / (entries - 1));
+                m_Palette[i].rgbRed = m_Palette[i].rgbGreen = m_Palette[i].rgbBlue = level;
+            } else if (i < stored) {
+                m_Palette[i] = table[i];
+            }
+        }
+    }
+    m_Histograms.assign(m_Direct ? 3 * 256 : 256, 0);
+    m_Next = 0;
+    m_Dark = m_Light = m_Colour = m_Ink = 0;
+    m_Format = input;
+    return true;
+}
+
+const BYTE* PageStatsStripStage::Rows(size_t first, size_t count, size_t& pitch) {
+    const BYTE* rows = m_Input.Rows(first, count, pitch);
+    if (first <= m_Next && first + count > m_Next) {
+        Count(rows + (m_Next - first) * pitch, pitch, first + count - m_Next);
+        m_Next = first + count;
+    }
+    return rows;
+}
+
+void PageStatsStripStage::Count(const BYTE* rows, size_t pitch, size_t count) {
+    // A chunk per thread, each with its own tally
+    size_t grain = std::max(kGrainRows, (count + ParallelThreads() - 1) / ParallelThreads());
+    std::vector<Tally> tallies((count + grain - 1) / grain);
+    const size_t width = m_Format.width;
+    const WORD bitCount = m_Format.bitCount;
+    const bool direct = m_Direct;
+    const int pixelBytes = m_PixelBytes;
+    ParallelFor(count, grain, [&tallies, rows, pitch, width, bitCount, direct, pixelBytes, grain](size_t begin, size_t end) {
+        for (size_t y = begin; y < end; y++) {
+            Tally& tally = tallies[y / grain];
+            if (direct) {
+                TallyDirectRow(rows + y * pitch, width, pixelBytes, tally);
+            } else {
+                TallyIndexRow(rows + y * pitch, width, bitCount, tally);
+            }
+        }
+    });
+
+    for (size_t t = 0; t < tallies.size(); t++) {
+        const Tally& tally = tallies[t];
+        for (int copy = 0; copy < kCopies; copy++) {
+            for (size_t i = 0; i < m_Histograms.size(); i++) {
+                m_Histograms[i] += tally.histograms[copy][i];
+            }
+        }
+        m_Dark += tally.dark;
+        m_Light += tally.light;
+        m_Colour += tally.colour;
+        m_Ink += tally.ink;
+    }
+}
+
+PageStats PageStatsStripStage::Finish() const {
+    PageStats stats;
+    double pixels = (double)m_Format.width * (double)m_Next;
+    if (pixels == 0) {
+        return stats;
+    }
+
+    // Stored blue, green, red; returned red, green, blue
+    std::vector<uint32_t> rgb(3 * 256, 0);
+    double dark = 0, light = 0, colour = 0, ink = 0;
+    bool grey = true;
+    if (m_Direct) {
+        for (int c = 0; c < 3; c++) {
+            std::copy(m_Histograms.begin() + (2 - c) * 256, m_Histograms.begin() + (3 - c) * 256, rgb.begin() + c * 256);
+        }
+        dark = (double)m_Dark;
+        light = (double)m_Light;
+        colour = (double)m_Colour;
+        ink = (double)m_Ink;
+        grey = false;
+    } else {
+        std::vector<uint32_t> indices(m_Histograms);
+        if (m_Format.bitCount == 1) {
+            indices[0] = (uint32_t)(pixels - indices[1]);
+        }
+        for (size_t i = 0; i < m_Palette.size(); i++) {
+            const RGBQUAD& entry = m_Palette[i];
+            uint32_t count = indices[i];
+            int low = std::min(entry.rgbRed, std::min(entry.rgbGreen, entry.rgbBlue));
+            int high = std::max(entry.rgbRed, std::max(entry.rgbGreen, entry.rgbBlue));
+            rgb[entry.rgbRed] += count;
+            rgb[256 + entry.rgbGreen] += count;
+            rgb[512 + entry.rgbBlue] += count;
+            dark += low == 0 ? count : 0;
+            light += high == 255 ? count : 0;
+            colour += high - low >= kColourChroma ? count : 0;
+            ink += GreyOf(entry.rgbRed, entry.rgbGreen, entry.rgbBlue) < kInkLevel ? count : 0;
+            grey = grey && low == high;
+        }
+    }
+
+    stats.channels = grey ? 1 : 3;
+    stats.histograms.assign(rgb.begin(), rgb.begin() + stats.channels * 256);
+    for (int c = 0; c < stats.channels; c++) {
+        const uint32_t* histogram = stats.histograms.data() + c * 256;
+        double sum = 0, squares = 0;
+        for (int level = 0; level < 256; level++) {
+            sum += (double)histogram[level] * level;
+            squares += (double)histogram[level] * level * level;
+        }
+        double mean = sum / pixels;
+        stats.mean.push_back(mean);
+        stats.stddev.push_back(std::sqrt(std::max(0.0, squares / pixels - mean * mean)));
+    }
+    stats.clippedDark = 100 * dark / pixels;
+    stats.clippedLight = 100 * light / pixels;
+    stats.colour = 100 * colour / pixels;
+    stats.inkCoverage = 100 * ink / pixels;
+    return stats;
+}
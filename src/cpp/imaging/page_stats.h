@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "strip_pipeline.h"
+
+// Pixel statistics of a returned page, for quality control rules that
+// would otherwise decode it. Percentages are of all the page's pixels.
+struct PageStats {
+    int channels;                      // 1 for grey and black and white pages, 3 (red, green, blue) otherwise; 0 when none were gathered
+    std::vector<uint32_t> histograms;  // 256 counts per channel, one channel after another
+    std::vector<double> mean;          // Per channel, 0-255
+    std::vector<double> stddev;
+    double clippedDark;                // Pixels with a channel at 0
+    double clippedLight;               // Pixels with a channel at 255
+    double colour;                     // Pixels whose channels spread by 48 levels or more
+    double inkCoverage;                // Pixels whose grey is below 128
+
+    PageStats() : channels(0), clippedDark(0), clippedLight(0), colour(0), inkCoverage(0) {}
+};
+
+// Passes its input's rows through untouched and tallies each the first
+// time it goes by, so the statistics cost no pass of their own. Colour
+// pixels are classed eight at a time with SSE2, and blocks of one colour,
+// as on paper, are counted at once; paletted pages only count their
+// indices and look up the colour table once at the end. Strips are
+// tallied across the ParallelFor pool.
+class PageStatsStripStage : public StripStage {
+public:
+    explicit PageStatsStripStage(StripStage& input);
+
+    // False for 16 bit pages and BI_BITFIELDS other than 8-8-8
+    bool Open();
+
+    const BYTE* Rows(size_t first, size_t count, size_t& pitch);
+
+    // Statistics of the rows gone by, the whole page once it is written
+    PageStats Finish() const;
+
+private:
+    void Count(const BYTE* rows, size_t pitch, size_t count);
+
+    StripStage& m_Input;
+    size_t m_Next;                 // First row not yet tallied
+    bool m_Direct;                 // 24 or 32 bit pixels, else palette indices
+    int m_PixelBytes;
+    std::vector<RGBQUAD> m_Palette;
+    std::vector<uint32_t> m_Histograms;  // Direct: 3 x 256, blue first; paletted: 256 index counts
+    uint64_t m_Dark;               // Direct pixels only; paletted ones are classed by entry
+    uint64_t m_Light;
+    uint64_t m_Colour;
+    uint64_t m_Ink;
+};
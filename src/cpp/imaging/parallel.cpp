@@ -0,0 +1,122 @@
+#include "parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Enough for page kernels, which run out of memory bandwidth first
+const unsigned kMaxThreads = 8;
+
+struct Job {
+    const std::function<void(size_t, size_t)>* body;
+    size_t count;
+    size_t grain;
+    std::atomic<size_t> next;
+    std::atomic<size_t> remaining;  // Chunks not yet finished
+};
+
+struct Pool {
+    std::mutex callMutex;  // One job at a time
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    Job* job;
+    unsigned busy;         // Workers holding job
+    uint64_t generation;
+    unsigned threads;
+
+    Pool() : job(nullptr), busy(0), generation(0), threads(1) {}
+};
+
+thread_local bool t_InParallelFor = false;
+
+void RunChunks(Pool& pool, Job& job) {
+    size_t begin;
+    while ((begin = job.next.fetch_add(job.grain)) < job.count) {
+        (*job.body)(begin, std::min(begin + job.grain, job.count));
+        if (job.remaining.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            pool.done.notify_all();
+        }
+    }
+}
+
+void Worker(Pool* pool) {
+    t_InParallelFor = true;
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    for (;;) {
+        pool->wake.wait(lock, [&]() { return pool->generation != seen; });
+        seen = pool->generation;
+        Job* job = pool->job;
+        if (!job) {
+            continue;
+        }
+        pool->busy++;
+        lock.unlock();
+        RunChunks(*pool, *job);
+        lock.lock();
+        if (--pool->busy == 0) {
+            pool->done.notify_all();
+        }
+    }
+}
+
+// Workers live for the whole process, parked between jobs
+Pool& GetPool() {
+    static Pool* pool = []() {
+        Pool* created = new Pool();
+        unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+        created->threads = std::min(hardware, kMaxThreads);
+        for (unsigned i = 1; i < created->threads; i++) {
+            std::thread(Worker, created).detach();
+        }
+        return created;
+    }();
+    return *pool;
+}
+
+}  // namespace
+
+unsigned ParallelThreads() {
+    return GetPool().threads;
+}
+
+void ParallelFor(size_t count, size_t grain, const std::function<void(size_t begin, size_t end)>& body) {
+    grain = std::max<size_t>(grain, 1);
+    if (count == 0) {
+        return;
+    }
+    Pool& pool = GetPool();
+    if (count <= grain || pool.threads == 1 || t_InParallelFor) {
+        body(0, count);
+        return;
+    }
+
+    std::lock_guard<std::mutex> call(pool.callMutex);
+    Job job;
+    job.body = &body;
+    job.count = count;
+    job.grain = grain;
+    job.next = 0;
+    job.remaining = (count + grain - 1) / grain;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.job = &job;
+        pool.generation++;
+    }
+    pool.wake.notify_all();
+
+    t_InParallelFor = true;
+    RunChunks(pool, job);
+    t_InParallelFor = false;
+
+    // Workers still inside RunChunks hold a pointer to job
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.done.wait(lock, [&]() { return job.remaining == 0 && pool.busy == 0; });
+    pool.job = nullptr;
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+
+// Runs body over [0, count) in chunks of grain on a process-wide worker
+// pool, the calling thread included, and returns once every chunk is
+// done. Bodies must not throw. Calls from several threads at once take
+// turns; a call made from inside a body runs inline.
+void ParallelFor(size_t count, size_t grain, const std::function<void(size_t begin, size_t end)>& body);
+
+// Threads a ParallelFor call can use, the caller included
+unsigned ParallelThreads();
@@ -0,0 +1,179 @@
+#include "perceptual_hash.h"
+#include "grey_rows.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+const size_t kProxySize = 32;
+const size_t kFrequencies = 8;
+const size_t kSampleRows = 256;  // Spread over the height, 8 per proxy row
+
+// Largest coefficient of a page with no shape to hash: a cosine of half a
+// grey level across the page
+const double kMinDetail = 256;
+
+}  // namespace
+
+bool PerceptualHash(const DibLayout& layout, uint64_t& hash) {
+    DibStripSource source;
+    return source.Open(layout) && PerceptualHash(source, hash);
+}
+
+bool PerceptualHash(StripStage& page, uint64_t& hash) {
+    // The reader sees one row at a time, moved under it as rows are fetched
+    const StripFormat& format = page.Format();
+    size_t width = format.width, height = format.height;
+    if (width < kProxySize || height < kProxySize) {
+        return false;
+    }
+    size_t pitch = 0;
+    DibLayout row = format.View(page.Rows(0, 1, pitch), pitch);
+    GreyRowReader reader;
+    if (!reader.Open(row)) {
+        return false;
+    }
+
+    // Proxy cells average whole sampled rows, top row first as viewed;
+    // rows are fetched in storage order
+    std::vector<uint8_t> cellOf(width);
+    for (size_t x = 0; x < width; x++) {
+        cellOf[x] = (uint8_t)(x * kProxySize / width);
+    }
+    uint32_t sums[kProxySize][kProxySize] = {};
+    uint32_t counts[kProxySize] = {};
+    size_t rows = std::min(height, kSampleRows);
+    for (size_t i = 0; i < rows; i++) {
+        size_t r = format.bottomUp ? rows - 1 - i : i;
+        size_t y = (2 * r + 1) * height / (2 * rows);
+        row.bits = page.Rows(format.bottomUp ? height - 1 - y : y, 1, pitch);
+        const uint8_t* grey = reader.Read(0, 0, width);
+        uint32_t* cells = sums[y * kProxySize / height];
+        for (size_t x = 0; x < width; x++) {
+            cells[cellOf[x]] += grey[x];
+        }
+        counts[y * kProxySize / height]++;
+    }
+    double proxy[kProxySize][kProxySize];
+    for (size_t py = 0; py < kProxySize; py++) {
+        for (size_t px = 0; px < kProxySize; px++) {
+            size_t columns = (((px + 1) * width + kProxySize - 1) / kProxySize) - ((px * width + kProxySize - 1) / kProxySize);
+            proxy[py][px] = counts[py] ? (double)sums[py][px] / (counts[py] * columns) : 0;
+        }
+    }
+
+    // Frequencies 1 to 8 of the DCT-II, across then down
+    const double pi = 3.14159265358979323846;
+    double basis[kFrequencies][kProxySize];
+    for (size_t u = 0; u < kFrequencies; u++) {
+        for (size_t x = 0; x < kProxySize; x++) {
+            basis[u][x] = std::cos((2 * x + 1) * (u + 1) * pi / (2 * kProxySize));
+        }
+    }
+    double across[kProxySize][kFrequencies];
+    for (size_t py = 0; py < kProxySize; py++) {
+        for (size_t u = 0; u < kFrequencies; u++) {
+            double sum = 0;
+            for (size_t x = 0; x < kProxySize; x++) {
+                sum += proxy[py][x] * basis[u][x];
+            }
+            across[py][u] = sum;
+        }
+    }
+    double coefficients[kFrequencies * kFrequencies];
+    double largest = 0;
+    for (size_t v = 0; v < kFrequencies; v++) {
+        for (size_t u = 0; u < kFrequencies; u++) {
+            double sum = 0;
+            for (size_t py = 0; py < kProxySize; py++) {
+                sum += across[py][u] * basis[v][py];
+            }
+            coefficients[v * kFrequencies + u] = sum;
+            largest = std::max(largest, std::fabs(sum));
+        }
+    }
+    if (largest < kMinDetail) {
+        return false;
+    }
+
+    double sorted[kFrequencies * kFrequencies];
+    std::copy(coefficients, coefficients + kFrequencies * kFrequencies, sorted);
+    std::sort(sorted, sorted + kFrequencies * kFrequencies);
+    double median = (sorted[31] + sorted[32]) / 2;
+    hash = 0;
+    for (size_t i = 0; i < kFrequencies * kFrequencies; i++) {
+        hash = (hash << 1) | (coefficients[i] > median ? 1 : 0);
+    }
+    return true;
+}
+
+int HammingDistance(uint64_t a, uint64_t b) {
+    uint64_t x = a ^ b;
+    x -= (x >> 1) & 0x5555555555555555ULL;
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int)((x * 0x0101010101010101ULL) >> 56);
+}
+
+PerceptualHashIndex::PerceptualHashIndex() : m_Chunks(0) {}
+
+uint64_t PerceptualHashIndex::Chunk(uint64_t hash, int chunk) const {
+    int first = chunk * 64 / m_Chunks, last = (chunk + 1) * 64 / m_Chunks;
+    int bits = last - first;
+    return bits == 64 ? hash : (hash >> first) & ((1ULL << bits) - 1);
+}
+
+void PerceptualHashIndex::Rebuild(int chunks) {
+    m_Chunks = chunks;
+    m_Buckets.assign(chunks, std::unordered_map<uint64_t, std::vector<uint32_t>>());
+    for (size_t i = 0; i < m_Entries.size(); i++) {
+        for (int c = 0; c < m_Chunks; c++) {
+            m_Buckets[c][Chunk(m_Entries[i].hash, c)].push_back((uint32_t)i);
+        }
+    }
+}
+
+bool PerceptualHashIndex::FindNearest(uint64_t hash, int maxDistance, uint32_t& page, int& distance) {
+    maxDistance = std::max(0, std::min(maxDistance, 63));
+    if (m_Chunks < maxDistance + 1) {
+        Rebuild(maxDistance + 1);
+    }
+
+    size_t nearest = m_Entries.size();
+    int nearestDistance = maxDistance + 1;
+    for (int c = 0; c < m_Chunks; c++) {
+        auto bucket = m_Buckets[c].find(Chunk(hash, c));
+        if (bucket == m_Buckets[c].end()) {
+            continue;
+        }
+        for (uint32_t entry : bucket->second) {
+            int d = HammingDistance(hash, m_Entries[entry].hash);
+            if (d < nearestDistance || (d == nearestDistance && d <= maxDistance && entry < nearest)) {
+                nearest = entry;
+                nearestDistance = d;
+            }
+        }
+    }
+    if (nearest == m_Entries.size()) {
+        return false;
+    }
+    page = m_Entries[nearest].page;
+    distance = nearestDistance;
+    return true;
+}
+
+void PerceptualHashIndex::Add(uint64_t hash, uint32_t page) {
+    Entry entry;
+    entry.hash = hash;
+    entry.page = page;
+    m_Entries.push_back(entry);
+    for (int c = 0; c < m_Chunks; c++) {
+        m_Buckets[c][Chunk(hash, c)].push_back((uint32_t)(m_Entries.size() - 1));
+    }
+}
+
+void PerceptualHashIndex::Clear() {
+    m_Entries.clear();
+    m_Buckets.clear();
+    m_Chunks = 0;
+}
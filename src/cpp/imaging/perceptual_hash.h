@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "bitmap.h"
+#include "strip_pipeline.h"
+
+// 64 bit pHash of a page as viewed: the signs, against their median, of
+// the 8x8 lowest frequencies but the DC row and column of the DCT of a
+// 32x32 grey proxy. Rescans of a sheet land a few bits apart.
+// False for layouts GreyRowReader cannot read and for pages too small or
+// too even to have a shape worth hashing.
+bool PerceptualHash(const DibLayout& layout, uint64_t& hash);
+
+// The same of the rows a pipeline stage makes, sampling 256 of them
+bool PerceptualHash(StripStage& page, uint64_t& hash);
+
+int HammingDistance(uint64_t a, uint64_t b);
+
+// Hashes of earlier pages, searched by splitting each into maxDistance + 1
+// chunks: a hash within maxDistance bits matches at least one chunk
+// exactly, so only the pages sharing a chunk are compared
+class PerceptualHashIndex {
+public:
+    PerceptualHashIndex();
+
+    // Nearest earlier page within maxDistance bits, the first added on a
+    // tie. False if there is none.
+    bool FindNearest(uint64_t hash, int maxDistance, uint32_t& page, int& distance);
+    void Add(uint64_t hash, uint32_t page);
+    void Clear();
+    size_t Size() const { return m_Entries.size(); }
+
+private:
+    struct Entry {
+        uint64_t hash;
+        uint32_t page;
+    };
+
+    void Rebuild(int chunks);
+    uint64_t Chunk(uint64_t hash, int chunk) const;
+
+    int m_Chunks;  // 0 until the first search
+    std::vector<Entry> m_Entries;
+    std::vector<std::unordered_map<uint64_t, std::vector<uint32_t>>> m_Buckets;  // Chunk value to entries
+};
@@ -0,0 +1,360 @@
+#include "resample.h"
+#include "parallel.h"
+#include "simd.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+const int kWeightBits = 14;
+// Samples filtered across keep this many fraction bits; Lanczos overshoot
+// of a 255 sample still fits 16 bits
+const int kFractionBits = 6;
+const size_t kBandRows = 64;
+const double kPi = 3.14159265358979323846;
+
+// Every output sample along an axis reads taps source samples from its
+// first, so the kernels never check bounds. Weight falling past an edge
+// is folded onto the edge sample.
+struct FilterTable {
+    size_t taps;
+    std::vector<int> first;
+    std::vector<int16_t> weights;  // taps per output sample
+};
+
+double Sinc(double x) {
+    if (x == 0) {
+        return 1;
+    }
+    x *= kPi;
+    return std::sin(x) / x;
+}
+
+// Pixel centres are at whole coordinates on both axes, so the output
+// covers exactly the source
+void BuildFilter(size_t inSize, size_t outSize, ResampleFilter filter, size_t tapMultiple, FilterTable& table) {
+    double scale = (double)inSize / outSize;
+    double stretch = std::max(1.0, scale);
+    bool area = filter == kResampleArea;
+    double support = !area ? 3 * stretch : scale > 1 ? scale / 2 + 0.5 : 1;
+    auto weightAt = [&](double centre, int j) {
+        double distance = j - centre;
+        if (!area) {
+            double x = distance / stretch;
+            return std::fabs(x) < 3 ? Sinc(x) * Sinc(x / 3) : 0.0;
+        }
+        if (scale > 1) {
+            double overlap = std::min(j + 0.5, centre + scale / 2) - std::max(j - 0.5, centre - scale / 2);
+            return std::max(0.0, overlap);
+        }
+        return std::max(0.0, 1 - std::fabs(distance));
+    };
+
+    int last = (int)inSize - 1;
+    size_t widest = 1;
+    for (size_t i = 0; i < outSize; i++) {
+        double centre = (i + 0.5) * scale - 0.5;
+        int lo = std::max(0, (int)std::floor(centre - support));
+        int hi = std::min(last, (int)std::ceil(centre + support));
+        widest = std::max(widest, (size_t)(hi - lo + 1));
+    }
+    table.taps = (widest + tapMultiple - 1) / tapMultiple * tapMultiple;
+    table.first.assign(outSize, 0);
+    table.weights.assign(outSize * table.taps, 0);
+
+    std::vector<double> weights;
+    for (size_t i = 0; i < outSize; i++) {
+        double centre = (i + 0.5) * scale - 0.5;
+        int from = (int)std::floor(centre - support), to = (int)std::ceil(centre + support);
+        int lo = std::max(0, from), hi = std::min(last, to);
+        weights.assign(hi - lo + 1, 0);
+        double sum = 0;
+        for (int j = from; j <= to; j++) {
+            double weight = weightAt(centre, j);
+            weights[std::min(hi, std::max(lo, j)) - lo] += weight;
+            sum += weight;
+        }
+
+        // Near the end the window slides back to stay inside the source,
+        // when the source is wide enough
+        int first = lo;
+        size_t offset = 0;
+        if (first + table.taps > inSize) {
+            offset = std::min<size_t>(first, first + table.taps - inSize);
+            first -= (int)offset;
+        }
+        table.first[i] = first;
+
+        int16_t* fixed = table.weights.data() + i * table.taps + offset;
+        int total = 0;
+        size_t largest = 0;
+        for (size_t k = 0; k < weights.size(); k++) {
+            fixed[k] = (int16_t)std::lround(weights[k] / sum * (1 << kWeightBits));
+            total += fixed[k];
+            if (std::abs(fixed[k]) > std::abs(fixed[largest])) {
+                largest = k;
+            }
+        }
+        fixed[largest] = (int16_t)(fixed[largest] + (1 << kWeightBits) - total);
+    }
+}
+
+struct BitExpandTable {
+    uint8_t value[256][8];
+
+    BitExpandTable() {
+        for (int byte = 0; byte < 256; byte++) {
+            for (int bit = 0; bit < 8; bit++) {
+                value[byte][bit] = (byte >> (7 - bit)) & 1 ? 255 : 0;
+            }
+        }
+    }
+};
+
+const BitExpandTable kBitExpand;
+
+// One row across, from width * channels samples followed by at least
+// taps * channels + 4 bytes of padding
+void FilterAcross(const uint8_t* src, const FilterTable& table, size_t channels, size_t outWidth, int16_t* out) {
+    const int shift = kWeightBits - kFractionBits;
+    const int round = 1 << (shift - 1);
+    size_t x = 0;
+#ifdef SCANNER_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi32(round);
+    if (channels == 1) {
+        // Eight taps to a multiply-add, summed across the lanes at the end
+        for (; x < outWidth; x++) {
+            const uint8_t* s = src + table.first[x];
+            const int16_t* w = table.weights.data() + x * table.taps;
+            __m128i sum = zero;
+            for (size_t t = 0; t < table.taps; t += 8) {
+                __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(s + t)), zero);
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(v, _mm_loadu_si128((const __m128i*)(w + t))));
+            }
+            sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+            sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+            out[x] = (int16_t)((_mm_cvtsi128_si32(sum) + round) >> shift);
+        }
+        return;
+    }
+    // Two pixels interleaved by channel meet a pair of taps in one
+    // multiply-add, giving all four channel sums. A 24 bit pixel is read
+    // with the next one's first byte, and written with a spare sample the
+    // next pixel overwrites.
+    for (; x < outWidth; x++) {
+        const uint8_t* s = src + table.first[x] * channels;
+        const int16_t* w = table.weights.data() + x * table.taps;
+        __m128i sum = zero;
+        for (size_t t = 0; t < table.taps; t += 2, s += 2 * channels) {
+            int32_t p0, p1;
+            memcpy(&p0, s, 4);
+            memcpy(&p1, s + channels, 4);
+            __m128i pair = _mm_unpacklo_epi8(_mm_cvtsi32_si128(p0), _mm_cvtsi32_si128(p1));
+            __m128i weights = _mm_set1_epi32((int)((uint16_t)w[t] | (uint32_t)(uint16_t)w[t + 1] << 16));
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi8(pair, zero), weights));
+        }
+        sum = _mm_srai_epi32(_mm_add_epi32(sum, rounding), shift);
+        _mm_storel_epi64((__m128i*)(out + x * channels), _mm_packs_epi32(sum, sum));
+    }
+#else
+    for (; x < outWidth; x++) {
+        const uint8_t* s = src + table.first[x] * channels;
+        const int16_t* w = table.weights.data() + x * table.taps;
+        for (size_t c = 0; c < channels; c++) {
+            int sum = 0;
+            for (size_t t = 0; t < table.taps; t++) {
+                sum += s[t * channels + c] * w[t];
+            }
+            out[x * channels + c] = (int16_t)((sum + round) >> shift);
+        }
+    }
+#endif
+}
+
+// One output row down from taps filtered rows, clamped to bytes
+void FilterDown(const int16_t* const* rows, const int16_t* weights, size_t taps, size_t count, uint8_t* out) {
+    const int shift = kWeightBits + kFractionBits;
+    const int round = 1 << (shift - 1);
+    size_t x = 0;
+#ifdef SCANNER_SSE2
+    // Rows in pairs, interleaved so one multiply-add applies both weights;
+    // an odd last row pairs with itself at weight 0
+    const __m128i rounding = _mm_set1_epi32(round);
+    for (; x + 8 <= count; x += 8) {
+        __m128i low = _mm_setzero_si128(), high = _mm_setzero_si128();
+        for (size_t t = 0; t < taps; t += 2) {
+            size_t next = std::min(t + 1, taps - 1);
+            int16_t nextWeight = t + 1 < taps ? weights[t + 1] : 0;
+            __m128i a = _mm_loadu_si128((const __m128i*)(rows[t] + x));
+            __m128i b = _mm_loadu_si128((const __m128i*)(rows[next] + x));
+            __m128i w = _mm_set1_epi32((int)((uint16_t)weights[t] | (uint32_t)(uint16_t)nextWeight << 16));
+            low = _mm_add_epi32(low, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            high = _mm_add_epi32(high, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+        low = _mm_srai_epi32(_mm_add_epi32(low, rounding), shift);
+        high = _mm_srai_epi32(_mm_add_epi32(high, rounding), shift);
+        __m128i words = _mm_packs_epi32(low, high);
+        _mm_storel_epi64((__m128i*)(out + x), _mm_packus_epi16(words, words));
+    }
+#endif
+    for (; x < count; x++) {
+        int sum = 0;
+        for (size_t t = 0; t < taps; t++) {
+            sum += rows[t][x] * weights[t];
+        }
+        out[x] = (uint8_t)std::min(255, std::max(0, (sum + round) >> shift));
+    }
+}
+
+struct ResampleJob {
+    const BYTE* src;
+    size_t srcStride;
+    size_t width;
+    size_t height;
+    int bitCount;
+    size_t channels;
+    BYTE* dst;
+    size_t dstStride;
+    size_t outWidth;
+    size_t outHeight;
+    FilterTable across;
+    FilterTable down;
+};
+
+void ResampleBand(const ResampleJob& job, size_t y0, size_t y1) {
+    size_t channels = job.channels;
+    size_t samples = job.outWidth * channels;
+    size_t filteredStride = samples + 4;
+    size_t firstRow = job.down.first[y0];
+    size_t rowCount = job.down.first[y1 - 1] + job.down.taps - firstRow;
+
+    // Across every source row the band reads
+    std::vector<uint8_t> line((job.width + job.across.taps + 8) * channels + 8, 0);
+    std::vector<int16_t> filtered(rowCount * filteredStride);
+    for (size_t r = 0; r < rowCount; r++) {
+        const BYTE* row = job.src + (firstRow + r) * job.srcStride;
+        if (job.bitCount == 1) {
+            for (size_t byte = 0; byte < (job.width + 7) / 8; byte++) {
+                memcpy(line.data() + byte * 8, kBitExpand.value[row[byte]], 8);
+            }
+            memset(line.data() + job.width, 0, 8);
+        } else {
+            memcpy(line.data(), row, job.width * channels);
+        }
+        FilterAcross(line.data(), job.across, channels, job.outWidth, filtered.data() + r * filteredStride);
+    }
+
+    // Then down
+    std::vector<const int16_t*> rows(job.down.taps);
+    std::vector<uint8_t> grey(job.bitCount == 1 ? samples : 0);
+    for (size_t y = y0; y < y1; y++) {
+        for (size_t t = 0; t < job.down.taps; t++) {
+            rows[t] = filtered.data() + (job.down.first[y] - firstRow + t) * filteredStride;
+        }
+        BYTE* out = job.dst + y * job.dstStride;
+        const int16_t* weights = job.down.weights.data() + y * job.down.taps;
+        if (job.bitCount != 1) {
+            FilterDown(rows.data(), weights, job.down.taps, samples, out);
+            memset(out + samples, 0, job.dstStride - samples);
+            continue;
+        }
+        FilterDown(rows.data(), weights, job.down.taps, samples, grey.data());
+        memset(out, 0, job.dstStride);
+        for (size_t x = 0; x < samples; x++) {
+            if (grey[x] >= 128) {
+                out[x >> 3] |= (BYTE)(0x80 >> (x & 7));
+            }
+        }
+    }
+}
+
+size_t ChannelsOf(const DibLayout& layout) {
+    const BITMAPINFOHEADER* header = layout.header;
+    if (!header || !layout.bits || header->biCompression != BI_RGB) {
+        return 0;
+    }
+    switch (header->biBitCount) {
+        case 1:
+            return 1;
+        case 24:
+            return 3;
+        case 32:
+            return 4;
+        case 8: {
+            // Only a grey ramp can be filtered by index
+            size_t entries = layout.paletteSize / sizeof(RGBQUAD);
+            const RGBQUAD* palette = (const RGBQUAD*)((const BYTE*)header + layout.headerSize);
+            if (entries != 256) {
+                return 0;
+            }
+            for (size_t i = 0; i < entries; i++) {
+                if (palette[i].rgbRed != i || palette[i].rgbGreen != i || palette[i].rgbBlue != i) {
+                    return 0;
+                }
+            }
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+}  // namespace
+
+size_t ResampledDibSize(const DibLayout& layout, size_t width, size_t height) {
+    if (width == 0 || height == 0 || ChannelsOf(layout) == 0) {
+        return 0;
+    }
+    const BITMAPINFOHEADER* header = layout.header;
+    size_t sourceHeight = (size_t)(header->biHeight < 0 ? -(long long)header->biHeight : header->biHeight);
+    if (layout.imageSize < layout.stride * sourceHeight) {
+        return 0;
+    }
+    size_t stride = ((width * header->biBitCount + 31) / 32) * 4;
+    return layout.headerSize + layout.paletteSize + stride * height;
+}
+
+bool ResampleDib(const DibLayout& layout, size_t width, size_t height, ResampleFilter filter, void* out) {
+    if (!out || ResampledDibSize(layout, width, height) == 0) {
+        return false;
+    }
+
+    const BITMAPINFOHEADER* header = layout.header;
+    bool bottomUp = header->biHeight > 0;
+    ResampleJob job;
+    job.src = layout.bits;
+    job.srcStride = layout.stride;
+    job.width = (size_t)header->biWidth;
+    job.height = (size_t)(bottomUp ? header->biHeight : -(long long)header->biHeight);
+    job.bitCount = header->biBitCount;
+    job.channels = ChannelsOf(layout);
+    job.outWidth = width;
+    job.outHeight = height;
+    job.dstStride = ((width * job.bitCount + 31) / 32) * 4;
+    // Rows are filtered in storage order; the filters are symmetric, so
+    // bottom-up pages come out the same as top-down ones
+    BuildFilter(job.width, width, filter, job.channels == 1 ? 8 : 2, job.across);
+    BuildFilter(job.height, height, filter, 1, job.down);
+
+    BYTE* dib = (BYTE*)out;
+    memcpy(dib, header, layout.headerSize + layout.paletteSize);
+    BITMAPINFOHEADER* scaled = (BITMAPINFOHEADER*)dib;
+    scaled->biWidth = (LONG)width;
+    scaled->biHeight = bottomUp ? (LONG)height : -(LONG)height;
+    scaled->biSizeImage = (DWORD)(job.dstStride * height);
+    scaled->biXPelsPerMeter = (LONG)std::lround((double)header->biXPelsPerMeter * width / job.width);
+    scaled->biYPelsPerMeter = (LONG)std::lround((double)header->biYPelsPerMeter * height / job.height);
+    job.dst = dib + layout.headerSize + layout.paletteSize;
+
+    size_t bands = (height + kBandRows - 1) / kBandRows;
+    ParallelFor(bands, 1, [&job](size_t begin, size_t end) {
+        for (size_t band = begin; band < end; band++) {
+            ResampleBand(job, band * kBandRows, std::min(job.outHeight, (band + 1) * kBandRows));
+        }
+    });
+    return true;
+}
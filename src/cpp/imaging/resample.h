@@ -0,0 +1,26 @@
+#pragma once
+#include "bitmap.h"
+
+enum ResampleFilter {
+    kResampleLanczos,  // Lanczos-3, widened to the source footprint when shrinking
+    kResampleArea      // Mean of the source area each pixel covers; linear when enlarging
+};
+
+struct ResampleOptions {
+    double dpi;              // Resolution pages are brought to, 0 to leave them as scanned
+    ResampleFilter filter;
+
+    ResampleOptions() : dpi(0), filter(kResampleLanczos) {}
+};
+
+// Bytes the DIB needs at width x height pixels, 0 for formats that cannot
+// be resampled: 1 bit, 8 bit grey, 24 and 32 bit BI_RGB
+size_t ResampledDibSize(const DibLayout& layout, size_t width, size_t height);
+
+// Scales the DIB into out, which must hold ResampledDibSize bytes and not
+// overlap the source. Separable, with 14 bit fixed-point coefficients
+// worked out once per axis: each band of output rows filters the source
+// rows it needs across, then down in SSE2, on the ParallelFor pool.
+// Bitonal pages are filtered as grey and thresholded back. The header
+// resolutions scale with the size.
+bool ResampleDib(const DibLayout& layout, size_t width, size_t height, ResampleFilter filter, void* out);
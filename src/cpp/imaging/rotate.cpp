@@ -0,0 +1,328 @@
+#include "rotate.h"
+#include "parallel.h"
+#include "simd.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+// A quarter turn makes each band of source columns a band of output rows.
+// Bands are filled in square blocks walking down the source, so the rows
+// of one band being written stay in L1 and each source line read is used
+// whole. Bands of 8 bit pages are a cache line of source wide.
+const size_t kBlock = 16;
+const size_t kBandPixels8 = 64;
+const size_t kBandPixels = 32;
+const size_t kHalfTurnRows = 64;
+
+struct TurnJob {
+    const BYTE* src;
+    size_t srcStride;
+    size_t width;         // Of the source
+    size_t height;
+    BYTE* dst;
+    size_t dstStride;
+    size_t dstRowBytes;   // Pixel bytes of an output row, the rest is padding
+
+    // Output row r is source column width - 1 - r and output column c is
+    // source row c; otherwise row r is column r and column c is source
+    // row height - 1 - c. Which one a turn is depends on the row order.
+    bool columnsReversed;
+
+    const BYTE* SourceRowFor(size_t column) const {
+        return src + (columnsReversed ? column : height - 1 - column) * srcStride;
+    }
+    BYTE* OutputRowFor(size_t sourceColumn) const {
+        return dst + (columnsReversed ? width - 1 - sourceColumn : sourceColumn) * dstStride;
+    }
+};
+
+struct BitReverseTable {
+    BYTE value[256];
+
+    BitReverseTable() {
+        for (int i = 0; i < 256; i++) {
+            int reversed = 0;
+            for (int bit = 0; bit < 8; bit++) {
+                reversed |= ((i >> bit) & 1) << (7 - bit);
+            }
+            value[i] = (BYTE)reversed;
+        }
+    }
+};
+
+const BitReverseTable kBitReverse;
+
+// Output row j of a block gets pixel j of every source row in it
+template <int kPixelBytes>
+inline void TransposeEdge(const BYTE* const* from, size_t offset, BYTE* const* to, size_t rows, size_t columns) {
+    for (size_t j = 0; j < columns; j++) {
+        BYTE* out = to[j];
+        for (size_t k = 0; k < rows; k++, out += kPixelBytes) {
+            memcpy(out, from[k] + offset + j * kPixelBytes, kPixelBytes);
+        }
+    }
+}
+
+template <int kPixelBytes>
+inline void TransposeBlock(const BYTE* const* from, size_t offset, BYTE* const* to) {
+    TransposeEdge<kPixelBytes>(from, offset, to, kBlock, kBlock);
+}
+
+#ifdef SCANNER_SSE2
+// Four rounds of interleaving rows i and i + 8 leave the registers holding
+// the columns, provided the rows went in in bit-reversed order
+template <>
+inline void TransposeBlock<1>(const BYTE* const* from, size_t offset, BYTE* const* to) {
+    static const int kOrder[16] = { 0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15 };
+    __m128i a[16], b[16];
+    for (int i = 0; i < 16; i++) {
+        a[i] = _mm_loadu_si128((const __m128i*)(from[kOrder[i]] + offset));
+    }
+    for (int i = 0; i < 8; i++) {
+        b[2 * i] = _mm_unpacklo_epi8(a[i], a[i + 8]);
+        b[2 * i + 1] = _mm_unpackhi_epi8(a[i], a[i + 8]);
+    }
+    for (int i = 0; i < 8; i++) {
+        a[2 * i] = _mm_unpacklo_epi16(b[i], b[i + 8]);
+        a[2 * i + 1] = _mm_unpackhi_epi16(b[i], b[i + 8]);
+    }
+    for (int i = 0; i < 8; i++) {
+        b[2 * i] = _mm_unpacklo_epi32(a[i], a[i + 8]);
+        b[2 * i + 1] = _mm_unpackhi_epi32(a[i], a[i + 8]);
+    }
+    for (int i = 0; i < 8; i++) {
+        _mm_storeu_si128((__m128i*)to[2 * i], _mm_unpacklo_epi64(b[i], b[i + 8]));
+        _mm_storeu_si128((__m128i*)to[2 * i + 1], _mm_unpackhi_epi64(b[i], b[i + 8]));
+    }
+}
+
+// The usual 4x4 transpose of 32 bit lanes, over each square of the block
+template <>
+inline void TransposeBlock<4>(const BYTE* const* from, size_t offset, BYTE* const* to) {
+    for (size_t row = 0; row < kBlock; row += 4) {
+        for (size_t column = 0; column < kBlock; column += 4) {
+            size_t at = offset + column * 4;
+            __m128i r0 = _mm_loadu_si128((const __m128i*)(from[row] + at));
+            __m128i r1 = _mm_loadu_si128((const __m128i*)(from[row + 1] + at));
+            __m128i r2 = _mm_loadu_si128((const __m128i*)(from[row + 2] + at));
+            __m128i r3 = _mm_loadu_si128((const __m128i*)(from[row + 3] + at));
+            __m128i t0 = _mm_unpacklo_epi32(r0, r1), t1 = _mm_unpackhi_epi32(r0, r1);
+            __m128i t2 = _mm_unpacklo_epi32(r2, r3), t3 = _mm_unpackhi_epi32(r2, r3);
+            _mm_storeu_si128((__m128i*)(to[column] + row * 4), _mm_unpacklo_epi64(t0, t2));
+            _mm_storeu_si128((__m128i*)(to[column + 1] + row * 4), _mm_unpackhi_epi64(t0, t2));
+            _mm_storeu_si128((__m128i*)(to[column + 2] + row * 4), _mm_unpacklo_epi64(t1, t3));
+            _mm_storeu_si128((__m128i*)(to[column + 3] + row * 4), _mm_unpackhi_epi64(t1, t3));
+        }
+    }
+}
+#endif
+
+template <int kPixelBytes>
+void TurnBand(const TurnJob& job, size_t x0, size_t x1) {
+    const BYTE* from[kBlock];
+    BYTE* to[kBlock];
+    for (size_t c0 = 0; c0 < job.height; c0 += kBlock) {
+        size_t rows = std::min(kBlock, job.height - c0);
+        for (size_t k = 0; k < rows; k++) {
+            from[k] = job.SourceRowFor(c0 + k);
+        }
+        for (size_t x = x0; x < x1; x += kBlock) {
+            size_t columns = std::min(kBlock, x1 - x);
+            for (size_t j = 0; j < columns; j++) {
+                to[j] = job.OutputRowFor(x + j) + c0 * kPixelBytes;
+            }
+            if (rows == kBlock && columns == kBlock) {
+                TransposeBlock<kPixelBytes>(from, x * kPixelBytes, to);
+            } else {
+                TransposeEdge<kPixelBytes>(from, x * kPixelBytes, to, rows, columns);
+            }
+        }
+    }
+}
+
+// Rows of an 8x8 bit square one per byte, first row in the top byte and
+// first pixel in the top bit of each, become its columns
+inline uint64_t TransposeBits(uint64_t x) {
+    uint64_t t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAull;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCull;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ull;
+    return x ^ t ^ (t << 28);
+}
+
+// Bitonal bands step over the source a byte column and eight rows at a
+// time. Rows past the end become the zero padding of the last output byte.
+void TurnBitBand(const TurnJob& job, size_t x0, size_t x1) {
+    const BYTE* from[8];
+    for (size_t c0 = 0; c0 < job.height; c0 += 8) {
+        size_t rows = std::min<size_t>(8, job.height - c0);
+        for (size_t k = 0; k < rows; k++) {
+            from[k] = job.SourceRowFor(c0 + k);
+        }
+        size_t outByte = c0 / 8;
+        for (size_t x = x0; x < x1; x += 8) {
+            uint64_t bits = 0;
+            for (size_t k = 0; k < rows; k++) {
+                bits |= (uint64_t)from[k][x >> 3] << (56 - 8 * k);
+            }
+            bits = TransposeBits(bits);
+            size_t columns = std::min<size_t>(8, x1 - x);
+            for (size_t j = 0; j < columns; j++) {
+                job.OutputRowFor(x + j)[outByte] = (BYTE)(bits >> (56 - 8 * j));
+            }
+        }
+    }
+}
+
+template <int kPixelBytes>
+void ReverseRow(const BYTE* from, BYTE* to, size_t width) {
+    for (size_t x = 0; x < width; x++) {
+        memcpy(to + x * kPixelBytes, from + (width - 1 - x) * kPixelBytes, kPixelBytes);
+    }
+}
+
+#ifdef SCANNER_SSE2
+template <>
+void ReverseRow<1>(const BYTE* from, BYTE* to, size_t width) {
+    size_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(from + width - x - 16));
+        v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i*)(to + x), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+    for (; x < width; x++) {
+        to[x] = from[width - 1 - x];
+    }
+}
+
+template <>
+void ReverseRow<4>(const BYTE* from, BYTE* to, size_t width) {
+    size_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(from + (width - x - 4) * 4));
+        _mm_storeu_si128((__m128i*)(to + x * 4), _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+    }
+    for (; x < width; x++) {
+        memcpy(to + x * 4, from + (width - 1 - x) * 4, 4);
+    }
+}
+#endif
+
+// Reversing the bytes and their bits leaves the padding of the last byte
+// in front; the row is shifted back over it
+void ReverseBitRow(const BYTE* from, BYTE* to, size_t width) {
+    size_t rowBytes = (width + 7) / 8;
+    int pad = (int)(rowBytes * 8 - width);
+    for (size_t i = 0; i < rowBytes; i++) {
+        unsigned next = i + 1 < rowBytes ? kBitReverse.value[from[rowBytes - 2 - i]] : 0;
+        unsigned word = (unsigned)kBitReverse.value[from[rowBytes - 1 - i]] << 8 | next;
+        to[i] = (BYTE)(word >> (8 - pad));
+    }
+}
+
+typedef void (*TurnBandFn)(const TurnJob& job, size_t x0, size_t x1);
+typedef void (*ReverseRowFn)(const BYTE* from, BYTE* to, size_t width);
+
+void TurnPixels(const TurnJob& job, int bitCount) {
+    TurnBandFn turnBand = bitCount == 1 ? TurnBitBand
+        : bitCount == 8 ? TurnBand<1>
+        : bitCount == 16 ? TurnBand<2>
+        : bitCount == 24 ? TurnBand<3> : TurnBand<4>;
+    size_t bandPixels = bitCount == 8 ? kBandPixels8 : kBandPixels;
+    size_t bands = (job.width + bandPixels - 1) / bandPixels;
+    ParallelFor(bands, 1, [&job, turnBand, bandPixels](size_t begin, size_t end) {
+        for (size_t band = begin; band < end; band++) {
+            size_t x0 = band * bandPixels, x1 = std::min(job.width, x0 + bandPixels);
+            turnBand(job, x0, x1);
+            for (size_t x = x0; x < x1; x++) {
+                BYTE* row = job.OutputRowFor(x);
+                memset(row + job.dstRowBytes, 0, job.dstStride - job.dstRowBytes);
+            }
+        }
+    });
+}
+
+void HalfTurnPixels(const TurnJob& job, int bitCount) {
+    ReverseRowFn reverseRow = bitCount == 1 ? ReverseBitRow
+        : bitCount == 8 ? ReverseRow<1>
+        : bitCount == 16 ? ReverseRow<2>
+        : bitCount == 24 ? ReverseRow<3> : ReverseRow<4>;
+    ParallelFor(job.height, kHalfTurnRows, [&job, reverseRow](size_t begin, size_t end) {
+        for (size_t y = begin; y < end; y++) {
+            BYTE* row = job.dst + y * job.dstStride;
+            reverseRow(job.src + (job.height - 1 - y) * job.srcStride, row, job.width);
+            memset(row + job.dstRowBytes, 0, job.dstStride - job.dstRowBytes);
+        }
+    });
+}
+
+}  // namespace
+
+size_t RotatedDibSize(const DibLayout& layout, int degrees) {
+    const BITMAPINFOHEADER* header = layout.header;
+    if (!header || !layout.bits || (degrees != 90 && degrees != 180 && degrees != 270)) {
+        return 0;
+    }
+    int bitCount = header->biBitCount;
+    bool bitfields = header->biCompression == BI_BITFIELDS && (bitCount == 16 || bitCount == 32);
+    if ((header->biCompression != BI_RGB && !bitfields) ||
+        (bitCount != 1 && bitCount != 8 && bitCount != 16 && bitCount != 24 && bitCount != 32)) {
+        return 0;
+    }
+
+    size_t width = (size_t)header->biWidth;
+    size_t height = (size_t)(header->biHeight < 0 ? -(long long)header->biHeight : header->biHeight);
+    if (layout.imageSize < layout.stride * height) {
+        return 0;
+    }
+    size_t outWidth = degrees == 180 ? width : height, outHeight = degrees == 180 ? height : width;
+    size_t outStride = ((outWidth * bitCount + 31) / 32) * 4;
+    return layout.headerSize + layout.paletteSize + outStride * outHeight;
+}
+
+bool RotateDib(const DibLayout& layout, int degrees, void* out) {
+    if (!out || RotatedDibSize(layout, degrees) == 0) {
+        return false;
+    }
+
+    const BITMAPINFOHEADER* header = layout.header;
+    int bitCount = header->biBitCount;
+    bool bottomUp = header->biHeight > 0;
+    TurnJob job;
+    job.src = layout.bits;
+    job.srcStride = layout.stride;
+    job.width = (size_t)header->biWidth;
+    job.height = (size_t)(bottomUp ? header->biHeight : -(long long)header->biHeight);
+
+    bool quarter = degrees != 180;
+    size_t outWidth = quarter ? job.height : job.width, outHeight = quarter ? job.width : job.height;
+    job.dstStride = ((outWidth * bitCount + 31) / 32) * 4;
+    job.dstRowBytes = (outWidth * bitCount + 7) / 8;
+    // Clockwise as viewed goes down the source columns of rows stored
+    // bottom-up, and up them when stored top-down
+    job.columnsReversed = (degrees == 90) == bottomUp;
+
+    // Header, masks and colour table carry over
+    BYTE* dib = (BYTE*)out;
+    memcpy(dib, header, layout.headerSize + layout.paletteSize);
+    BITMAPINFOHEADER* turned = (BITMAPINFOHEADER*)dib;
+    if (quarter) {
+        turned->biWidth = (LONG)outWidth;
+        turned->biHeight = bottomUp ? (LONG)outHeight : -(LONG)outHeight;
+        std::swap(turned->biXPelsPerMeter, turned->biYPelsPerMeter);
+    }
+    turned->biSizeImage = (DWORD)(job.dstStride * outHeight);
+    job.dst = dib + layout.headerSize + layout.paletteSize;
+
+    if (quarter) {
+        TurnPixels(job, bitCount);
+    } else {
+        HalfTurnPixels(job, bitCount);
+    }
+    return true;
+}
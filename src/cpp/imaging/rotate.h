@@ -0,0 +1,16 @@
+#pragma once
+#include "bitmap.h"
+
+// Lossless quarter and half turns of uncompressed 1, 8, 16, 24 and 32 bit
+// DIBs. Degrees are clockwise as the page is viewed: 90, 180 or 270.
+
+// Bytes the DIB needs once turned, 0 for other angles and for formats
+// that cannot be turned
+size_t RotatedDibSize(const DibLayout& layout, int degrees);
+
+// Writes the turned DIB into out, which must hold RotatedDibSize bytes
+// and not overlap the source. Quarter turns swap the width, height and
+// resolutions and keep the row order; they are copied in blocks transposed
+// in SSE2 registers, a band of output rows at a time across the
+// ParallelFor pool. Half turns reverse each row.
+bool RotateDib(const DibLayout& layout, int degrees, void* out);
@@ -0,0 +1,8 @@
+#pragma once
+
+// SSE2 is the baseline on x64 and on the ia32 Electron build (MSVC's
+// default /arch:SSE2); other targets take the scalar paths
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SCANNER_SSE2 1
+#include <emmintrin.h>
+#endif
@@ -0,0 +1,222 @@
+#include "strip_pipeline.h"
+#include "base64.h"
+#include "page_hash.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// Rows per strip fill about half a typical L2, leaving room for the
+// stages' windows and the encoded text
+const size_t kStripBytes = 256 * 1024;
+
+// Base64 of a stream fed in pieces of any size, into text sized up front
+class Base64Stream {
+public:
+    explicit Base64Stream(char* out) : m_Out(out), m_Carried(0) {}
+
+    void Add(const BYTE* data, size_t size) {
+        while (m_Carried && size) {
+            m_Carry[m_Carried++] = *data++;
+            size--;
+            if (m_Carried == 3) {
+                EncodeBase64Groups(m_Carry, 3, m_Out);
+                m_Out += 4;
+                m_Carried = 0;
+            }
+        }
+        size_t whole = size - size % 3;
+        EncodeBase64Groups(data, whole, m_Out);
+        m_Out += whole / 3 * 4;
+        memcpy(m_Carry, data + whole, size - whole);
+        m_Carried = size - whole;
+    }
+
+    void Finish() {
+        if (m_Carried) {
+            std::string tail;
+            EncodeBase64(m_Carry, m_Carried, tail);
+            memcpy(m_Out, tail.data(), tail.size());
+        }
+    }
+
+private:
+    char* m_Out;
+    BYTE m_Carry[3];
+    size_t m_Carried;
+};
+
+}  // namespace
+
+DibLayout StripFormat::View(const BYTE* rows, size_t pitch) const {
+    DibLayout layout;
+    layout.header = (const BITMAPINFOHEADER*)head.data();
+    layout.headerSize = head.empty() ? 0 : layout.header->biSize;
+    if (!head.empty() && layout.header->biCompression == BI_BITFIELDS && layout.headerSize == sizeof(BITMAPINFOHEADER)) {
+        layout.headerSize += 3 * sizeof(DWORD);
+    }
+    layout.paletteSize = head.size() - layout.headerSize;
+    layout.stride = pitch;
+    layout.imageSize = pitch * height;
+    layout.bits = rows;
+    return layout;
+}
+
+bool HasGreyRamp(const StripFormat& format) {
+    if (format.bitCount != 8 || format.head.size() < sizeof(BITMAPINFOHEADER)) {
+        return false;
+    }
+    const BITMAPINFOHEADER* header = (const BITMAPINFOHEADER*)format.head.data();
+    if (header->biCompression != BI_RGB || format.head.size() < header->biSize + 256 * sizeof(RGBQUAD)) {
+        return false;
+    }
+    const RGBQUAD* palette = (const RGBQUAD*)(format.head.data() + header->biSize);
+    for (int i = 0; i < 256; i++) {
+        if (palette[i].rgbRed != i || palette[i].rgbGreen != i || palette[i].rgbBlue != i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+DibStripSource::DibStripSource() : m_First(nullptr), m_Pitch(0) {}
+
+bool DibStripSource::Open(const DibLayout& layout, const CropRect* crop) {
+    const BITMAPINFOHEADER* header = layout.header;
+    if (!header || !layout.bits || (header->biCompression != BI_RGB && header->biCompression != BI_BITFIELDS)) {
+        return false;
+    }
+    size_t width = (size_t)header->biWidth;
+    size_t height = (size_t)(header->biHeight < 0 ? -(long long)header->biHeight : header->biHeight);
+    if (layout.imageSize < layout.stride * height) {
+        return false;
+    }
+
+    // No crop, or an empty one, keeps the whole page
+    CropRect rect(0, 0, (uint32_t)width, (uint32_t)height);
+    if (crop && crop->width && crop->height) {
+        rect = *crop;
+    }
+    WORD bitCount = header->biBitCount;
+    if (rect.left + (size_t)rect.width > width || rect.top + (size_t)rect.height > height ||
+        ((size_t)rect.left * bitCount) % 8 != 0) {
+        return false;
+    }
+
+    m_Format.width = rect.width;
+    m_Format.height = rect.height;
+    m_Format.bitCount = bitCount;
+    m_Format.bottomUp = header->biHeight > 0;
+    m_Format.rowBytes = ((size_t)rect.width * bitCount + 7) / 8;
+    m_Format.stride = (((size_t)rect.width * bitCount + 31) / 32) * 4;
+    const BYTE* head = (const BYTE*)header;
+    m_Format.head.assign(head, head + layout.headerSize + layout.paletteSize);
+    BITMAPINFOHEADER* cropped = (BITMAPINFOHEADER*)m_Format.head.data();
+    cropped->biWidth = (LONG)rect.width;
+    cropped->biHeight = m_Format.bottomUp ? (LONG)rect.height : -(LONG)rect.height;
+    cropped->biSizeImage = (DWORD)(m_Format.stride * rect.height);
+
+    size_t firstRow = m_Format.bottomUp ? height - rect.top - rect.height : rect.top;
+    m_Pitch = layout.stride;
+    m_First = layout.bits + firstRow * m_Pitch + (size_t)rect.left * bitCount / 8;
+    return true;
+}
+
+const BYTE* DibStripSource::Rows(size_t first, size_t count, size_t& pitch) {
+    (void)count;
+    pitch = m_Pitch;
+    return m_First + first * m_Pitch;
+}
+
+WindowedStripStage::WindowedStripStage(StripStage& input) : m_Input(input), m_First(0), m_Count(0) {}
+
+const BYTE* WindowedStripStage::Rows(size_t first, size_t count, size_t& pitch) {
+    const size_t stride = m_Format.stride;
+    pitch = stride;
+    size_t last = first + count;
+    if (first >= m_First && last <= m_First + m_Count) {
+        return m_Rows.data() + (first - m_First) * stride;
+    }
+
+    // Rows already made at the start of the request move to the front
+    size_t made = first;
+    if (first >= m_First && first < m_First + m_Count) {
+        made = m_First + m_Count;
+        memmove(m_Rows.data(), m_Rows.data() + (first - m_First) * stride, (made - first) * stride);
+    }
+    if (m_Rows.size() < count * stride) {
+        m_Rows.resize(count * stride);
+    }
+    size_t inFirst = 0, inLast = 0, inPitch = 0;
+    InputSpan(made, last, inFirst, inLast);
+    const BYTE* input = m_Input.Rows(inFirst, inLast - inFirst, inPitch);
+    Make(input, inPitch, inFirst, made, last, m_Rows.data() + (made - first) * stride);
+    m_First = first;
+    m_Count = count;
+    return m_Rows.data();
+}
+
+void WriteBmpStrips(StripStage& page, std::vector<BYTE>* bmp, std::string* text,
+    PageHasher* pixels, PageHasher* file) {
+    const StripFormat& format = page.Format();
+    size_t headBytes = sizeof(BITMAPFILEHEADER) + format.head.size();
+    size_t total = headBytes + format.stride * format.height;
+
+    std::vector<BYTE> head(headBytes);
+    BITMAPFILEHEADER fileHeader;
+    memset(&fileHeader, 0, sizeof(BITMAPFILEHEADER));
+    fileHeader.bfType = 0x4D42; // "BM"
+    fileHeader.bfSize = (DWORD)total;
+    fileHeader.bfOffBits = (DWORD)headBytes;
+    memcpy(head.data(), &fileHeader, sizeof(BITMAPFILEHEADER));
+    memcpy(head.data() + sizeof(BITMAPFILEHEADER), format.head.data(), format.head.size());
+    if (file) {
+        file->Update(head.data(), headBytes);
+    }
+
+    // Strips are packed straight into the .bmp, or into one buffer that is
+    // encoded while it is still in cache
+    std::vector<BYTE> strip;
+    if (bmp) {
+        bmp->resize(total);
+        memcpy(bmp->data(), head.data(), headBytes);
+    } else {
+        text->resize((total + 2) / 3 * 4);
+    }
+    Base64Stream base64(bmp ? nullptr : &(*text)[0]);
+    if (!bmp) {
+        base64.Add(head.data(), headBytes);
+    }
+
+    size_t stripRows = std::max<size_t>(1, kStripBytes / std::max<size_t>(1, format.stride));
+    size_t padding = format.stride - format.rowBytes;
+    for (size_t y = 0; y < format.height; y += stripRows) {
+        size_t rows = std::min(stripRows, format.height - y);
+        size_t pitch = 0;
+        const BYTE* from = page.Rows(y, rows, pitch);
+        BYTE* to;
+        if (bmp) {
+            to = bmp->data() + headBytes + y * format.stride;
+        } else {
+            strip.resize(rows * format.stride);
+            to = strip.data();
+        }
+        for (size_t row = 0; row < rows; row++) {
+            BYTE* packed = to + row * format.stride;
+            memcpy(packed, from + row * pitch, format.rowBytes);
+            memset(packed + format.rowBytes, 0, padding);
+            if (pixels) {
+                pixels->Update(packed, format.rowBytes);
+            }
+        }
+        if (file) {
+            file->Update(to, rows * format.stride);
+        }
+        if (!bmp) {
+            base64.Add(to, rows * format.stride);
+        }
+    }
+    if (!bmp) {
+        base64.Finish();
+    }
+}
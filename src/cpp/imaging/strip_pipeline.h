@@ -0,0 +1,98 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "auto_crop.h"
+#include "bitmap.h"
+
+class PageHasher;
+
+// The rows one stage of a strip pipeline makes: what a packed DIB of them
+// would start with (header, BI_BITFIELDS masks and colour table, sized
+// for these rows) and their geometry
+struct StripFormat {
+    std::vector<BYTE> head;
+    size_t width;
+    size_t height;
+    WORD bitCount;
+    bool bottomUp;
+    size_t rowBytes;  // Pixel bytes of a row
+    size_t stride;    // Row bytes padded to 4, as the rows are packed
+
+    StripFormat() : width(0), height(0), bitCount(0), bottomUp(true), rowBytes(0), stride(0) {}
+
+    // A layout of the whole page over rows pitch bytes apart, for the
+    // DibLayout readers that only touch the pixel bytes of each row
+    DibLayout View(const BYTE* rows, size_t pitch) const;
+};
+
+// Whether the rows are 8 bit with a plain grey ramp for a colour table,
+// so each byte is its grey level
+bool HasGreyRamp(const StripFormat& format);
+
+// A stage of the pipeline that carries a transferred page to its encoded
+// file a strip of rows at a time, so that each row is read from memory
+// once and stays in cache through every stage. Rows are numbered in
+// storage order and are cheapest asked for in increasing order.
+class StripStage {
+public:
+    virtual ~StripStage() {}
+
+    const StripFormat& Format() const { return m_Format; }
+
+    // Rows [first, first + count), pitch bytes apart, valid until the next call
+    virtual const BYTE* Rows(size_t first, size_t count, size_t& pitch) = 0;
+
+protected:
+    StripFormat m_Format;
+};
+
+// Rows straight out of a DIB, seen through a crop window when given one:
+// the crop costs nothing until the rows are read
+class DibStripSource : public StripStage {
+public:
+    DibStripSource();
+
+    // False for compressed pages and for a crop off the page or not
+    // starting on a whole byte. The DIB must outlive the stage.
+    bool Open(const DibLayout& layout, const CropRect* crop = nullptr);
+
+    const BYTE* Rows(size_t first, size_t count, size_t& pitch);
+
+    // The page as cropped, in place
+    DibLayout View() const { return m_Format.View(m_First, m_Pitch); }
+
+private:
+    const BYTE* m_First;  // First stored row kept, at the crop's left edge
+    size_t m_Pitch;
+};
+
+// Base of the stages that make each row from a window of the input's:
+// the rows made last are kept, so overlapping requests make each row once
+class WindowedStripStage : public StripStage {
+public:
+    const BYTE* Rows(size_t first, size_t count, size_t& pitch);
+
+protected:
+    explicit WindowedStripStage(StripStage& input);
+
+    // Input rows [inFirst, inLast) that output rows [first, last) are made from
+    virtual void InputSpan(size_t first, size_t last, size_t& inFirst, size_t& inLast) const = 0;
+
+    // Makes output rows [first, last) into out, Format().stride apart, from
+    // input rows pitch apart starting with row inFirst
+    virtual void Make(const BYTE* input, size_t pitch, size_t inFirst, size_t first, size_t last, BYTE* out) = 0;
+
+    StripStage& m_Input;
+
+private:
+    std::vector<BYTE> m_Rows;
+    size_t m_First;
+    size_t m_Count;
+};
+
+// The pipeline's sink: packs the rows a strip of about 256 KiB at a time
+// behind a BITMAPFILEHEADER into bmp, or Base64 encodes each strip into
+// text as it is packed so the .bmp never exists whole. Exactly one of bmp
+// and text is given; hashers are fed as AssembleBmp feeds them.
+void WriteBmpStrips(StripStage& page, std::vector<BYTE>* bmp, std::string* text,
+    PageHasher* pixels = nullptr, PageHasher* file = nullptr);
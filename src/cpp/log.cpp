@@ -0,0 +1,376 @@
+#include "log.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+std::atomic<int> Logger::s_Level(kLogInfo);
+
+namespace {
+
+const char* const kLevelNames[kLogOff + 1] = { "debug", "info", "warn", "error", "off" };
+
+struct RingSlot {
+    LogLevel level;
+    uint64_t sequence;
+    uint64_t timeMs;
+    int64_t deviceId;
+    int32_t page;
+    int32_t rc;
+    size_t length;
+    char message[Logger::kMaxMessage];
+};
+
+// Single producer (the owning thread), single consumer (whoever holds
+// g_DrainMutex). head and tail only grow; a slot is index % kRingRecords.
+struct ThreadRing {
+    uint32_t thread;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> dropped;
+    std::atomic<bool> retired;  // Set once the owning thread has exited
+    RingSlot slots[Logger::kRingRecords];
+
+    explicit ThreadRing(uint32_t id) : thread(id), head(0), tail(0), dropped(0), retired(false) {}
+};
+
+// Retires the thread's ring when the thread exits; the next drain
+// delivers what is left in it and frees it
+struct RingOwner {
+    ThreadRing* ring;
+
+    RingOwner() : ring(nullptr) {}
+    ~RingOwner() {
+        if (ring) {
+            ring->retired.store(true, std::memory_order_release);
+            ring = nullptr;
+        }
+    }
+};
+
+std::mutex g_RegistryMutex;
+std::vector<std::unique_ptr<ThreadRing>> g_Rings;
+uint32_t g_NextThread = 1;
+thread_local RingOwner t_Ring;
+
+std::atomic<uint64_t> g_Sequence(0);
+
+// Sinks and the file are only touched while draining or under this lock
+std::mutex g_DrainMutex;
+Logger::Options g_Options;
+Logger::Sink g_Sink;
+FILE* g_File = nullptr;
+uint64_t g_FileBytes = 0;
+
+// Flusher thread
+std::mutex g_ControlMutex;
+std::condition_variable g_Wake;
+std::thread* g_Flusher = nullptr;
+std::atomic<bool> g_FlusherRunning(false);
+std::atomic<bool> g_ShutDown(false);
+bool g_StopRequested = false;
+
+const int kFlushIntervalMs = 20;
+
+ThreadRing* LocalRing() {
+    if (!t_Ring.ring) {
+        std::lock_guard<std::mutex> lock(g_RegistryMutex);
+        g_Rings.emplace_back(new ThreadRing(g_NextThread++));
+        t_Ring.ring = g_Rings.back().get();
+    }
+    return t_Ring.ring;
+}
+
+uint64_t NowMs() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::string FormatLine(const LogRecord& record) {
+    time_t seconds = (time_t)(record.timeMs / 1000);
+    struct tm utc;
+#ifdef _WIN32
+    gmtime_s(&utc, &seconds);
+#else
+    gmtime_r(&seconds, &utc);
+#endif
+    char prefix[96];
+    size_t length = strftime(prefix, sizeof(prefix), "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(prefix + length, sizeof(prefix) - length, ".%03uZ %-5s [%u]",
+        (unsigned)(record.timeMs % 1000), LogLevelName(record.level), record.thread);
+
+    std::string line = prefix;
+    char field[32];
+    if (record.deviceId != LogRecord::kNone) {
+        snprintf(field, sizeof(field), " device=%lld", (long long)record.deviceId);
+        line += field;
+    }
+    if (record.page != LogRecord::kNone) {
+        snprintf(field, sizeof(field), " page=%d", record.page);
+        line += field;
+    }
+    if (record.rc != LogRecord::kNone) {
+        snprintf(field, sizeof(field), " rc=%d", record.rc);
+        line += field;
+    }
+    line += ' ';
+    line += record.message;
+    line += '\n';
+    return line;
+}
+
+void CloseFile() {
+    if (g_File) {
+        fclose(g_File);
+        g_File = nullptr;
+    }
+}
+
+bool OpenFile(const std::string& path) {
+    g_File = fopen(path.c_str(), "ab");
+    if (!g_File) {
+        return false;
+    }
+    fseek(g_File, 0, SEEK_END);
+    long size = ftell(g_File);
+    g_FileBytes = size > 0 ? (uint64_t)size : 0;
+    return true;
+}
+
+// path -> path.1 -> ... -> path.N, dropping the oldest
+void RotateFile() {
+    CloseFile();
+    const std::string& path = g_Options.filePath;
+    if (g_Options.maxFiles == 0) {
+        remove(path.c_str());
+    } else {
+        remove((path + "." + std::to_string(g_Options.maxFiles)).c_str());
+        for (uint32_t i = g_Options.maxFiles; i > 1; i--) {
+            rename((path + "." + std::to_string(i - 1)).c_str(), (path + "." + std::to_string(i)).c_str());
+        }
+        rename(path.c_str(), (path + ".1").c_str());
+    }
+    OpenFile(path);
+}
+
+void Deliver(const std::vector<LogRecord>& records) {
+    if (g_Options.console || g_File) {
+        for (const LogRecord& record : records) {
+            std::string line = FormatLine(record);
+            if (g_Options.console) {
+                fputs(line.c_str(), stdout);
+            }
+            if (g_File) {
+                if (g_Options.maxFileBytes && g_FileBytes > 0 && g_FileBytes + line.size() > g_Options.maxFileBytes) {
+                    RotateFile();
+                }
+                if (g_File) {
+                    fwrite(line.data(), 1, line.size(), g_File);
+                    g_FileBytes += line.size();
+                }
+            }
+        }
+        if (g_Options.console) {
+            fflush(stdout);
+        }
+        if (g_File) {
+            fflush(g_File);
+        }
+    }
+    if (g_Sink) {
+        g_Sink(records);
+    }
+}
+
+void Drain() {
+    std::lock_guard<std::mutex> lock(g_DrainMutex);
+
+    std::vector<ThreadRing*> rings;
+    {
+        std::lock_guard<std::mutex> registry(g_RegistryMutex);
+        for (auto& ring : g_Rings) {
+            rings.push_back(ring.get());
+        }
+    }
+
+    std::vector<LogRecord> records;
+    std::vector<ThreadRing*> retired;
+    uint64_t dropped = 0;
+    for (ThreadRing* ring : rings) {
+        // Read before head, so a retired ring's last records are seen
+        if (ring->retired.load(std::memory_order_acquire)) {
+            retired.push_back(ring);
+        }
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        for (; tail != head; tail++) {
+            const RingSlot& slot = ring->slots[tail % Logger::kRingRecords];
+            LogRecord record;
+            record.level = slot.level;
+            record.sequence = slot.sequence;
+            record.timeMs = slot.timeMs;
+            record.thread = ring->thread;
+            record.deviceId = slot.deviceId;
+            record.page = slot.page;
+            record.rc = slot.rc;
+            record.message.assign(slot.message, slot.length);
+            records.push_back(std::move(record));
+        }
+        ring->tail.store(head, std::memory_order_release);
+        dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+    }
+
+    // Only the drain, under g_DrainMutex, reads other threads' rings
+    if (!retired.empty()) {
+        std::lock_guard<std::mutex> registry(g_RegistryMutex);
+        g_Rings.erase(std::remove_if(g_Rings.begin(), g_Rings.end(), [&retired](const std::unique_ptr<ThreadRing>& ring) {
+            return std::find(retired.begin(), retired.end(), ring.get()) != retired.end();
+        }), g_Rings.end());
+    }
+
+    if (records.empty() && dropped == 0) {
+        return;
+    }
+    std::sort(records.begin(), records.end(), [](const LogRecord& a, const LogRecord& b) {
+        return a.sequence < b.sequence;
+    });
+
+    if (dropped && Logger::Enabled(kLogWarn)) {
+        LogRecord record;
+        record.level = kLogWarn;
+        record.sequence = records.empty() ? 0 : records.back().sequence;
+        record.timeMs = NowMs();
+        record.thread = 0;
+        record.deviceId = LogRecord::kNone;
+        record.page = LogRecord::kNone;
+        record.rc = LogRecord::kNone;
+        record.message = std::to_string(dropped) + " log records dropped";
+        records.push_back(record);
+    }
+    Deliver(records);
+}
+
+void FlusherMain() {
+    std::unique_lock<std::mutex> lock(g_ControlMutex);
+    while (!g_StopRequested) {
+        g_Wake.wait_for(lock, std::chrono::milliseconds(kFlushIntervalMs));
+        lock.unlock();
+        Drain();
+        lock.lock();
+    }
+}
+
+void StartFlusher() {
+    std::lock_guard<std::mutex> lock(g_ControlMutex);
+    if (g_FlusherRunning.load(std::memory_order_relaxed) || g_ShutDown.load()) {
+        return;
+    }
+    g_StopRequested = false;
+    g_Flusher = new std::thread(FlusherMain);
+    g_FlusherRunning.store(true, std::memory_order_release);
+}
+
+}  // namespace
+
+const char* LogLevelName(LogLevel level) {
+    return level >= kLogDebug && level <= kLogOff ? kLevelNames[level] : "unknown";
+}
+
+bool ParseLogLevel(const std::string& name, LogLevel& level) {
+    for (int i = kLogDebug; i <= kLogOff; i++) {
+        if (name == kLevelNames[i]) {
+            level = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Logger::Write(LogLevel level, int64_t deviceId, int32_t page, int32_t rc, const char* format, ...) {
+    if (!g_FlusherRunning.load(std::memory_order_acquire)) {
+        StartFlusher();
+    }
+
+    ThreadRing* ring = LocalRing();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= kRingRecords) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    RingSlot& slot = ring->slots[head % kRingRecords];
+    slot.level = level;
+    slot.sequence = g_Sequence.fetch_add(1, std::memory_order_relaxed);
+    slot.timeMs = NowMs();
+    slot.deviceId = deviceId;
+    slot.page = page;
+    slot.rc = rc;
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(slot.message, kMaxMessage, format, args);
+    va_end(args);
+    slot.length = length < 0 ? 0 : std::min((size_t)length, kMaxMessage - 1);
+
+    ring->head.store(head + 1, std::memory_order_release);
+
+    // Nothing drains after shutdown, so the writer does
+    if (g_ShutDown.load(std::memory_order_relaxed)) {
+        Drain();
+    }
+}
+
+bool Logger::Configure(const Options& options, std::string& error) {
+    std::lock_guard<std::mutex> lock(g_DrainMutex);
+    if (options.filePath != g_Options.filePath || !g_File) {
+        CloseFile();
+        if (!options.filePath.empty() && !OpenFile(options.filePath)) {
+            error = "Cannot write log file " + options.filePath;
+            if (!g_Options.filePath.empty()) {
+                OpenFile(g_Options.filePath);
+            }
+            return false;
+        }
+    }
+    g_Options = options;
+    s_Level.store(options.level, std::memory_order_relaxed);
+    return true;
+}
+
+Logger::Options Logger::Current() {
+    std::lock_guard<std::mutex> lock(g_DrainMutex);
+    Options options = g_Options;
+    options.level = (LogLevel)s_Level.load(std::memory_order_relaxed);
+    return options;
+}
+
+void Logger::SetSink(const Sink& sink) {
+    std::lock_guard<std::mutex> lock(g_DrainMutex);
+    g_Sink = sink;
+}
+
+void Logger::Flush() {
+    Drain();
+}
+
+void Logger::Shutdown() {
+    std::thread* flusher = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(g_ControlMutex);
+        g_ShutDown = true;
+        g_StopRequested = true;
+        flusher = g_Flusher;
+        g_Flusher = nullptr;
+    }
+    g_Wake.notify_all();
+    if (flusher) {
+        flusher->join();
+        delete flusher;
+    }
+    Drain();
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Structured log for the scanner core. SCANNER_LOG formats the message on
+// the calling thread into that thread's ring buffer without locking; a
+// background thread drains the rings and hands the records to the console,
+// a rotating file and a JS callback. A disabled level costs one branch and
+// its arguments are not evaluated.
+//
+// A thread that logs faster than the flusher drains drops records rather
+// than wait; the drops are reported with the next flush.
+
+enum LogLevel {
+    kLogDebug,
+    kLogInfo,
+    kLogWarn,
+    kLogError,
+    kLogOff
+};
+
+const char* LogLevelName(LogLevel level);
+bool ParseLogLevel(const std::string& name, LogLevel& level);
+
+struct LogRecord {
+    static const int kNone = -1;  // For deviceId, page and rc
+
+    LogLevel level;
+    uint64_t sequence;
+    uint64_t timeMs;        // Milliseconds since the Unix epoch
+    uint32_t thread;        // Order in which threads first logged, from 1
+    int64_t deviceId;
+    int32_t page;           // Zero-based page within the current scan
+    int32_t rc;             // TWAIN return code
+    std::string message;
+};
+
+class Logger {
+public:
+    static const size_t kRingRecords = 512;  // Per thread
+    static const size_t kMaxMessage = 192;   // Longer messages are cut
+
+    struct Options {
+        LogLevel level;
+        bool console;
+        std::string filePath;      // Empty for no file
+        uint64_t maxFileBytes;     // Rotate once the file grows past this
+        uint32_t maxFiles;         // Rotated files kept as path.1 .. path.N
+
+        // Info and up to stdout, as printf did
+        Options() : level(kLogInfo), console(true), maxFileBytes(10 << 20), maxFiles(5) {}
+    };
+
+    typedef std::function<void(const std::vector<LogRecord>&)> Sink;
+
+    static bool Enabled(LogLevel level) {
+        return level >= s_Level.load(std::memory_order_relaxed);
+    }
+
+    // Use SCANNER_LOG rather than calling this directly
+    static void Write(LogLevel level, int64_t deviceId, int32_t page, int32_t rc, const char* format, ...)
+#if defined(__GNUC__)
+        __attribute__((format(printf, 5, 6)))
+#endif
+        ;
+
+    static bool Configure(const Options& options, std::string& error);
+    static Options Current();
+
+    // Receives each flushed batch on the flusher thread; empty to remove.
+    // Once this returns the previous sink is no longer called.
+    static void SetSink(const Sink& sink);
+
+    // Delivers everything logged so far before returning
+    static void Flush();
+
+    // Flushes and stops the flusher thread for good; from then on each
+    // record is written out by the thread that logs it
+    static void Shutdown();
+
+private:
+    static std::atomic<int> s_Level;
+};
+
+#define SCANNER_LOG(level, deviceId, page, rc, ...) \
+    do { \
+        if (Logger::Enabled(level)) { \
+            Logger::Write(level, (int64_t)(deviceId), (int32_t)(page), (int32_t)(rc), __VA_ARGS__); \
+        } \
+    } while (0)
@@ -0,0 +1,235 @@
+#ifndef _WIN32
+
+#include "win32_compat.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_set>
+
+namespace {
+
+struct GlobalBlock {
+    size_t size;
+    unsigned lockCount;
+};
+
+// Keeps the payload 16-byte aligned
+const size_t kBlockHeader = (sizeof(GlobalBlock) + 15) & ~size_t(15);
+
+std::mutex g_MemoryMutex;
+std::unordered_set<HGLOBAL> g_LiveBlocks;
+size_t g_LiveBytes = 0;
+uint64_t g_InvalidFrees = 0;
+
+thread_local DWORD g_LastError = 0;
+
+std::mutex g_WindowMutex;
+std::set<std::wstring> g_WindowClasses;
+std::unordered_set<HWND> g_LiveWindows;
+std::atomic<uintptr_t> g_NextWindow(0x1000);
+
+std::mutex g_MessageMutex;
+std::deque<MSG> g_Messages;
+
+GlobalBlock* BlockOf(HGLOBAL hMem) {
+    std::lock_guard<std::mutex> lock(g_MemoryMutex);
+    if (!hMem || g_LiveBlocks.find(hMem) == g_LiveBlocks.end()) {
+        g_LastError = ERROR_INVALID_HANDLE;
+        return nullptr;
+    }
+    return (GlobalBlock*)hMem;
+}
+
+}  // namespace
+
+HGLOBAL GlobalAlloc(UINT flags, size_t bytes) {
+    void* memory = (flags & GMEM_ZEROINIT) ? calloc(1, kBlockHeader + bytes) : malloc(kBlockHeader + bytes);
+    if (!memory) {
+        g_LastError = ERROR_NOT_ENOUGH_MEMORY;
+        return NULL;
+    }
+
+    GlobalBlock* block = (GlobalBlock*)memory;
+    block->size = bytes;
+    block->lockCount = 0;
+
+    std::lock_guard<std::mutex> lock(g_MemoryMutex);
+    g_LiveBlocks.insert(memory);
+    g_LiveBytes += bytes;
+    return memory;
+}
+
+LPVOID GlobalLock(HGLOBAL hMem) {
+    GlobalBlock* block = BlockOf(hMem);
+    if (!block) {
+        return NULL;
+    }
+    block->lockCount++;
+    return (char*)block + kBlockHeader;
+}
+
+BOOL GlobalUnlock(HGLOBAL hMem) {
+    GlobalBlock* block = BlockOf(hMem);
+    if (!block || block->lockCount == 0) {
+        return FALSE;
+    }
+    return --block->lockCount > 0;
+}
+
+size_t GlobalSize(HGLOBAL hMem) {
+    GlobalBlock* block = BlockOf(hMem);
+    return block ? block->size : 0;
+}
+
+HGLOBAL GlobalFree(HGLOBAL hMem) {
+    {
+        std::lock_guard<std::mutex> lock(g_MemoryMutex);
+        if (!hMem || g_LiveBlocks.erase(hMem) == 0) {
+            g_LastError = ERROR_INVALID_HANDLE;
+            if (hMem) {
+                g_InvalidFrees++;
+            }
+            return hMem;
+        }
+        g_LiveBytes -= ((GlobalBlock*)hMem)->size;
+    }
+    free(hMem);
+    return NULL;
+}
+
+DWORD GetTickCount() {
+    return (DWORD)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Sleep(DWORD milliseconds) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+}
+
+DWORD GetLastError() {
+    return g_LastError;
+}
+
+void SetLastError(DWORD error) {
+    g_LastError = error;
+}
+
+HMODULE LoadLibraryA(const char*) {
+    g_LastError = ERROR_MOD_NOT_FOUND;
+    return NULL;
+}
+
+FARPROC GetProcAddress(HMODULE, const char*) {
+    return NULL;
+}
+
+BOOL FreeLibrary(HMODULE) {
+    return TRUE;
+}
+
+HMODULE GetModuleHandleW(const wchar_t*) {
+    return NULL;
+}
+
+ATOM RegisterClassExW(const WNDCLASSEXW* wndClass) {
+    if (!wndClass || !wndClass->lpszClassName) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(g_WindowMutex);
+    if (!g_WindowClasses.insert(wndClass->lpszClassName).second) {
+        g_LastError = ERROR_CLASS_ALREADY_EXISTS;
+        return 0;
+    }
+    return (ATOM)g_WindowClasses.size();
+}
+
+BOOL UnregisterClassW(const wchar_t* className, HINSTANCE) {
+    std::lock_guard<std::mutex> lock(g_WindowMutex);
+    return className && g_WindowClasses.erase(className) > 0;
+}
+
+HWND CreateWindowA(const char*, const char*, DWORD, int, int, int, int, HWND, void*, HINSTANCE, void*) {
+    HWND hWnd = (HWND)g_NextWindow.fetch_add(1);
+    std::lock_guard<std::mutex> lock(g_WindowMutex);
+    g_LiveWindows.insert(hWnd);
+    return hWnd;
+}
+
+HWND CreateWindowExW(DWORD, const wchar_t* className, const wchar_t*, DWORD,
+    int, int, int, int, HWND, void*, HINSTANCE, void*) {
+    std::lock_guard<std::mutex> lock(g_WindowMutex);
+    if (!className || g_WindowClasses.find(className) == g_WindowClasses.end()) {
+        return NULL;
+    }
+    HWND hWnd = (HWND)g_NextWindow.fetch_add(1);
+    g_LiveWindows.insert(hWnd);
+    return hWnd;
+}
+
+BOOL DestroyWindow(HWND hWnd) {
+    std::lock_guard<std::mutex> lock(g_WindowMutex);
+    if (!hWnd || g_LiveWindows.erase(hWnd) == 0) {
+        g_LastError = ERROR_INVALID_WINDOW_HANDLE;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+LRESULT DefWindowProcW(HWND, UINT, WPARAM, LPARAM) {
+    return 0;
+}
+
+BOOL PostMessageW(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
+    MSG msg;
+    memset(&msg, 0, sizeof(MSG));
+    msg.hwnd = hWnd;
+    msg.message = message;
+    msg.wParam = wParam;
+    msg.lParam = lParam;
+    msg.time = GetTickCount();
+
+    std::lock_guard<std::mutex> lock(g_MessageMutex);
+    g_Messages.push_back(msg);
+    return TRUE;
+}
+
+BOOL PeekMessageW(MSG* msg, HWND, UINT, UINT, UINT removeMsg) {
+    std::lock_guard<std::mutex> lock(g_MessageMutex);
+    if (g_Messages.empty()) {
+        return FALSE;
+    }
+    *msg = g_Messages.front();
+    if (removeMsg & PM_REMOVE) {
+        g_Messages.pop_front();
+    }
+    return TRUE;
+}
+
+BOOL TranslateMessage(const MSG*) {
+    return FALSE;
+}
+
+LRESULT DispatchMessageW(const MSG*) {
+    return 0;
+}
+
+Win32CompatUsage GetWin32CompatUsage() {
+    Win32CompatUsage usage;
+    {
+        std::lock_guard<std::mutex> lock(g_MemoryMutex);
+        usage.globalBlocks = g_LiveBlocks.size();
+        usage.globalBytes = g_LiveBytes;
+        usage.invalidFrees = g_InvalidFrees;
+    }
+    std::lock_guard<std::mutex> lock(g_WindowMutex);
+    usage.windows = g_LiveWindows.size();
+    usage.windowClasses = g_WindowClasses.size();
+    return usage;
+}
+
+#endif  // _WIN32
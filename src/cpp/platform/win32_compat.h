@@ -0,0 +1,194 @@
+#pragma once
+
+// Minimal stand-in for the parts of the Win32 API used by the scanner core,
+// so it builds and runs against the simulated DSM on non-Windows hosts.
+// Only included by twain/windows_wrapper.h when _WIN32 is not defined.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+typedef void* HANDLE;
+typedef HANDLE HGLOBAL;
+typedef void* HWND;
+typedef void* HMODULE;
+typedef void* HINSTANCE;
+typedef void* HICON;
+typedef void* HCURSOR;
+typedef void* HBRUSH;
+typedef void* LPVOID;
+typedef uint32_t DWORD;
+typedef uint16_t WORD;
+typedef int32_t LONG;
+typedef int BOOL;
+typedef unsigned int UINT;
+typedef unsigned char BYTE;
+typedef WORD ATOM;
+typedef uintptr_t UINT_PTR;
+typedef uintptr_t WPARAM;
+typedef intptr_t LPARAM;
+typedef intptr_t LRESULT;
+typedef intptr_t (*FARPROC)();
+typedef LRESULT (*WNDPROC)(HWND, UINT, WPARAM, LPARAM);
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define GMEM_FIXED      0x0000
+#define GMEM_MOVEABLE   0x0002
+#define GMEM_ZEROINIT   0x0040
+#define GHND            (GMEM_MOVEABLE | GMEM_ZEROINIT)
+#define GPTR            (GMEM_FIXED | GMEM_ZEROINIT)
+
+#define WS_POPUP        0x80000000L
+#define HWND_DESKTOP    ((HWND)0)
+#define PM_NOREMOVE     0x0000
+#define PM_REMOVE       0x0001
+#define WM_NULL         0x0000
+#define WM_USER         0x0400
+#define BI_RGB          0
+#define BI_BITFIELDS    3
+
+#define ERROR_INVALID_HANDLE        6
+#define ERROR_NOT_ENOUGH_MEMORY     8
+#define ERROR_MOD_NOT_FOUND         126
+#define ERROR_INVALID_WINDOW_HANDLE 1400
+#define ERROR_CLASS_ALREADY_EXISTS  1410
+
+#define MAKEINTRESOURCEA(i) ((const char*)(uintptr_t)(WORD)(i))
+
+struct POINT {
+    LONG x;
+    LONG y;
+};
+
+struct MSG {
+    HWND hwnd;
+    UINT message;
+    WPARAM wParam;
+    LPARAM lParam;
+    DWORD time;
+    POINT pt;
+};
+
+struct WNDCLASSEXW {
+    UINT cbSize;
+    UINT style;
+    WNDPROC lpfnWndProc;
+    int cbClsExtra;
+    int cbWndExtra;
+    HINSTANCE hInstance;
+    HICON hIcon;
+    HCURSOR hCursor;
+    HBRUSH hbrBackground;
+    const wchar_t* lpszMenuName;
+    const wchar_t* lpszClassName;
+    HICON hIconSm;
+};
+
+#pragma pack(push, 2)
+struct BITMAPFILEHEADER {
+    WORD bfType;
+    DWORD bfSize;
+    WORD bfReserved1;
+    WORD bfReserved2;
+    DWORD bfOffBits;
+};
+#pragma pack(pop)
+
+struct BITMAPINFOHEADER {
+    DWORD biSize;
+    LONG biWidth;
+    LONG biHeight;
+    WORD biPlanes;
+    WORD biBitCount;
+    DWORD biCompression;
+    DWORD biSizeImage;
+    LONG biXPelsPerMeter;
+    LONG biYPelsPerMeter;
+    DWORD biClrUsed;
+    DWORD biClrImportant;
+};
+typedef BITMAPINFOHEADER* PBITMAPINFOHEADER;
+
+struct RGBQUAD {
+    BYTE rgbBlue;
+    BYTE rgbGreen;
+    BYTE rgbRed;
+    BYTE rgbReserved;
+};
+
+// Global memory. Handles are tracked so a stale or repeated GlobalFree
+// fails with ERROR_INVALID_HANDLE instead of corrupting the heap.
+HGLOBAL GlobalAlloc(UINT flags, size_t bytes);
+LPVOID GlobalLock(HGLOBAL hMem);
+BOOL GlobalUnlock(HGLOBAL hMem);
+size_t GlobalSize(HGLOBAL hMem);
+HGLOBAL GlobalFree(HGLOBAL hMem);
+
+DWORD GetTickCount();
+void Sleep(DWORD milliseconds);
+DWORD GetLastError();
+void SetLastError(DWORD error);
+
+// There is no TWAIN runtime to load; LoadLibraryA always fails
+HMODULE LoadLibraryA(const char* fileName);
+FARPROC GetProcAddress(HMODULE module, const char* procName);
+BOOL FreeLibrary(HMODULE module);
+HMODULE GetModuleHandleW(const wchar_t* moduleName);
+
+// Windows are opaque handles. Classes and live windows are tracked so a
+// duplicate RegisterClassExW or DestroyWindow fails as it does on Windows.
+ATOM RegisterClassExW(const WNDCLASSEXW* wndClass);
+BOOL UnregisterClassW(const wchar_t* className, HINSTANCE instance);
+HWND CreateWindowA(const char* className, const char* windowName, DWORD style,
+    int x, int y, int width, int height, HWND parent, void* menu, HINSTANCE instance, void* param);
+HWND CreateWindowExW(DWORD exStyle, const wchar_t* className, const wchar_t* windowName, DWORD style,
+    int x, int y, int width, int height, HWND parent, void* menu, HINSTANCE instance, void* param);
+BOOL DestroyWindow(HWND hWnd);
+LRESULT DefWindowProcW(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
+
+// One process-wide posted-message queue
+BOOL PostMessageW(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
+BOOL PeekMessageW(MSG* msg, HWND hWnd, UINT filterMin, UINT filterMax, UINT removeMsg);
+BOOL TranslateMessage(const MSG* msg);
+LRESULT DispatchMessageW(const MSG* msg);
+
+// What is currently held through this layer, for leak checks.
+// invalidFrees counts GlobalFree calls on handles that were not live,
+// such as a second free of the same handle.
+struct Win32CompatUsage {
+    size_t globalBlocks;
+    size_t globalBytes;
+    size_t windows;
+    size_t windowClasses;
+    uint64_t invalidFrees;
+};
+Win32CompatUsage GetWin32CompatUsage();
+
+#define GetModuleHandle GetModuleHandleW
+#define PeekMessage PeekMessageW
+#define PostMessage PostMessageW
+
+inline int strcpy_s(char* dest, size_t size, const char* src) {
+    if (!dest || size == 0) {
+        return 22;
+    }
+    snprintf(dest, size, "%s", src ? src : "");
+    return 0;
+}
+
+template <size_t N>
+inline int strcpy_s(char (&dest)[N], const char* src) {
+    return strcpy_s(dest, N, src);
+}
+
+template <size_t N, typename... Args>
+inline int sprintf_s(char (&dest)[N], const char* format, Args... args) {
+    return snprintf(dest, N, format, args...);
+}
@@ -0,0 +1,173 @@
+#include "scan_stats.h"
+#include "tracing.h"
+
+namespace {
+
+const char* const kStageNames[kStageCount] = {
+    "openDsm",
+    "openSource",
+    "negotiate",
+    "enableSource",
+    "waitForTransfer",
+    "transfer",
+    "autoCrop",
+    "blankDetect",
+    "resample",
+    "deskew",
+    "rotate",
+    "duplicates",
+    "assemble",
+    "marshal"
+};
+
+double ToMs(uint64_t micros) {
+    return micros / 1000.0;
+}
+
+}  // namespace
+
+const char* ScanStageName(ScanStage stage) {
+    return stage < kStageCount ? kStageNames[stage] : "unknown";
+}
+
+LatencyHistogram::LatencyHistogram()
+    : m_Count(0), m_Sum(0), m_Min(UINT64_MAX), m_Max(0) {}
+
+// Values below kLinearLimit get a bucket each. Above it, a value shifted
+// right until it lands in [64, 128) picks one of 64 sub-buckets in the
+// band for that shift.
+size_t LatencyHistogram::IndexOf(uint64_t micros) {
+    if (micros < kLinearLimit) {
+        return (size_t)micros;
+    }
+    unsigned shift = 1;
+    while ((micros >> shift) >= kLinearLimit && shift < kMaxShift) {
+        shift++;
+    }
+    uint64_t sub = micros >> shift;
+    if (sub >= kLinearLimit) {
+        return kBucketCount - 1;
+    }
+    return (size_t)(kLinearLimit + (shift - 1) * kSubBuckets + (sub - kSubBuckets));
+}
+
+uint64_t LatencyHistogram::HighestValueAt(size_t index) {
+    if (index < kLinearLimit) {
+        return index;
+    }
+    unsigned shift = (unsigned)((index - kLinearLimit) / kSubBuckets) + 1;
+    uint64_t sub = (index - kLinearLimit) % kSubBuckets + kSubBuckets;
+    return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(uint64_t micros) {
+    if (m_Counts.empty()) {
+        m_Counts.assign(kBucketCount, 0);
+    }
+    m_Counts[IndexOf(micros)]++;
+    m_Count++;
+    m_Sum += micros;
+    if (micros < m_Min) m_Min = micros;
+    if (micros > m_Max) m_Max = micros;
+}
+
+void LatencyHistogram::Reset() {
+    m_Counts.clear();
+    m_Count = 0;
+    m_Sum = 0;
+    m_Min = UINT64_MAX;
+    m_Max = 0;
+}
+
+uint64_t LatencyHistogram::ValueAtPercentile(double percentile) const {
+    if (m_Count == 0) {
+        return 0;
+    }
+    if (percentile > 100) {
+        percentile = 100;
+    }
+
+    uint64_t target = (uint64_t)(percentile / 100.0 * m_Count + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < m_Counts.size(); i++) {
+        seen += m_Counts[i];
+        if (seen >= target) {
+            uint64_t value = HighestValueAt(i);
+            return value < m_Max ? value : m_Max;
+        }
+    }
+    return m_Max;
+}
+
+ScanStats::ScanStats() : m_ResetAt(std::chrono::steady_clock::now()) {}
+
+void ScanStats::Record(TW_UINT32 deviceId, ScanStage stage, double ms) {
+    if (stage >= kStageCount) {
+        return;
+    }
+    uint64_t micros = ms > 0 ? (uint64_t)(ms * 1000.0 + 0.5) : 0;
+
+    // Every timed stage also shows up in a trace, ending now
+    if (Tracer::Enabled()) {
+        uint64_t duration = micros * 1000;
+        TraceArg device = { "deviceId", nullptr, (int64_t)deviceId };
+        Tracer::Complete("stage", ScanStageName(stage), Tracer::Now() - duration, duration, &device, 1);
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Devices[deviceId].stages[stage].Record(micros);
+}
+
+void ScanStats::SetDeviceName(TW_UINT32 deviceId, const std::string& name) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Devices[deviceId].name = name;
+}
+
+ScanStats::Snapshot ScanStats::GetSnapshot(bool reset) {
+    Snapshot snapshot;
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    auto now = std::chrono::steady_clock::now();
+    snapshot.sinceResetMs = std::chrono::duration<double, std::milli>(now - m_ResetAt).count();
+
+    for (auto& entry : m_Devices) {
+        DeviceSummary device;
+        device.deviceId = entry.first;
+        device.deviceName = entry.first == 0 && entry.second.name.empty()
+            ? "Data Source Manager" : entry.second.name;
+
+        for (int stage = 0; stage < kStageCount; stage++) {
+            LatencyHistogram& histogram = entry.second.stages[stage];
+            StageSummary& summary = device.stages[stage];
+            summary.count = histogram.Count();
+            summary.minMs = ToMs(histogram.Min());
+            summary.meanMs = histogram.Mean() / 1000.0;
+            summary.p50Ms = ToMs(histogram.ValueAtPercentile(50));
+            summary.p90Ms = ToMs(histogram.ValueAtPercentile(90));
+            summary.p99Ms = ToMs(histogram.ValueAtPercentile(99));
+            summary.p999Ms = ToMs(histogram.ValueAtPercentile(99.9));
+            summary.maxMs = ToMs(histogram.Max());
+            if (reset) {
+                histogram.Reset();
+            }
+        }
+        snapshot.devices.push_back(device);
+    }
+
+    if (reset) {
+        m_ResetAt = now;
+    }
+    return snapshot;
+}
+
+void ScanStats::Reset() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    for (auto& entry : m_Devices) {
+        for (int stage = 0; stage < kStageCount; stage++) {
+            entry.second.stages[stage].Reset();
+        }
+    }
+    m_ResetAt = std::chrono::steady_clock::now();
+}
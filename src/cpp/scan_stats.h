@@ -0,0 +1,120 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "twain/windows_wrapper.h"
+#include "twain.h"
+
+// Timed stages of a scan, in the order they happen
+enum ScanStage {
+    kStageOpenDsm,          // MSG_OPENDSM, recorded against device 0
+    kStageOpenSource,       // MSG_OPENDS
+    kStageNegotiate,        // Capability probe and setup after MSG_OPENDS
+    kStageEnableSource,     // MSG_ENABLEDS
+    kStageWaitForTransfer,  // MSG_ENABLEDS returning to the first MSG_XFERREADY
+    kStageTransfer,         // Each DAT_IMAGENATIVEXFER
+    kStageAutoCrop,         // Host border detection per page, and the crop when a whole-page transform follows
+    kStageBlankDetect,      // Host blank page detection per page
+    kStageResample,         // Scaling a page to the requested resolution
+    kStageDeskew,           // Host skew estimate per page; the rotation is part of kStageAssemble
+    kStageRotate,           // Quarter or half turn of a page per ScanOptions side rotation
+    kStageDuplicates,       // Perceptual hash and duplicate lookup per page
+    kStageAssemble,         // Strip pass per page: pending crop and deskew, BMP assembly, hashing and Base64
+    kStageMarshal,          // Converting the scan result to JS values
+    kStageCount
+};
+
+const char* ScanStageName(ScanStage stage);
+
+// Log-linear latency histogram in microseconds, in the style of
+// HdrHistogram: 64 linear sub-buckets per power of two, so recorded
+// values keep about two significant digits (1.6% worst case) from 1 us
+// up to about 38 hours. Counts are allocated on the first Record.
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void Record(uint64_t micros);
+    void Reset();
+
+    uint64_t Count() const { return m_Count; }
+    uint64_t Min() const { return m_Count ? m_Min : 0; }
+    uint64_t Max() const { return m_Max; }
+    double Mean() const { return m_Count ? (double)m_Sum / m_Count : 0; }
+
+    // Highest value equivalent to the one at percentile (0-100)
+    uint64_t ValueAtPercentile(double percentile) const;
+
+private:
+    static const uint64_t kLinearLimit = 128;
+    static const unsigned kSubBuckets = 64;
+    static const unsigned kMaxShift = 30;
+    static const size_t kBucketCount = kLinearLimit + kMaxShift * kSubBuckets;
+
+    static size_t IndexOf(uint64_t micros);
+    static uint64_t HighestValueAt(size_t index);
+
+    std::vector<uint32_t> m_Counts;
+    uint64_t m_Count;
+    uint64_t m_Sum;
+    uint64_t m_Min;
+    uint64_t m_Max;
+};
+
+// Per-device histograms for every ScanStage. Recording takes one
+// uncontended lock; stages are recorded on the TWAIN thread except
+// kStageMarshal, which runs on the JS thread.
+class ScanStats {
+public:
+    struct StageSummary {
+        uint64_t count;
+        double minMs;
+        double meanMs;
+        double p50Ms;
+        double p90Ms;
+        double p99Ms;
+        double p999Ms;
+        double maxMs;
+
+        StageSummary()
+            : count(0), minMs(0), meanMs(0), p50Ms(0), p90Ms(0)
+            , p99Ms(0), p999Ms(0), maxMs(0) {}
+    };
+
+    struct DeviceSummary {
+        TW_UINT32 deviceId;
+        std::string deviceName;
+        StageSummary stages[kStageCount];
+
+        DeviceSummary() : deviceId(0) {}
+    };
+
+    struct Snapshot {
+        double sinceResetMs;
+        std::vector<DeviceSummary> devices;
+
+        Snapshot() : sinceResetMs(0) {}
+    };
+
+    ScanStats();
+
+    void Record(TW_UINT32 deviceId, ScanStage stage, double ms);
+    void SetDeviceName(TW_UINT32 deviceId, const std::string& name);
+
+    // reset clears the histograms after taking the snapshot
+    Snapshot GetSnapshot(bool reset);
+    void Reset();
+
+private:
+    struct Device {
+        std::string name;
+        LatencyHistogram stages[kStageCount];
+    };
+
+    std::mutex m_Mutex;
+    std::map<TW_UINT32, Device> m_Devices;
+    std::chrono::steady_clock::time_point m_ResetAt;
+};
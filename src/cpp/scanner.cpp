@@ -1,17 +1,224 @@
 #include "scanner.h"
-#include <Windows.h>
+#include "log.h"
+#include "tracing.h"
+#include "imaging/base64.h"
+#include "imaging/bitmap.h"
+#include "sim/dsm_recording.h"
+#include "sim/replay_dsm.h"
+#include "sim/simulated_dsm.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <vector>
 #include <algorithm>
 #include <sstream>
 #include <iomanip>
 #include <string>
 #include <stdexcept>
+#include <chrono>
+#include <map>
+#include <mutex>
 
 
 // Global TWAIN variables
 HMODULE hTwainDLL = NULL;
 DSMENTRYPROC g_pDSM_Entry = NULL;
 
+// Scanners with a registered DAT_CALLBACK, keyed by application identity
+// Id. TW_CALLBACK.RefCon is 32 bits on Windows, so it cannot hold a pointer.
+static std::mutex g_CallbackMutex;
+static std::map<TW_UINT32, TwainScanner*> g_CallbackTargets;
+
+// The message window class is shared by every scanner in the process and
+// unregistered when the last window using it goes away
+static const wchar_t kWindowClassName[] = L"TwainWindowClass";
+static std::mutex g_WindowClassMutex;
+static int g_WindowClassUsers = 0;
+
+static bool AcquireWindowClass() {
+    std::lock_guard<std::mutex> lock(g_WindowClassMutex);
+    if (g_WindowClassUsers == 0) {
+        WNDCLASSEXW wc = {0};
+        wc.cbSize = sizeof(wc);
+        wc.lpfnWndProc = DefWindowProcW;
+        wc.hInstance = GetModuleHandleW(NULL);
+        wc.lpszClassName = kWindowClassName;
+        if (!RegisterClassExW(&wc) && GetLastError() != ERROR_CLASS_ALREADY_EXISTS) {
+            return false;
+        }
+    }
+    g_WindowClassUsers++;
+    return true;
+}
+
+static void ReleaseWindowClass() {
+    std::lock_guard<std::mutex> lock(g_WindowClassMutex);
+    if (g_WindowClassUsers > 0 && --g_WindowClassUsers == 0) {
+        UnregisterClassW(kWindowClassName, GetModuleHandleW(NULL));
+    }
+}
+
+static const char* DatNameOf(TW_UINT16 dat) {
+    switch (dat) {
+        case DAT_CAPABILITY: return "DAT_CAPABILITY";
+        case DAT_EVENT: return "DAT_EVENT";
+        case DAT_IDENTITY: return "DAT_IDENTITY";
+        case DAT_PARENT: return "DAT_PARENT";
+        case DAT_PENDINGXFERS: return "DAT_PENDINGXFERS";
+        case DAT_SETUPMEMXFER: return "DAT_SETUPMEMXFER";
+        case DAT_STATUS: return "DAT_STATUS";
+        case DAT_USERINTERFACE: return "DAT_USERINTERFACE";
+        case DAT_CALLBACK: return "DAT_CALLBACK";
+        case DAT_DEVICEEVENT: return "DAT_DEVICEEVENT";
+        case DAT_IMAGEINFO: return "DAT_IMAGEINFO";
+        case DAT_IMAGELAYOUT: return "DAT_IMAGELAYOUT";
+        case DAT_IMAGEMEMXFER: return "DAT_IMAGEMEMXFER";
+        case DAT_IMAGENATIVEXFER: return "DAT_IMAGENATIVEXFER";
+        case DAT_IMAGEFILEXFER: return "DAT_IMAGEFILEXFER";
+        default: return "DAT_OTHER";
+    }
+}
+
+static const char* MsgNameOf(TW_UINT16 msg) {
+    switch (msg) {
+        case MSG_GET: return "MSG_GET";
+        case MSG_GETCURRENT: return "MSG_GETCURRENT";
+        case MSG_GETDEFAULT: return "MSG_GETDEFAULT";
+        case MSG_GETFIRST: return "MSG_GETFIRST";
+        case MSG_GETNEXT: return "MSG_GETNEXT";
+        case MSG_SET: return "MSG_SET";
+        case MSG_RESET: return "MSG_RESET";
+        case MSG_QUERYSUPPORT: return "MSG_QUERYSUPPORT";
+        case MSG_OPENDSM: return "MSG_OPENDSM";
+        case MSG_CLOSEDSM: return "MSG_CLOSEDSM";
+        case MSG_OPENDS: return "MSG_OPENDS";
+        case MSG_CLOSEDS: return "MSG_CLOSEDS";
+        case MSG_DISABLEDS: return "MSG_DISABLEDS";
+        case MSG_ENABLEDS: return "MSG_ENABLEDS";
+        case MSG_PROCESSEVENT: return "MSG_PROCESSEVENT";
+        case MSG_ENDXFER: return "MSG_ENDXFER";
+        case MSG_REGISTER_CALLBACK: return "MSG_REGISTER_CALLBACK";
+        default: return nullptr;
+    }
+}
+
+// Every call into the DSM goes through here so a trace or a recording can
+// show each one
+static TW_UINT16 DsmEntry(pTW_IDENTITY pOrigin, pTW_IDENTITY pDest,
+    TW_UINT32 DG, TW_UINT16 DAT, TW_UINT16 MSG, TW_MEMREF pData) {
+    if (!Tracer::Enabled() && !DsmRecorder::Active()) {
+        return g_pDSM_Entry(pOrigin, pDest, DG, DAT, MSG, pData);
+    }
+
+    TraceScope scope("dsm", DatNameOf(DAT));
+    uint64_t start = Tracer::Now();
+    TW_UINT16 rc = g_pDSM_Entry(pOrigin, pDest, DG, DAT, MSG, pData);
+    if (DsmRecorder::Active()) {
+        DsmRecorder::RecordCall(DG, DAT, MSG, pData, rc, start, Tracer::Now() - start);
+    }
+    const char* msgName = MsgNameOf(MSG);
+    if (msgName) {
+        scope.AddArg("msg", msgName);
+    } else {
+        scope.AddArg("msg", (int64_t)MSG);
+    }
+    scope.AddArg("dg", (int64_t)DG);
+    scope.AddArg("rc", (int64_t)rc);
+    return rc;
+}
+
+// Clockwise turn asked for pages of side; pages of an unknown side are
+// left as they are
+static int RotationFor(PageSide side, const ScanOptions& options) {
+    return side == kSideFront ? options.frontRotation : side == kSideBack ? options.backRotation : 0;
+}
+
+static double MillisecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Locks the DIB behind handle and opens source over it through the
+// pending crop. The caller unlocks the handle when this succeeds.
+static bool LockPage(TW_HANDLE handle, const CropRect& crop, DibStripSource& source) {
+    const void* dib = GlobalLock((HANDLE)handle);
+    if (!dib) {
+        return false;
+    }
+    DibLayout layout;
+    std::string error;
+    if (!ReadDibLayout(dib, GlobalSize((HANDLE)handle), layout, error) || !source.Open(layout, &crop)) {
+        GlobalUnlock((HANDLE)handle);
+        return false;
+    }
+    return true;
+}
+
+// Sets a TWTY_UINT16 capability of the open source
+static TW_UINT16 SetUInt16Capability(pTW_IDENTITY app, pTW_IDENTITY source, TW_UINT16 capId, TW_UINT16 value) {
+    TW_CAPABILITY cap;
+    cap.Cap = capId;
+    cap.ConType = TWON_ONEVALUE;
+    cap.hContainer = GlobalAlloc(GHND, sizeof(TW_ONEVALUE));
+    if (!cap.hContainer) {
+        return TWRC_FAILURE;
+    }
+
+    pTW_ONEVALUE pVal = (pTW_ONEVALUE)GlobalLock(cap.hContainer);
+    pVal->ItemType = TWTY_UINT16;
+    pVal->Item = value;
+    GlobalUnlock(cap.hContainer);
+
+    TW_UINT16 rc = DsmEntry(app, source, DG_CONTROL, DAT_CAPABILITY, MSG_SET, (TW_MEMREF)&cap);
+    GlobalFree(cap.hContainer);
+    return rc;
+}
+
+// The stages the encoding pass reads a page through after its crop:
+// colour dropout, deskew, thresholding to 1 bit and despeckling, each
+// where asked for and where the page's format allows it
+class PagePipeline {
+public:
+    PagePipeline(DibStripSource& source, const ScanOptions& options, double deskewAngle)
+        : m_Output(&source) {
+        const ColourDropoutOptions& dropout = options.dropoutOptions;
+        if (dropout.mode != kDropoutNone) {
+            m_Dropout.reset(new ColourDropoutStripStage(*m_Output));
+            if (m_Dropout->Open(dropout)) {
+                m_Output = m_Dropout.get();
+            }
+        }
+        // Straightening grey rather than colour turns a third of the bytes
+        if (deskewAngle != 0) {
+            m_Deskew.reset(new DeskewStripStage(*m_Output));
+            if (m_Deskew->Open(deskewAngle)) {
+                m_Output = m_Deskew.get();
+            }
+        }
+        if (dropout.mode != kDropoutNone && dropout.outputBits == 1) {
+            m_Threshold.reset(new ThresholdStripStage(*m_Output));
+            if (m_Threshold->Open(dropout.threshold)) {
+                m_Output = m_Threshold.get();
+            }
+        }
+        // Last, so it sees the page as it will be encoded
+        if (options.despeckle) {
+            m_Despeckle.reset(new DespeckleStripStage(*m_Output));
+            if (m_Despeckle->Open(options.despeckleOptions)) {
+                m_Output = m_Despeckle.get();
+            }
+        }
+    }
+
+    StripStage& Output() { return *m_Output; }
+
+private:
+    StripStage* m_Output;
+    std::unique_ptr<ColourDropoutStripStage> m_Dropout;
+    std::unique_ptr<DeskewStripStage> m_Deskew;
+    std::unique_ptr<ThresholdStripStage> m_Threshold;
+    std::unique_ptr<DespeckleStripStage> m_Despeckle;
+};
+
 std::string GetTwainErrorMessage(TW_UINT16 rc) {
     switch (rc) {
         case TWRC_SUCCESS: return "Success";
@@ -27,7 +234,18 @@ std::string GetTwainErrorMessage(TW_UINT16 rc) {
 }
 
 bool LoadTwainLibrary() {
-    if (hTwainDLL) return true;  // Already loaded
+    if (g_pDSM_Entry) return true;  // Already loaded
+
+    // A recorded session or the simulated DSM stands in when requested, and
+    // the simulator wherever there is no TWAIN runtime to load
+    if (ReplayDsm::Loaded()) {
+        g_pDSM_Entry = &ReplayDsm::Entry;
+        return true;
+    }
+    if (SimulatedDsm::Enabled()) {
+        g_pDSM_Entry = &SimulatedDsm::Entry;
+        return true;
+    }
     
     // Try multiple possible paths for TWAIN_32.DLL
     const char* paths[] = {
@@ -68,8 +286,8 @@ void UnloadTwainLibrary() {
     if (hTwainDLL) {
         FreeLibrary(hTwainDLL);
         hTwainDLL = NULL;
-        g_pDSM_Entry = NULL;
     }
+    g_pDSM_Entry = NULL;
 }
 
 TwainScanner::TwainScanner() 
@@ -77,18 +295,45 @@ TwainScanner::TwainScanner()
     , m_hDSMLib(nullptr)
     , m_pDSM(nullptr)
     , m_DuplexSupported(false)
+    , m_DeviceDetectsBorders(false)
+    , m_DeviceDiscardsBlanks(false)
+    , m_DeviceDeskews(false)
+    , m_DeviceFilter(TWFT_NONE)
+    , m_FilterPixelType(TWPT_RGB)
+    , m_PixelTypeBeforeFilter(TWPT_RGB)
+    , m_PersistentSession(false)
+    , m_SessionIdleTimeout(120000)
+    , m_LastSessionUse(0)
+    , m_SourceOpen(false)
+    , m_hWnd(NULL)
+    , m_WindowClassRegistered(false)
+    , m_CapabilitiesFromCache(false)
+    , m_CapabilitiesStale(false)
+    , m_CapabilitiesComplete(false)
+    , m_CapabilitiesSourceId(0)
+    , m_Stats(std::make_shared<ScanStats>())
+    , m_SessionPages(0)
+    , m_SourcesFetchedAt(0)
+    , m_SourceListTtl(30000)
+    , m_DevicePollInterval(2000)
+    , m_LastDevicePoll(0)
+    , m_CallbackRegistered(false)
+    , m_DeviceEventPending(false)
+    , m_CallbackMessage(MSG_NULL)
 {
     memset(&m_AppId, 0, sizeof(TW_IDENTITY));
     memset(&m_SrcId, 0, sizeof(TW_IDENTITY));
 }
 
 TwainScanner::~TwainScanner() {
+    StopDeviceMonitor();
     Cleanup();
     UnloadTwainLibrary();
 }
 
 TwainScanner::InitResult TwainScanner::Initialize() {
     InitResult result;
+    auto initStart = std::chrono::steady_clock::now();
     
     if (m_Initialized) {
         result.success = true;
@@ -97,11 +342,13 @@ TwainScanner::InitResult TwainScanner::Initialize() {
     }
 
     try {
+        auto phaseStart = std::chrono::steady_clock::now();
         if (!LoadTwainLibrary()) {
             result.success = false;
             result.message = "Failed to load TWAIN_32.DLL";
             return result;
         }
+        result.timings.loadLibraryMs = MillisecondsSince(phaseStart);
 
         // Initialize TWAIN application identity
         m_AppId.Id = 1;
@@ -128,7 +375,8 @@ TwainScanner::InitResult TwainScanner::Initialize() {
         }
 
         // Open Data Source Manager
-        TW_UINT16 rc = g_pDSM_Entry(&m_AppId, nullptr, DG_CONTROL, DAT_PARENT, MSG_OPENDSM, (TW_MEMREF)&hwnd);
+        phaseStart = std::chrono::steady_clock::now();
+        TW_UINT16 rc = DsmEntry(&m_AppId, nullptr, DG_CONTROL, DAT_PARENT, MSG_OPENDSM, (TW_MEMREF)&hwnd);
         if (rc != TWRC_SUCCESS) {
             DestroyWindow(hwnd);
             result.success = false;
@@ -137,64 +385,225 @@ TwainScanner::InitResult TwainScanner::Initialize() {
         }
 
         m_hDSMLib = (HMODULE)hwnd;
-
-        // Get first available source
-        rc = g_pDSM_Entry(&m_AppId, nullptr, DG_CONTROL, DAT_IDENTITY, MSG_GETFIRST, &m_SrcId);
-        if (rc != TWRC_SUCCESS) {
-            result.success = false;
-            result.message = "No scanner found";
-            return result;
-        }
-
-        // Open the data source
-        rc = g_pDSM_Entry(&m_AppId, nullptr, DG_CONTROL, DAT_IDENTITY, MSG_OPENDS, &m_SrcId);
-        if (rc != TWRC_SUCCESS) {
+        result.timings.openDsmMs = MillisecondsSince(phaseStart);
+        m_Stats->Record(0, kStageOpenDsm, result.timings.openDsmMs);
+
+        // Identify the first source. A cached capability set probed with
+        // the same driver version lets us skip opening it here.
+        phaseStart = std::chrono::steady_clock::now();
+        if (!SelectSource(0)) {
+            CloseDsm();
             result.success = false;
-            result.message = "Failed to open scanner";
+            result.message = m_LastError;
             return result;
         }
 
-        // Now check for duplex capability
-        TW_CAPABILITY cap = {0};
-        cap.Cap = CAP_DUPLEX;
-        cap.ConType = TWON_ONEVALUE;
-        
-        rc = g_pDSM_Entry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CAPABILITY, MSG_GET, &cap);
-        if (rc == TWRC_SUCCESS) {
-            pTW_ONEVALUE pVal = (pTW_ONEVALUE)GlobalLock(cap.hContainer);
-            if (pVal) {
-                // Check if scanner supports any form of duplex (1-pass or 2-pass)
-                m_DuplexSupported = (pVal->Item == TWDX_1PASSDUPLEX || pVal->Item == TWDX_2PASSDUPLEX);
-                GlobalUnlock(cap.hContainer);
+        m_CapabilitiesFromCache = LoadCachedCapabilities();
+        m_CapabilitiesStale = m_CapabilitiesFromCache;
+
+        // Opening the source probes it when the cache had nothing
+        if (!m_CapabilitiesFromCache || m_PersistentSession) {
+            if (!OpenDataSource()) {
+                CloseSession();
+                CloseDsm();
+                result.success = false;
+                result.message = m_LastError;
+                return result;
             }
-            GlobalFree(cap.hContainer);
         }
-
-        // Close the data source for now (we'll reopen it during scanning)
-        rc = g_pDSM_Entry(&m_AppId, nullptr, DG_CONTROL, DAT_IDENTITY, MSG_CLOSEDS, &m_SrcId);
-
-        // Count available devices
-        TW_UINT32 sourceCount = 0;
-        rc = g_pDSM_Entry(&m_AppId, nullptr, DG_CONTROL, DAT_IDENTITY, MSG_GETFIRST, &m_SrcId);
-        while (rc == TWRC_SUCCESS) {
-            sourceCount++;
-            rc = g_pDSM_Entry(&m_AppId, nullptr, DG_CONTROL, DAT_IDENTITY, MSG_GETNEXT, &m_SrcId);
+        result.timings.capabilitiesMs = MillisecondsSince(phaseStart);
+
+        if (m_PersistentSession) {
+            // Keep the source open so the first scan can skip MSG_OPENDS
+            m_LastSessionUse = GetTickCount();
+        } else {
+            // Close the data source for now (we'll reopen it during scanning)
+            CloseDataSource();
         }
 
+        // Cache the available devices for listDevices()
+        phaseStart = std::chrono::steady_clock::now();
+        EnumerateSources();
+
         m_Initialized = true;
         result.success = true;
         result.message = "Initialized successfully";
-        result.deviceCount = sourceCount;
+        result.deviceCount = (int)m_Sources.size();
+        result.capabilitiesFromCache = m_CapabilitiesFromCache;
+        result.timings.enumerateMs = MillisecondsSince(phaseStart);
+        result.timings.totalMs = MillisecondsSince(initStart);
         
         return result;
     }
     catch (const std::exception& e) {
+        CloseSession();
+        CloseDsm();
         result.success = false;
         result.message = std::string("Initialization error: ") + e.what();
         return result;
     }
 }
 
+void TwainScanner::SetCapabilityCachePath(const std::string& path) {
+    m_CapabilityCache.SetPath(path);
+    m_CapabilityCache.Load();
+}
+
+bool TwainScanner::LoadCachedCapabilities() {
+    if (!m_CapabilityCache.Lookup(m_SrcId, m_Capabilities, m_CapabilitiesComplete)) {
+        return false;
+    }
+    m_CapabilitiesSourceId = m_SrcId.Id;
+    ApplyCapabilities();
+    return true;
+}
+
+void TwainScanner::ProbeCapabilities(const TW_UINT16* capList, size_t count, std::vector<CapabilityInfo>& caps) {
+    caps.clear();
+
+    for (size_t i = 0; i < count; i++) {
+        auto capStart = std::chrono::steady_clock::now();
+
+        // Ask what the source allows first so unsupported capabilities
+        // cost one round-trip instead of a failing MSG_GET
+        TW_CAPABILITY query = {0};
+        query.Cap = capList[i];
+        query.ConType = TWON_DONTCARE16;
+
+        TW_INT32 supportFlags = 0;
+        TW_UINT16 rc = DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CAPABILITY, MSG_QUERYSUPPORT, (TW_MEMREF)&query);
+        if (rc == TWRC_SUCCESS && query.hContainer) {
+            pTW_ONEVALUE pVal = (pTW_ONEVALUE)GlobalLock(query.hContainer);
+            if (pVal) {
+                supportFlags = (TW_INT32)pVal->Item;
+                GlobalUnlock(query.hContainer);
+            }
+            GlobalFree(query.hContainer);
+
+            if (!(supportFlags & TWQC_GET)) {
+                continue;
+            }
+        }
+
+        TW_CAPABILITY cap = {0};
+        cap.Cap = capList[i];
+        cap.ConType = TWON_DONTCARE16;
+
+        rc = DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CAPABILITY, MSG_GET, (TW_MEMREF)&cap);
+        if (rc != TWRC_SUCCESS) {
+            continue;
+        }
+
+        CapabilityInfo info;
+        if (DecodeCapability(cap, info)) {
+            info.supportFlags = supportFlags;
+            info.elapsedMs = MillisecondsSince(capStart);
+            caps.push_back(info);
+        }
+        GlobalFree(cap.hContainer);
+    }
+}
+
+void TwainScanner::ProbeAllCapabilities(std::vector<CapabilityInfo>& caps) {
+    std::vector<TW_UINT16> capList(kStandardCapabilityCount);
+    for (size_t i = 0; i < kStandardCapabilityCount; i++) {
+        capList[i] = kStandardCapabilities[i].cap;
+    }
+    ProbeCapabilities(capList.data(), capList.size(), caps);
+}
+
+TwainScanner::CapabilityReport TwainScanner::DiscoverCapabilities(bool refresh) {
+    CapabilityReport report;
+    auto discoverStart = std::chrono::steady_clock::now();
+
+    if (!m_Initialized) {
+        report.errorMessage = "Scanner not initialized. Call Initialize() first.";
+        return report;
+    }
+
+    if (m_CapabilitiesComplete && !refresh) {
+        report.success = true;
+        report.fromCache = true;
+        report.capabilities = m_Capabilities;
+        report.fastPaths = DescribeFastPaths(m_Capabilities);
+        report.totalMs = MillisecondsSince(discoverStart);
+        return report;
+    }
+
+    bool openedHere = false;
+    if (!m_SourceOpen) {
+        if (!OpenDataSource()) {
+            report.errorMessage = m_LastError;
+            return report;
+        }
+        openedHere = true;
+    }
+
+    ProbeAllCapabilities(m_Capabilities);
+    m_CapabilitiesSourceId = m_SrcId.Id;
+
+    if (openedHere) {
+        CloseDataSource();
+    }
+
+    m_CapabilitiesComplete = true;
+    m_CapabilitiesStale = false;
+    ApplyCapabilities();
+    m_CapabilityCache.Store(m_SrcId, m_Capabilities, m_CapabilitiesComplete);
+    m_CapabilityCache.Save();
+
+    report.success = true;
+    report.capabilities = m_Capabilities;
+    report.fastPaths = DescribeFastPaths(m_Capabilities);
+    report.totalMs = MillisecondsSince(discoverStart);
+    return report;
+}
+
+void TwainScanner::ApplyCapabilities() {
+    // Check if scanner supports any form of duplex (1-pass or 2-pass)
+    const CapabilityInfo* duplex = FindCapability(m_Capabilities, CAP_DUPLEX);
+    m_DuplexSupported = duplex &&
+        (duplex->currentValue == TWDX_1PASSDUPLEX || duplex->currentValue == TWDX_2PASSDUPLEX);
+}
+
+bool TwainScanner::RevalidateCapabilities(bool& changed) {
+    changed = false;
+    if (!m_Initialized) {
+        m_LastError = "Scanner not initialized. Call Initialize() first.";
+        return false;
+    }
+
+    bool openedHere = false;
+    if (!m_SourceOpen) {
+        if (!OpenDataSource()) {
+            return false;
+        }
+        openedHere = true;
+    }
+
+    // Re-probe whatever the cached set covered
+    std::vector<CapabilityInfo> caps;
+    if (m_CapabilitiesComplete) {
+        ProbeAllCapabilities(caps);
+    } else {
+        ProbeCapabilities(kProbedCapabilities, kProbedCapabilityCount, caps);
+    }
+
+    if (openedHere) {
+        CloseDataSource();
+    }
+
+    changed = caps != m_Capabilities;
+    if (changed) {
+        m_Capabilities.swap(caps);
+        ApplyCapabilities();
+    }
+    m_CapabilityCache.Store(m_SrcId, m_Capabilities, m_CapabilitiesComplete);
+    m_CapabilityCache.Save();
+    m_CapabilitiesStale = false;
+    return true;
+}
+
 bool TwainScanner::NegotiateCapabilities() {
     TW_CAPABILITY cap;
     TW_UINT16 rc;
@@ -213,7 +622,7 @@ bool TwainScanner::NegotiateCapabilities() {
     pVal->Item = TWPT_RGB;
     GlobalUnlock(cap.hContainer);
 
-    rc = g_pDSM_Entry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CAPABILITY, MSG_SET, (TW_MEMREF)&cap);
+    rc = DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CAPABILITY, MSG_SET, (TW_MEMREF)&cap);
     GlobalFree(cap.hContainer);
 
     if (rc != TWRC_SUCCESS) {
@@ -238,7 +647,7 @@ bool TwainScanner::NegotiateCapabilities() {
     memcpy(&pVal->Item, &resolution, sizeof(TW_FIX32));
     GlobalUnlock(cap.hContainer);
 
-    rc = g_pDSM_Entry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CAPABILITY, MSG_SET, (TW_MEMREF)&cap);
+    rc = DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CAPABILITY, MSG_SET, (TW_MEMREF)&cap);
     GlobalFree(cap.hContainer);
 
     if (rc != TWRC_SUCCESS) {
@@ -262,7 +671,7 @@ bool TwainScanner::NegotiateCapabilities() {
         pVal->Item = TRUE;
         GlobalUnlock(cap.hContainer);
 
-        rc = g_pDSM_Entry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CAPABILITY, MSG_SET, (TW_MEMREF)&cap);
+        rc = DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CAPABILITY, MSG_SET, (TW_MEMREF)&cap);
         GlobalFree(cap.hContainer);
 
         if (rc != TWRC_SUCCESS) {
@@ -274,7 +683,7 @@ bool TwainScanner::NegotiateCapabilities() {
     return true;
 }
 
-ScannerResult TwainScanner::Scan(bool showUI) {
+ScannerResult TwainScanner::Scan(const ScanOptions& options) {
     ScannerResult result;
     m_LastError.clear();
     
@@ -283,92 +692,69 @@ ScannerResult TwainScanner::Scan(bool showUI) {
         return result;
     }
 
-    HWND hwnd = NULL;
-    const wchar_t CLASS_NAME[] = L"TwainWindowClass";
-    bool windowClassRegistered = false;
+    // Drop a persistent session that sat idle past its timeout
+    ExpireIdleSession();
+
+    // A session holding a different source than the one requested has to go
+    if (m_SourceOpen && options.deviceId && options.deviceId != m_SrcId.Id) {
+        CloseSession();
+    }
 
     try {
-        // Find first available scanner
-        TW_UINT16 rc = g_pDSM_Entry(&m_AppId, nullptr, DG_CONTROL, DAT_IDENTITY, MSG_GETFIRST, &m_SrcId);
-        if (rc != TWRC_SUCCESS) {
-            result.errorMessage = "No scanner found";
-            return result;
-        }
+        TW_UINT16 rc;
 
-        // Open data source
-        rc = g_pDSM_Entry(&m_AppId, nullptr, DG_CONTROL, DAT_IDENTITY, MSG_OPENDS, &m_SrcId);
-        if (rc != TWRC_SUCCESS) {
-            result.errorMessage = "Failed to open scanner. Error: " + GetTwainErrorMessage(rc);
+        // Open the data source unless a session is still holding it
+        if (!m_SourceOpen && (!SelectSource(options.deviceId) || !OpenDataSource())) {
+            result.errorMessage = m_LastError;
             return result;
         }
 
-        // Enable duplex if supported
-        if (m_DuplexSupported) {
-            TW_CAPABILITY cap;
-            cap.Cap = CAP_DUPLEXENABLED;
-            cap.ConType = TWON_ONEVALUE;
-            cap.hContainer = GlobalAlloc(GHND, sizeof(TW_ONEVALUE));
-            
-            if (cap.hContainer) {
-                pTW_ONEVALUE pVal = (pTW_ONEVALUE)GlobalLock(cap.hContainer);
-                pVal->ItemType = TWTY_BOOL;
-                pVal->Item = TRUE;
-                GlobalUnlock(cap.hContainer);
-
-                rc = g_pDSM_Entry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CAPABILITY, MSG_SET, (TW_MEMREF)&cap);
-                GlobalFree(cap.hContainer);
-
-                if (rc != TWRC_SUCCESS) {
-                    printf("Warning: Failed to enable duplex scanning\n");
-                }
-            }
-        }
-
         // Set up event handling window
-        WNDCLASSEXW wc = {0};
-        wc.cbSize = sizeof(wc);
-        wc.lpfnWndProc = DefWindowProcW;
-        wc.hInstance = GetModuleHandleW(NULL);
-        wc.lpszClassName = CLASS_NAME;
-        
-        if (!RegisterClassExW(&wc)) {
-            result.errorMessage = "Failed to register window class";
-            CleanupSource();
-            return result;
-        }
-        windowClassRegistered = true;
-        
-        hwnd = CreateWindowExW(
-            0, CLASS_NAME, L"", WS_POPUP,
-            0, 0, 1, 1, NULL, NULL,
-            GetModuleHandleW(NULL), NULL
-        );
-
-        if (!hwnd) {
-            result.errorMessage = "Failed to create message window";
-            CleanupSource();
-            if (windowClassRegistered) {
-                UnregisterClassW(CLASS_NAME, GetModuleHandleW(NULL));
-            }
+        if (!m_hWnd && !CreateMessageWindow()) {
+            result.errorMessage = m_LastError;
+            CloseSession();
             return result;
         }
+        HWND hwnd = m_hWnd;
+        result.deviceId = m_SrcId.Id;
+
+        // Borders the source finds are cropped before transfer
+        SetDeviceBorderDetection(options.autoCrop);
+        bool deviceCrops = m_DeviceDetectsBorders;
+
+        // Blank pages the source drops are never transferred; a session
+        // may still have discarding on from an earlier scan
+        SetDeviceBlankDiscard(options.blankPages == kBlankPagesDrop);
+        bool deviceDiscards = m_DeviceDiscardsBlanks;
+        SetDeviceDeskew(options.deskew);
+        bool deviceDeskews = m_DeviceDeskews;
+        SetDeviceColourDropout(options.dropoutOptions);
+        bool deviceDropsColour = m_DeviceFilter != TWFT_NONE;
+        bool duplex = m_DuplexSupported;
 
         // Enable data source
         TW_USERINTERFACE ui = {0};
-        ui.ShowUI = showUI ? TRUE : FALSE;
+        ui.ShowUI = options.showUI ? TRUE : FALSE;
         ui.ModalUI = TRUE;
         ui.hParent = hwnd;
 
-        rc = g_pDSM_Entry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_USERINTERFACE, MSG_ENABLEDS, (TW_MEMREF)&ui);
+        auto scanStart = std::chrono::steady_clock::now();
+        rc = DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_USERINTERFACE, MSG_ENABLEDS, (TW_MEMREF)&ui);
         if (rc != TWRC_SUCCESS) {
             result.errorMessage = "Failed to enable scanner. Error: " + GetTwainErrorMessage(rc);
-            CleanupResources(hwnd, windowClassRegistered);
+            CloseSession();
             return result;
         }
+        m_Stats->Record(m_SrcId.Id, kStageEnableSource, MillisecondsSince(scanStart));
+        auto enabledAt = std::chrono::steady_clock::now();
 
         // Message loop for scanning
         bool scanning = true;
         std::vector<TW_HANDLE> imageHandles;
+        std::vector<double> transferMs;
+        std::vector<PageSide> pageSides;
+        std::vector<PageResolution> pageResolutions;
+        double firstPageMs = 0;
         DWORD startTime = GetTickCount();
         const DWORD SCAN_TIMEOUT = 300000; // 5 minutes timeout
         bool transferReady = false;
@@ -382,312 +768,1188 @@ ScannerResult TwainScanner::Scan(bool showUI) {
                 break;
             }
 
-            if (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+            // With DAT_CALLBACK registered the source may notify through
+            // the callback instead of the message queue
+            TW_UINT16 dsMessage = m_CallbackMessage.exchange(MSG_NULL);
+            if (dsMessage == MSG_NULL && PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
                 TW_EVENT twEvent;
                 twEvent.pEvent = (TW_MEMREF)&msg;
                 twEvent.TWMessage = MSG_NULL;
 
-                rc = g_pDSM_Entry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_EVENT, MSG_PROCESSEVENT, (TW_MEMREF)&twEvent);
-                
+                rc = DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_EVENT, MSG_PROCESSEVENT, (TW_MEMREF)&twEvent);
                 if (rc == TWRC_DSEVENT) {
-                    printf("Processing TWAIN event: %d\n", twEvent.TWMessage);
+                    dsMessage = twEvent.TWMessage;
+                }
+
+                TranslateMessage(&msg);
+                DispatchMessageW(&msg);
+                startTime = GetTickCount();
+            } else if (dsMessage == MSG_NULL) {
+                if (m_DeviceEventPending) {
+                    DrainDeviceEvents();
+                }
+                Sleep(10);
+            }
+
+            if (dsMessage == MSG_NULL) {
+                continue;
+            }
+
+            SCANNER_LOG(kLogDebug, m_SrcId.Id, LogRecord::kNone, LogRecord::kNone, "Processing TWAIN message %u", (unsigned)dsMessage);
+
+
+            switch (dsMessage) {
+                case MSG_XFERREADY:
+                    if (imageHandles.empty()) {
+                        m_Stats->Record(m_SrcId.Id, kStageWaitForTransfer, MillisecondsSince(enabledAt));
+                    }
+                    transferReady = true;
+                    SCANNER_LOG(kLogDebug, m_SrcId.Id, (int)imageHandles.size(), LogRecord::kNone, "Transfer ready");
                     
-                    switch (twEvent.TWMessage) {
-                        case MSG_XFERREADY:
-                            transferReady = true;
-                            printf("Transfer ready\n");
+                    while (transferReady) {
+                        TW_IMAGEINFO imageInfo;
+                        rc = DsmEntry(&m_AppId, &m_SrcId, DG_IMAGE, DAT_IMAGEINFO, MSG_GET, (TW_MEMREF)&imageInfo);
+                        
+                        if (rc == TWRC_SUCCESS) {
+                            TW_HANDLE handle = NULL;
+                            auto transferStart = std::chrono::steady_clock::now();
+                            rc = DsmEntry(&m_AppId, &m_SrcId, DG_IMAGE, DAT_IMAGENATIVEXFER, MSG_GET, (TW_MEMREF)&handle);
                             
-                            while (transferReady) {
-                                TW_IMAGEINFO imageInfo;
-                                rc = g_pDSM_Entry(&m_AppId, &m_SrcId, DG_IMAGE, DAT_IMAGEINFO, MSG_GET, (TW_MEMREF)&imageInfo);
-                                
-                                if (rc == TWRC_SUCCESS) {
-                                    TW_HANDLE handle = NULL;
-                                    rc = g_pDSM_Entry(&m_AppId, &m_SrcId, DG_IMAGE, DAT_IMAGENATIVEXFER, MSG_GET, (TW_MEMREF)&handle);
-                                    
-                                    if (rc == TWRC_XFERDONE && handle) {
-                                        printf("Image transferred successfully\n");
-                                        imageHandles.push_back(handle);
-                                    }
-                                }
-
-                                // Check for more pending transfers
-                                TW_PENDINGXFERS pendingXfers = {0};
-                                rc = g_pDSM_Entry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_PENDINGXFERS, MSG_ENDXFER, (TW_MEMREF)&pendingXfers);
-                                
-                                if (pendingXfers.Count == 0) {
-                                    printf("No more pending transfers\n");
-                                    transferReady = false;
-                                    scanning = false;
+                            if (rc == TWRC_XFERDONE && handle) {
+                                SCANNER_LOG(kLogDebug, m_SrcId.Id, (int)imageHandles.size(), rc, "Image transferred");
+                                // Duplex pages alternate sides unless the source drops some
+                                pageSides.push_back(!duplex ? kSideFront : deviceDiscards ? kSideUnknown
+                                    : imageHandles.size() % 2 == 0 ? kSideFront : kSideBack);
+                                imageHandles.push_back(handle);
+                                pageResolutions.push_back(PageResolution(Fix32ToDouble(imageInfo.XResolution),
+                                    Fix32ToDouble(imageInfo.YResolution)));
+                                transferMs.push_back(MillisecondsSince(transferStart));
+                                m_Stats->Record(m_SrcId.Id, kStageTransfer, transferMs.back());
+                                if (imageHandles.size() == 1) {
+                                    firstPageMs = MillisecondsSince(scanStart);
                                 }
+                            } else {
+                                SCANNER_LOG(kLogWarn, m_SrcId.Id, (int)imageHandles.size(), rc, "Native transfer failed");
                             }
-                            break;
-
-                        case MSG_CLOSEDSREQ:
-                            printf("Close DS requested\n");
+                        } else {
+                            SCANNER_LOG(kLogWarn, m_SrcId.Id, (int)imageHandles.size(), rc, "Image info unavailable");
+                        }
+
+                        // Check for more pending transfers
+                        TW_PENDINGXFERS pendingXfers = {0};
+                        rc = DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_PENDINGXFERS, MSG_ENDXFER, (TW_MEMREF)&pendingXfers);
+                        
+                        if (pendingXfers.Count == 0) {
+                            SCANNER_LOG(kLogDebug, m_SrcId.Id, LogRecord::kNone, rc, "No more pending transfers");
+                            transferReady = false;
                             scanning = false;
-                            break;
+                        }
                     }
-                }
+                    break;
 
-                TranslateMessage(&msg);
-                DispatchMessageW(&msg);
-                startTime = GetTickCount();
-            } else {
-                Sleep(10);
+                case MSG_CLOSEDSREQ:
+                    SCANNER_LOG(kLogInfo, m_SrcId.Id, LogRecord::kNone, LogRecord::kNone, "Source asked to be closed");
+                    scanning = false;
+                    break;
+
+                case MSG_DEVICEEVENT:
+                    DrainDeviceEvents();
+                    break;
             }
         }
 
         // Process scanned images
         if (!imageHandles.empty()) {
-            printf("Processing %zu images\n", imageHandles.size());
+            SCANNER_LOG(kLogInfo, m_SrcId.Id, LogRecord::kNone, LogRecord::kNone, "Processing %zu images", imageHandles.size());
+            // Cropping goes first so every later stage reads less. The crop
+            // and deskew are left to the encoding pass, which applies them
+            // strip by strip as it reads each page, unless a whole-page
+            // transform has to see the cropped page first.
+            bool wholePageTransforms = options.resampleOptions.dpi > 0 ||
+                options.frontRotation != 0 || options.backRotation != 0;
+            std::vector<CropRect> cropRects;
+            std::vector<PendingPage> pending(imageHandles.size());
+            if (options.autoCrop && !deviceCrops) {
+                CropPages(imageHandles, options.autoCropOptions, wholePageTransforms, cropRects);
+                for (size_t i = 0; i < pending.size() && !wholePageTransforms; i++) {
+                    pending[i].crop = cropRects[i];
+                }
+            }
+            std::vector<TW_UINT32> blankPages;
+            if (options.blankPages != kBlankPagesKeep && !deviceDiscards) {
+                DetectBlankPages(imageHandles, transferMs, pending, options, blankPages);
+            }
+            if (options.blankPages == kBlankPagesDrop) {
+                for (auto page = blankPages.rbegin(); page != blankPages.rend(); ++page) {
+                    if (*page < cropRects.size()) {
+                        cropRects.erase(cropRects.begin() + *page);
+                    }
+                    if (*page < pageSides.size()) {
+                        pageSides.erase(pageSides.begin() + *page);
+                    }
+                    if (*page < pageResolutions.size()) {
+                        pageResolutions.erase(pageResolutions.begin() + *page);
+                    }
+                }
+            }
+            // Before deskew, which then turns fewer pixels when shrinking
+            if (options.resampleOptions.dpi > 0) {
+                ResamplePages(imageHandles, pageResolutions, options.resampleOptions);
+            }
+            std::vector<double> deskewAngles;
+            if (options.deskew && !deviceDeskews) {
+                DeskewPages(imageHandles, pending, options.deskewOptions, deskewAngles);
+            }
+
             try {
-                if (m_DuplexSupported && imageHandles.size() > 1) {
-                    result = ProcessDuplexImages(imageHandles);
+                // Feeder batches come back as several handles with or without duplex
+                if (imageHandles.size() > 1) {
+                    result = ProcessDuplexImages(imageHandles, pageSides, pending, options);
+                } else if (!imageHandles.empty()) {
+                    result = ProcessImage(imageHandles[0], pageSides.empty() ? kSideFront : pageSides[0], pending[0], options);
                 } else {
-                    result = ProcessImage(imageHandles[0]);
+                    // Every page was blank and dropped
+                    result = ScannerResult();
+                    result.success = true;
                 }
             } catch (const std::exception& e) {
                 result.errorMessage = std::string("Image processing failed: ") + e.what();
             }
+            result.deviceId = m_SrcId.Id;
+            result.cropRects.swap(cropRects);
+            result.blankPages.swap(blankPages);
+            result.deskewAngles.swap(deskewAngles);
+            result.scanResolutions.swap(pageResolutions);
 
             // Clean up handles regardless of processing result
-            printf("Cleaning up image handles\n");
+            SCANNER_LOG(kLogDebug, m_SrcId.Id, LogRecord::kNone, LogRecord::kNone, "Cleaning up image handles");
             for (auto handle : imageHandles) {
                 if (handle) {
                     GlobalFree((HANDLE)handle);
                 }
             }
             imageHandles.clear();
+
+            // Encode times were recorded per page by the processing step
+            result.timings.firstPageMs = firstPageMs;
+            for (size_t i = 0; i < result.timings.pageMs.size() && i < transferMs.size(); i++) {
+                result.timings.pageMs[i] += transferMs[i];
+            }
         }
+        result.timings.totalMs = MillisecondsSince(scanStart);
+        result.croppedByDevice = deviceCrops;
+        result.blankPagesDiscardedByDevice = deviceDiscards;
+        result.deskewedByDevice = deviceDeskews;
+        result.colourDroppedByDevice = deviceDropsColour;
 
         // Ensure UI is disabled before cleanup
         ui.ShowUI = FALSE;
         ui.ModalUI = TRUE;
         ui.hParent = hwnd;
-        g_pDSM_Entry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_USERINTERFACE, MSG_DISABLEDS, (TW_MEMREF)&ui);
+        DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_USERINTERFACE, MSG_DISABLEDS, (TW_MEMREF)&ui);
 
-        // Final cleanup
-        CleanupResources(hwnd, windowClassRegistered);
+        // Final cleanup, unless the session keeps the source for the next scan
+        if (m_PersistentSession) {
+            m_LastSessionUse = GetTickCount();
+        } else {
+            CloseSession();
+        }
         return result;
     }
     catch (const std::exception& e) {
         result.errorMessage = std::string("Scanning error: ") + e.what();
-        CleanupResources(hwnd, windowClassRegistered);
+        CloseSession();
         return result;
     }
 }
 
-void TwainScanner::CleanupSource() {
-    g_pDSM_Entry(&m_AppId, nullptr, DG_CONTROL, DAT_IDENTITY, MSG_CLOSEDS, &m_SrcId);
-}
+bool TwainScanner::EnumerateSources() {
+    std::vector<TW_IDENTITY> sources;
+    TW_IDENTITY source;
+    memset(&source, 0, sizeof(TW_IDENTITY));
 
-void TwainScanner::CleanupResources(HWND hwnd, bool windowClassRegistered) {
-    if (hwnd) {
-        DestroyWindow(hwnd);
-    }
-    if (windowClassRegistered) {
-        UnregisterClassW(L"TwainWindowClass", GetModuleHandleW(NULL));
+    TW_UINT16 rc = DsmEntry(&m_AppId, nullptr, DG_CONTROL, DAT_IDENTITY, MSG_GETFIRST, &source);
+    while (rc == TWRC_SUCCESS) {
+        sources.push_back(source);
+        rc = DsmEntry(&m_AppId, nullptr, DG_CONTROL, DAT_IDENTITY, MSG_GETNEXT, &source);
     }
-    CleanupSource();
+
+    m_Sources.swap(sources);
+    m_SourcesFetchedAt = GetTickCount();
+    return rc == TWRC_ENDOFLIST;
 }
 
-bool TwainScanner::EnableDuplex() {
-    TW_CAPABILITY cap;
-    cap.Cap = CAP_DUPLEXENABLED;
-    cap.ConType = TWON_ONEVALUE;
-    cap.hContainer = GlobalAlloc(GHND, sizeof(TW_ONEVALUE));
-    
-    if (!cap.hContainer) {
-        printf("Failed to allocate memory for duplex setting\n");
+bool TwainScanner::ListDevices(bool refresh, std::vector<TW_IDENTITY>& devices) {
+    if (!m_Initialized) {
+        m_LastError = "Scanner not initialized. Call Initialize() first.";
         return false;
     }
 
-    pTW_ONEVALUE pVal = (pTW_ONEVALUE)GlobalLock(cap.hContainer);
-    pVal->ItemType = TWTY_BOOL;
-    pVal->Item = TRUE;
-    GlobalUnlock(cap.hContainer);
-
-    TW_UINT16 rc = g_pDSM_Entry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CAPABILITY, MSG_SET, (TW_MEMREF)&cap);
-    GlobalFree(cap.hContainer);
-
-    if (rc != TWRC_SUCCESS) {
-        printf("Failed to enable duplex scanning\n");
-        return false;
+    if (refresh || GetTickCount() - m_SourcesFetchedAt > m_SourceListTtl) {
+        EnumerateSources();
     }
 
+    devices = m_Sources;
     return true;
 }
 
-ScannerResult TwainScanner::ProcessDuplexImages(const std::vector<TW_HANDLE>& handles) {
-    ScannerResult result;
-    
-    if (handles.empty()) {
-        result.errorMessage = "No images to process";
-        return result;
+bool TwainScanner::SelectSource(TW_UINT32 deviceId) {
+    if (deviceId == 0) {
+        // Find first available scanner
+        TW_UINT16 rc = DsmEntry(&m_AppId, nullptr, DG_CONTROL, DAT_IDENTITY, MSG_GETFIRST, &m_SrcId);
+        if (rc != TWRC_SUCCESS) {
+            m_LastError = "No scanner found";
+            return false;
+        }
+        return true;
     }
 
-    try {
-        printf("Starting duplex image processing with %zu images\n", handles.size());
-        
-        // Process each image separately instead of combining them
-        for (size_t i = 0; i < handles.size(); i++) {
-            printf("Processing image %zu of %zu\n", i + 1, handles.size());
-            
-            PBITMAPINFOHEADER pHeader = (PBITMAPINFOHEADER)GlobalLock((HANDLE)handles[i]);
-            if (!pHeader) {
-                throw std::runtime_error("Failed to lock image memory");
+    // Look in the cached list first and re-enumerate once on a miss
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (attempt == 1 || GetTickCount() - m_SourcesFetchedAt > m_SourceListTtl) {
+            EnumerateSources();
+        }
+        for (const auto& source : m_Sources) {
+            if (source.Id == deviceId) {
+                m_SrcId = source;
+                return true;
             }
+        }
+    }
 
-            // Calculate sizes
-            DWORD dwImageSize = pHeader->biSizeImage;
-            DWORD dwFileSize = dwImageSize + sizeof(BITMAPFILEHEADER) + pHeader->biSize;
-            
-            // Create file header
-            BITMAPFILEHEADER fileHeader = { 0 };
-            fileHeader.bfType = 0x4D42; // "BM"
-            fileHeader.bfSize = dwFileSize;
-            fileHeader.bfOffBits = sizeof(BITMAPFILEHEADER) + pHeader->biSize;
-
-            // Create memory buffer for the complete BMP
-            std::vector<BYTE> buffer(dwFileSize);
-            
-            // Copy file header
-            memcpy(buffer.data(), &fileHeader, sizeof(BITMAPFILEHEADER));
-            
-            // Copy info header and color table
-            DWORD headerSize = pHeader->biSize;
-            memcpy(buffer.data() + sizeof(BITMAPFILEHEADER), pHeader, headerSize);
-            
-            // Copy image data
-            memcpy(
-                buffer.data() + sizeof(BITMAPFILEHEADER) + headerSize,
-                (BYTE*)pHeader + headerSize,
-                dwImageSize
-            );
+    m_LastError = "Scanner " + std::to_string(deviceId) + " not found";
+    return false;
+}
 
-            GlobalUnlock((HANDLE)handles[i]);
+bool TwainScanner::OpenDataSource() {
+    auto openStart = std::chrono::steady_clock::now();
+    TW_UINT16 rc = DsmEntry(&m_AppId, nullptr, DG_CONTROL, DAT_IDENTITY, MSG_OPENDS, &m_SrcId);
+    if (rc != TWRC_SUCCESS) {
+        m_LastError = "Failed to open scanner. Error: " + GetTwainErrorMessage(rc);
+        return false;
+    }
+    m_SourceOpen = true;
+    m_Stats->SetDeviceName(m_SrcId.Id, m_SrcId.ProductName);
+    m_Stats->Record(m_SrcId.Id, kStageOpenSource, MillisecondsSince(openStart));
+    auto negotiateStart = std::chrono::steady_clock::now();
+
+    // Capabilities are per source; probe the short set when switching to
+    // a source the cache has not seen
+    if (m_CapabilitiesSourceId != m_SrcId.Id && !LoadCachedCapabilities()) {
+        ProbeCapabilities(kProbedCapabilities, kProbedCapabilityCount, m_Capabilities);
+        m_CapabilitiesSourceId = m_SrcId.Id;
+        m_CapabilitiesComplete = false;
+        ApplyCapabilities();
+        m_CapabilityCache.Store(m_SrcId, m_Capabilities, m_CapabilitiesComplete);
+        m_CapabilityCache.Save();
+    }
 
-            // Convert to Base64
-            static const char base64Chars[] =
-                "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    // Enable duplex if supported
+    if (m_DuplexSupported) {
+        EnableDuplex();
+    }
 
-            std::string base64;
-            base64.reserve(((buffer.size() + 2) / 3) * 4);
+    if (m_DeviceEventHandler) {
+        EnableDeviceEvents();
+    }
+
+    m_Stats->Record(m_SrcId.Id, kStageNegotiate, MillisecondsSince(negotiateStart));
+    return true;
+}
+
+void TwainScanner::CloseDataSource() {
+    if (!m_SourceOpen) {
+        return;
+    }
+    DsmEntry(&m_AppId, nullptr, DG_CONTROL, DAT_IDENTITY, MSG_CLOSEDS, &m_SrcId);
+    m_SourceOpen = false;
+    // Capabilities go back to their defaults with the source
+    m_DeviceDetectsBorders = false;
+    m_DeviceDiscardsBlanks = false;
+    m_DeviceDeskews = false;
+    m_DeviceFilter = TWFT_NONE;
+
+    // The callback registration ends with the source
+    if (m_CallbackRegistered) {
+        std::lock_guard<std::mutex> lock(g_CallbackMutex);
+        g_CallbackTargets.erase(m_AppId.Id);
+        m_CallbackRegistered = false;
+    }
+    m_CallbackMessage = MSG_NULL;
+    m_DeviceEventPending = false;
+}
+
+bool TwainScanner::CreateMessageWindow() {
+    if (!AcquireWindowClass()) {
+        m_LastError = "Failed to register window class";
+        return false;
+    }
+    m_WindowClassRegistered = true;
+
+    m_hWnd = CreateWindowExW(
+        0, kWindowClassName, L"", WS_POPUP,
+        0, 0, 1, 1, NULL, NULL,
+        GetModuleHandleW(NULL), NULL
+    );
+
+    if (!m_hWnd) {
+        m_LastError = "Failed to create message window";
+        DestroyMessageWindow();
+        return false;
+    }
+
+    return true;
+}
+
+void TwainScanner::DestroyMessageWindow() {
+    if (m_hWnd) {
+        DestroyWindow(m_hWnd);
+        m_hWnd = NULL;
+    }
+    if (m_WindowClassRegistered) {
+        ReleaseWindowClass();
+        m_WindowClassRegistered = false;
+    }
+}
+
+// Closes the DSM and the window it was opened with
+void TwainScanner::CloseDsm() {
+    if (m_hDSMLib) {
+        DsmEntry(&m_AppId, nullptr, DG_CONTROL, DAT_PARENT, MSG_CLOSEDSM, (TW_MEMREF)&m_hDSMLib);
+        DestroyWindow((HWND)m_hDSMLib);
+        m_hDSMLib = nullptr;
+    }
+}
+
+void TwainScanner::SetSessionOptions(bool persistent, DWORD idleTimeoutMs) {
+    m_PersistentSession = persistent;
+    m_SessionIdleTimeout = idleTimeoutMs;
+    if (!persistent) {
+        CloseSession();
+    }
+}
+
+void TwainScanner::CloseSession() {
+    DestroyMessageWindow();
+    CloseDataSource();
+}
+
+void TwainScanner::OnIdle() {
+    if (!m_Initialized) {
+        return;
+    }
+
+    ExpireIdleSession();
+
+    if (m_CapabilitiesStale) {
+        // One attempt per initialize; a missing device surfaces on the next scan
+        m_CapabilitiesStale = false;
+        bool changed = false;
+        if (RevalidateCapabilities(changed) && changed) {
+            SCANNER_LOG(kLogInfo, m_SrcId.Id, LogRecord::kNone, LogRecord::kNone, "Cached capabilities were out of date and have been refreshed");
+        }
+    }
+
+    if (m_DeviceEventPending) {
+        DrainDeviceEvents();
+    }
+    if (m_DeviceEventHandler) {
+        PollDevices();
+    }
+}
+
+bool TwainScanner::ProcessMessage(MSG& msg) {
+    if (!m_SourceOpen) {
+        return false;
+    }
+
+    TW_EVENT twEvent;
+    twEvent.pEvent = (TW_MEMREF)&msg;
+    twEvent.TWMessage = MSG_NULL;
+    TW_UINT16 rc = DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_EVENT, MSG_PROCESSEVENT, (TW_MEMREF)&twEvent);
+    if (rc != TWRC_DSEVENT) {
+        return false;
+    }
+
+    // The source is not enabled between scans, so transfer and close
+    // requests cannot arrive here
+    if (twEvent.TWMessage == MSG_DEVICEEVENT) {
+        DrainDeviceEvents();
+    }
+    return true;
+}
+
+void TwainScanner::ExpireIdleSession() {
+    if (m_SourceOpen && m_PersistentSession &&
+        GetTickCount() - m_LastSessionUse > m_SessionIdleTimeout) {
+        SCANNER_LOG(kLogInfo, m_SrcId.Id, LogRecord::kNone, LogRecord::kNone, "Closing idle scanner session");
+        CloseSession();
+    }
+}
+
+void TwainScanner::StartDeviceMonitor(DeviceEventHandler handler, DWORD pollIntervalMs) {
+    m_DeviceEventHandler = handler;
+    m_DevicePollInterval = pollIntervalMs;
+    m_LastDevicePoll = GetTickCount();
+
+    // Take a fresh baseline so only later changes are reported
+    if (m_Initialized) {
+        EnumerateSources();
+    }
+    if (m_SourceOpen) {
+        EnableDeviceEvents();
+    }
+}
+
+void TwainScanner::StopDeviceMonitor() {
+    // A registered callback stays in place until the source closes, since
+    // the source may also use it for MSG_XFERREADY
+    m_DeviceEventHandler = nullptr;
+}
+
+bool TwainScanner::EnableDeviceEvents() {
+    static const TW_UINT16 events[] = {
+        TWDE_DEVICEADDED, TWDE_DEVICEOFFLINE, TWDE_DEVICEREADY, TWDE_DEVICEREMOVED,
+        TWDE_PAPERDOUBLEFEED, TWDE_PAPERJAM, TWDE_LAMPFAILURE, TWDE_POWERSAVE
+    };
+    const TW_UINT32 count = sizeof(events) / sizeof(events[0]);
+
+    TW_CAPABILITY cap;
+    cap.Cap = CAP_DEVICEEVENT;
+    cap.ConType = TWON_ARRAY;
+    cap.hContainer = GlobalAlloc(GHND, sizeof(TW_ARRAY) + count * sizeof(TW_UINT16));
+    if (!cap.hContainer) {
+        return false;
+    }
+
+    pTW_ARRAY pArray = (pTW_ARRAY)GlobalLock(cap.hContainer);
+    pArray->ItemType = TWTY_UINT16;
+    pArray->NumItems = count;
+    memcpy(pArray->ItemList, events, sizeof(events));
+    GlobalUnlock(cap.hContainer);
+
+    TW_UINT16 rc = DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CAPABILITY, MSG_SET, (TW_MEMREF)&cap);
+    GlobalFree(cap.hContainer);
+
+    if (rc != TWRC_SUCCESS) {
+        SCANNER_LOG(kLogWarn, m_SrcId.Id, LogRecord::kNone, rc, "Scanner does not report device events");
+        return false;
+    }
+
+    if (!m_CallbackRegistered) {
+        {
+            std::lock_guard<std::mutex> lock(g_CallbackMutex);
+            g_CallbackTargets[m_AppId.Id] = this;
+        }
+
+        TW_CALLBACK callback;
+        memset(&callback, 0, sizeof(TW_CALLBACK));
+        callback.CallBackProc = (TW_MEMREF)&TwainScanner::DeviceCallback;
+        callback.RefCon = m_AppId.Id;
+
+        rc = DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CALLBACK, MSG_REGISTER_CALLBACK, (TW_MEMREF)&callback);
+        m_CallbackRegistered = rc == TWRC_SUCCESS;
+        if (!m_CallbackRegistered) {
+            // Events still arrive as MSG_DEVICEEVENT through
+            // MSG_PROCESSEVENT, from the scan loop or ProcessMessage
+            std::lock_guard<std::mutex> lock(g_CallbackMutex);
+            g_CallbackTargets.erase(m_AppId.Id);
+        }
+    }
+
+    return true;
+}
+
+TW_UINT16 TW_CALLINGSTYLE TwainScanner::DeviceCallback(pTW_IDENTITY pOrigin, pTW_IDENTITY pDest,
+    TW_UINT32 DG, TW_UINT16 DAT, TW_UINT16 MSG, TW_MEMREF pData) {
+    (void)pOrigin;
+    (void)DG;
+    (void)DAT;
+
+    // May be called from a thread owned by the source; only flag the
+    // message here and let the TWAIN thread act on it
+    std::lock_guard<std::mutex> lock(g_CallbackMutex);
+    auto it = g_CallbackTargets.find(pDest ? pDest->Id : 0);
+    if (it == g_CallbackTargets.end()) {
+        it = g_CallbackTargets.find((TW_UINT32)(TW_UINTPTR)pData);
+    }
+    if (it == g_CallbackTargets.end()) {
+        return TWRC_FAILURE;
+    }
+    if (DsmRecorder::Active()) {
+        DsmRecorder::RecordNotification(MSG);
+    }
+
+    if (MSG == MSG_DEVICEEVENT) {
+        it->second->m_DeviceEventPending = true;
+    } else if (MSG == MSG_XFERREADY || MSG == MSG_CLOSEDSREQ || MSG == MSG_CLOSEDSOK) {
+        it->second->m_CallbackMessage = MSG;
+    }
+    return TWRC_SUCCESS;
+}
+
+static const char* DeviceEventTypeOf(TW_UINT16 event) {
+    switch (event) {
+        case TWDE_CHECKAUTOMATICCAPTURE:
+        case TWDE_CHECKBATTERY:
+        case TWDE_CHECKDEVICEONLINE:
+        case TWDE_CHECKFLASH:
+        case TWDE_CHECKPOWERSUPPLY:
+        case TWDE_CHECKRESOLUTION: return "statusChanged";
+        case TWDE_DEVICEADDED: return "deviceAdded";
+        case TWDE_DEVICEOFFLINE: return "deviceOffline";
+        case TWDE_DEVICEREADY: return "deviceReady";
+        case TWDE_DEVICEREMOVED: return "deviceRemoved";
+        case TWDE_IMAGECAPTURED: return "imageCaptured";
+        case TWDE_IMAGEDELETED: return "imageDeleted";
+        case TWDE_PAPERDOUBLEFEED: return "paperDoubleFeed";
+        case TWDE_PAPERJAM: return "paperJam";
+        case TWDE_LAMPFAILURE: return "lampFailure";
+        case TWDE_POWERSAVE:
+        case TWDE_POWERSAVENOTIFY: return "powerSave";
+        default: return "custom";
+    }
+}
+
+void TwainScanner::DrainDeviceEvents() {
+    m_DeviceEventPending = false;
+    if (!m_SourceOpen) {
+        return;
+    }
+
+    // The source queues one TW_DEVICEEVENT per notification; read until
+    // it reports none left, bounded in case a driver never does
+    for (int i = 0; i < 64; i++) {
+        TW_DEVICEEVENT twEvent;
+        memset(&twEvent, 0, sizeof(TW_DEVICEEVENT));
+        TW_UINT16 rc = DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_DEVICEEVENT, MSG_GET, (TW_MEMREF)&twEvent);
+        if (rc != TWRC_SUCCESS) {
+            break;
+        }
+        if (!m_DeviceEventHandler) {
+            continue;
+        }
+
+        DeviceEvent event;
+        event.type = DeviceEventTypeOf((TW_UINT16)twEvent.Event);
+        event.deviceId = m_SrcId.Id;
+        event.deviceName = std::string(twEvent.DeviceName, strnlen(twEvent.DeviceName, sizeof(twEvent.DeviceName)));
+        if (event.deviceName.empty()) {
+            event.deviceName = m_SrcId.ProductName;
+        }
+        event.code = (TW_UINT16)twEvent.Event;
+        m_DeviceEventHandler(event);
+    }
+}
+
+void TwainScanner::EmitDeviceEvent(const char* type, const TW_IDENTITY& source) {
+    DeviceEvent event;
+    event.type = type;
+    event.deviceId = source.Id;
+    event.deviceName = source.ProductName;
+    m_DeviceEventHandler(event);
+}
+
+void TwainScanner::PollDevices() {
+    DWORD now = GetTickCount();
+    if (now - m_LastDevicePoll < m_DevicePollInterval) {
+        return;
+    }
+    m_LastDevicePoll = now;
+
+    std::vector<TW_IDENTITY> previous = m_Sources;
+    if (!EnumerateSources()) {
+        return;
+    }
 
-            for (size_t j = 0; j < buffer.size(); j += 3) {
-                uint32_t b = (buffer[j] << 16) & 0xFF0000;
-                if (j + 1 < buffer.size()) b |= (buffer[j + 1] << 8) & 0xFF00;
-                if (j + 2 < buffer.size()) b |= buffer[j + 2] & 0xFF;
+    auto contains = [](const std::vector<TW_IDENTITY>& list, TW_UINT32 id) {
+        return std::any_of(list.begin(), list.end(),
+            [id](const TW_IDENTITY& source) { return source.Id == id; });
+    };
 
-                base64.push_back(base64Chars[(b >> 18) & 0x3F]);
-                base64.push_back(base64Chars[(b >> 12) & 0x3F]);
-                base64.push_back(j + 1 < buffer.size() ? base64Chars[(b >> 6) & 0x3F] : '=');
-                base64.push_back(j + 2 < buffer.size() ? base64Chars[b & 0x3F] : '=');
+    for (const auto& source : m_Sources) {
+        if (!contains(previous, source.Id)) {
+            EmitDeviceEvent("deviceAdded", source);
+        }
+    }
+    for (const auto& source : previous) {
+        if (!contains(m_Sources, source.Id)) {
+            if (m_SourceOpen && source.Id == m_SrcId.Id) {
+                CloseSession();
             }
+            EmitDeviceEvent("deviceRemoved", source);
+        }
+    }
+}
+
+bool TwainScanner::EnableDuplex() {
+    TW_CAPABILITY cap;
+    cap.Cap = CAP_DUPLEXENABLED;
+    cap.ConType = TWON_ONEVALUE;
+    cap.hContainer = GlobalAlloc(GHND, sizeof(TW_ONEVALUE));
+    
+    if (!cap.hContainer) {
+        SCANNER_LOG(kLogError, m_SrcId.Id, LogRecord::kNone, LogRecord::kNone, "Failed to allocate memory for duplex setting");
+        return false;
+    }
+
+    pTW_ONEVALUE pVal = (pTW_ONEVALUE)GlobalLock(cap.hContainer);
+    pVal->ItemType = TWTY_BOOL;
+    pVal->Item = TRUE;
+    GlobalUnlock(cap.hContainer);
+
+    TW_UINT16 rc = DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CAPABILITY, MSG_SET, (TW_MEMREF)&cap);
+    GlobalFree(cap.hContainer);
+
+    if (rc != TWRC_SUCCESS) {
+        SCANNER_LOG(kLogWarn, m_SrcId.Id, LogRecord::kNone, rc, "Failed to enable duplex scanning");
+        return false;
+    }
+
+    return true;
+}
+
+// Asks the source to find the document edges and crop to them, or to
+// stop. Border detection needs ICAP_UNDEFINEDIMAGESIZE on, where offered.
+// False when the source does not offer ICAP_AUTOMATICBORDERDETECTION or
+// refuses.
+bool TwainScanner::SetDeviceBorderDetection(bool enabled) {
+    if (enabled == m_DeviceDetectsBorders) {
+        return true;
+    }
+    const CapabilityInfo* border = FindCapability(m_Capabilities, ICAP_AUTOMATICBORDERDETECTION);
+    if (!border || !border->IsSettable()) {
+        return false;
+    }
 
-            result.base64Images.push_back(base64);
+    const TW_UINT16 caps[] = { ICAP_UNDEFINEDIMAGESIZE, ICAP_AUTOMATICBORDERDETECTION };
+    for (TW_UINT16 capId : caps) {
+        const CapabilityInfo* info = FindCapability(m_Capabilities, capId);
+        if (!info || !info->IsSettable()) {
+            continue;
         }
 
-        result.success = true;
+        TW_CAPABILITY cap;
+        cap.Cap = capId;
+        cap.ConType = TWON_ONEVALUE;
+        cap.hContainer = GlobalAlloc(GHND, sizeof(TW_ONEVALUE));
+        if (!cap.hContainer) {
+            return false;
+        }
 
-    } catch (const std::exception& e) {
-        result.errorMessage = std::string("Duplex image processing error: ") + e.what();
-        printf("Error during image processing: %s\n", result.errorMessage.c_str());
+        pTW_ONEVALUE pVal = (pTW_ONEVALUE)GlobalLock(cap.hContainer);
+        pVal->ItemType = TWTY_BOOL;
+        pVal->Item = enabled ? TRUE : FALSE;
+        GlobalUnlock(cap.hContainer);
+
+        TW_UINT16 rc = DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CAPABILITY, MSG_SET, (TW_MEMREF)&cap);
+        GlobalFree(cap.hContainer);
+
+        if (rc != TWRC_SUCCESS && capId == ICAP_AUTOMATICBORDERDETECTION) {
+            SCANNER_LOG(kLogWarn, m_SrcId.Id, LogRecord::kNone, rc, "Failed to %s border detection on the source",
+                enabled ? "enable" : "disable");
+            return false;
+        }
     }
+    m_DeviceDetectsBorders = enabled;
+    return true;
+}
 
-    return result;
+// Finds the document on every transferred page, cropping the DIB to it in
+// place when apply is set and otherwise leaving the crop to the encoding
+// pass. rects gets the rectangle kept of each page.
+void TwainScanner::CropPages(const std::vector<TW_HANDLE>& handles, const AutoCropOptions& options, bool apply,
+    std::vector<CropRect>& rects) {
+    rects.assign(handles.size(), CropRect());
+    for (size_t i = 0; i < handles.size(); i++) {
+        auto cropStart = std::chrono::steady_clock::now();
+        void* dib = GlobalLock((HANDLE)handles[i]);
+        if (!dib) {
+            continue;
+        }
+        DibLayout layout;
+        std::string error;
+        bool found = ReadDibLayout(dib, GlobalSize((HANDLE)handles[i]), layout, error)
+            && FindDocumentBounds(layout, options, rects[i]) && (!apply || CropDib(layout, rects[i]));
+        GlobalUnlock((HANDLE)handles[i]);
+        m_Stats->Record(m_SrcId.Id, kStageAutoCrop, MillisecondsSince(cropStart));
+
+        if (found) {
+            SCANNER_LOG(kLogDebug, m_SrcId.Id, (int)i, LogRecord::kNone, "Cropped to %ux%u at %u,%u",
+                rects[i].width, rects[i].height, rects[i].left, rects[i].top);
+        } else {
+            SCANNER_LOG(kLogDebug, m_SrcId.Id, (int)i, LogRecord::kNone, "No document found, page left as is");
+        }
+    }
+}
+
+// Asks the source to discard blank pages itself (TWBP_AUTO) or to stop.
+// False when it does not offer ICAP_AUTODISCARDBLANKPAGES or refuses.
+bool TwainScanner::SetDeviceBlankDiscard(bool enabled) {
+    if (enabled == m_DeviceDiscardsBlanks) {
+        return true;
+    }
+    const CapabilityInfo* discard = FindCapability(m_Capabilities, ICAP_AUTODISCARDBLANKPAGES);
+    if (!discard || !discard->IsSettable()) {
+        return false;
+    }
+
+    TW_CAPABILITY cap;
+    cap.Cap = ICAP_AUTODISCARDBLANKPAGES;
+    cap.ConType = TWON_ONEVALUE;
+    cap.hContainer = GlobalAlloc(GHND, sizeof(TW_ONEVALUE));
+    if (!cap.hContainer) {
+        return false;
+    }
+
+    pTW_ONEVALUE pVal = (pTW_ONEVALUE)GlobalLock(cap.hContainer);
+    pVal->ItemType = TWTY_INT32;
+    pVal->Item = (TW_UINT32)(TW_INT32)(enabled ? TWBP_AUTO : TWBP_DISABLE);
+    GlobalUnlock(cap.hContainer);
+
+    TW_UINT16 rc = DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CAPABILITY, MSG_SET, (TW_MEMREF)&cap);
+    GlobalFree(cap.hContainer);
+
+    if (rc != TWRC_SUCCESS) {
+        SCANNER_LOG(kLogWarn, m_SrcId.Id, LogRecord::kNone, rc, "Failed to %s blank page discarding on the source",
+            enabled ? "enable" : "disable");
+        return false;
+    }
+    m_DeviceDiscardsBlanks = enabled;
+    return true;
+}
+
+// Runs the host blank page detector over every transferred page, as
+// cropped, before any of them is encoded. Blank pages are listed by
+// transfer order and, when dropping, freed and removed along with their
+// transfer times and pending work.
+void TwainScanner::DetectBlankPages(std::vector<TW_HANDLE>& handles, std::vector<double>& transferMs,
+    std::vector<PendingPage>& pending, const ScanOptions& options, std::vector<TW_UINT32>& blankPages) {
+    size_t kept = 0;
+    for (size_t i = 0; i < handles.size(); i++) {
+        auto detectStart = std::chrono::steady_clock::now();
+        BlankPageAnalysis analysis;
+        DibStripSource source;
+        if (LockPage(handles[i], pending[i].crop, source)) {
+            DibLayout view = source.View();
+            AnalyzeBlankPage(view, options.blankPageOptions, analysis);
+            GlobalUnlock((HANDLE)handles[i]);
+        }
+        m_Stats->Record(m_SrcId.Id, kStageBlankDetect, MillisecondsSince(detectStart));
+
+        if (analysis.blank) {
+            SCANNER_LOG(kLogDebug, m_SrcId.Id, (int)i, LogRecord::kNone, "Blank page: ink %.5f, edges %.5f",
+                analysis.inkCoverage, analysis.edgeDensity);
+            blankPages.push_back((TW_UINT32)i);
+            if (options.blankPages == kBlankPagesDrop) {
+                GlobalFree((HANDLE)handles[i]);
+                continue;
+            }
+        }
+        handles[kept] = handles[i];
+        pending[kept] = pending[i];
+        if (i < transferMs.size()) {
+            transferMs[kept] = transferMs[i];
+        }
+        kept++;
+    }
+    handles.resize(kept);
+    pending.resize(kept);
+    transferMs.resize(std::min(transferMs.size(), kept));
+}
+
+// Asks the source to straighten pages itself or to stop. False when it
+// does not offer ICAP_AUTOMATICDESKEW or refuses.
+bool TwainScanner::SetDeviceDeskew(bool enabled) {
+    if (enabled == m_DeviceDeskews) {
+        return true;
+    }
+    const CapabilityInfo* deskew = FindCapability(m_Capabilities, ICAP_AUTOMATICDESKEW);
+    if (!deskew || !deskew->IsSettable()) {
+        return false;
+    }
+
+    TW_CAPABILITY cap;
+    cap.Cap = ICAP_AUTOMATICDESKEW;
+    cap.ConType = TWON_ONEVALUE;
+    cap.hContainer = GlobalAlloc(GHND, sizeof(TW_ONEVALUE));
+    if (!cap.hContainer) {
+        return false;
+    }
+
+    pTW_ONEVALUE pVal = (pTW_ONEVALUE)GlobalLock(cap.hContainer);
+    pVal->ItemType = TWTY_BOOL;
+    pVal->Item = enabled ? TRUE : FALSE;
+    GlobalUnlock(cap.hContainer);
+
+    TW_UINT16 rc = DsmEntry(&m_AppId, &m_SrcId, DG_CONTROL, DAT_CAPABILITY, MSG_SET, (TW_MEMREF)&cap);
+    GlobalFree(cap.hContainer);
+
+    if (rc != TWRC_SUCCESS) {
+        SCANNER_LOG(kLogWarn, m_SrcId.Id, LogRecord::kNone, rc, "Failed to %s automatic deskew on the source",
+            enabled ? "enable" : "disable");
+        return false;
+    }
+    m_DeviceDeskews = enabled;
+    return true;
+}
+
+// Asks the source to drop a colour channel itself through ICAP_FILTER,
+// sending that channel as grey or, for 1 bit output, black and white; or
+// to go back to its earlier pixel type. True when the source now drops the
+// channel asked for. Hue ranges are only ever dropped on the host.
+bool TwainScanner::SetDeviceColourDropout(const ColourDropoutOptions& options) {
+    TW_UINT16 filter = options.mode == kDropoutRed ? TWFT_RED : options.mode == kDropoutGreen ? TWFT_GREEN :
+        options.mode == kDropoutBlue ? TWFT_BLUE : TWFT_NONE;
+    TW_UINT16 pixelType = options.outputBits == 1 ? TWPT_BW : TWPT_GRAY;
+    const CapabilityInfo* filterCap = FindCapability(m_Capabilities, ICAP_FILTER);
+    const CapabilityInfo* pixelTypeCap = FindCapability(m_Capabilities, ICAP_PIXELTYPE);
+    bool offered = filter != TWFT_NONE && filterCap && filterCap->IsSettable() && filterCap->Offers(filter) &&
+        pixelTypeCap && pixelTypeCap->IsSettable() && pixelTypeCap->Offers(pixelType);
+    if (!offered) {
+        filter = TWFT_NONE;
+        pixelType = m_PixelTypeBeforeFilter;
+    }
+    if (filter == m_DeviceFilter && (filter == TWFT_NONE || pixelType == m_FilterPixelType)) {
+        return filter != TWFT_NONE;
+    }
+    if (m_DeviceFilter == TWFT_NONE) {
+        m_PixelTypeBeforeFilter = pixelTypeCap ? (TW_UINT16)pixelTypeCap->currentValue : TWPT_RGB;
+    }
+
+    // The filter goes first and comes back off if the pixel type is
+    // refused, so colour pages never arrive filtered
+    TW_UINT16 previous = m_DeviceFilter;
+    TW_UINT16 rc = SetUInt16Capability(&m_AppId, &m_SrcId, ICAP_FILTER, filter);
+    if (rc == TWRC_SUCCESS) {
+        m_DeviceFilter = filter;
+        rc = SetUInt16Capability(&m_AppId, &m_SrcId, ICAP_PIXELTYPE, pixelType);
+        if (rc != TWRC_SUCCESS && filter != TWFT_NONE &&
+            SetUInt16Capability(&m_AppId, &m_SrcId, ICAP_FILTER, previous) == TWRC_SUCCESS) {
+            m_DeviceFilter = previous;
+        }
+    }
+    if (rc != TWRC_SUCCESS) {
+        SCANNER_LOG(kLogWarn, m_SrcId.Id, LogRecord::kNone, rc, "Failed to %s colour dropout on the source",
+            filter != TWFT_NONE ? "enable" : "disable");
+        return false;
+    }
+    m_FilterPixelType = pixelType;
+    return filter != TWFT_NONE;
 }
 
+// Measures the skew of every transferred page, as cropped, before any is
+// encoded; the encoding pass turns the page straight as it reads it.
+// angles gets the correction due to each, 0 for pages left alone.
+void TwainScanner::DeskewPages(const std::vector<TW_HANDLE>& handles, std::vector<PendingPage>& pending,
+    const DeskewOptions& options, std::vector<double>& angles) {
+    angles.assign(handles.size(), 0);
+    for (size_t i = 0; i < handles.size(); i++) {
+        auto deskewStart = std::chrono::steady_clock::now();
+        DibStripSource source;
+        if (!LockPage(handles[i], pending[i].crop, source)) {
+            continue;
+        }
+        DibLayout view = source.View();
+        DeskewStripStage deskew(source);
+        bool estimated = EstimateSkew(view, options.maxAngle, angles[i]) && deskew.Open(angles[i]);
+        GlobalUnlock((HANDLE)handles[i]);
+        if (!estimated || std::fabs(angles[i]) < options.minAngle) {
+            angles[i] = 0;
+        }
+        pending[i].deskewAngle = angles[i];
+        m_Stats->Record(m_SrcId.Id, kStageDeskew, MillisecondsSince(deskewStart));
 
+        if (!estimated) {
+            SCANNER_LOG(kLogDebug, m_SrcId.Id, (int)i, LogRecord::kNone, "Skew not measurable, page left as is");
+        } else if (angles[i] != 0) {
+            SCANNER_LOG(kLogDebug, m_SrcId.Id, (int)i, LogRecord::kNone, "Deskewing by %.2f degrees", angles[i]);
+        }
+    }
+}
 
-ScannerResult TwainScanner::ProcessImage(TW_MEMREF handle) {
+// Replaces the DIB behind handle with the one write makes, size bytes
+// long, in a new handle, and frees the old one. False, with the handle
+// left as it was, when size is 0 or write fails.
+bool TwainScanner::TransformPage(TW_HANDLE& handle, const std::function<size_t(const DibLayout&)>& size,
+    const std::function<bool(const DibLayout&, void*)>& write) {
+    const void* dib = GlobalLock((HANDLE)handle);
+    if (!dib) {
+        return false;
+    }
+    DibLayout layout;
+    std::string error;
+    size_t bytes = ReadDibLayout(dib, GlobalSize((HANDLE)handle), layout, error) ? size(layout) : 0;
+    HGLOBAL replaced = bytes ? GlobalAlloc(GMEM_MOVEABLE, bytes) : NULL;
+    void* out = replaced ? GlobalLock(replaced) : nullptr;
+    bool written = out && write(layout, out);
+    if (out) {
+        GlobalUnlock(replaced);
+    }
+    GlobalUnlock((HANDLE)handle);
+
+    if (!written) {
+        if (replaced) {
+            GlobalFree(replaced);
+        }
+        return false;
+    }
+    GlobalFree((HANDLE)handle);
+    handle = (TW_HANDLE)replaced;
+    return true;
+}
+
+// Brings every page transferred at another resolution to options.dpi. The
+// resolution is the one TW_IMAGEINFO reported, or else the DIB header's.
+void TwainScanner::ResamplePages(std::vector<TW_HANDLE>& handles, const std::vector<PageResolution>& resolutions,
+    const ResampleOptions& options) {
+    for (size_t i = 0; i < handles.size(); i++) {
+        auto resampleStart = std::chrono::steady_clock::now();
+        PageResolution scanned = i < resolutions.size() ? resolutions[i] : PageResolution();
+        size_t width = 0, height = 0;
+        bool needed = false;
+        bool resampled = TransformPage(handles[i], [&](const DibLayout& layout) -> size_t {
+            const BITMAPINFOHEADER* header = layout.header;
+            double x = scanned.x > 0 ? scanned.x : header->biXPelsPerMeter * 0.0254;
+            double y = scanned.y > 0 ? scanned.y : header->biYPelsPerMeter * 0.0254;
+            if (x <= 0 || y <= 0) {
+                return 0;
+            }
+            size_t sourceWidth = (size_t)header->biWidth;
+            size_t sourceHeight = (size_t)(header->biHeight < 0 ? -(long long)header->biHeight : header->biHeight);
+            width = (size_t)std::max(1L, std::lround(sourceWidth * options.dpi / x));
+            height = (size_t)std::max(1L, std::lround(sourceHeight * options.dpi / y));
+            needed = width != sourceWidth || height != sourceHeight;
+            return needed ? ResampledDibSize(layout, width, height) : 0;
+        }, [&](const DibLayout& layout, void* out) {
+            return ResampleDib(layout, width, height, options.filter, out);
+        });
+
+        if (resampled) {
+            m_Stats->Record(m_SrcId.Id, kStageResample, MillisecondsSince(resampleStart));
+            SCANNER_LOG(kLogDebug, m_SrcId.Id, (int)i, LogRecord::kNone, "Resampled from %.0fx%.0f dpi to %zux%zu",
+                scanned.x, scanned.y, width, height);
+        } else if (needed) {
+            SCANNER_LOG(kLogWarn, m_SrcId.Id, (int)i, LogRecord::kNone, "Page format cannot be resampled");
+        }
+    }
+}
+
+// Turns the DIB behind handle clockwise by degrees, leaving the handle as
+// it was when the page cannot be turned
+bool TwainScanner::RotatePage(TW_HANDLE& handle, int degrees, size_t page) {
+    auto rotateStart = std::chrono::steady_clock::now();
+    bool rotated = TransformPage(handle,
+        [degrees](const DibLayout& layout) { return RotatedDibSize(layout, degrees); },
+        [degrees](const DibLayout& layout, void* out) { return RotateDib(layout, degrees, out); });
+    if (!rotated) {
+        SCANNER_LOG(kLogWarn, m_SrcId.Id, (int)page, LogRecord::kNone, "Page cannot be turned by %d degrees", degrees);
+        return false;
+    }
+    m_Stats->Record(m_SrcId.Id, kStageRotate, MillisecondsSince(rotateStart));
+    SCANNER_LOG(kLogDebug, m_SrcId.Id, (int)page, LogRecord::kNone, "Turned by %d degrees", degrees);
+    return true;
+}
+
+void TwainScanner::ResetDuplicateIndex() {
+    m_PageIndex.Clear();
+    m_SessionPages = 0;
+}
+
+// Gives the page the next session page number and looks it up among the
+// earlier ones before adding it, as cropped, straightened and turned for
+// its side so that rescans fed the same way match
+void TwainScanner::CheckDuplicate(TW_HANDLE handle, const PendingPage& pending, size_t page,
+    const ScanOptions& options, ScannerResult& result) {
+    auto checkStart = std::chrono::steady_clock::now();
+    TW_UINT32 sessionPage = m_SessionPages++;
+    uint64_t hash = 0;
+    bool hashed = false;
+    DibStripSource source;
+    if (LockPage(handle, pending.crop, source)) {
+        // Only the sampled rows go through the pipeline
+        PagePipeline pipeline(source, options, pending.deskewAngle);
+        hashed = PerceptualHash(pipeline.Output(), hash);
+        GlobalUnlock((HANDLE)handle);
+    }
+    if (!hashed) {
+        result.perceptualHashes.push_back(std::string());
+        SCANNER_LOG(kLogDebug, m_SrcId.Id, (int)page, LogRecord::kNone, "No perceptual hash for the page");
+        return;
+    }
+
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+    result.perceptualHashes.push_back(hex);
+    uint32_t original = 0;
+    int distance = 0;
+    if (m_PageIndex.FindNearest(hash, options.duplicateDistance, original, distance)) {
+        result.duplicatePages.push_back(DuplicatePage((TW_UINT32)page, original, distance));
+        SCANNER_LOG(kLogInfo, m_SrcId.Id, (int)page, LogRecord::kNone,
+            "Page looks like session page %u, %d bits apart", original, distance);
+    }
+    m_PageIndex.Add(hash, sessionPage);
+    m_Stats->Record(m_SrcId.Id, kStageDuplicates, MillisecondsSince(checkStart));
+}
+
+// Encodes every page in transfer order, first turning each by the
+// rotation asked for its side
+ScannerResult TwainScanner::ProcessDuplexImages(std::vector<TW_HANDLE>& handles, const std::vector<PageSide>& sides,
+    const std::vector<PendingPage>& pending, const ScanOptions& options) {
     ScannerResult result;
     
-    if (!handle) {
-        result.errorMessage = "No image data received";
+    if (handles.empty()) {
+        result.errorMessage = "No images to process";
         return result;
     }
 
     try {
-        PBITMAPINFOHEADER pHeader = (PBITMAPINFOHEADER)GlobalLock((HANDLE)handle);
-        if (!pHeader) {
-            result.errorMessage = "Failed to lock image memory";
-            return result;
+        SCANNER_LOG(kLogDebug, m_SrcId.Id, LogRecord::kNone, LogRecord::kNone, "Processing %zu pages", handles.size());
+        
+        result.firstSessionPage = m_SessionPages;
+        // Process each image separately instead of combining them
+        for (size_t i = 0; i < handles.size(); i++) {
+            SCANNER_LOG(kLogDebug, m_SrcId.Id, (int)i, LogRecord::kNone, "Encoding page %zu of %zu", i + 1, handles.size());
+            
+            PageSide side = i < sides.size() ? sides[i] : kSideUnknown;
+            int degrees = RotationFor(side, options);
+            if (degrees != 0 && !RotatePage(handles[i], degrees, i)) {
+                degrees = 0;
+            }
+            result.pageSides.push_back(side);
+            result.rotations.push_back(degrees);
+            if (options.detectDuplicates) {
+                CheckDuplicate(handles[i], pending[i], i, options, result);
+            }
+
+            std::string error;
+            if (!EncodePage(handles[i], pending[i], options, result, error)) {
+                throw std::runtime_error(error);
+            }
         }
 
-        // Calculate sizes
-        DWORD dwImageSize = pHeader->biSizeImage;
-        DWORD dwFileSize = dwImageSize + sizeof(BITMAPFILEHEADER) + pHeader->biSize;
-        
-        // Create file header
-        BITMAPFILEHEADER fileHeader = { 0 };
-        fileHeader.bfType = 0x4D42; // "BM"
-        fileHeader.bfSize = dwFileSize;
-        fileHeader.bfOffBits = sizeof(BITMAPFILEHEADER) + pHeader->biSize;
-
-        // Create memory buffer for the complete BMP
-        std::vector<BYTE> buffer(dwFileSize);
-        
-        // Copy file header
-        memcpy(buffer.data(), &fileHeader, sizeof(BITMAPFILEHEADER));
-        
-        // Copy info header and color table
-        DWORD headerSize = pHeader->biSize;
-        memcpy(buffer.data() + sizeof(BITMAPFILEHEADER), pHeader, headerSize);
-        
-        // Copy image data
-        memcpy(
-            buffer.data() + sizeof(BITMAPFILEHEADER) + headerSize,
-            (BYTE*)pHeader + headerSize,
-            dwImageSize
-        );
+        result.success = true;
 
-        GlobalUnlock((HANDLE)handle);
-        GlobalFree((HANDLE)handle);
+    } catch (const std::exception& e) {
+        result.errorMessage = std::string("Duplex image processing error: ") + e.what();
+        SCANNER_LOG(kLogError, m_SrcId.Id, LogRecord::kNone, LogRecord::kNone, "%s", result.errorMessage.c_str());
+    }
 
-        // Convert to Base64
-        static const char base64Chars[] =
-            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    return result;
+}
 
-        std::string base64;
-        base64.reserve(((buffer.size() + 2) / 3) * 4);
+ScannerResult TwainScanner::ProcessImage(TW_HANDLE& handle, PageSide side, const PendingPage& pending,
+    const ScanOptions& options) {
+    ScannerResult result;
+    
+    if (!handle) {
+        result.errorMessage = "No image data received";
+        return result;
+    }
 
-        for (size_t i = 0; i < buffer.size(); i += 3) {
-            uint32_t b = (buffer[i] << 16) & 0xFF0000;
-            if (i + 1 < buffer.size()) b |= (buffer[i + 1] << 8) & 0xFF00;
-            if (i + 2 < buffer.size()) b |= buffer[i + 2] & 0xFF;
+    // The caller owns the handle, turned or not, and frees it
+    try {
+        int degrees = RotationFor(side, options);
+        if (degrees != 0 && !RotatePage(handle, degrees, 0)) {
+            degrees = 0;
+        }
+        result.pageSides.push_back(side);
+        result.rotations.push_back(degrees);
+        if (options.detectDuplicates) {
+            result.firstSessionPage = m_SessionPages;
+            CheckDuplicate(handle, pending, 0, options, result);
+        }
 
-            base64.push_back(base64Chars[(b >> 18) & 0x3F]);
-            base64.push_back(base64Chars[(b >> 12) & 0x3F]);
-            base64.push_back(i + 1 < buffer.size() ? base64Chars[(b >> 6) & 0x3F] : '=');
-            base64.push_back(i + 2 < buffer.size() ? base64Chars[b & 0x3F] : '=');
+        std::string error;
+        bool encoded = EncodePage(handle, pending, options, result, error);
+        if (!encoded) {
+            result.errorMessage = "Image processing error: " + error;
+            return result;
         }
 
         result.success = true;
-        result.base64Images.push_back(base64);  // Changed from base64Image to base64Images.push_back()
         return result;
     }
     catch (const std::exception& e) {
-        if (handle) {
-            GlobalUnlock((HANDLE)handle);
-            GlobalFree((HANDLE)handle);
-        }
         result.errorMessage = std::string("Image processing error: ") + e.what();
         return result;
     }
 }
 
+// Wraps the DIB behind a native transfer handle in a BMP file header and
+// appends it to result, base64-encoded unless raw output was asked for,
+// hashing it and tallying its statistics on the way when asked. The
+// pending crop, colour dropout, deskew and despeckling are done in the
+// same pass: rows flow through every step a strip at a time, so the page
+// is read from memory once and the .bmp is never held whole before
+// Base64. The handle stays owned by the caller.
+bool TwainScanner::EncodePage(TW_HANDLE handle, const PendingPage& pending, const ScanOptions& options,
+    ScannerResult& result, std::string& error) {
+    auto encodeStart = std::chrono::steady_clock::now();
+    const void* dib = GlobalLock((HANDLE)handle);
+    if (!dib) {
+        error = "Failed to lock image memory";
+        return false;
+    }
+
+    DibLayout layout;
+    std::vector<BYTE> buffer;
+    std::string text;
+    bool hashing = options.pageHashes != kPageHashNone;
+    PageHasher pixels(options.pageHashes), file(options.pageHashes);
+    bool valid = ReadDibLayout(dib, GlobalSize((HANDLE)handle), layout, error);
+    PageStats stats;
+    DibStripSource source;
+    if (valid && source.Open(layout, &pending.crop)) {
+        PagePipeline pipeline(source, options, pending.deskewAngle);
+        // Statistics are tallied as the encoded rows go by
+        PageStatsStripStage tally(pipeline.Output());
+        bool counting = options.pageStats && tally.Open();
+        WriteBmpStrips(counting ? (StripStage&)tally : pipeline.Output(), options.base64 ? nullptr : &buffer,
+            options.base64 ? &text : nullptr, hashing ? &pixels : nullptr, hashing ? &file : nullptr);
+        if (counting) {
+            stats = tally.Finish();
+        }
+    } else if (valid) {
+        // Compressed pages go out as they came
+        AssembleBmp(layout, buffer, hashing ? &pixels : nullptr, hashing ? &file : nullptr);
+        if (options.base64) {
+            EncodeBase64(buffer.data(), buffer.size(), text);
+        }
+    }
+    GlobalUnlock((HANDLE)handle);
+
+    if (!valid) {
+        return false;
+    }
+    if (hashing) {
+        PageHashes hashes;
+        hashes.pixels = pixels.Finish();
+        hashes.file = file.Finish();
+        result.pageHashes.push_back(hashes);
+    }
+    if (options.pageStats) {
+        result.pageStats.push_back(std::move(stats));
+    }
+    m_Stats->Record(m_SrcId.Id, kStageAssemble, MillisecondsSince(encodeStart));
+
+    if (options.base64) {
+        result.base64Images.push_back(std::move(text));
+    } else {
+        result.bmpImages.push_back(std::move(buffer));
+    }
+    result.timings.pageMs.push_back(MillisecondsSince(encodeStart));
+    return true;
+}
+
 bool TwainScanner::Cleanup() {
     if (!m_Initialized) {
         return true;
     }
 
     try {
-        if (m_hDSMLib) {
-            g_pDSM_Entry(&m_AppId, nullptr, DG_CONTROL, DAT_PARENT, MSG_CLOSEDSM, (TW_MEMREF)&m_hDSMLib);
-            m_hDSMLib = nullptr;
-        }
+        CloseSession();
+        CloseDsm();
 
         m_Initialized = false;
         return true;
@@ -1,17 +1,170 @@
 #pragma once
+#include <atomic>
+#include <functional>
 #include <string>
 #include <memory>
 #include <vector>
 #include "twain/windows_wrapper.h"
 #include "twain.h"
+#include "capabilities.h"
+#include "capability_cache.h"
+#include "imaging/auto_crop.h"
+#include "imaging/blank_page.h"
+#include "imaging/colour_dropout.h"
+#include "imaging/deskew.h"
+#include "imaging/despeckle.h"
+#include "imaging/page_hash.h"
+#include "imaging/page_stats.h"
+#include "imaging/perceptual_hash.h"
+#include "imaging/resample.h"
+#include "imaging/rotate.h"
+#include "imaging/strip_pipeline.h"
+#include "scan_stats.h"
+
+// Side of the sheet a page was scanned from. Duplex sources alternate
+// front and back; once the source drops blank pages itself the order no
+// longer tells which is which.
+enum PageSide {
+    kSideFront,
+    kSideBack,
+    kSideUnknown
+};
+
+// Dots per inch a page was transferred at, as TW_IMAGEINFO reports it
+struct PageResolution {
+    double x;
+    double y;
+
+    PageResolution() : x(0), y(0) {}
+    PageResolution(double xDpi, double yDpi) : x(xDpi), y(yDpi) {}
+};
+
+// A page that looks like one already seen this session
+struct DuplicatePage {
+    TW_UINT32 page;      // Among the returned pages
+    TW_UINT32 original;  // Session page number of the nearest earlier page
+    int distance;        // Bits the perceptual hashes differ by
+
+    DuplicatePage() : page(0), original(0), distance(0) {}
+    DuplicatePage(TW_UINT32 pageIndex, TW_UINT32 originalPage, int bits)
+        : page(pageIndex), original(originalPage), distance(bits) {}
+};
 
 class ScannerResult {
 public:
     bool success;
     std::vector<std::string> base64Images;
+    std::vector<std::vector<BYTE>> bmpImages;  // Filled instead when ScanOptions::base64 is false
     std::string errorMessage;
+    TW_UINT32 deviceId;  // Source that was scanned, 0 if none was opened
+
+    // Document rectangle kept of each returned page, in pixels of the page
+    // as transferred. Empty when the host did not crop, including when the
+    // source did it (croppedByDevice).
+    std::vector<CropRect> cropRects;
+    bool croppedByDevice;
+
+    // Transfer order of the pages found blank: listed and kept with
+    // kBlankPagesFlag, listed and left out with kBlankPagesDrop. Pages the
+    // source discarded itself never arrive, so are not listed.
+    std::vector<TW_UINT32> blankPages;
+    bool blankPagesDiscardedByDevice;
+
+    // Skew in degrees corrected on each returned page, 0 where none was
+    // found or the page was left alone. Empty when the host did not
+    // deskew, including when the source did it (deskewedByDevice).
+    std::vector<double> deskewAngles;
+    bool deskewedByDevice;
+
+    // Side of each returned page and the clockwise turn in degrees applied
+    // to it from ScanOptions::frontRotation or backRotation, 0 where none
+    // was asked for or the page format cannot be turned
+    std::vector<PageSide> pageSides;
+    std::vector<int> rotations;
+
+    // Whether the source dropped the colour channel itself through
+    // ICAP_FILTER, returning grey or black and white pages
+    bool colourDroppedByDevice;
+
+    // Resolution of each returned page as transferred, before any
+    // resampling to ScanOptions::resampleOptions.dpi. 0 where the source
+    // did not say.
+    std::vector<PageResolution> scanResolutions;
+
+    // Digests of each returned page when ScanOptions::pageHashes asks for
+    // them, worked out while the page is assembled
+    std::vector<PageHashes> pageHashes;
+
+    // With ScanOptions::detectDuplicates, the perceptual hash of each
+    // returned page in hex (empty where the page had none) and the pages
+    // near one returned earlier in the session. Session page numbers count
+    // every page checked since TwainScanner::ResetDuplicateIndex; the
+    // returned pages are numbered on from firstSessionPage.
+    std::vector<std::string> perceptualHashes;
+    std::vector<DuplicatePage> duplicatePages;
+    TW_UINT32 firstSessionPage;
+
+    // Pixel statistics of each returned page with ScanOptions::pageStats,
+    // gathered while it is encoded; channels is 0 for compressed pages
+    std::vector<PageStats> pageStats;
+
+    // Monotonic milliseconds. pageMs is the transfer plus encode time of
+    // each page; firstPageMs is from MSG_ENABLEDS to the first transfer.
+    struct Timings {
+        double firstPageMs;
+        double totalMs;
+        std::vector<double> pageMs;
+
+        Timings() : firstPageMs(0), totalMs(0) {}
+    } timings;
     
-    ScannerResult() : success(false) {}
+    ScannerResult()
+        : success(false), deviceId(0), croppedByDevice(false), blankPagesDiscardedByDevice(false)
+        , deskewedByDevice(false), colourDroppedByDevice(false), firstSessionPage(0) {}
+};
+
+enum BlankPageMode {
+    kBlankPagesKeep,
+    kBlankPagesFlag,
+    kBlankPagesDrop   // Through ICAP_AUTODISCARDBLANKPAGES when the source offers it
+};
+
+struct ScanOptions {
+    bool showUI;
+    TW_UINT32 deviceId;  // TW_IDENTITY.Id from ListDevices; 0 picks the first source
+    bool base64;         // false returns the BMP bytes without text encoding
+    bool autoCrop;                      // Through ICAP_AUTOMATICBORDERDETECTION when the source offers it
+    AutoCropOptions autoCropOptions;    // Host border detection, used when the source does not
+    BlankPageMode blankPages;
+    BlankPageOptions blankPageOptions;  // Host detector, used when the source does not discard
+    bool deskew;                        // Through ICAP_AUTOMATICDESKEW when the source offers it
+    DeskewOptions deskewOptions;        // Host deskew, used when the source does not
+    int frontRotation;                  // Clockwise degrees (0, 90, 180 or 270) front sides are turned
+    int backRotation;                   // and back sides, as for sheets fed flipped end over end
+    ResampleOptions resampleOptions;    // Pages transferred at another resolution are scaled to dpi
+    PageHashMode pageHashes;            // Digests returned in ScannerResult::pageHashes
+    bool detectDuplicates;              // Flags pages near one already seen this session
+    int duplicateDistance;              // Most bits perceptual hashes of duplicates differ by
+    ColourDropoutOptions dropoutOptions; // Channels through ICAP_FILTER when the source offers them
+    bool despeckle;                     // Cleans 1 bit and grey pages just before they are encoded
+    DespeckleOptions despeckleOptions;
+    bool pageStats;                     // Statistics returned in ScannerResult::pageStats
+
+    ScanOptions()
+        : showUI(true), deviceId(0), base64(true), autoCrop(false), blankPages(kBlankPagesKeep)
+        , deskew(false), frontRotation(0), backRotation(0), pageHashes(kPageHashNone)
+        , detectDuplicates(false), duplicateDistance(4), despeckle(false)
+        , pageStats(false) {}
+};
+
+// Arrival, removal and status change reported by the device monitor
+struct DeviceEvent {
+    std::string type;        // "deviceAdded", "deviceRemoved", "paperJam", ...
+    TW_UINT32 deviceId;      // TW_IDENTITY.Id, 0 when the source did not say
+    std::string deviceName;
+    TW_UINT16 code;          // TWDE_* for events reported by the source
+
+    DeviceEvent() : deviceId(0), code(0) {}
 };
 
 class TwainScanner {
@@ -23,31 +176,196 @@ public:
         bool success;
         std::string message;
         int deviceCount;
+        bool capabilitiesFromCache;
+
+        // Monotonic milliseconds per phase. warm and waitMs are filled in
+        // by the caller when the result came from a warm-up.
+        struct Timings {
+            double loadLibraryMs;
+            double openDsmMs;
+            double capabilitiesMs;
+            double enumerateMs;
+            double totalMs;
+            double waitMs;
+            bool warm;
+
+            Timings()
+                : loadLibraryMs(0), openDsmMs(0), capabilitiesMs(0)
+                , enumerateMs(0), totalMs(0), waitMs(0), warm(false) {}
+        } timings;
+
+        InitResult() : success(false), deviceCount(0), capabilitiesFromCache(false) {}
     };
 
     InitResult Initialize();
-    ScannerResult Scan(bool showUI = true);
+    ScannerResult Scan(const ScanOptions& options = ScanOptions());
     bool Cleanup();
     bool IsDuplexSupported() const { return m_DuplexSupported; }
 
+    // Session mode keeps the data source open (state 4) and the message
+    // window alive between scans. An idle session is closed on the next
+    // call once idleTimeoutMs has elapsed since the last scan.
+    void SetSessionOptions(bool persistent, DWORD idleTimeoutMs);
+    void CloseSession();
+    bool IsSessionOpen() const { return m_SourceOpen; }
+
+    // Capability sets are cached on disk per source and driver version.
+    // A set loaded from the cache is stale until RevalidateCapabilities
+    // re-probes the source and rewrites the entry.
+    void SetCapabilityCachePath(const std::string& path);
+    bool RevalidateCapabilities(bool& changed);
+    bool CapabilitiesStale() const { return m_CapabilitiesStale; }
+
+    // Identities of every installed source, re-enumerated once the cached
+    // list is older than the TTL
+    bool ListDevices(bool refresh, std::vector<TW_IDENTITY>& devices);
+    void SetDeviceListTtl(DWORD ttlMs) { m_SourceListTtl = ttlMs; }
+
+    struct CapabilityReport {
+        bool success;
+        bool fromCache;
+        double totalMs;
+        std::string errorMessage;
+        std::vector<CapabilityInfo> capabilities;
+        CapabilityFastPaths fastPaths;
+
+        CapabilityReport() : success(false), fromCache(false), totalMs(0) {}
+    };
+
+    // Runs MSG_QUERYSUPPORT and MSG_GET over every standard capability in
+    // one pass. A complete set already known for this source is returned
+    // without touching the device unless refresh is set.
+    CapabilityReport DiscoverCapabilities(bool refresh);
+    const std::string& LastError() const { return m_LastError; }
+
+    // Device monitoring diffs the source list every pollIntervalMs and,
+    // while a source is open, asks it for CAP_DEVICEEVENT notifications.
+    // The handler is called on the TWAIN thread.
+    typedef std::function<void(const DeviceEvent&)> DeviceEventHandler;
+    void StartDeviceMonitor(DeviceEventHandler handler, DWORD pollIntervalMs);
+    void StopDeviceMonitor();
+
+    // Housekeeping run by the owning thread while no call is pending:
+    // closes an expired session, revalidates cached capabilities and
+    // polls for device events.
+    void OnIdle();
+
+    // Hands a message pumped outside a scan to the open source, so device
+    // events still arrive when no callback could be registered. Returns
+    // true when the message was the source's and must not be dispatched.
+    bool ProcessMessage(MSG& msg);
+
+    // Forgets the pages duplicates are looked for among and numbers the
+    // next one 0
+    void ResetDuplicateIndex();
+
+    // Per-device stage latency histograms. Thread-safe. SharedStats()
+    // is for callers that may outlive the scanner.
+    ScanStats& Stats() { return *m_Stats; }
+    std::shared_ptr<ScanStats> SharedStats() const { return m_Stats; }
+
 private:
+    // What the encoding pass still has to do to a transferred page as it
+    // reads it
+    struct PendingPage {
+        CropRect crop;       // Window the page is read through, empty for all of it
+        double deskewAngle;  // Degrees it is turned by, 0 for none
+
+        PendingPage() : deskewAngle(0) {}
+    };
+
     TW_IDENTITY m_AppId;
     TW_IDENTITY m_SrcId;
     DSMENTRYPROC m_pDSM;
     HMODULE m_hDSMLib;
     bool m_Initialized;
-    bool m_DuplexSupported; 
+    std::atomic<bool> m_DuplexSupported;
+    bool m_DeviceDetectsBorders;  // ICAP_AUTOMATICBORDERDETECTION set on the open source
+    bool m_DeviceDiscardsBlanks;  // ICAP_AUTODISCARDBLANKPAGES set on the open source
+    bool m_DeviceDeskews;         // ICAP_AUTOMATICDESKEW set on the open source
+    TW_UINT16 m_DeviceFilter;     // ICAP_FILTER set on the open source, TWFT_NONE for none
+    TW_UINT16 m_FilterPixelType;  // ICAP_PIXELTYPE set along with it
+    TW_UINT16 m_PixelTypeBeforeFilter;
     std::string m_LastError;
+
+    // Session state
+    bool m_PersistentSession;
+    DWORD m_SessionIdleTimeout;
+    DWORD m_LastSessionUse;
+    bool m_SourceOpen;
+    HWND m_hWnd;
+    bool m_WindowClassRegistered;
+
+    // Capability state
+    CapabilityCache m_CapabilityCache;
+    std::vector<CapabilityInfo> m_Capabilities;
+    bool m_CapabilitiesFromCache;
+    bool m_CapabilitiesStale;
+    bool m_CapabilitiesComplete;
+    TW_UINT32 m_CapabilitiesSourceId;
+
+    std::shared_ptr<ScanStats> m_Stats;
+
+    // Perceptual hashes of the pages checked for duplicates this session
+    PerceptualHashIndex m_PageIndex;
+    TW_UINT32 m_SessionPages;
+
+    // Cached source list
+    std::vector<TW_IDENTITY> m_Sources;
+    DWORD m_SourcesFetchedAt;
+    DWORD m_SourceListTtl;
+
+    // Device monitor state
+    DeviceEventHandler m_DeviceEventHandler;
+    DWORD m_DevicePollInterval;
+    DWORD m_LastDevicePoll;
+    bool m_CallbackRegistered;
+    std::atomic<bool> m_DeviceEventPending;
+    std::atomic<TW_UINT16> m_CallbackMessage;
     
     bool LoadDSM();
     void UnloadDSM();
+    bool EnumerateSources();
+    bool SelectSource(TW_UINT32 deviceId);
     bool OpenDataSource();
     void CloseDataSource();
+    bool CreateMessageWindow();
+    void DestroyMessageWindow();
+    void CloseDsm();
+    void ExpireIdleSession();
     bool NegotiateCapabilities();
-    void CleanupSource();
-    void CleanupResources(HWND hwnd, bool windowClassRegistered);
+    void ProbeCapabilities(const TW_UINT16* capList, size_t count, std::vector<CapabilityInfo>& caps);
+    void ProbeAllCapabilities(std::vector<CapabilityInfo>& caps);
+    void ApplyCapabilities();
+    bool LoadCachedCapabilities();
     bool EnableDuplex();
-    ScannerResult ProcessImage(TW_MEMREF handle);
-    ScannerResult ProcessDuplexImages(const std::vector<TW_HANDLE>& handles);
+    bool SetDeviceBorderDetection(bool enabled);
+    void CropPages(const std::vector<TW_HANDLE>& handles, const AutoCropOptions& options, bool apply,
+        std::vector<CropRect>& rects);
+    bool SetDeviceBlankDiscard(bool enabled);
+    void DetectBlankPages(std::vector<TW_HANDLE>& handles, std::vector<double>& transferMs,
+        std::vector<PendingPage>& pending, const ScanOptions& options, std::vector<TW_UINT32>& blankPages);
+    bool SetDeviceDeskew(bool enabled);
+    void DeskewPages(const std::vector<TW_HANDLE>& handles, std::vector<PendingPage>& pending,
+        const DeskewOptions& options, std::vector<double>& angles);
+    bool SetDeviceColourDropout(const ColourDropoutOptions& options);
+    bool EnableDeviceEvents();
+    void DrainDeviceEvents();
+    void PollDevices();
+    void EmitDeviceEvent(const char* type, const TW_IDENTITY& source);
+    static TW_UINT16 TW_CALLINGSTYLE DeviceCallback(pTW_IDENTITY pOrigin, pTW_IDENTITY pDest,
+        TW_UINT32 DG, TW_UINT16 DAT, TW_UINT16 MSG, TW_MEMREF pData);
+    void ResamplePages(std::vector<TW_HANDLE>& handles, const std::vector<PageResolution>& resolutions,
+        const ResampleOptions& options);
+    bool TransformPage(TW_HANDLE& handle, const std::function<size_t(const DibLayout&)>& size,
+        const std::function<bool(const DibLayout&, void*)>& write);
+    bool RotatePage(TW_HANDLE& handle, int degrees, size_t page);
+    ScannerResult ProcessImage(TW_HANDLE& handle, PageSide side, const PendingPage& pending, const ScanOptions& options);
+    ScannerResult ProcessDuplexImages(std::vector<TW_HANDLE>& handles, const std::vector<PageSide>& sides,
+        const std::vector<PendingPage>& pending, const ScanOptions& options);
+    void CheckDuplicate(TW_HANDLE handle, const PendingPage& pending, size_t page, const ScanOptions& options,
+        ScannerResult& result);
+    bool EncodePage(TW_HANDLE handle, const PendingPage& pending, const ScanOptions& options, ScannerResult& result,
+        std::string& error);
     std::string ConvertToBase64(const std::vector<uint8_t>& data);
 };
\ No newline at end of file
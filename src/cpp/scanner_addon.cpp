@@ -1,4 +1,603 @@
 #include "scanner_addon.h"
+#include "log.h"
+#include "sim/dsm_recording.h"
+#include "sim/replay_dsm.h"
+#include "sim/simulated_dsm.h"
+#include "tracing.h"
+
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <functional>
+
+namespace {
+
+// Settles a promise from whichever thread did the work: the result is
+// handed to the JS thread through a thread-safe function, so no libuv
+// pool thread sits waiting on a task queued behind a scan.
+template <typename T>
+class Settlement {
+public:
+    typedef std::function<Napi::Value(Napi::Env, const T&)> Converter;
+
+    // On the JS thread
+    Settlement(Napi::Env env, const char* name, Converter convert)
+        : m_Deferred(Napi::Promise::Deferred::New(env))
+        , m_Convert(convert)
+        , m_Failed(false)
+        , m_Function(nullptr) {
+        napi_status status = napi_create_threadsafe_function(env, nullptr, nullptr, Napi::String::New(env, name),
+            0, 1, this, Finalize, this, CallJs, &m_Function);
+        if (status != napi_ok) {
+            m_Function = nullptr;
+            m_Deferred.Reject(Napi::Error::New(env, "Failed to queue the TWAIN task").Value());
+        }
+    }
+
+    Napi::Promise Promise() const { return m_Deferred.Promise(); }
+
+    // On the thread doing the work, once. The settlement is deleted on the
+    // JS thread after the promise settles.
+    template <typename F>
+    void Run(F& task) {
+        if (!m_Function) {
+            delete this;
+            return;
+        }
+        try {
+            m_Result = task();
+        }
+        catch (const std::exception& e) {
+            m_Failed = true;
+            m_Error = e.what();
+        }
+        napi_call_threadsafe_function(m_Function, nullptr, napi_tsfn_blocking);
+        napi_release_threadsafe_function(m_Function, napi_tsfn_release);
+    }
+
+private:
+    static void CallJs(napi_env env, napi_value, void* context, void*) {
+        // No environment means it is being torn down, with nobody to tell
+        if (!env) {
+            return;
+        }
+        Settlement* settlement = (Settlement*)context;
+        Napi::Env jsEnv(env);
+        Napi::HandleScope scope(jsEnv);
+        if (settlement->m_Failed) {
+            settlement->m_Deferred.Reject(Napi::Error::New(jsEnv, settlement->m_Error).Value());
+        } else {
+            settlement->m_Deferred.Resolve(settlement->m_Convert(jsEnv, settlement->m_Result));
+        }
+    }
+
+    static void Finalize(napi_env, void* data, void*) {
+        delete (Settlement*)data;
+    }
+
+    Napi::Promise::Deferred m_Deferred;
+    Converter m_Convert;
+    T m_Result;
+    bool m_Failed;
+    std::string m_Error;
+    napi_threadsafe_function m_Function;
+};
+
+// Runs task on the TWAIN thread and settles the promise with its result
+template <typename T, typename F>
+Napi::Promise Settle(Napi::Env env, TwainThread& thread, const char* name, F task,
+                     typename Settlement<T>::Converter convert) {
+    Settlement<T>* settlement = new Settlement<T>(env, name, convert);
+    Napi::Promise promise = settlement->Promise();
+    thread.Post(name, [settlement, task]() mutable {
+        settlement->Run(task);
+    });
+    return promise;
+}
+
+// Runs task on a thread of its own that environment teardown waits for,
+// for work that does not touch the DSM
+template <typename T, typename F>
+Napi::Promise SettleOffThread(Napi::Env env, const char* name, F task,
+                              typename Settlement<T>::Converter convert) {
+    Settlement<T>* settlement = new Settlement<T>(env, name, convert);
+    Napi::Promise promise = settlement->Promise();
+    TwainThread::RunDetached([settlement, task]() mutable {
+        settlement->Run(task);
+    });
+    return promise;
+}
+
+struct DeviceListResult {
+    bool success;
+    std::string errorMessage;
+    std::vector<TW_IDENTITY> devices;
+
+    DeviceListResult() : success(false) {}
+};
+
+struct RevalidateResult {
+    bool success;
+    bool changed;
+    std::string errorMessage;
+
+    RevalidateResult() : success(false), changed(false) {}
+};
+
+Napi::Value InitResultToObject(Napi::Env env, const TwainScanner::InitResult& result) {
+    auto response = Napi::Object::New(env);
+    response.Set("success", Napi::Boolean::New(env, result.success));
+    response.Set("message", Napi::String::New(env, result.message));
+    response.Set("deviceCount", Napi::Number::New(env, result.deviceCount));
+    response.Set("capabilitiesFromCache", Napi::Boolean::New(env, result.capabilitiesFromCache));
+
+    auto timings = Napi::Object::New(env);
+    timings.Set("warm", Napi::Boolean::New(env, result.timings.warm));
+    timings.Set("waitMs", Napi::Number::New(env, result.timings.waitMs));
+    timings.Set("loadLibraryMs", Napi::Number::New(env, result.timings.loadLibraryMs));
+    timings.Set("openDsmMs", Napi::Number::New(env, result.timings.openDsmMs));
+    timings.Set("capabilitiesMs", Napi::Number::New(env, result.timings.capabilitiesMs));
+    timings.Set("enumerateMs", Napi::Number::New(env, result.timings.enumerateMs));
+    timings.Set("totalMs", Napi::Number::New(env, result.timings.totalMs));
+    response.Set("timings", timings);
+
+    return response;
+}
+
+Napi::Value ScanResultToObject(Napi::Env env, const ScannerResult& result) {
+    auto response = Napi::Object::New(env);
+    response.Set("success", Napi::Boolean::New(env, result.success));
+    
+    if (result.success) {
+        // Buffers are copied rather than wrapped: Electron's V8 sandbox
+        // rejects external backing stores
+        size_t count = result.bmpImages.empty() ? result.base64Images.size() : result.bmpImages.size();
+        auto images = Napi::Array::New(env, count);
+        for (size_t i = 0; i < count; i++) {
+            if (result.bmpImages.empty()) {
+                images[i] = Napi::String::New(env, result.base64Images[i]);
+            } else {
+                images[i] = Napi::Buffer<uint8_t>::Copy(env, result.bmpImages[i].data(), result.bmpImages[i].size());
+            }
+        }
+        response.Set("images", images);
+
+        auto cropRects = Napi::Array::New(env, result.cropRects.size());
+        for (size_t i = 0; i < result.cropRects.size(); i++) {
+            auto rect = Napi::Object::New(env);
+            rect.Set("left", Napi::Number::New(env, result.cropRects[i].left));
+            rect.Set("top", Napi::Number::New(env, result.cropRects[i].top));
+            rect.Set("width", Napi::Number::New(env, result.cropRects[i].width));
+            rect.Set("height", Napi::Number::New(env, result.cropRects[i].height));
+            cropRects[i] = rect;
+        }
+        response.Set("cropRects", cropRects);
+        response.Set("croppedByDevice", Napi::Boolean::New(env, result.croppedByDevice));
+
+        auto blankPages = Napi::Array::New(env, result.blankPages.size());
+        for (size_t i = 0; i < result.blankPages.size(); i++) {
+            blankPages[i] = Napi::Number::New(env, result.blankPages[i]);
+        }
+        response.Set("blankPages", blankPages);
+        response.Set("blankPagesDiscardedByDevice", Napi::Boolean::New(env, result.blankPagesDiscardedByDevice));
+
+        auto deskewAngles = Napi::Array::New(env, result.deskewAngles.size());
+        for (size_t i = 0; i < result.deskewAngles.size(); i++) {
+            deskewAngles[i] = Napi::Number::New(env, result.deskewAngles[i]);
+        }
+        response.Set("deskewAngles", deskewAngles);
+        response.Set("deskewedByDevice", Napi::Boolean::New(env, result.deskewedByDevice));
+
+        auto pageSides = Napi::Array::New(env, result.pageSides.size());
+        auto rotations = Napi::Array::New(env, result.rotations.size());
+        for (size_t i = 0; i < result.pageSides.size(); i++) {
+            PageSide side = result.pageSides[i];
+            pageSides[i] = Napi::String::New(env, side == kSideFront ? "front" : side == kSideBack ? "back" : "unknown");
+        }
+        for (size_t i = 0; i < result.rotations.size(); i++) {
+            rotations[i] = Napi::Number::New(env, result.rotations[i]);
+        }
+        response.Set("pageSides", pageSides);
+        response.Set("rotations", rotations);
+        response.Set("colourDroppedByDevice", Napi::Boolean::New(env, result.colourDroppedByDevice));
+
+        auto scanResolutions = Napi::Array::New(env, result.scanResolutions.size());
+        for (size_t i = 0; i < result.scanResolutions.size(); i++) {
+            auto resolution = Napi::Object::New(env);
+            resolution.Set("x", Napi::Number::New(env, result.scanResolutions[i].x));
+            resolution.Set("y", Napi::Number::New(env, result.scanResolutions[i].y));
+            scanResolutions[i] = resolution;
+        }
+        response.Set("scanResolutions", scanResolutions);
+
+        auto digestsToObject = [env](const PageDigests& digests) {
+            auto object = Napi::Object::New(env);
+            object.Set("xxh3", Napi::String::New(env, digests.xxh3));
+            if (!digests.sha256.empty()) {
+                object.Set("sha256", Napi::String::New(env, digests.sha256));
+            }
+            return object;
+        };
+        auto pageHashes = Napi::Array::New(env, result.pageHashes.size());
+        for (size_t i = 0; i < result.pageHashes.size(); i++) {
+            auto hashes = Napi::Object::New(env);
+            hashes.Set("pixels", digestsToObject(result.pageHashes[i].pixels));
+            hashes.Set("file", digestsToObject(result.pageHashes[i].file));
+            pageHashes[i] = hashes;
+        }
+        response.Set("pageHashes", pageHashes);
+
+        auto perceptualHashes = Napi::Array::New(env, result.perceptualHashes.size());
+        for (size_t i = 0; i < result.perceptualHashes.size(); i++) {
+            const std::string& hash = result.perceptualHashes[i];
+            perceptualHashes[i] = hash.empty() ? env.Null() : Napi::String::New(env, hash);
+        }
+        response.Set("perceptualHashes", perceptualHashes);
+        auto duplicatePages = Napi::Array::New(env, result.duplicatePages.size());
+        for (size_t i = 0; i < result.duplicatePages.size(); i++) {
+            auto duplicate = Napi::Object::New(env);
+            duplicate.Set("page", Napi::Number::New(env, result.duplicatePages[i].page));
+            duplicate.Set("original", Napi::Number::New(env, result.duplicatePages[i].original));
+            duplicate.Set("distance", Napi::Number::New(env, result.duplicatePages[i].distance));
+            duplicatePages[i] = duplicate;
+        }
+        response.Set("duplicatePages", duplicatePages);
+        response.Set("firstSessionPage", Napi::Number::New(env, result.firstSessionPage));
+
+        // Histograms and per-channel figures as typed arrays, so QC rules
+        // read them without a JS array per value
+        auto pageStats = Napi::Array::New(env, result.pageStats.size());
+        for (size_t i = 0; i < result.pageStats.size(); i++) {
+            const PageStats& page = result.pageStats[i];
+            if (page.channels == 0) {
+                pageStats[i] = env.Null();
+                continue;
+            }
+            auto histograms = Napi::Uint32Array::New(env, page.histograms.size());
+            std::copy(page.histograms.begin(), page.histograms.end(), histograms.Data());
+            auto mean = Napi::Float64Array::New(env, page.mean.size());
+            std::copy(page.mean.begin(), page.mean.end(), mean.Data());
+            auto stddev = Napi::Float64Array::New(env, page.stddev.size());
+            std::copy(page.stddev.begin(), page.stddev.end(), stddev.Data());
+            auto stats = Napi::Object::New(env);
+            stats.Set("channels", Napi::Number::New(env, page.channels));
+            stats.Set("histograms", histograms);
+            stats.Set("mean", mean);
+            stats.Set("stddev", stddev);
+            stats.Set("clippedDark", Napi::Number::New(env, page.clippedDark));
+            stats.Set("clippedLight", Napi::Number::New(env, page.clippedLight));
+            stats.Set("colour", Napi::Number::New(env, page.colour));
+            stats.Set("inkCoverage", Napi::Number::New(env, page.inkCoverage));
+            pageStats[i] = stats;
+        }
+        response.Set("pageStats", pageStats);
+    } else {
+        response.Set("errorMessage", Napi::String::New(env, result.errorMessage));
+    }
+
+    auto timings = Napi::Object::New(env);
+    timings.Set("firstPageMs", Napi::Number::New(env, result.timings.firstPageMs));
+    timings.Set("totalMs", Napi::Number::New(env, result.timings.totalMs));
+    auto pageMs = Napi::Array::New(env, result.timings.pageMs.size());
+    for (size_t i = 0; i < result.timings.pageMs.size(); i++) {
+        pageMs[i] = Napi::Number::New(env, result.timings.pageMs[i]);
+    }
+    timings.Set("pageMs", pageMs);
+    response.Set("timings", timings);
+    
+    return response;
+}
+
+Napi::Value CapabilityToObject(Napi::Env env, const CapabilityInfo& info) {
+    auto response = Napi::Object::New(env);
+    response.Set("id", Napi::Number::New(env, info.cap));
+    response.Set("container", Napi::String::New(env, ContainerNameOf(info.conType)));
+    response.Set("itemType", Napi::String::New(env, ItemTypeNameOf(info.itemType)));
+
+    auto supports = Napi::Object::New(env);
+    supports.Set("get", Napi::Boolean::New(env, info.supportFlags == 0 || (info.supportFlags & TWQC_GET)));
+    supports.Set("set", Napi::Boolean::New(env, info.IsSettable()));
+    supports.Set("getDefault", Napi::Boolean::New(env, (info.supportFlags & TWQC_GETDEFAULT) != 0));
+    supports.Set("getCurrent", Napi::Boolean::New(env, (info.supportFlags & TWQC_GETCURRENT) != 0));
+    supports.Set("reset", Napi::Boolean::New(env, (info.supportFlags & TWQC_RESET) != 0));
+    response.Set("supports", supports);
+
+    response.Set("current", Napi::Number::New(env, info.currentValue));
+    response.Set("default", Napi::Number::New(env, info.defaultValue));
+    if (info.conType == TWON_RANGE) {
+        response.Set("min", Napi::Number::New(env, info.minValue));
+        response.Set("max", Napi::Number::New(env, info.maxValue));
+        response.Set("step", Napi::Number::New(env, info.stepValue));
+    }
+    if (info.conType == TWON_ENUMERATION || info.conType == TWON_ARRAY) {
+        auto values = Napi::Array::New(env, info.values.size());
+        for (size_t i = 0; i < info.values.size(); i++) {
+            values[i] = Napi::Number::New(env, info.values[i]);
+        }
+        response.Set("values", values);
+    }
+    response.Set("elapsedMs", Napi::Number::New(env, info.elapsedMs));
+
+    return response;
+}
+
+Napi::Value CapabilityReportToObject(Napi::Env env, const TwainScanner::CapabilityReport& report) {
+    auto response = Napi::Object::New(env);
+    response.Set("success", Napi::Boolean::New(env, report.success));
+
+    if (!report.success) {
+        response.Set("errorMessage", Napi::String::New(env, report.errorMessage));
+        return response;
+    }
+
+    response.Set("fromCache", Napi::Boolean::New(env, report.fromCache));
+    response.Set("totalMs", Napi::Number::New(env, report.totalMs));
+
+    auto capabilities = Napi::Object::New(env);
+    for (const auto& info : report.capabilities) {
+        const char* name = CapabilityNameOf(info.cap);
+        std::string key = name ? name : std::to_string(info.cap);
+        capabilities.Set(key, CapabilityToObject(env, info));
+    }
+    response.Set("capabilities", capabilities);
+
+    auto fastPaths = Napi::Object::New(env);
+    fastPaths.Set("compression", Napi::Boolean::New(env, report.fastPaths.compression));
+    fastPaths.Set("memoryTransfer", Napi::Boolean::New(env, report.fastPaths.memoryTransfer));
+    fastPaths.Set("fileTransfer", Napi::Boolean::New(env, report.fastPaths.fileTransfer));
+    fastPaths.Set("blankPageDiscard", Napi::Boolean::New(env, report.fastPaths.blankPageDiscard));
+    fastPaths.Set("automaticDeskew", Napi::Boolean::New(env, report.fastPaths.automaticDeskew));
+    fastPaths.Set("automaticBorderDetection", Napi::Boolean::New(env, report.fastPaths.automaticBorderDetection));
+    fastPaths.Set("colourDropout", Napi::Boolean::New(env, report.fastPaths.colourDropout));
+    response.Set("fastPaths", fastPaths);
+
+    return response;
+}
+
+Napi::Value IdentityToObject(Napi::Env env, const TW_IDENTITY& identity) {
+    auto device = Napi::Object::New(env);
+    device.Set("id", Napi::Number::New(env, identity.Id));
+    device.Set("productName", Napi::String::New(env, identity.ProductName));
+    device.Set("productFamily", Napi::String::New(env, identity.ProductFamily));
+    device.Set("manufacturer", Napi::String::New(env, identity.Manufacturer));
+    device.Set("protocolVersion", Napi::String::New(env,
+        std::to_string(identity.ProtocolMajor) + "." + std::to_string(identity.ProtocolMinor)));
+    device.Set("driverVersion", Napi::String::New(env,
+        std::to_string(identity.Version.MajorNum) + "." + std::to_string(identity.Version.MinorNum)));
+    return device;
+}
+
+Napi::Value DeviceListToObject(Napi::Env env, const DeviceListResult& result) {
+    auto response = Napi::Object::New(env);
+    response.Set("success", Napi::Boolean::New(env, result.success));
+
+    if (result.success) {
+        auto devices = Napi::Array::New(env, result.devices.size());
+        for (size_t i = 0; i < result.devices.size(); i++) {
+            devices[i] = IdentityToObject(env, result.devices[i]);
+        }
+        response.Set("devices", devices);
+    } else {
+        response.Set("errorMessage", Napi::String::New(env, result.errorMessage));
+    }
+
+    return response;
+}
+
+Napi::Value StatsToObject(Napi::Env env, const ScanStats::Snapshot& snapshot) {
+    auto response = Napi::Object::New(env);
+    response.Set("sinceResetMs", Napi::Number::New(env, snapshot.sinceResetMs));
+
+    auto devices = Napi::Array::New(env, snapshot.devices.size());
+    for (size_t i = 0; i < snapshot.devices.size(); i++) {
+        const ScanStats::DeviceSummary& device = snapshot.devices[i];
+        auto object = Napi::Object::New(env);
+        object.Set("deviceId", Napi::Number::New(env, device.deviceId));
+        object.Set("deviceName", Napi::String::New(env, device.deviceName));
+
+        // Stages that never ran are left out
+        auto stages = Napi::Object::New(env);
+        for (int stage = 0; stage < kStageCount; stage++) {
+            const ScanStats::StageSummary& summary = device.stages[stage];
+            if (summary.count == 0) {
+                continue;
+            }
+            auto histogram = Napi::Object::New(env);
+            histogram.Set("count", Napi::Number::New(env, (double)summary.count));
+            histogram.Set("minMs", Napi::Number::New(env, summary.minMs));
+            histogram.Set("meanMs", Napi::Number::New(env, summary.meanMs));
+            histogram.Set("p50Ms", Napi::Number::New(env, summary.p50Ms));
+            histogram.Set("p90Ms", Napi::Number::New(env, summary.p90Ms));
+            histogram.Set("p99Ms", Napi::Number::New(env, summary.p99Ms));
+            histogram.Set("p999Ms", Napi::Number::New(env, summary.p999Ms));
+            histogram.Set("maxMs", Napi::Number::New(env, summary.maxMs));
+            stages.Set(ScanStageName((ScanStage)stage), histogram);
+        }
+        object.Set("stages", stages);
+        devices[i] = object;
+    }
+    response.Set("devices", devices);
+
+    return response;
+}
+
+Napi::Value DeviceEventToObject(Napi::Env env, const DeviceEvent& event) {
+    auto object = Napi::Object::New(env);
+    object.Set("type", Napi::String::New(env, event.type));
+    object.Set("deviceId", Napi::Number::New(env, event.deviceId));
+    object.Set("deviceName", Napi::String::New(env, event.deviceName));
+    if (event.code) {
+        object.Set("code", Napi::Number::New(env, event.code));
+    }
+    return object;
+}
+
+// Accepts the legacy scan(showUI) form as well as
+// scan({ showUI, deviceId, output: "base64" | "buffer", autoCrop,
+//        blankPages: "keep" | "flag" | "drop", blankThreshold, blankMargin,
+//        deskew, maxSkew, rotateFront, rotateBack,
+//        resampleDpi, resampleFilter: "lanczos" | "area",
+//        hash: "none" | "xxh3" | "sha256", duplicates, duplicateDistance,
+//        dropout: "none" | "red" | "green" | "blue" | "hue", dropoutHue: [from, to],
+//        dropoutMinChroma, dropoutOutput: "grey" | "bw", dropoutThreshold,
+//        despeckle, despeckleSize, despeckleThreshold, pageStats })
+ScanOptions ParseScanOptions(const Napi::CallbackInfo& info) {
+    ScanOptions options;
+    if (info.Length() == 0) {
+        return options;
+    }
+
+    if (info[0].IsBoolean()) {
+        options.showUI = info[0].As<Napi::Boolean>().Value();
+    } else if (info[0].IsObject()) {
+        auto object = info[0].As<Napi::Object>();
+        if (object.Has("showUI") && object.Get("showUI").IsBoolean()) {
+            options.showUI = object.Get("showUI").As<Napi::Boolean>().Value();
+        }
+        if (object.Has("deviceId") && object.Get("deviceId").IsNumber()) {
+            options.deviceId = object.Get("deviceId").As<Napi::Number>().Uint32Value();
+        }
+        if (object.Has("output") && object.Get("output").IsString()) {
+            options.base64 = object.Get("output").As<Napi::String>().Utf8Value() != "buffer";
+        }
+        if (object.Has("autoCrop") && object.Get("autoCrop").IsBoolean()) {
+            options.autoCrop = object.Get("autoCrop").As<Napi::Boolean>().Value();
+        }
+        if (object.Has("blankPages") && object.Get("blankPages").IsString()) {
+            std::string mode = object.Get("blankPages").As<Napi::String>().Utf8Value();
+            options.blankPages = mode == "drop" ? kBlankPagesDrop : mode == "flag" ? kBlankPagesFlag : kBlankPagesKeep;
+        }
+        if (object.Has("blankThreshold") && object.Get("blankThreshold").IsNumber()) {
+            options.blankPageOptions.threshold = object.Get("blankThreshold").As<Napi::Number>().DoubleValue();
+        }
+        if (object.Has("blankMargin") && object.Get("blankMargin").IsNumber()) {
+            options.blankPageOptions.margin = object.Get("blankMargin").As<Napi::Number>().DoubleValue();
+        }
+        if (object.Has("deskew") && object.Get("deskew").IsBoolean()) {
+            options.deskew = object.Get("deskew").As<Napi::Boolean>().Value();
+        }
+        if (object.Has("maxSkew") && object.Get("maxSkew").IsNumber()) {
+            options.deskewOptions.maxAngle = object.Get("maxSkew").As<Napi::Number>().DoubleValue();
+        }
+        // Clockwise quarter turns; other angles leave the side as scanned
+        auto rotation = [&object](const char* name, int& degrees) {
+            if (object.Has(name) && object.Get(name).IsNumber()) {
+                double value = object.Get(name).As<Napi::Number>().DoubleValue();
+                degrees = std::fmod(value, 90) == 0 ? (int)std::fmod(std::fmod(value, 360) + 360, 360) : 0;
+            }
+        };
+        rotation("rotateFront", options.frontRotation);
+        rotation("rotateBack", options.backRotation);
+        if (object.Has("resampleDpi") && object.Get("resampleDpi").IsNumber()) {
+            options.resampleOptions.dpi = std::max(0.0, object.Get("resampleDpi").As<Napi::Number>().DoubleValue());
+        }
+        if (object.Has("resampleFilter") && object.Get("resampleFilter").IsString()) {
+            std::string filter = object.Get("resampleFilter").As<Napi::String>().Utf8Value();
+            options.resampleOptions.filter = filter == "area" ? kResampleArea : kResampleLanczos;
+        }
+        // SHA-256 comes with XXH3 rather than instead of it
+        if (object.Has("hash") && object.Get("hash").IsString()) {
+            std::string hash = object.Get("hash").As<Napi::String>().Utf8Value();
+            options.pageHashes = hash == "sha256" ? kPageHashFastAndSha256 : hash == "xxh3" ? kPageHashFast : kPageHashNone;
+        }
+        if (object.Has("duplicates") && object.Get("duplicates").IsBoolean()) {
+            options.detectDuplicates = object.Get("duplicates").As<Napi::Boolean>().Value();
+        }
+        if (object.Has("duplicateDistance") && object.Get("duplicateDistance").IsNumber()) {
+            int distance = object.Get("duplicateDistance").As<Napi::Number>().Int32Value();
+            options.duplicateDistance = std::max(0, std::min(distance, 32));
+        }
+        ColourDropoutOptions& dropout = options.dropoutOptions;
+        if (object.Has("dropout") && object.Get("dropout").IsString()) {
+            std::string mode = object.Get("dropout").As<Napi::String>().Utf8Value();
+            dropout.mode = mode == "red" ? kDropoutRed : mode == "green" ? kDropoutGreen :
+                mode == "blue" ? kDropoutBlue : mode == "hue" ? kDropoutHueRange : kDropoutNone;
+        }
+        // Degrees round from red through green, as [from, to]
+        if (object.Has("dropoutHue") && object.Get("dropoutHue").IsArray()) {
+            auto hue = object.Get("dropoutHue").As<Napi::Array>();
+            if (hue.Length() == 2 && hue.Get((uint32_t)0).IsNumber() && hue.Get((uint32_t)1).IsNumber()) {
+                dropout.hueFrom = hue.Get((uint32_t)0).As<Napi::Number>().DoubleValue();
+                dropout.hueTo = hue.Get((uint32_t)1).As<Napi::Number>().DoubleValue();
+            }
+        }
+        if (object.Has("dropoutMinChroma") && object.Get("dropoutMinChroma").IsNumber()) {
+            int chroma = object.Get("dropoutMinChroma").As<Napi::Number>().Int32Value();
+            dropout.minChroma = (uint8_t)std::max(0, std::min(chroma, 255));
+        }
+        if (object.Has("dropoutOutput") && object.Get("dropoutOutput").IsString()) {
+            dropout.outputBits = object.Get("dropoutOutput").As<Napi::String>().Utf8Value() == "bw" ? 1 : 8;
+        }
+        if (object.Has("dropoutThreshold") && object.Get("dropoutThreshold").IsNumber()) {
+            int level = object.Get("dropoutThreshold").As<Napi::Number>().Int32Value();
+            dropout.threshold = (uint8_t)std::max(0, std::min(level, 255));
+        }
+        if (object.Has("despeckle") && object.Get("despeckle").IsBoolean()) {
+            options.despeckle = object.Get("despeckle").As<Napi::Boolean>().Value();
+        }
+        if (object.Has("despeckleSize") && object.Get("despeckleSize").IsNumber()) {
+            int size = object.Get("despeckleSize").As<Napi::Number>().Int32Value();
+            options.despeckleOptions.maxSpeckle = std::max(1, std::min(size, 64));
+        }
+        if (object.Has("despeckleThreshold") && object.Get("despeckleThreshold").IsNumber()) {
+            int level = object.Get("despeckleThreshold").As<Napi::Number>().Int32Value();
+            options.despeckleOptions.greyThreshold = (uint8_t)std::max(0, std::min(level, 255));
+        }
+        if (object.Has("pageStats") && object.Get("pageStats").IsBoolean()) {
+            options.pageStats = object.Get("pageStats").As<Napi::Boolean>().Value();
+        }
+    }
+
+    return options;
+}
+
+Napi::Value SuccessToObject(Napi::Env env, const bool& success) {
+    auto response = Napi::Object::New(env);
+    response.Set("success", Napi::Boolean::New(env, success));
+    return response;
+}
+
+Napi::Value LogRecordsToArray(Napi::Env env, const std::vector<LogRecord>& records) {
+    auto array = Napi::Array::New(env, records.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        const LogRecord& record = records[i];
+        auto item = Napi::Object::New(env);
+        item.Set("level", Napi::String::New(env, LogLevelName(record.level)));
+        item.Set("time", Napi::Number::New(env, (double)record.timeMs));
+        item.Set("thread", Napi::Number::New(env, record.thread));
+        if (record.deviceId != LogRecord::kNone) {
+            item.Set("deviceId", Napi::Number::New(env, (double)record.deviceId));
+        }
+        if (record.page != LogRecord::kNone) {
+            item.Set("page", Napi::Number::New(env, record.page));
+        }
+        if (record.rc != LogRecord::kNone) {
+            item.Set("rc", Napi::Number::New(env, record.rc));
+        }
+        item.Set("message", Napi::String::New(env, record.message));
+        array.Set((uint32_t)i, item);
+    }
+    return array;
+}
+
+// The log is process-wide, so is its JS callback. Only touched on the JS
+// thread.
+Napi::ThreadSafeFunction g_LogCallback;
+
+void ShutdownLog(void*) {
+    Logger::SetSink(Logger::Sink());
+    if (g_LogCallback) {
+        g_LogCallback.Release();
+        g_LogCallback = Napi::ThreadSafeFunction();
+    }
+    Logger::Shutdown();
+}
+
+void WaitForTwainThreads(void*) {
+    TwainThread::WaitForDetached();
+}
+
+}  // namespace
 
 Napi::FunctionReference ScannerAddon::constructor;
 
@@ -6,88 +605,645 @@ Napi::Object ScannerAddon::Init(Napi::Env env, Napi::Object exports) {
     Napi::HandleScope scope(env);
 
     Napi::Function func = DefineClass(env, "Scanner", {
+        InstanceMethod("warmUp", &ScannerAddon::WarmUp),
         InstanceMethod("initialize", &ScannerAddon::Initialize),
         InstanceMethod("scan", &ScannerAddon::Scan),
         InstanceMethod("cleanup", &ScannerAddon::Cleanup),
         InstanceMethod("isDuplexSupported", &ScannerAddon::IsDuplexSupported),
+        InstanceMethod("setSessionOptions", &ScannerAddon::SetSessionOptions),
+        InstanceMethod("closeSession", &ScannerAddon::CloseSession),
+        InstanceMethod("setCapabilityCachePath", &ScannerAddon::SetCapabilityCachePath),
+        InstanceMethod("revalidateCapabilities", &ScannerAddon::RevalidateCapabilities),
+        InstanceMethod("getCapabilities", &ScannerAddon::GetCapabilities),
+        InstanceMethod("listDevices", &ScannerAddon::ListDevices),
+        InstanceMethod("startDeviceMonitor", &ScannerAddon::StartDeviceMonitor),
+        InstanceMethod("stopDeviceMonitor", &ScannerAddon::StopDeviceMonitor),
+        InstanceMethod("useSimulator", &ScannerAddon::UseSimulator),
+        InstanceMethod("getStats", &ScannerAddon::GetStats),
+        InstanceMethod("resetStats", &ScannerAddon::ResetStats),
+        InstanceMethod("resetDuplicates", &ScannerAddon::ResetDuplicates),
+        InstanceMethod("startTrace", &ScannerAddon::StartTrace),
+        InstanceMethod("stopTrace", &ScannerAddon::StopTrace),
+        InstanceMethod("startRecording", &ScannerAddon::StartRecording),
+        InstanceMethod("stopRecording", &ScannerAddon::StopRecording),
+        InstanceMethod("useReplay", &ScannerAddon::UseReplay),
+        InstanceMethod("setLogOptions", &ScannerAddon::SetLogOptions),
+        InstanceMethod("onLog", &ScannerAddon::OnLog),
     });
 
     constructor = Napi::Persistent(func);
     constructor.SuppressDestruct();
 
     exports.Set("Scanner", func);
+
+    // Delivers what is still buffered and stops the flusher thread before
+    // the environment goes away
+    napi_add_env_cleanup_hook(env, ShutdownLog, nullptr);
+
+    // Cleanup hooks run last-added first: scanners still alive stop their
+    // threads, then those of collected scanners and detached work such as
+    // stopTrace() and stopRecording() are waited for, then the log shuts down
+    napi_add_env_cleanup_hook(env, WaitForTwainThreads, nullptr);
     return exports;
 }
 
 ScannerAddon::ScannerAddon(const Napi::CallbackInfo& info) 
-    : Napi::ObjectWrap<ScannerAddon>(info) {
-    scanner = std::make_unique<TwainScanner>();
+    : Napi::ObjectWrap<ScannerAddon>(info)
+    , state(std::make_shared<ScannerState>())
+    , twainThread(std::make_shared<TwainThread>()) {
+    state->scanner = std::make_unique<TwainScanner>();
+
+    Tracer::SetThreadName("JS main thread");
+    twainThread->SetIdleHandler([state = state]() {
+        if (state->scanner) {
+            state->scanner->OnIdle();
+        }
+    }, 1000);
+    twainThread->SetMessageHandler([state = state](MSG& msg) {
+        return state->scanner && state->scanner->ProcessMessage(msg);
+    });
+    twainThread->Start();
+
+    // A scanner still alive when the environment goes away is torn down
+    // there, while the DSM can still be closed
+    napi_add_env_cleanup_hook(info.Env(), TeardownOnExit, this);
+}
+
+ScannerAddon::~ScannerAddon() {
+    // Runs in a GC finalizer, so the thread is left to finish on its own
+    napi_remove_env_cleanup_hook(Env(), TeardownOnExit, this);
+    Teardown(false);
+}
+
+void ScannerAddon::Teardown(bool wait) {
+    if (!twainThread) {
+        return;
+    }
+
+    // The scanner closes the DSM in its destructor, so release it on the
+    // thread that opened it
+    Napi::ThreadSafeFunction events = deviceEvents;
+    deviceEvents = Napi::ThreadSafeFunction();
+    twainThread->Post("destroy", [state = state, events]() mutable {
+        state->scanner.reset();
+        if (events) {
+            events.Release();
+        }
+    });
+
+    if (wait) {
+        twainThread->Stop();
+    } else {
+        twainThread->Detach();
+    }
+    twainThread.reset();
+}
+
+void ScannerAddon::TeardownOnExit(void* addon) {
+    static_cast<ScannerAddon*>(addon)->Teardown(true);
+}
+
+Napi::Value ScannerAddon::WarmUp(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    // Loads and opens the DSM, enumerates sources and fetches capabilities
+    // ahead of the first initialize() call
+    return Settle<TwainScanner::InitResult>(env, *twainThread, "warmUp", [state = state]() {
+        if (!state->hasWarmUp) {
+            state->warmUpResult = state->scanner->Initialize();
+            state->hasWarmUp = true;
+        }
+        return state->warmUpResult;
+    }, InitResultToObject);
 }
 
 Napi::Value ScannerAddon::Initialize(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
+    auto calledAt = std::chrono::steady_clock::now();
     
-    auto result = scanner->Initialize();
-    
-    auto response = Napi::Object::New(env);
-    response.Set("success", Napi::Boolean::New(env, result.success));
-    response.Set("message", Napi::String::New(env, result.message));
-    response.Set("deviceCount", Napi::Number::New(env, result.deviceCount));
-    
-    return response;
+    // Tasks run in order, so a pending warm-up finishes before this one
+    return Settle<TwainScanner::InitResult>(env, *twainThread, "initialize", [state = state, calledAt]() {
+        TwainScanner::InitResult result;
+        if (state->hasWarmUp && state->warmUpResult.success) {
+            result = state->warmUpResult;
+            result.timings.warm = true;
+        } else {
+            result = state->scanner->Initialize();
+        }
+        state->hasWarmUp = false;
+
+        result.timings.waitMs = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - calledAt).count();
+        return result;
+    }, InitResultToObject);
 }
 
 Napi::Value ScannerAddon::IsDuplexSupported(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     
-    if (!scanner) {
+    if (!state->scanner) {
         Napi::Error::New(env, "Scanner not initialized").ThrowAsJavaScriptException();
         return env.Null();
     }
     
-    return Napi::Boolean::New(env, scanner->IsDuplexSupported());
+    return Napi::Boolean::New(env, state->scanner->IsDuplexSupported());
+}
+
+Napi::Value ScannerAddon::SetSessionOptions(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsObject()) {
+        Napi::TypeError::New(env, "Expected an options object").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    auto options = info[0].As<Napi::Object>();
+    bool persistent = false;
+    DWORD idleTimeoutMs = 120000;
+    if (options.Has("persistent") && options.Get("persistent").IsBoolean()) {
+        persistent = options.Get("persistent").As<Napi::Boolean>().Value();
+    }
+    if (options.Has("idleTimeoutMs") && options.Get("idleTimeoutMs").IsNumber()) {
+        idleTimeoutMs = options.Get("idleTimeoutMs").As<Napi::Number>().Uint32Value();
+    }
+
+    twainThread->Post("setSessionOptions", [state = state, persistent, idleTimeoutMs]() {
+        state->scanner->SetSessionOptions(persistent, idleTimeoutMs);
+    });
+    return env.Undefined();
+}
+
+Napi::Value ScannerAddon::CloseSession(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    return Settle<bool>(env, *twainThread, "closeSession", [state = state]() {
+        bool wasOpen = state->scanner->IsSessionOpen();
+        state->scanner->CloseSession();
+        return wasOpen;
+    }, [](Napi::Env env, const bool& wasOpen) {
+        auto response = Napi::Object::New(env);
+        response.Set("success", Napi::Boolean::New(env, true));
+        response.Set("wasOpen", Napi::Boolean::New(env, wasOpen));
+        return (Napi::Value)response;
+    });
+}
+
+Napi::Value ScannerAddon::SetCapabilityCachePath(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsString()) {
+        Napi::TypeError::New(env, "Expected a cache file path").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    std::string path = info[0].As<Napi::String>().Utf8Value();
+    twainThread->Post("setCapabilityCachePath", [state = state, path]() {
+        state->scanner->SetCapabilityCachePath(path);
+    });
+    return env.Undefined();
+}
+
+Napi::Value ScannerAddon::RevalidateCapabilities(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    return Settle<RevalidateResult>(env, *twainThread, "revalidateCapabilities", [state = state]() {
+        RevalidateResult result;
+        result.success = state->scanner->RevalidateCapabilities(result.changed);
+        if (!result.success) {
+            result.errorMessage = state->scanner->LastError();
+        }
+        return result;
+    }, [](Napi::Env env, const RevalidateResult& result) {
+        auto response = Napi::Object::New(env);
+        response.Set("success", Napi::Boolean::New(env, result.success));
+        response.Set("changed", Napi::Boolean::New(env, result.changed));
+        if (!result.success) {
+            response.Set("errorMessage", Napi::String::New(env, result.errorMessage));
+        }
+        return (Napi::Value)response;
+    });
+}
+
+Napi::Value ScannerAddon::GetCapabilities(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    bool refresh = false;
+    if (info.Length() > 0 && info[0].IsObject()) {
+        auto options = info[0].As<Napi::Object>();
+        if (options.Has("refresh") && options.Get("refresh").IsBoolean()) {
+            refresh = options.Get("refresh").As<Napi::Boolean>().Value();
+        }
+    }
+
+    return Settle<TwainScanner::CapabilityReport>(env, *twainThread, "getCapabilities", [state = state, refresh]() {
+        return state->scanner->DiscoverCapabilities(refresh);
+    }, CapabilityReportToObject);
+}
+
+Napi::Value ScannerAddon::ListDevices(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    bool refresh = false;
+    if (info.Length() > 0 && info[0].IsObject()) {
+        auto options = info[0].As<Napi::Object>();
+        if (options.Has("refresh") && options.Get("refresh").IsBoolean()) {
+            refresh = options.Get("refresh").As<Napi::Boolean>().Value();
+        }
+    }
+
+    return Settle<DeviceListResult>(env, *twainThread, "listDevices", [state = state, refresh]() {
+        DeviceListResult result;
+        result.success = state->scanner->ListDevices(refresh, result.devices);
+        if (!result.success) {
+            result.errorMessage = state->scanner->LastError();
+        }
+        return result;
+    }, DeviceListToObject);
+}
+
+Napi::Value ScannerAddon::StartDeviceMonitor(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsFunction()) {
+        Napi::TypeError::New(env, "Expected a device event callback").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    DWORD intervalMs = 2000;
+    if (info.Length() > 1 && info[1].IsObject()) {
+        auto options = info[1].As<Napi::Object>();
+        if (options.Has("intervalMs") && options.Get("intervalMs").IsNumber()) {
+            intervalMs = options.Get("intervalMs").As<Napi::Number>().Uint32Value();
+        }
+    }
+
+    // Events are raised on the TWAIN thread and queued to the JS thread.
+    // The monitor alone does not keep the process alive.
+    Napi::ThreadSafeFunction previous = deviceEvents;
+    deviceEvents = Napi::ThreadSafeFunction::New(
+        env, info[0].As<Napi::Function>(), "TwainDeviceEvents", 0, 1);
+    deviceEvents.Unref(env);
+
+    Napi::ThreadSafeFunction events = deviceEvents;
+    return Settle<bool>(env, *twainThread, "startDeviceMonitor", [state = state, events, previous, intervalMs]() {
+        state->scanner->StartDeviceMonitor([events](const DeviceEvent& event) {
+            auto data = new DeviceEvent(event);
+            napi_status status = events.NonBlockingCall(data,
+                [](Napi::Env env, Napi::Function callback, DeviceEvent* data) {
+                    callback.Call({ DeviceEventToObject(env, *data) });
+                    delete data;
+                });
+            if (status != napi_ok) {
+                delete data;
+            }
+        }, intervalMs);
+
+        // The handler holding the previous callback has just been replaced
+        if (previous) {
+            previous.Release();
+        }
+        return true;
+    }, SuccessToObject);
+}
+
+Napi::Value ScannerAddon::StopDeviceMonitor(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    // Release on the TWAIN thread once the handler holding it is gone
+    Napi::ThreadSafeFunction events = deviceEvents;
+    deviceEvents = Napi::ThreadSafeFunction();
+    return Settle<bool>(env, *twainThread, "stopDeviceMonitor", [state = state, events]() {
+        state->scanner->StopDeviceMonitor();
+        if (events) {
+            events.Release();
+        }
+        return true;
+    }, SuccessToObject);
+}
+
+Napi::Value ScannerAddon::UseSimulator(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    SimulatedScannerConfig config;
+    if (info.Length() > 0 && info[0].IsObject()) {
+        auto options = info[0].As<Napi::Object>();
+        auto number = [&options](const char* name, double& value) {
+            if (options.Has(name) && options.Get(name).IsNumber()) {
+                value = options.Get(name).As<Napi::Number>().DoubleValue();
+            }
+        };
+        auto flag = [&options](const char* name, bool& value) {
+            if (options.Has(name) && options.Get(name).IsBoolean()) {
+                value = options.Get(name).As<Napi::Boolean>().Value();
+            }
+        };
+
+        double pageWidth = config.pageWidth, pageHeight = config.pageHeight;
+        double resolution = config.resolution, bitDepth = config.bitDepth;
+        double sheetCount = config.sheetCount, sourceCount = config.sourceCount;
+        number("pageWidth", pageWidth);
+        number("pageHeight", pageHeight);
+        number("resolution", resolution);
+        number("bitDepth", bitDepth);
+        number("pagesPerMinute", config.pagesPerMinute);
+        number("sheetCount", sheetCount);
+        number("sourceCount", sourceCount);
+        number("skewDegrees", config.skewDegrees);
+        number("platenBorder", config.platenBorder);
+        flag("duplex", config.duplex);
+        flag("closeRequestAfterScan", config.closeRequestAfterScan);
+        flag("blankBackSides", config.blankBackSides);
+        flag("blankPageDiscard", config.blankPageDiscard);
+        flag("deviceDeskew", config.deviceDeskew);
+        flag("deviceColourDropout", config.deviceColourDropout);
+        flag("deviceBorderDetection", config.deviceBorderDetection);
+        flag("invertedBackSides", config.invertedBackSides);
+        flag("ignoresResolution", config.ignoresResolution);
+
+        // Whole numbers within range, so the casts below neither wrap nor
+        // hit undefined behaviour; NaN fails every comparison
+        auto whole = [](double value, double min, double max) {
+            return value >= min && value <= max && std::floor(value) == value;
+        };
+        if (!whole(pageWidth, 1, 65535) || !whole(pageHeight, 1, 65535) || !whole(resolution, 1, 65535) ||
+            !whole(sheetCount, 0, 10000) || !whole(sourceCount, 0, 64) ||
+            (bitDepth != 1 && bitDepth != 8 && bitDepth != 24)) {
+            Napi::TypeError::New(env, "Invalid simulator page format").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        config.pageWidth = (TW_UINT32)pageWidth;
+        config.pageHeight = (TW_UINT32)pageHeight;
+        config.resolution = (TW_UINT16)resolution;
+        config.bitDepth = (TW_UINT16)bitDepth;
+        config.sheetCount = (TW_UINT32)sheetCount;
+        config.sourceCount = (TW_UINT32)sourceCount;
+    }
+
+    // Applies to the next initialize(); a DSM that is already loaded stays
+    twainThread->Post("useSimulator", [config]() {
+        SimulatedDsm::Configure(config);
+        SimulatedDsm::Enable(true);
+    });
+    return env.Undefined();
 }
 
 Napi::Value ScannerAddon::Scan(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     
-    bool showUI = true;
-    if (info.Length() > 0 && info[0].IsBoolean()) {
-        showUI = info[0].As<Napi::Boolean>().Value();
-    }
+    ScanOptions options = ParseScanOptions(info);
     
-    auto result = scanner->Scan(showUI);
+    // Marshalling runs here on the JS thread, so it is timed here. The
+    // stats are shared since the scanner may be released first.
+    std::shared_ptr<ScanStats> stats = state->scanner->SharedStats();
+    return Settle<ScannerResult>(env, *twainThread, "scan", [state = state, options]() {
+        return state->scanner->Scan(options);
+    }, [stats](Napi::Env env, const ScannerResult& result) {
+        auto marshalStart = std::chrono::steady_clock::now();
+        Napi::Value response = ScanResultToObject(env, result);
+        if (result.deviceId) {
+            stats->Record(result.deviceId, kStageMarshal,
+                std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - marshalStart).count());
+        }
+        return response;
+    });
+}
+
+// Stats are kept behind their own lock, so this does not wait for a scan
+// in progress on the TWAIN thread
+Napi::Value ScannerAddon::GetStats(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    bool reset = false;
+    if (info.Length() > 0 && info[0].IsObject()) {
+        auto options = info[0].As<Napi::Object>();
+        if (options.Has("reset") && options.Get("reset").IsBoolean()) {
+            reset = options.Get("reset").As<Napi::Boolean>().Value();
+        }
+    }
+
+    auto deferred = Napi::Promise::Deferred::New(env);
+    deferred.Resolve(StatsToObject(env, state->scanner->Stats().GetSnapshot(reset)));
+    return deferred.Promise();
+}
+
+Napi::Value ScannerAddon::ResetStats(const Napi::CallbackInfo& info) {
+    state->scanner->Stats().Reset();
+    return info.Env().Undefined();
+}
+
+// The index is only touched on the TWAIN thread, so this waits for a scan
+// in progress
+Napi::Value ScannerAddon::ResetDuplicates(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    return Settle<bool>(env, *twainThread, "resetDuplicates", [state = state]() {
+        state->scanner->ResetDuplicateIndex();
+        return true;
+    }, SuccessToObject);
+}
+
+Napi::Value ScannerAddon::Cleanup(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
     
+    return Settle<bool>(env, *twainThread, "cleanup", [state = state]() {
+        state->hasWarmUp = false;
+        return state->scanner->Cleanup();
+    }, SuccessToObject);
+}
+
+// Tracing is process-wide: a session records every scanner instance
+Napi::Value ScannerAddon::StartTrace(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsString()) {
+        Napi::TypeError::New(env, "Trace file path expected").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    std::string error;
     auto response = Napi::Object::New(env);
-    response.Set("success", Napi::Boolean::New(env, result.success));
-    
-    if (result.success) {
-        auto images = Napi::Array::New(env, result.base64Images.size());
-        for (size_t i = 0; i < result.base64Images.size(); i++) {
-            images[i] = Napi::String::New(env, result.base64Images[i]);
+    bool started = Tracer::Start(info[0].As<Napi::String>().Utf8Value(), error);
+    response.Set("success", Napi::Boolean::New(env, started));
+    if (!started) {
+        response.Set("errorMessage", Napi::String::New(env, error));
+    }
+    return response;
+}
+
+// Writing the file can take a while for a long session, so it happens off
+// the JS thread
+Napi::Value ScannerAddon::StopTrace(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    return SettleOffThread<Tracer::Summary>(env, "stopTrace", []() {
+        return Tracer::Stop();
+    }, [](Napi::Env env, const Tracer::Summary& summary) {
+        auto response = Napi::Object::New(env);
+        response.Set("success", Napi::Boolean::New(env, summary.success));
+        response.Set("path", Napi::String::New(env, summary.path));
+        response.Set("eventCount", Napi::Number::New(env, (double)summary.eventCount));
+        response.Set("droppedCount", Napi::Number::New(env, (double)summary.droppedCount));
+        if (!summary.success) {
+            response.Set("errorMessage", Napi::String::New(env, summary.errorMessage));
         }
-        response.Set("images", images);
-    } else {
-        response.Set("errorMessage", Napi::String::New(env, result.errorMessage));
+        return (Napi::Value)response;
+    });
+}
+
+// Like tracing, a recording covers every scanner instance in the process
+Napi::Value ScannerAddon::StartRecording(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsString()) {
+        Napi::TypeError::New(env, "Recording file path expected").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    std::string error;
+    auto response = Napi::Object::New(env);
+    bool started = DsmRecorder::Start(info[0].As<Napi::String>().Utf8Value(), error);
+    response.Set("success", Napi::Boolean::New(env, started));
+    if (!started) {
+        response.Set("errorMessage", Napi::String::New(env, error));
     }
-    
     return response;
 }
 
-Napi::Value ScannerAddon::Cleanup(const Napi::CallbackInfo& info) {
+Napi::Value ScannerAddon::StopRecording(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
-    
-    bool result = scanner->Cleanup();
-    
+
+    return SettleOffThread<DsmRecorder::Summary>(env, "stopRecording", []() {
+        return DsmRecorder::Stop();
+    }, [](Napi::Env env, const DsmRecorder::Summary& summary) {
+        auto response = Napi::Object::New(env);
+        response.Set("success", Napi::Boolean::New(env, summary.success));
+        response.Set("path", Napi::String::New(env, summary.path));
+        response.Set("callCount", Napi::Number::New(env, (double)summary.callCount));
+        response.Set("notificationCount", Napi::Number::New(env, (double)summary.notificationCount));
+        response.Set("bytes", Napi::Number::New(env, (double)summary.bytes));
+        if (!summary.success) {
+            response.Set("errorMessage", Napi::String::New(env, summary.errorMessage));
+        }
+        return (Napi::Value)response;
+    });
+}
+
+Napi::Value ScannerAddon::UseReplay(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsString()) {
+        Napi::TypeError::New(env, "Recording file path expected").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    std::string path = info[0].As<Napi::String>().Utf8Value();
+
+    double speed = 1;
+    if (info.Length() > 1 && info[1].IsObject()) {
+        auto options = info[1].As<Napi::Object>();
+        if (options.Has("speed") && options.Get("speed").IsNumber()) {
+            speed = options.Get("speed").As<Napi::Number>().DoubleValue();
+        }
+    }
+
+    // Applies to the next initialize(), like useSimulator()
+    return Settle<std::string>(env, *twainThread, "useReplay", [path, speed]() {
+        std::string error;
+        ReplayDsm::Load(path, speed, error);
+        return error;
+    }, [](Napi::Env env, const std::string& error) {
+        auto response = Napi::Object::New(env);
+        response.Set("success", Napi::Boolean::New(env, error.empty()));
+        if (!error.empty()) {
+            response.Set("errorMessage", Napi::String::New(env, error));
+        }
+        return (Napi::Value)response;
+    });
+}
+
+Napi::Value ScannerAddon::SetLogOptions(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsObject()) {
+        Napi::TypeError::New(env, "Log options expected").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    auto options = info[0].As<Napi::Object>();
+    Logger::Options log = Logger::Current();
+
+    if (options.Has("level")) {
+        Napi::Value level = options.Get("level");
+        if (!level.IsString() || !ParseLogLevel(level.As<Napi::String>().Utf8Value(), log.level)) {
+            Napi::TypeError::New(env, "level must be debug, info, warn, error or off").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+    }
+    if (options.Has("console") && options.Get("console").IsBoolean()) {
+        log.console = options.Get("console").As<Napi::Boolean>().Value();
+    }
+    if (options.Has("file")) {
+        Napi::Value file = options.Get("file");
+        log.filePath = file.IsString() ? file.As<Napi::String>().Utf8Value() : std::string();
+    }
+    if (options.Has("maxFileBytes") && options.Get("maxFileBytes").IsNumber()) {
+        log.maxFileBytes = (uint64_t)options.Get("maxFileBytes").As<Napi::Number>().Int64Value();
+    }
+    if (options.Has("maxFiles") && options.Get("maxFiles").IsNumber()) {
+        log.maxFiles = options.Get("maxFiles").As<Napi::Number>().Uint32Value();
+    }
+
+    std::string error;
     auto response = Napi::Object::New(env);
-    response.Set("success", Napi::Boolean::New(env, result));
-    
+    bool configured = Logger::Configure(log, error);
+    response.Set("success", Napi::Boolean::New(env, configured));
+    if (!configured) {
+        response.Set("errorMessage", Napi::String::New(env, error));
+    }
     return response;
 }
 
+// Records arrive in batches from the flusher thread; the callback alone
+// does not keep the process alive
+Napi::Value ScannerAddon::OnLog(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !(info[0].IsFunction() || info[0].IsNull() || info[0].IsUndefined())) {
+        Napi::TypeError::New(env, "Expected a log callback or null").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    Napi::ThreadSafeFunction previous = g_LogCallback;
+    g_LogCallback = Napi::ThreadSafeFunction();
+    if (info[0].IsFunction()) {
+        g_LogCallback = Napi::ThreadSafeFunction::New(
+            env, info[0].As<Napi::Function>(), "TwainLog", 0, 1);
+        g_LogCallback.Unref(env);
+
+        Napi::ThreadSafeFunction callback = g_LogCallback;
+        Logger::SetSink([callback](const std::vector<LogRecord>& records) {
+            auto data = new std::vector<LogRecord>(records);
+            napi_status status = callback.NonBlockingCall(data,
+                [](Napi::Env env, Napi::Function callback, std::vector<LogRecord>* data) {
+                    callback.Call({ LogRecordsToArray(env, *data) });
+                    delete data;
+                });
+            if (status != napi_ok) {
+                delete data;
+            }
+        });
+    } else {
+        Logger::SetSink(Logger::Sink());
+    }
+
+    // The flusher no longer holds the previous callback
+    if (previous) {
+        previous.Release();
+    }
+    return env.Undefined();
+}
+
 // Init addon
 Napi::Object Init(Napi::Env env, Napi::Object exports) {
     return ScannerAddon::Init(env, exports);
 }
 
-NODE_API_MODULE(scanner, Init)
\ No newline at end of file
+NODE_API_MODULE(scanner, Init)
@@ -1,19 +1,64 @@
 #pragma once
 #include <napi.h>
 #include "scanner.h"
+#include "twain_thread.h"
+
+// What the TWAIN thread works on. Tasks hold it by shared_ptr, so a
+// scanner collected with tasks still queued does not free it under them.
+// Only touched on the TWAIN thread, except the thread-safe ScanStats.
+struct ScannerState {
+    std::unique_ptr<TwainScanner> scanner;
+
+    // Result of warmUp(), handed to the next initialize()
+    TwainScanner::InitResult warmUpResult;
+    bool hasWarmUp;
+
+    ScannerState() : hasWarmUp(false) {}
+};
 
 class ScannerAddon : public Napi::ObjectWrap<ScannerAddon> {
 public:
     static Napi::Object Init(Napi::Env env, Napi::Object exports);
     ScannerAddon(const Napi::CallbackInfo& info);
+    ~ScannerAddon();
 
 private:
     static Napi::FunctionReference constructor;
     
-     Napi::Value Initialize(const Napi::CallbackInfo& info);
+    Napi::Value WarmUp(const Napi::CallbackInfo& info);
+    Napi::Value Initialize(const Napi::CallbackInfo& info);
     Napi::Value Scan(const Napi::CallbackInfo& info);
     Napi::Value Cleanup(const Napi::CallbackInfo& info);
     Napi::Value IsDuplexSupported(const Napi::CallbackInfo& info);
+    Napi::Value SetSessionOptions(const Napi::CallbackInfo& info);
+    Napi::Value CloseSession(const Napi::CallbackInfo& info);
+    Napi::Value SetCapabilityCachePath(const Napi::CallbackInfo& info);
+    Napi::Value RevalidateCapabilities(const Napi::CallbackInfo& info);
+    Napi::Value GetCapabilities(const Napi::CallbackInfo& info);
+    Napi::Value ListDevices(const Napi::CallbackInfo& info);
+    Napi::Value StartDeviceMonitor(const Napi::CallbackInfo& info);
+    Napi::Value StopDeviceMonitor(const Napi::CallbackInfo& info);
+    Napi::Value UseSimulator(const Napi::CallbackInfo& info);
+    Napi::Value GetStats(const Napi::CallbackInfo& info);
+    Napi::Value ResetStats(const Napi::CallbackInfo& info);
+    Napi::Value ResetDuplicates(const Napi::CallbackInfo& info);
+    Napi::Value StartTrace(const Napi::CallbackInfo& info);
+    Napi::Value StopTrace(const Napi::CallbackInfo& info);
+    Napi::Value StartRecording(const Napi::CallbackInfo& info);
+    Napi::Value StopRecording(const Napi::CallbackInfo& info);
+    Napi::Value UseReplay(const Napi::CallbackInfo& info);
+    Napi::Value SetLogOptions(const Napi::CallbackInfo& info);
+    Napi::Value OnLog(const Napi::CallbackInfo& info);
+
+    // Posts the scanner's release and stops the TWAIN thread, waiting for
+    // it only when wait is set. Does nothing the second time.
+    void Teardown(bool wait);
+    static void TeardownOnExit(void* addon);
     
-    std::unique_ptr<TwainScanner> scanner;
-};
\ No newline at end of file
+    std::shared_ptr<ScannerState> state;
+    std::shared_ptr<TwainThread> twainThread;
+
+    // JS callback for device events; empty while the monitor is stopped.
+    // Only touched on the JS thread.
+    Napi::ThreadSafeFunction deviceEvents;
+};
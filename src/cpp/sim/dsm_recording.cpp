@@ -0,0 +1,285 @@
+#include "dsm_recording.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+
+std::atomic<bool> DsmRecorder::s_Active(false);
+
+namespace {
+
+const char kMagic[8] = { 'T', 'W', 'A', 'I', 'N', 'R', 'E', 'C' };
+const TW_UINT32 kVersion = 1;
+
+struct RecorderState {
+    std::mutex mutex;
+    FILE* file;
+    std::string path;
+    uint64_t startedAt;
+    DsmRecorder::Summary totals;
+
+    RecorderState() : file(nullptr), startedAt(0) {}
+};
+
+RecorderState& State() {
+    static RecorderState state;
+    return state;
+}
+
+uint64_t NowNs() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename T>
+void Put(std::vector<TW_UINT8>& out, T value) {
+    const TW_UINT8* bytes = (const TW_UINT8*)&value;
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+bool Take(FILE* file, T& value) {
+    return fread(&value, sizeof(T), 1, file) == 1;
+}
+
+void AppendHandle(std::vector<TW_UINT8>& payload, TW_HANDLE handle) {
+    const TW_UINT8* data = handle ? (const TW_UINT8*)GlobalLock((HANDLE)handle) : nullptr;
+    if (data) {
+        payload.insert(payload.end(), data, data + GlobalSize((HANDLE)handle));
+        GlobalUnlock((HANDLE)handle);
+    }
+}
+
+// Structures returned in place that hold no pointers
+size_t FixedOutputSize(TW_UINT16 DAT) {
+    switch (DAT) {
+        case DAT_IDENTITY: return sizeof(TW_IDENTITY);
+        case DAT_IMAGEINFO: return sizeof(TW_IMAGEINFO);
+        case DAT_IMAGELAYOUT: return sizeof(TW_IMAGELAYOUT);
+        case DAT_PENDINGXFERS: return sizeof(TW_PENDINGXFERS);
+        case DAT_SETUPMEMXFER: return sizeof(TW_SETUPMEMXFER);
+        case DAT_STATUS: return sizeof(TW_STATUS);
+        case DAT_DEVICEEVENT: return sizeof(TW_DEVICEEVENT);
+        default: return 0;
+    }
+}
+
+void CapturePayload(RecordedEntry& entry, TW_MEMREF pData) {
+    if (!pData) {
+        return;
+    }
+
+    if (entry.dat == DAT_CAPABILITY) {
+        pTW_CAPABILITY cap = (pTW_CAPABILITY)pData;
+        entry.cap = cap->Cap;
+        entry.conType = cap->ConType;
+        if (entry.rc == TWRC_SUCCESS && entry.msg != MSG_SET && entry.msg != MSG_SETCONSTRAINT) {
+            AppendHandle(entry.payload, cap->hContainer);
+        }
+        return;
+    }
+
+    if (entry.dat == DAT_IMAGENATIVEXFER) {
+        if (entry.rc == TWRC_XFERDONE) {
+            AppendHandle(entry.payload, *(TW_HANDLE*)pData);
+        }
+        return;
+    }
+
+    if (entry.dat == DAT_IMAGEMEMXFER) {
+        if (entry.rc != TWRC_SUCCESS && entry.rc != TWRC_XFERDONE) {
+            return;
+        }
+        TW_IMAGEMEMXFER strip = *(pTW_IMAGEMEMXFER)pData;
+        TW_MEMREF memory = strip.Memory.TheMem;
+        bool isHandle = (strip.Memory.Flags & TWMF_HANDLE) != 0;
+        const TW_UINT8* data = (const TW_UINT8*)(isHandle && memory ? GlobalLock((HANDLE)memory) : memory);
+        strip.Memory.TheMem = nullptr;
+        entry.payload.assign((const TW_UINT8*)&strip, (const TW_UINT8*)&strip + sizeof(TW_IMAGEMEMXFER));
+        if (data) {
+            entry.payload.insert(entry.payload.end(), data, data + std::min(strip.BytesWritten, strip.Memory.Length));
+            if (isHandle) {
+                GlobalUnlock((HANDLE)memory);
+            }
+        }
+        return;
+    }
+
+    size_t size = FixedOutputSize(entry.dat);
+    if (size) {
+        entry.payload.assign((const TW_UINT8*)pData, (const TW_UINT8*)pData + size);
+    }
+}
+
+void WriteEntry(RecorderState& s, const RecordedEntry& entry) {
+    std::vector<TW_UINT8> header;
+    Put(header, entry.kind);
+    if (entry.kind == RecordedEntry::kRecordedNotification) {
+        Put(header, entry.msg);
+        Put(header, entry.startNs);
+        s.totals.notificationCount++;
+    } else {
+        Put(header, entry.dg);
+        Put(header, entry.dat);
+        Put(header, entry.msg);
+        Put(header, entry.rc);
+        Put(header, entry.cap);
+        Put(header, entry.conType);
+        Put(header, entry.startNs);
+        Put(header, entry.durationNs);
+        Put(header, (TW_UINT32)entry.payload.size());
+        s.totals.callCount++;
+    }
+
+    fwrite(header.data(), 1, header.size(), s.file);
+    if (!entry.payload.empty()) {
+        fwrite(entry.payload.data(), 1, entry.payload.size(), s.file);
+    }
+    s.totals.bytes += header.size() + entry.payload.size();
+}
+
+}  // namespace
+
+bool DsmRecorder::Start(const std::string& path, std::string& error) {
+    RecorderState& s = State();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (s.file) {
+        error = "Already recording to " + s.path;
+        return false;
+    }
+
+    s.file = fopen(path.c_str(), "wb");
+    if (!s.file) {
+        error = "Cannot write recording " + path;
+        return false;
+    }
+
+    TW_UINT32 reserved = 0;
+    fwrite(kMagic, 1, sizeof(kMagic), s.file);
+    fwrite(&kVersion, sizeof(kVersion), 1, s.file);
+    fwrite(&reserved, sizeof(reserved), 1, s.file);
+
+    s.path = path;
+    s.startedAt = NowNs();
+    s.totals = Summary();
+    s.totals.path = path;
+    s.totals.bytes = sizeof(kMagic) + 2 * sizeof(TW_UINT32);
+    s_Active = true;
+    return true;
+}
+
+DsmRecorder::Summary DsmRecorder::Stop() {
+    RecorderState& s = State();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (!s.file) {
+        Summary summary;
+        summary.errorMessage = "Not recording";
+        return summary;
+    }
+
+    s_Active = false;
+    Summary summary = s.totals;
+    summary.success = fclose(s.file) == 0;
+    if (!summary.success) {
+        summary.errorMessage = "Failed to write recording " + s.path;
+    }
+    s.file = nullptr;
+    return summary;
+}
+
+void DsmRecorder::RecordCall(TW_UINT32 DG, TW_UINT16 DAT, TW_UINT16 MSG, TW_MEMREF pData,
+    TW_UINT16 rc, uint64_t startNs, uint64_t durationNs) {
+    // Window messages that were not for the source are noise; the ones
+    // that were become notifications
+    if (DAT == DAT_EVENT && MSG == MSG_PROCESSEVENT) {
+        if (rc == TWRC_DSEVENT && pData && ((pTW_EVENT)pData)->TWMessage != MSG_NULL) {
+            RecordNotification(((pTW_EVENT)pData)->TWMessage);
+        }
+        return;
+    }
+
+    RecordedEntry entry;
+    entry.dg = DG;
+    entry.dat = DAT;
+    entry.msg = MSG;
+    entry.rc = rc;
+    entry.durationNs = durationNs;
+    CapturePayload(entry, pData);
+
+    RecorderState& s = State();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (!s.file) {
+        return;
+    }
+    entry.startNs = startNs > s.startedAt ? startNs - s.startedAt : 0;
+    WriteEntry(s, entry);
+}
+
+void DsmRecorder::RecordNotification(TW_UINT16 message) {
+    RecordedEntry entry;
+    entry.kind = RecordedEntry::kRecordedNotification;
+    entry.msg = message;
+
+    RecorderState& s = State();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (!s.file) {
+        return;
+    }
+    entry.startNs = NowNs() - s.startedAt;
+    WriteEntry(s, entry);
+}
+
+bool ReadRecording(const std::string& path, std::vector<RecordedEntry>& entries, std::string& error) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        error = "Cannot open recording " + path;
+        return false;
+    }
+
+    char magic[8];
+    TW_UINT32 version = 0, reserved = 0;
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, kMagic, sizeof(kMagic)) != 0 ||
+        !Take(file, version) || !Take(file, reserved)) {
+        fclose(file);
+        error = path + " is not a DSM recording";
+        return false;
+    }
+    if (version != kVersion) {
+        fclose(file);
+        error = "Unsupported recording version " + std::to_string(version);
+        return false;
+    }
+
+    entries.clear();
+    TW_UINT8 kind;
+    bool valid = true;
+    while (valid && Take(file, kind)) {
+        RecordedEntry entry;
+        entry.kind = kind;
+        if (kind == RecordedEntry::kRecordedNotification) {
+            valid = Take(file, entry.msg) && Take(file, entry.startNs);
+        } else if (kind == RecordedEntry::kRecordedCall) {
+            TW_UINT32 size = 0;
+            valid = Take(file, entry.dg) && Take(file, entry.dat) && Take(file, entry.msg) &&
+                Take(file, entry.rc) && Take(file, entry.cap) && Take(file, entry.conType) &&
+                Take(file, entry.startNs) && Take(file, entry.durationNs) && Take(file, size);
+            if (valid && size) {
+                entry.payload.resize(size);
+                valid = fread(entry.payload.data(), 1, size, file) == size;
+            }
+        } else {
+            valid = false;
+        }
+        if (valid) {
+            entries.push_back(std::move(entry));
+        }
+    }
+    fclose(file);
+
+    if (!valid) {
+        error = path + " is truncated or corrupt after " + std::to_string(entries.size()) + " entries";
+        return false;
+    }
+    return true;
+}
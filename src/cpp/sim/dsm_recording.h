@@ -0,0 +1,75 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "../twain/windows_wrapper.h"
+#include "twain.h"
+
+// Session file written by DsmRecorder and served by ReplayDsm.
+//
+// Layout (little-endian): the 8-byte magic "TWAINREC", a u32 version and
+// a u32 reserved word, then entries until end of file. An entry is a u8
+// kind followed by
+//   kRecordedCall:         u32 DG, u16 DAT, u16 MSG, u16 rc, u16 Cap,
+//                          u16 ConType, u64 startNs, u64 durationNs,
+//                          u32 payload size, payload
+//   kRecordedNotification: u16 message, u64 atNs
+//
+// Payloads are what the call returned to the application: the packed
+// structure for pointer-free DATs (these have the same layout on every
+// TWAIN platform but the Mac), the container for DAT_CAPABILITY, the DIB
+// for DAT_IMAGENATIVEXFER, and TW_IMAGEMEMXFER followed by the strip for
+// DAT_IMAGEMEMXFER. Times are relative to the start of the recording.
+struct RecordedEntry {
+    enum Kind { kRecordedCall = 1, kRecordedNotification = 2 };
+
+    TW_UINT8 kind;
+    TW_UINT32 dg;
+    TW_UINT16 dat;
+    TW_UINT16 msg;      // The notification for kRecordedNotification
+    TW_UINT16 rc;
+    TW_UINT16 cap;      // DAT_CAPABILITY only
+    TW_UINT16 conType;  // DAT_CAPABILITY only
+    uint64_t startNs;
+    uint64_t durationNs;
+    std::vector<TW_UINT8> payload;
+
+    RecordedEntry()
+        : kind(kRecordedCall), dg(0), dat(0), msg(0), rc(0), cap(0), conType(0)
+        , startNs(0), durationNs(0) {}
+};
+
+bool ReadRecording(const std::string& path, std::vector<RecordedEntry>& entries, std::string& error);
+
+// Captures every DSM call made by the scanner, with its result, timing
+// and the data returned, into a session file. Notifications that reach
+// the application through MSG_PROCESSEVENT or DAT_CALLBACK are recorded
+// as their own entries; MSG_PROCESSEVENT calls for other window messages
+// are left out.
+class DsmRecorder {
+public:
+    struct Summary {
+        bool success;
+        std::string path;
+        std::string errorMessage;
+        uint64_t callCount;
+        uint64_t notificationCount;
+        uint64_t bytes;
+
+        Summary() : success(false), callCount(0), notificationCount(0), bytes(0) {}
+    };
+
+    static bool Active() { return s_Active.load(std::memory_order_relaxed); }
+
+    static bool Start(const std::string& path, std::string& error);
+    static Summary Stop();
+
+    // Called after the DSM returned; startNs is steady-clock nanoseconds
+    static void RecordCall(TW_UINT32 DG, TW_UINT16 DAT, TW_UINT16 MSG, TW_MEMREF pData,
+        TW_UINT16 rc, uint64_t startNs, uint64_t durationNs);
+    static void RecordNotification(TW_UINT16 message);
+
+private:
+    static std::atomic<bool> s_Active;
+};
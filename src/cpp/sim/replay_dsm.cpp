@@ -0,0 +1,287 @@
+#include "replay_dsm.h"
+#include "dsm_recording.h"
+#include "../log.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+
+struct ReplayQueue {
+    std::vector<size_t> entries;  // Indexes into ReplayState::entries
+    size_t cursor;
+
+    ReplayQueue() : cursor(0) {}
+};
+
+struct Notification {
+    uint64_t offsetNs;  // From the start of the MSG_ENABLEDS it follows
+    TW_UINT16 message;
+};
+
+struct ReplayState {
+    std::mutex mutex;
+    bool loaded;
+    bool environmentChecked;
+    double speed;
+    std::string path;
+    std::vector<RecordedEntry> entries;
+    std::map<uint64_t, ReplayQueue> queues;
+    std::map<size_t, std::vector<Notification>> notifications;  // By MSG_ENABLEDS entry
+
+    // Current session
+    HWND parent;
+    std::chrono::steady_clock::time_point enabledAt;
+    std::deque<Notification> pending;
+
+    ReplayState() : loaded(false), environmentChecked(false), speed(1), parent(NULL) {}
+};
+
+ReplayState& State() {
+    static ReplayState state;
+    return state;
+}
+
+uint64_t KeyOf(TW_UINT16 DAT, TW_UINT16 MSG, TW_UINT16 cap) {
+    return ((uint64_t)DAT << 32) | ((uint64_t)MSG << 16) | cap;
+}
+
+uint64_t Scaled(ReplayState& s, uint64_t ns) {
+    return s.speed > 0 ? (uint64_t)(ns / s.speed) : 0;
+}
+
+TW_HANDLE CopyToHandle(const std::vector<TW_UINT8>& payload) {
+    TW_HANDLE handle = (TW_HANDLE)GlobalAlloc(GHND, payload.size());
+    void* data = handle ? GlobalLock((HANDLE)handle) : nullptr;
+    if (data) {
+        memcpy(data, payload.data(), payload.size());
+        GlobalUnlock((HANDLE)handle);
+    }
+    return handle;
+}
+
+size_t StructSize(TW_UINT16 DAT) {
+    switch (DAT) {
+        case DAT_IDENTITY: return sizeof(TW_IDENTITY);
+        case DAT_IMAGEINFO: return sizeof(TW_IMAGEINFO);
+        case DAT_IMAGELAYOUT: return sizeof(TW_IMAGELAYOUT);
+        case DAT_PENDINGXFERS: return sizeof(TW_PENDINGXFERS);
+        case DAT_SETUPMEMXFER: return sizeof(TW_SETUPMEMXFER);
+        case DAT_STATUS: return sizeof(TW_STATUS);
+        case DAT_DEVICEEVENT: return sizeof(TW_DEVICEEVENT);
+        default: return 0;
+    }
+}
+
+// Hands the recorded result back the way the DSM returned it
+void ApplyPayload(const RecordedEntry& entry, TW_MEMREF pData) {
+    if (!pData || entry.payload.empty()) {
+        return;
+    }
+
+    if (entry.dat == DAT_CAPABILITY) {
+        pTW_CAPABILITY cap = (pTW_CAPABILITY)pData;
+        cap->ConType = entry.conType;
+        cap->hContainer = CopyToHandle(entry.payload);
+        return;
+    }
+
+    if (entry.dat == DAT_IMAGENATIVEXFER) {
+        *(TW_HANDLE*)pData = CopyToHandle(entry.payload);
+        return;
+    }
+
+    if (entry.dat == DAT_IMAGEMEMXFER) {
+        if (entry.payload.size() < sizeof(TW_IMAGEMEMXFER)) {
+            return;
+        }
+        pTW_IMAGEMEMXFER strip = (pTW_IMAGEMEMXFER)pData;
+        TW_MEMORY memory = strip->Memory;
+        memcpy(strip, entry.payload.data(), sizeof(TW_IMAGEMEMXFER));
+        strip->Memory = memory;
+
+        bool isHandle = (memory.Flags & TWMF_HANDLE) != 0;
+        TW_UINT8* target = (TW_UINT8*)(isHandle && memory.TheMem ? GlobalLock((HANDLE)memory.TheMem) : memory.TheMem);
+        if (target) {
+            size_t size = std::min<size_t>(entry.payload.size() - sizeof(TW_IMAGEMEMXFER), memory.Length);
+            memcpy(target, entry.payload.data() + sizeof(TW_IMAGEMEMXFER), size);
+            strip->BytesWritten = (TW_UINT32)size;
+            if (isHandle) {
+                GlobalUnlock((HANDLE)memory.TheMem);
+            }
+        }
+        return;
+    }
+
+    if (entry.payload.size() == StructSize(entry.dat)) {
+        memcpy(pData, entry.payload.data(), entry.payload.size());
+    }
+}
+
+void Index(ReplayState& s) {
+    s.queues.clear();
+    s.notifications.clear();
+
+    size_t enableEntry = 0;
+    uint64_t enabledAt = 0;
+    bool enabled = false;
+    for (size_t i = 0; i < s.entries.size(); i++) {
+        const RecordedEntry& entry = s.entries[i];
+        if (entry.kind == RecordedEntry::kRecordedNotification) {
+            // Messages outside a scan have nothing to be replayed against
+            if (enabled) {
+                Notification notification = { entry.startNs - std::min(entry.startNs, enabledAt), entry.msg };
+                s.notifications[enableEntry].push_back(notification);
+            }
+            continue;
+        }
+
+        s.queues[KeyOf(entry.dat, entry.msg, entry.cap)].entries.push_back(i);
+        if (entry.dat == DAT_USERINTERFACE && entry.msg == MSG_ENABLEDS && entry.rc == TWRC_SUCCESS) {
+            enableEntry = i;
+            enabledAt = entry.startNs;
+            enabled = true;
+        }
+    }
+}
+
+TW_UINT16 ProcessEvent(ReplayState& s, std::unique_lock<std::mutex>& lock, pTW_EVENT event) {
+    event->TWMessage = MSG_NULL;
+    if (s.pending.empty()) {
+        return TWRC_NOTDSEVENT;
+    }
+
+    // The source is still "scanning" until the message is due
+    Notification next = s.pending.front();
+    s.pending.pop_front();
+    auto due = s.enabledAt + std::chrono::nanoseconds(Scaled(s, next.offsetNs));
+    lock.unlock();
+    std::this_thread::sleep_until(due);
+    lock.lock();
+
+    event->TWMessage = next.message;
+    if (!s.pending.empty()) {
+        PostMessageW(s.parent, WM_USER, 0, 0);
+    }
+    return TWRC_DSEVENT;
+}
+
+}  // namespace
+
+bool ReplayDsm::Load(const std::string& path, double speed, std::string& error) {
+    std::vector<RecordedEntry> entries;
+    if (!ReadRecording(path, entries, error)) {
+        return false;
+    }
+
+    ReplayState& s = State();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.entries.swap(entries);
+    s.path = path;
+    s.speed = speed > 0 ? speed : 0;
+    s.pending.clear();
+    Index(s);
+    s.loaded = true;
+    return true;
+}
+
+void ReplayDsm::Unload() {
+    ReplayState& s = State();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.loaded = false;
+    s.entries.clear();
+    s.queues.clear();
+    s.notifications.clear();
+    s.pending.clear();
+}
+
+bool ReplayDsm::Loaded() {
+    ReplayState& s = State();
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (s.loaded || s.environmentChecked) {
+            return s.loaded;
+        }
+        s.environmentChecked = true;
+    }
+
+    const char* path = getenv("TWAIN_REPLAY");
+    if (!path || !*path) {
+        return false;
+    }
+    const char* speed = getenv("TWAIN_REPLAY_SPEED");
+    std::string error;
+    if (!Load(path, speed && *speed ? atof(speed) : 1.0, error)) {
+        SCANNER_LOG(kLogWarn, LogRecord::kNone, LogRecord::kNone, LogRecord::kNone, "Ignoring TWAIN_REPLAY: %s", error.c_str());
+        return false;
+    }
+    return true;
+}
+
+TW_UINT16 TW_CALLINGSTYLE ReplayDsm::Entry(pTW_IDENTITY pOrigin, pTW_IDENTITY pDest,
+    TW_UINT32 DG, TW_UINT16 DAT, TW_UINT16 MSG, TW_MEMREF pData) {
+    (void)pDest;
+    (void)DG;
+
+    ReplayState& s = State();
+    std::unique_lock<std::mutex> lock(s.mutex);
+    if (!s.loaded || !pOrigin) {
+        return TWRC_FAILURE;
+    }
+
+    if (DAT == DAT_EVENT && MSG == MSG_PROCESSEVENT) {
+        return pData ? ProcessEvent(s, lock, (pTW_EVENT)pData) : TWRC_NOTDSEVENT;
+    }
+
+    // Notifications are only replayed through the message queue
+    if (DAT == DAT_CALLBACK) {
+        return TWRC_FAILURE;
+    }
+
+    if (DAT == DAT_PARENT && MSG == MSG_OPENDSM) {
+        if (pOrigin->Id == 0) {
+            pOrigin->Id = 1;
+        }
+        s.parent = pData ? *(HWND*)pData : NULL;
+    }
+
+    TW_UINT16 cap = DAT == DAT_CAPABILITY && pData ? ((pTW_CAPABILITY)pData)->Cap : 0;
+    auto queue = s.queues.find(KeyOf(DAT, MSG, cap));
+    if (queue == s.queues.end() || queue->second.entries.empty()) {
+        return DAT == DAT_PARENT ? TWRC_SUCCESS : TWRC_FAILURE;
+    }
+
+    size_t index = queue->second.entries[queue->second.cursor];
+    queue->second.cursor = (queue->second.cursor + 1) % queue->second.entries.size();
+    const RecordedEntry& entry = s.entries[index];
+    ApplyPayload(entry, pData);
+    TW_UINT16 rc = entry.rc;
+    uint64_t delay = Scaled(s, entry.durationNs);
+
+    if (DAT == DAT_USERINTERFACE && MSG == MSG_ENABLEDS) {
+        s.enabledAt = std::chrono::steady_clock::now();
+        s.pending.clear();
+        auto notifications = s.notifications.find(index);
+        if (notifications != s.notifications.end()) {
+            s.pending.assign(notifications->second.begin(), notifications->second.end());
+            HWND parent = pData && ((pTW_USERINTERFACE)pData)->hParent ? (HWND)((pTW_USERINTERFACE)pData)->hParent : s.parent;
+            s.parent = parent;
+            PostMessageW(parent, WM_USER, 0, 0);
+        }
+    } else if (DAT == DAT_USERINTERFACE && MSG == MSG_DISABLEDS) {
+        s.pending.clear();
+    }
+    lock.unlock();
+
+    if (delay) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(delay));
+    }
+    return rc;
+}
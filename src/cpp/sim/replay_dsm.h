@@ -0,0 +1,30 @@
+#pragma once
+#include <string>
+#include "../twain/windows_wrapper.h"
+#include "twain.h"
+
+// Data Source Manager that answers from a session written by DsmRecorder,
+// so a scan can be repeated without the scanner that produced it.
+//
+// Calls are matched on DAT, MSG and, for DAT_CAPABILITY, the capability;
+// each match returns the next recorded answer for that key and wraps
+// around at the end, so a recorded scan can be replayed any number of
+// times. Calls the recording never saw fail with TWRC_FAILURE.
+//
+// Notifications are replayed through the parent window's message queue at
+// their recorded offset from MSG_ENABLEDS, whether the recorded session
+// received them that way or through DAT_CALLBACK.
+class ReplayDsm {
+public:
+    // speed scales recorded call durations and notification delays: 1
+    // plays back at the recorded pace, 2 twice as fast, 0 without delays
+    static bool Load(const std::string& path, double speed, std::string& error);
+    static void Unload();
+
+    // Used in place of twain_32.dll and the simulator while loaded, and
+    // when TWAIN_REPLAY names a recording in the environment
+    static bool Loaded();
+
+    static TW_UINT16 TW_CALLINGSTYLE Entry(pTW_IDENTITY pOrigin, pTW_IDENTITY pDest,
+        TW_UINT32 DG, TW_UINT16 DAT, TW_UINT16 MSG, TW_MEMREF pData);
+};
@@ -0,0 +1,1234 @@
+#include "simulated_dsm.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace {
+
+const TW_UINT32 kFirstSourceId = 1000;
+
+struct SimCapability {
+    TW_UINT16 cap;
+    TW_UINT16 conType;   // Container returned by MSG_GET
+    TW_UINT16 itemType;
+    std::vector<double> values;  // Allowed values, or the items of an array
+    double current;
+    double defaultValue;
+    bool settable;
+};
+
+struct PendingCallback {
+    TWAINCALLBACKPROC proc;
+    TW_IDENTITY source;
+    TW_IDENTITY app;
+    TW_UINT32 refCon;
+    TW_UINT16 message;
+};
+
+struct InjectedFailure {
+    TW_UINT32 remaining;  // Matching calls until the one that fails
+    TW_UINT16 conditionCode;
+};
+
+struct SimState {
+    std::mutex mutex;
+    SimulatedScannerConfig config;
+    bool enabled;
+
+    // Source manager
+    bool dsmOpen;
+    TW_UINT32 nextAppId;
+    TW_IDENTITY app;
+    HWND parent;
+    TW_UINT32 enumIndex;
+    std::map<TW_UINT32, TW_UINT32> callCounts;
+    std::map<TW_UINT32, InjectedFailure> failures;
+
+    // Open source; state follows the TWAIN state machine (3 = closed)
+    int state;
+    TW_IDENTITY source;
+    std::vector<SimCapability> caps;
+    TW_UINT16 conditionCode;
+    TW_SETUPFILEXFER fileXfer;
+
+    // Current batch
+    TW_UINT32 pendingImages;
+    TW_UINT32 imageIndex;
+    TW_UINT32 rowsSent;
+    bool discardingBacks;  // ICAP_AUTODISCARDBLANKPAGES on with blank backs
+    std::chrono::steady_clock::time_point nextSheetDue;
+
+    // Rendered pages, top-down in DIB row layout, indexed by side
+    std::vector<TW_UINT8> pages[2];
+    TW_UINT32 pageKey;
+    double pageSkew;
+
+    // Notifications
+    bool callbackRegistered;
+    TWAINCALLBACKPROC callbackProc;
+    TW_UINT32 callbackRefCon;
+    std::deque<TW_UINT16> pendingMessages;
+    std::deque<TW_DEVICEEVENT> deviceEvents;
+
+    SimState()
+        : enabled(false), dsmOpen(false), nextAppId(1), parent(NULL), enumIndex(0)
+        , state(3), conditionCode(TWCC_SUCCESS)
+        , pendingImages(0), imageIndex(0), rowsSent(0), discardingBacks(false), pageKey(0), pageSkew(0)
+        , callbackRegistered(false), callbackProc(NULL), callbackRefCon(0) {
+        memset(&app, 0, sizeof(TW_IDENTITY));
+        memset(&source, 0, sizeof(TW_IDENTITY));
+        memset(&fileXfer, 0, sizeof(TW_SETUPFILEXFER));
+    }
+};
+
+SimState& State() {
+    static SimState state;
+    return state;
+}
+
+TW_UINT16 Fail(SimState& s, TW_UINT16 conditionCode) {
+    s.conditionCode = conditionCode;
+    return TWRC_FAILURE;
+}
+
+TW_IDENTITY SourceIdentity(TW_UINT32 index) {
+    TW_IDENTITY identity;
+    memset(&identity, 0, sizeof(TW_IDENTITY));
+    identity.Id = kFirstSourceId + index;
+    identity.Version.MajorNum = 1;
+    identity.Version.MinorNum = 0;
+    identity.Version.Language = TWLG_ENGLISH;
+    identity.Version.Country = TWCY_USA;
+    strcpy_s(identity.Version.Info, sizeof(identity.Version.Info), "Simulated DS");
+    identity.ProtocolMajor = 2;
+    identity.ProtocolMinor = 4;
+    identity.SupportedGroups = DG_CONTROL | DG_IMAGE | DF_DS2;
+    strcpy_s(identity.Manufacturer, sizeof(identity.Manufacturer), "TWAIN Simulator");
+    strcpy_s(identity.ProductFamily, sizeof(identity.ProductFamily), "Simulated");
+    if (index == 0) {
+        strcpy_s(identity.ProductName, sizeof(identity.ProductName), "Simulated Scanner");
+    } else {
+        snprintf(identity.ProductName, sizeof(identity.ProductName), "Simulated Scanner %u", index + 1);
+    }
+    return identity;
+}
+
+// Capability table
+
+SimCapability MakeCap(TW_UINT16 cap, TW_UINT16 conType, TW_UINT16 itemType,
+                      std::vector<double> values, double current, bool settable) {
+    SimCapability c;
+    c.cap = cap;
+    c.conType = conType;
+    c.itemType = itemType;
+    c.values = values;
+    c.current = current;
+    c.defaultValue = current;
+    c.settable = settable;
+    return c;
+}
+
+TW_UINT16 PixelTypeFor(TW_UINT16 bitDepth) {
+    return bitDepth == 1 ? TWPT_BW : bitDepth == 8 ? TWPT_GRAY : TWPT_RGB;
+}
+
+TW_UINT16 BitDepthFor(TW_UINT16 pixelType) {
+    return pixelType == TWPT_BW ? 1 : pixelType == TWPT_GRAY ? 8 : 24;
+}
+
+void ResetCapabilities(SimState& s) {
+    const SimulatedScannerConfig& config = s.config;
+    TW_UINT16 bitDepth = (config.bitDepth == 1 || config.bitDepth == 8) ? config.bitDepth : 24;
+
+    std::vector<double> resolutions = { 100, 150, 200, 300, 600 };
+    if (std::find(resolutions.begin(), resolutions.end(), (double)config.resolution) == resolutions.end()) {
+        resolutions.push_back(config.resolution);
+        std::sort(resolutions.begin(), resolutions.end());
+    }
+
+    s.caps.clear();
+    s.caps.push_back(MakeCap(CAP_XFERCOUNT, TWON_ONEVALUE, TWTY_INT16, {}, -1, true));
+    s.caps.push_back(MakeCap(CAP_FEEDERENABLED, TWON_ONEVALUE, TWTY_BOOL, { 0, 1 }, 1, true));
+    s.caps.push_back(MakeCap(CAP_FEEDERLOADED, TWON_ONEVALUE, TWTY_BOOL, {}, config.sheetCount > 0, false));
+    s.caps.push_back(MakeCap(CAP_AUTOFEED, TWON_ONEVALUE, TWTY_BOOL, { 0, 1 }, 1, true));
+    s.caps.push_back(MakeCap(CAP_INDICATORS, TWON_ONEVALUE, TWTY_BOOL, { 0, 1 }, 1, true));
+    s.caps.push_back(MakeCap(CAP_UICONTROLLABLE, TWON_ONEVALUE, TWTY_BOOL, {}, 1, false));
+    s.caps.push_back(MakeCap(CAP_DEVICEONLINE, TWON_ONEVALUE, TWTY_BOOL, {}, 1, false));
+    s.caps.push_back(MakeCap(CAP_DUPLEX, TWON_ONEVALUE, TWTY_UINT16, {},
+        config.duplex ? TWDX_1PASSDUPLEX : TWDX_NONE, false));
+    if (config.duplex) {
+        s.caps.push_back(MakeCap(CAP_DUPLEXENABLED, TWON_ONEVALUE, TWTY_BOOL, { 0, 1 }, 0, true));
+    }
+    s.caps.push_back(MakeCap(CAP_DEVICEEVENT, TWON_ARRAY, TWTY_UINT16, {}, 0, true));
+    s.caps.push_back(MakeCap(ICAP_XFERMECH, TWON_ENUMERATION, TWTY_UINT16,
+        { TWSX_NATIVE, TWSX_FILE, TWSX_MEMORY }, TWSX_NATIVE, true));
+    s.caps.push_back(MakeCap(ICAP_PIXELTYPE, TWON_ENUMERATION, TWTY_UINT16,
+        { TWPT_BW, TWPT_GRAY, TWPT_RGB }, PixelTypeFor(bitDepth), true));
+    s.caps.push_back(MakeCap(ICAP_BITDEPTH, TWON_ENUMERATION, TWTY_UINT16, { 1, 8, 24 }, bitDepth, true));
+    s.caps.push_back(MakeCap(ICAP_PIXELFLAVOR, TWON_ONEVALUE, TWTY_UINT16, {}, TWPF_CHOCOLATE, false));
+    s.caps.push_back(MakeCap(ICAP_XRESOLUTION, TWON_ENUMERATION, TWTY_FIX32, resolutions, config.resolution, true));
+    s.caps.push_back(MakeCap(ICAP_YRESOLUTION, TWON_ENUMERATION, TWTY_FIX32, resolutions, config.resolution, true));
+    s.caps.push_back(MakeCap(ICAP_UNITS, TWON_ENUMERATION, TWTY_UINT16, { TWUN_INCHES }, TWUN_INCHES, true));
+    s.caps.push_back(MakeCap(ICAP_COMPRESSION, TWON_ENUMERATION, TWTY_UINT16, { TWCP_NONE }, TWCP_NONE, true));
+    s.caps.push_back(MakeCap(ICAP_PHYSICALWIDTH, TWON_ONEVALUE, TWTY_FIX32, {},
+        (double)config.pageWidth / config.resolution, false));
+    s.caps.push_back(MakeCap(ICAP_PHYSICALHEIGHT, TWON_ONEVALUE, TWTY_FIX32, {},
+        (double)config.pageHeight / config.resolution, false));
+    if (config.blankPageDiscard) {
+        s.caps.push_back(MakeCap(ICAP_AUTODISCARDBLANKPAGES, TWON_ONEVALUE, TWTY_INT32, {}, TWBP_DISABLE, true));
+    }
+    if (config.deviceBorderDetection) {
+        s.caps.push_back(MakeCap(ICAP_UNDEFINEDIMAGESIZE, TWON_ONEVALUE, TWTY_BOOL, { 0, 1 }, 0, true));
+        s.caps.push_back(MakeCap(ICAP_AUTOMATICBORDERDETECTION, TWON_ONEVALUE, TWTY_BOOL, { 0, 1 }, 0, true));
+    }
+    if (config.deviceDeskew) {
+        s.caps.push_back(MakeCap(ICAP_AUTOMATICDESKEW, TWON_ONEVALUE, TWTY_BOOL, { 0, 1 }, 0, true));
+    }
+    if (config.deviceColourDropout) {
+        s.caps.push_back(MakeCap(ICAP_FILTER, TWON_ENUMERATION, TWTY_UINT16,
+            { TWFT_RED, TWFT_GREEN, TWFT_BLUE, TWFT_NONE }, TWFT_NONE, true));
+    }
+
+    std::vector<double> supported;
+    for (const auto& c : s.caps) {
+        supported.push_back(c.cap);
+    }
+    supported.push_back(CAP_SUPPORTEDCAPS);
+    s.caps.push_back(MakeCap(CAP_SUPPORTEDCAPS, TWON_ARRAY, TWTY_UINT16, supported, 0, false));
+}
+
+SimCapability* FindCap(SimState& s, TW_UINT16 cap) {
+    for (auto& c : s.caps) {
+        if (c.cap == cap) {
+            return &c;
+        }
+    }
+    return nullptr;
+}
+
+double CapValue(SimState& s, TW_UINT16 cap) {
+    SimCapability* c = FindCap(s, cap);
+    return c ? c->current : 0;
+}
+
+size_t ItemSize(TW_UINT16 itemType) {
+    switch (itemType) {
+        case TWTY_INT8:
+        case TWTY_UINT8: return 1;
+        case TWTY_INT16:
+        case TWTY_UINT16:
+        case TWTY_BOOL: return 2;
+        case TWTY_INT32:
+        case TWTY_UINT32:
+        case TWTY_FIX32: return 4;
+        default: return 0;
+    }
+}
+
+void WriteItem(TW_UINT8* p, TW_UINT16 itemType, double value) {
+    switch (itemType) {
+        case TWTY_INT8: { TW_INT8 v = (TW_INT8)value; memcpy(p, &v, sizeof(v)); break; }
+        case TWTY_UINT8: { TW_UINT8 v = (TW_UINT8)value; memcpy(p, &v, sizeof(v)); break; }
+        case TWTY_INT16: { TW_INT16 v = (TW_INT16)value; memcpy(p, &v, sizeof(v)); break; }
+        case TWTY_UINT16:
+        case TWTY_BOOL: { TW_UINT16 v = (TW_UINT16)value; memcpy(p, &v, sizeof(v)); break; }
+        case TWTY_INT32: { TW_INT32 v = (TW_INT32)value; memcpy(p, &v, sizeof(v)); break; }
+        case TWTY_UINT32: { TW_UINT32 v = (TW_UINT32)value; memcpy(p, &v, sizeof(v)); break; }
+        case TWTY_FIX32: {
+            TW_FIX32 v;
+            double whole = std::floor(value);
+            v.Whole = (TW_INT16)whole;
+            v.Frac = (TW_UINT16)((value - whole) * 65536.0);
+            memcpy(p, &v, sizeof(v));
+            break;
+        }
+    }
+}
+
+double ReadItem(const TW_UINT8* p, TW_UINT16 itemType) {
+    switch (itemType) {
+        case TWTY_INT8: return *(const TW_INT8*)p;
+        case TWTY_UINT8: return *p;
+        case TWTY_INT16: { TW_INT16 v; memcpy(&v, p, sizeof(v)); return v; }
+        case TWTY_UINT16:
+        case TWTY_BOOL: { TW_UINT16 v; memcpy(&v, p, sizeof(v)); return v; }
+        case TWTY_INT32: { TW_INT32 v; memcpy(&v, p, sizeof(v)); return v; }
+        case TWTY_UINT32: { TW_UINT32 v; memcpy(&v, p, sizeof(v)); return v; }
+        case TWTY_FIX32: { TW_FIX32 v; memcpy(&v, p, sizeof(v)); return v.Whole + v.Frac / 65536.0; }
+        default: return 0;
+    }
+}
+
+TW_HANDLE BuildContainer(const SimCapability& c, TW_UINT16 conType, double value, TW_UINT16& builtType) {
+    size_t itemSize = ItemSize(c.itemType);
+    TW_HANDLE handle = NULL;
+
+    if (conType == TWON_ENUMERATION && !c.values.empty()) {
+        size_t count = c.values.size();
+        handle = GlobalAlloc(GHND, sizeof(TW_ENUMERATION) + count * itemSize);
+        if (!handle) return NULL;
+        pTW_ENUMERATION e = (pTW_ENUMERATION)GlobalLock(handle);
+        e->ItemType = c.itemType;
+        e->NumItems = (TW_UINT32)count;
+        e->CurrentIndex = 0;
+        e->DefaultIndex = 0;
+        for (size_t i = 0; i < count; i++) {
+            WriteItem(e->ItemList + i * itemSize, c.itemType, c.values[i]);
+            if (c.values[i] == c.current) e->CurrentIndex = (TW_UINT32)i;
+            if (c.values[i] == c.defaultValue) e->DefaultIndex = (TW_UINT32)i;
+        }
+        GlobalUnlock(handle);
+        builtType = TWON_ENUMERATION;
+    } else if (conType == TWON_ARRAY) {
+        size_t count = c.values.size();
+        handle = GlobalAlloc(GHND, sizeof(TW_ARRAY) + count * itemSize);
+        if (!handle) return NULL;
+        pTW_ARRAY a = (pTW_ARRAY)GlobalLock(handle);
+        a->ItemType = c.itemType;
+        a->NumItems = (TW_UINT32)count;
+        for (size_t i = 0; i < count; i++) {
+            WriteItem(a->ItemList + i * itemSize, c.itemType, c.values[i]);
+        }
+        GlobalUnlock(handle);
+        builtType = TWON_ARRAY;
+    } else {
+        handle = GlobalAlloc(GHND, sizeof(TW_ONEVALUE));
+        if (!handle) return NULL;
+        pTW_ONEVALUE o = (pTW_ONEVALUE)GlobalLock(handle);
+        o->ItemType = c.itemType;
+        TW_UINT8 slot[sizeof(TW_UINT32)] = { 0 };
+        WriteItem(slot, c.itemType, value);
+        memcpy(&o->Item, slot, sizeof(slot));
+        GlobalUnlock(handle);
+        builtType = TWON_ONEVALUE;
+    }
+    return handle;
+}
+
+TW_UINT16 HandleCapability(SimState& s, TW_UINT16 msg, pTW_CAPABILITY pCap) {
+    if (!pCap) {
+        return Fail(s, TWCC_BADVALUE);
+    }
+
+    if (msg == MSG_RESETALL) {
+        if (s.state != 4) return Fail(s, TWCC_SEQERROR);
+        for (auto& c : s.caps) {
+            c.current = c.defaultValue;
+        }
+        return TWRC_SUCCESS;
+    }
+
+    SimCapability* c = FindCap(s, pCap->Cap);
+    if (!c) {
+        return Fail(s, TWCC_CAPUNSUPPORTED);
+    }
+
+    switch (msg) {
+        case MSG_QUERYSUPPORT: {
+            TW_INT32 flags = TWQC_GET | TWQC_GETCURRENT | TWQC_GETDEFAULT;
+            if (c->settable) flags |= TWQC_SET | TWQC_RESET;
+            pCap->ConType = TWON_ONEVALUE;
+            pCap->hContainer = GlobalAlloc(GHND, sizeof(TW_ONEVALUE));
+            if (!pCap->hContainer) return Fail(s, TWCC_LOWMEMORY);
+            pTW_ONEVALUE o = (pTW_ONEVALUE)GlobalLock(pCap->hContainer);
+            o->ItemType = TWTY_INT32;
+            o->Item = (TW_UINT32)flags;
+            GlobalUnlock(pCap->hContainer);
+            return TWRC_SUCCESS;
+        }
+
+        case MSG_GET:
+        case MSG_GETCURRENT:
+        case MSG_GETDEFAULT:
+        case MSG_RESET: {
+            if (msg == MSG_RESET) {
+                if (!c->settable) return Fail(s, TWCC_CAPBADOPERATION);
+                if (s.state != 4) return Fail(s, TWCC_SEQERROR);
+                c->current = c->defaultValue;
+            }
+            TW_UINT16 conType = msg == MSG_GET ? c->conType : (c->conType == TWON_ARRAY ? TWON_ARRAY : TWON_ONEVALUE);
+            double value = msg == MSG_GETDEFAULT ? c->defaultValue : c->current;
+            pCap->hContainer = BuildContainer(*c, conType, value, pCap->ConType);
+            return pCap->hContainer ? TWRC_SUCCESS : Fail(s, TWCC_LOWMEMORY);
+        }
+
+        case MSG_SET: {
+            if (!c->settable) return Fail(s, TWCC_CAPBADOPERATION);
+            if (s.state != 4) return Fail(s, TWCC_SEQERROR);
+            if (!pCap->hContainer) return Fail(s, TWCC_BADVALUE);
+
+            TW_MEMREF container = GlobalLock(pCap->hContainer);
+            if (!container) return Fail(s, TWCC_BADVALUE);
+
+            TW_UINT16 rc = TWRC_SUCCESS;
+            if (pCap->ConType == TWON_ARRAY && c->conType == TWON_ARRAY) {
+                pTW_ARRAY a = (pTW_ARRAY)container;
+                size_t itemSize = ItemSize(a->ItemType);
+                c->values.clear();
+                for (TW_UINT32 i = 0; i < a->NumItems && itemSize; i++) {
+                    c->values.push_back(ReadItem(a->ItemList + i * itemSize, a->ItemType));
+                }
+            } else if (pCap->ConType == TWON_ONEVALUE || pCap->ConType == TWON_ENUMERATION) {
+                double value;
+                if (pCap->ConType == TWON_ONEVALUE) {
+                    pTW_ONEVALUE o = (pTW_ONEVALUE)container;
+                    TW_UINT8 slot[sizeof(TW_UINT32)];
+                    memcpy(slot, &o->Item, sizeof(slot));
+                    value = ReadItem(slot, o->ItemType);
+                } else {
+                    pTW_ENUMERATION e = (pTW_ENUMERATION)container;
+                    size_t itemSize = ItemSize(e->ItemType);
+                    value = e->CurrentIndex < e->NumItems
+                        ? ReadItem(e->ItemList + e->CurrentIndex * itemSize, e->ItemType) : c->current;
+                }
+
+                bool allowed = c->values.empty() ||
+                    std::find(c->values.begin(), c->values.end(), value) != c->values.end();
+                if (!allowed) {
+                    rc = Fail(s, TWCC_BADVALUE);
+                } else {
+                    c->current = value;
+                    // Pixel type and bit depth move together
+                    if (c->cap == ICAP_PIXELTYPE) {
+                        FindCap(s, ICAP_BITDEPTH)->current = BitDepthFor((TW_UINT16)value);
+                    } else if (c->cap == ICAP_BITDEPTH) {
+                        FindCap(s, ICAP_PIXELTYPE)->current = PixelTypeFor((TW_UINT16)value);
+                    }
+                }
+            } else {
+                rc = Fail(s, TWCC_BADVALUE);
+            }
+
+            GlobalUnlock(pCap->hContainer);
+            return rc;
+        }
+
+        default:
+            return Fail(s, TWCC_CAPBADOPERATION);
+    }
+}
+
+// Page geometry
+
+struct PageFormat {
+    TW_UINT32 width;
+    TW_UINT32 height;
+    TW_UINT16 bitDepth;
+    double xResolution;
+    double yResolution;
+    TW_UINT32 stride;       // DIB row size, padded to 4 bytes
+    TW_UINT32 rowBytes;     // Unpadded row size used by memory transfers
+    TW_UINT32 paletteSize;  // Entries after BITMAPINFOHEADER
+    TW_UINT32 borderX;      // Platen scanned left and right of the document
+    TW_UINT32 borderY;      // and above and below it
+    TW_UINT16 filter;       // TWFT_* colour filter grey and bitonal pages are scanned through
+};
+
+PageFormat CurrentFormat(SimState& s) {
+    PageFormat format;
+    const SimulatedScannerConfig& config = s.config;
+    // as a driver that keeps its native resolution does
+    format.xResolution = config.ignoresResolution ? config.resolution : CapValue(s, ICAP_XRESOLUTION);
+    format.yResolution = config.ignoresResolution ? config.resolution : CapValue(s, ICAP_YRESOLUTION);
+    format.width = std::max<TW_UINT32>(1, (TW_UINT32)((double)config.pageWidth * format.xResolution / config.resolution));
+    format.height = std::max<TW_UINT32>(1, (TW_UINT32)((double)config.pageHeight * format.yResolution / config.resolution));
+    // The whole platen comes back unless the source crops to the document
+    SimCapability* border = FindCap(s, ICAP_AUTOMATICBORDERDETECTION);
+    bool cropped = border && border->current != 0;
+    format.borderX = cropped ? 0 : (TW_UINT32)(format.width * config.platenBorder);
+    format.borderY = cropped ? 0 : (TW_UINT32)(format.height * config.platenBorder);
+    format.width += 2 * format.borderX;
+    format.height += 2 * format.borderY;
+    format.bitDepth = (TW_UINT16)CapValue(s, ICAP_BITDEPTH);
+    format.stride = ((format.width * format.bitDepth + 31) / 32) * 4;
+    format.rowBytes = (format.width * format.bitDepth + 7) / 8;
+    format.paletteSize = format.bitDepth == 1 ? 2 : format.bitDepth == 8 ? 256 : 0;
+    SimCapability* filter = FindCap(s, ICAP_FILTER);
+    format.filter = filter ? (TW_UINT16)filter->current : (TW_UINT16)TWFT_NONE;
+    return format;
+}
+
+// Grey level (or BGR colour) of the synthetic document at (x, y): white
+// paper with a thin frame, lines of "words" and, in colour, a red stamp
+void PutPixel(TW_UINT8* row, TW_UINT32 x, TW_UINT16 bitDepth, TW_UINT8 r, TW_UINT8 g, TW_UINT8 b) {
+    if (bitDepth == 24) {
+        row[x * 3] = b;
+        row[x * 3 + 1] = g;
+        row[x * 3 + 2] = r;
+    } else {
+        TW_UINT8 grey = (TW_UINT8)((r * 77 + g * 150 + b * 29) >> 8);
+        if (bitDepth == 8) {
+            row[x] = grey;
+        } else if (grey >= 128) {
+            row[x >> 3] |= (TW_UINT8)(0x80 >> (x & 7));
+        } else {
+            row[x >> 3] &= (TW_UINT8)~(0x80 >> (x & 7));
+        }
+    }
+}
+
+void RenderPage(const PageFormat& format, int side, bool blank, std::vector<TW_UINT8>& page) {
+    page.assign((size_t)format.stride * format.height, 0);
+
+    TW_UINT32 margin = std::max<TW_UINT32>(8, format.width / 12);
+    TW_UINT32 lineHeight = std::max<TW_UINT32>(4, format.height / 60);
+    TW_UINT32 glyphHeight = lineHeight * 3 / 5;
+    // The back of a sheet carries less text
+    TW_UINT32 textBottom = side == 0 ? format.height - margin : format.height / 2;
+
+    // Word layout per text line from a fixed LCG so pages are reproducible
+    TW_UINT32 seed = 12345u + side * 7919u;
+    std::vector<TW_UINT8> ink(format.width);
+
+    // Through a colour filter a grey scan sees only that channel of the stamp
+    TW_UINT8 stamp[3] = { 220, 40, 40 };
+    if (format.bitDepth != 24 && format.filter <= TWFT_BLUE) {
+        stamp[0] = stamp[1] = stamp[2] = stamp[format.filter];
+    }
+
+    for (TW_UINT32 y = 0; y < format.height; y++) {
+        TW_UINT8* row = page.data() + (size_t)y * format.stride;
+        TW_UINT32 line = y / lineHeight;
+        bool inText = !blank && y >= margin && y < textBottom && (y % lineHeight) < glyphHeight && (line % 8) != 7;
+
+        if (y % lineHeight == 0) {
+            std::fill(ink.begin(), ink.end(), 0);
+            TW_UINT32 x = margin;
+            while (x < format.width - margin) {
+                seed = seed * 1103515245u + 12345u;
+                TW_UINT32 word = format.width / 80 + (seed >> 16) % (format.width / 20 + 1);
+                for (TW_UINT32 i = x; i < std::min(x + word, format.width - margin); i++) {
+                    ink[i] = 1;
+                }
+                x += word + format.width / 90 + 1;
+            }
+        }
+
+        for (TW_UINT32 x = 0; x < format.width; x++) {
+            bool frame = x < 2 || y < 2 || x >= format.width - 2 || y >= format.height - 2;
+            bool inStamp = !blank && side == 0 && y >= margin / 2 && y < margin / 2 + format.height / 20
+                && x >= format.width - margin - format.width / 6 && x < format.width - margin;
+
+            if (inStamp) {
+                PutPixel(row, x, format.bitDepth, stamp[0], stamp[1], stamp[2]);
+            } else if (frame || (inText && ink[x])) {
+                PutPixel(row, x, format.bitDepth, 30, 30, 30);
+            } else {
+                PutPixel(row, x, format.bitDepth, 255, 255, 255);
+            }
+        }
+    }
+
+    // A few specks of dust, so blank pages are not perfectly clean
+    if (blank) {
+        for (TW_UINT32 i = 0; i < format.width * format.height / 200000 + 1; i++) {
+            seed = seed * 1103515245u + 12345u;
+            TW_UINT32 x = (seed >> 8) % format.width;
+            seed = seed * 1103515245u + 12345u;
+            TW_UINT32 y = (seed >> 8) % format.height;
+            PutPixel(page.data() + (size_t)y * format.stride, x, format.bitDepth, 60, 60, 60);
+        }
+    }
+}
+
+TW_UINT8 GetPixelGrey(const TW_UINT8* row, TW_UINT32 x, TW_UINT16 bitDepth) {
+    if (bitDepth == 24) {
+        return (TW_UINT8)((row[x * 3 + 2] * 77 + row[x * 3 + 1] * 150 + row[x * 3] * 29) >> 8);
+    }
+    if (bitDepth == 8) {
+        return row[x];
+    }
+    return (row[x >> 3] & (0x80 >> (x & 7))) ? 255 : 0;
+}
+
+// Turns a rendered page by degrees about its centre, as a sheet fed
+// askew would be scanned. Nearest pixel; the corners uncovered are white.
+void SkewPage(const PageFormat& format, double degrees, std::vector<TW_UINT8>& page) {
+    std::vector<TW_UINT8> straight(page);
+    double radians = degrees * 3.14159265358979323846 / 180;
+    double c = std::cos(radians), sn = std::sin(radians);
+    double cx = (format.width - 1) / 2.0, cy = (format.height - 1) / 2.0;
+
+    for (TW_UINT32 y = 0; y < format.height; y++) {
+        TW_UINT8* row = page.data() + (size_t)y * format.stride;
+        for (TW_UINT32 x = 0; x < format.width; x++) {
+            double dx = x - cx, dy = y - cy;
+            long sx = std::lround(cx + dx * c - dy * sn);
+            long sy = std::lround(cy + dx * sn + dy * c);
+            if (sx < 0 || sy < 0 || sx >= (long)format.width || sy >= (long)format.height) {
+                PutPixel(row, x, format.bitDepth, 255, 255, 255);
+                continue;
+            }
+            const TW_UINT8* from = straight.data() + (size_t)sy * format.stride;
+            if (format.bitDepth == 24) {
+                PutPixel(row, x, 24, from[sx * 3 + 2], from[sx * 3 + 1], from[sx * 3]);
+            } else {
+                TW_UINT8 grey = GetPixelGrey(from, (TW_UINT32)sx, format.bitDepth);
+                PutPixel(row, x, format.bitDepth, grey, grey, grey);
+            }
+        }
+    }
+}
+
+// The document rendered inside a dark platen with a little sensor noise,
+// laid on it turned by degrees
+void RenderOnPlaten(const PageFormat& format, int side, bool blank, double degrees, std::vector<TW_UINT8>& page) {
+    PageFormat document = format;
+    document.width -= 2 * format.borderX;
+    document.height -= 2 * format.borderY;
+    document.stride = ((document.width * format.bitDepth + 31) / 32) * 4;
+    document.rowBytes = (document.width * format.bitDepth + 7) / 8;
+    document.borderX = document.borderY = 0;
+    std::vector<TW_UINT8> inner;
+    RenderPage(document, side, blank, inner);
+
+    double radians = degrees * 3.14159265358979323846 / 180;
+    double c = std::cos(radians), sn = std::sin(radians);
+    double cx = (format.width - 1) / 2.0, cy = (format.height - 1) / 2.0;
+
+    page.assign((size_t)format.stride * format.height, 0);
+    TW_UINT32 seed = 4242u;
+    for (TW_UINT32 y = 0; y < format.height; y++) {
+        TW_UINT8* row = page.data() + (size_t)y * format.stride;
+        for (TW_UINT32 x = 0; x < format.width; x++) {
+            long dx = std::lround(cx + (x - cx) * c - (y - cy) * sn) - (long)format.borderX;
+            long dy = std::lround(cy + (x - cx) * sn + (y - cy) * c) - (long)format.borderY;
+            if (dx >= 0 && dy >= 0 && dx < (long)document.width && dy < (long)document.height) {
+                const TW_UINT8* from = inner.data() + (size_t)dy * document.stride;
+                if (format.bitDepth == 24) {
+                    PutPixel(row, x, 24, from[dx * 3 + 2], from[dx * 3 + 1], from[dx * 3]);
+                } else {
+                    TW_UINT8 grey = GetPixelGrey(from, (TW_UINT32)dx, format.bitDepth);
+                    PutPixel(row, x, format.bitDepth, grey, grey, grey);
+                }
+            } else {
+                seed = seed * 1103515245u + 12345u;
+                TW_UINT8 level = (TW_UINT8)(24 + (seed >> 16) % 12);
+                PutPixel(row, x, format.bitDepth, level, level, level);
+            }
+        }
+    }
+}
+
+// Turns a rendered page upside down
+void TurnPageOver(const PageFormat& format, std::vector<TW_UINT8>& page) {
+    std::vector<TW_UINT8> upright(page);
+    for (TW_UINT32 y = 0; y < format.height; y++) {
+        const TW_UINT8* from = upright.data() + (size_t)(format.height - 1 - y) * format.stride;
+        TW_UINT8* row = page.data() + (size_t)y * format.stride;
+        for (TW_UINT32 x = 0; x < format.width; x++) {
+            TW_UINT32 sx = format.width - 1 - x;
+            if (format.bitDepth == 24) {
+                PutPixel(row, x, 24, from[sx * 3 + 2], from[sx * 3 + 1], from[sx * 3]);
+            } else {
+                TW_UINT8 grey = GetPixelGrey(from, sx, format.bitDepth);
+                PutPixel(row, x, format.bitDepth, grey, grey, grey);
+            }
+        }
+    }
+}
+
+// Rendered page for the current format, reused until the format or the
+// skew changes
+const std::vector<TW_UINT8>& PageFor(SimState& s, const PageFormat& format, int side) {
+    TW_UINT32 key = format.width * 31u + format.height * 17u + format.bitDepth + ((TW_UINT32)format.filter << 24);
+    SimCapability* deskew = FindCap(s, ICAP_AUTOMATICDESKEW);
+    double skew = deskew && deskew->current != 0 ? 0 : s.config.skewDegrees;
+    if (key != s.pageKey || skew != s.pageSkew) {
+        s.pages[0].clear();
+        s.pages[1].clear();
+        s.pageKey = key;
+        s.pageSkew = skew;
+    }
+    if (s.pages[side].empty()) {
+        bool blank = side == 1 && s.config.blankBackSides;
+        if (format.borderX || format.borderY) {
+            RenderOnPlaten(format, side, blank, skew, s.pages[side]);
+        } else {
+            RenderPage(format, side, blank, s.pages[side]);
+        }
+        if (skew != 0 && !format.borderX && !format.borderY) {
+            SkewPage(format, skew, s.pages[side]);
+        }
+        if (side == 1 && s.config.invertedBackSides) {
+            TurnPageOver(format, s.pages[side]);
+        }
+    }
+    return s.pages[side];
+}
+
+// Dark squares in the top-left margin encode the image number so
+// consecutive pages differ
+void StampImageNumber(TW_UINT8* topRow, long rowStep, const PageFormat& format, TW_UINT32 number) {
+    TW_UINT32 cell = std::max<TW_UINT32>(2, (format.width - 2 * format.borderX) / 200);
+    TW_UINT32 top = format.borderY + 4, left = format.borderX + 4;
+    for (TW_UINT32 bit = 0; bit < 16; bit++) {
+        bool set = (number >> bit) & 1;
+        for (TW_UINT32 y = top; y < top + cell && y < format.height; y++) {
+            TW_UINT8* row = topRow + (long)y * rowStep;
+            for (TW_UINT32 x = left + bit * cell * 2; x < left + bit * cell * 2 + cell && x < format.width; x++) {
+                TW_UINT8 level = set ? 0 : 255;
+                PutPixel(row, x, format.bitDepth, level, level, level);
+            }
+        }
+    }
+}
+
+void WritePalette(RGBQUAD* palette, const PageFormat& format) {
+    for (TW_UINT32 i = 0; i < format.paletteSize; i++) {
+        TW_UINT8 level = format.paletteSize == 2 ? (TW_UINT8)(i * 255) : (TW_UINT8)i;
+        palette[i].rgbBlue = level;
+        palette[i].rgbGreen = level;
+        palette[i].rgbRed = level;
+        palette[i].rgbReserved = 0;
+    }
+}
+
+void FillInfoHeader(BITMAPINFOHEADER* header, const PageFormat& format) {
+    memset(header, 0, sizeof(BITMAPINFOHEADER));
+    header->biSize = sizeof(BITMAPINFOHEADER);
+    header->biWidth = (LONG)format.width;
+    header->biHeight = (LONG)format.height;
+    header->biPlanes = 1;
+    header->biBitCount = format.bitDepth;
+    header->biCompression = BI_RGB;
+    header->biSizeImage = format.stride * format.height;
+    header->biXPelsPerMeter = (LONG)(format.xResolution * 39.3701 + 0.5);
+    header->biYPelsPerMeter = (LONG)(format.yResolution * 39.3701 + 0.5);
+    header->biClrUsed = format.paletteSize;
+}
+
+TW_UINT32 ImagesPerSheet(SimState& s) {
+    return s.config.duplex && CapValue(s, CAP_DUPLEXENABLED) && !s.discardingBacks ? 2 : 1;
+}
+
+// Copies the current image bottom-up into a packed DIB
+void WriteDib(SimState& s, const PageFormat& format, TW_UINT8* dib) {
+    BITMAPINFOHEADER* header = (BITMAPINFOHEADER*)dib;
+    FillInfoHeader(header, format);
+    WritePalette((RGBQUAD*)(dib + sizeof(BITMAPINFOHEADER)), format);
+
+    int side = ImagesPerSheet(s) == 2 ? (int)(s.imageIndex % 2) : 0;
+    const std::vector<TW_UINT8>& page = PageFor(s, format, side);
+    TW_UINT8* bits = dib + sizeof(BITMAPINFOHEADER) + format.paletteSize * sizeof(RGBQUAD);
+    for (TW_UINT32 y = 0; y < format.height; y++) {
+        memcpy(bits + (size_t)(format.height - 1 - y) * format.stride,
+               page.data() + (size_t)y * format.stride, format.stride);
+    }
+    StampImageNumber(bits + (size_t)(format.height - 1) * format.stride, -(long)format.stride, format, s.imageIndex + 1);
+}
+
+size_t DibSize(const PageFormat& format) {
+    return sizeof(BITMAPINFOHEADER) + format.paletteSize * sizeof(RGBQUAD) + (size_t)format.stride * format.height;
+}
+
+// Blocks until the feeder would deliver the next sheet
+void WaitForSheet(SimState& s) {
+    if (s.config.pagesPerMinute <= 0 || s.imageIndex % ImagesPerSheet(s) != 0) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (s.nextSheetDue > now) {
+        Sleep((DWORD)std::chrono::duration_cast<std::chrono::milliseconds>(s.nextSheetDue - now).count());
+    }
+    s.nextSheetDue += std::chrono::microseconds((long long)(60000000.0 / s.config.pagesPerMinute));
+}
+
+void Notify(SimState& s, TW_UINT16 message, std::vector<PendingCallback>& callbacks) {
+    if (s.callbackRegistered && s.callbackProc) {
+        PendingCallback callback;
+        callback.proc = s.callbackProc;
+        callback.source = s.source;
+        callback.app = s.app;
+        callback.refCon = s.callbackRefCon;
+        callback.message = message;
+        callbacks.push_back(callback);
+        return;
+    }
+    s.pendingMessages.push_back(message);
+    PostMessageW(s.parent, WM_USER, 0, 0);
+}
+
+TW_UINT16 TransferDone(SimState& s) {
+    s.state = 7;
+    return TWRC_XFERDONE;
+}
+
+TW_UINT16 HandleSource(SimState& s, TW_UINT32 DG, TW_UINT16 DAT, TW_UINT16 MSG, TW_MEMREF pData,
+                       std::vector<PendingCallback>& callbacks) {
+    if (DG == DG_CONTROL && DAT == DAT_CAPABILITY) {
+        return HandleCapability(s, MSG, (pTW_CAPABILITY)pData);
+    }
+
+    if (DG == DG_CONTROL && DAT == DAT_EVENT && MSG == MSG_PROCESSEVENT) {
+        pTW_EVENT event = (pTW_EVENT)pData;
+        event->TWMessage = MSG_NULL;
+        if (s.pendingMessages.empty()) {
+            return TWRC_NOTDSEVENT;
+        }
+        event->TWMessage = s.pendingMessages.front();
+        s.pendingMessages.pop_front();
+        return TWRC_DSEVENT;
+    }
+
+    if (DG == DG_CONTROL && DAT == DAT_USERINTERFACE) {
+        if (MSG == MSG_ENABLEDS || MSG == MSG_ENABLEDSUIONLY) {
+            if (s.state != 4) return Fail(s, TWCC_SEQERROR);
+            s.state = 5;
+            if (MSG == MSG_ENABLEDSUIONLY) {
+                return TWRC_SUCCESS;
+            }
+
+            s.imageIndex = 0;
+            SimCapability* discard = FindCap(s, ICAP_AUTODISCARDBLANKPAGES);
+            s.discardingBacks = s.config.blankBackSides && discard && discard->current != TWBP_DISABLE;
+            s.pendingImages = s.config.sheetCount * ImagesPerSheet(s);
+            double xferCount = CapValue(s, CAP_XFERCOUNT);
+            if (xferCount > 0 && xferCount < s.pendingImages) {
+                s.pendingImages = (TW_UINT32)xferCount;
+            }
+            s.nextSheetDue = std::chrono::steady_clock::now();
+            if (s.config.pagesPerMinute > 0) {
+                s.nextSheetDue += std::chrono::microseconds((long long)(60000000.0 / s.config.pagesPerMinute));
+            }
+
+            if (s.pendingImages > 0) {
+                s.state = 6;
+                Notify(s, MSG_XFERREADY, callbacks);
+            } else {
+                // Empty feeder: behave like a user closing the source UI
+                Notify(s, MSG_CLOSEDSREQ, callbacks);
+            }
+            return TWRC_SUCCESS;
+        }
+        if (MSG == MSG_DISABLEDS) {
+            if (s.state < 5) return Fail(s, TWCC_SEQERROR);
+            s.pendingImages = 0;
+            s.state = 4;
+            return TWRC_SUCCESS;
+        }
+        return Fail(s, TWCC_BADPROTOCOL);
+    }
+
+    if (DG == DG_CONTROL && DAT == DAT_PENDINGXFERS) {
+        pTW_PENDINGXFERS pending = (pTW_PENDINGXFERS)pData;
+        if (MSG == MSG_GET) {
+            pending->Count = (TW_UINT16)s.pendingImages;
+            return TWRC_SUCCESS;
+        }
+        if (MSG == MSG_ENDXFER || MSG == MSG_RESET) {
+            if (s.state < 6) return Fail(s, TWCC_SEQERROR);
+            if (MSG == MSG_RESET) {
+                s.pendingImages = 0;
+            } else if (s.pendingImages > 0) {
+                // Transferred or skipped in state 6, the image leaves the queue
+                s.pendingImages--;
+                s.imageIndex++;
+            }
+            s.rowsSent = 0;
+            pending->Count = (TW_UINT16)s.pendingImages;
+            if (s.pendingImages == 0) {
+                s.state = 5;
+                if (s.config.closeRequestAfterScan) {
+                    Notify(s, MSG_CLOSEDSREQ, callbacks);
+                }
+            } else {
+                s.state = 6;
+            }
+            return TWRC_SUCCESS;
+        }
+        return Fail(s, TWCC_BADPROTOCOL);
+    }
+
+    if (DG == DG_CONTROL && DAT == DAT_SETUPMEMXFER && MSG == MSG_GET) {
+        if (s.state < 4) return Fail(s, TWCC_SEQERROR);
+        PageFormat format = CurrentFormat(s);
+        pTW_SETUPMEMXFER setup = (pTW_SETUPMEMXFER)pData;
+        setup->MinBufSize = format.rowBytes;
+        setup->MaxBufSize = format.rowBytes * format.height;
+        setup->Preferred = std::max<TW_UINT32>(format.rowBytes, (65536 / format.rowBytes) * format.rowBytes);
+        return TWRC_SUCCESS;
+    }
+
+    if (DG == DG_CONTROL && DAT == DAT_SETUPFILEXFER) {
+        pTW_SETUPFILEXFER setup = (pTW_SETUPFILEXFER)pData;
+        if (MSG == MSG_GET || MSG == MSG_GETDEFAULT) {
+            *setup = s.fileXfer;
+            return TWRC_SUCCESS;
+        }
+        if (MSG == MSG_SET) {
+            if (setup->Format != TWFF_BMP) return Fail(s, TWCC_BADVALUE);
+            s.fileXfer = *setup;
+            return TWRC_SUCCESS;
+        }
+        if (MSG == MSG_RESET) {
+            strcpy_s(s.fileXfer.FileName, sizeof(s.fileXfer.FileName), "TWAIN.TMP");
+            s.fileXfer.Format = TWFF_BMP;
+            *setup = s.fileXfer;
+            return TWRC_SUCCESS;
+        }
+        return Fail(s, TWCC_BADPROTOCOL);
+    }
+
+    if (DG == DG_CONTROL && DAT == DAT_CALLBACK && MSG == MSG_REGISTER_CALLBACK) {
+        if (s.state != 4) return Fail(s, TWCC_SEQERROR);
+        pTW_CALLBACK callback = (pTW_CALLBACK)pData;
+        s.callbackProc = (TWAINCALLBACKPROC)callback->CallBackProc;
+        s.callbackRefCon = (TW_UINT32)(TW_UINTPTR)callback->RefCon;
+        s.callbackRegistered = s.callbackProc != NULL;
+        return TWRC_SUCCESS;
+    }
+
+    if (DG == DG_CONTROL && DAT == DAT_DEVICEEVENT && MSG == MSG_GET) {
+        if (s.deviceEvents.empty()) return Fail(s, TWCC_SEQERROR);
+        *(pTW_DEVICEEVENT)pData = s.deviceEvents.front();
+        s.deviceEvents.pop_front();
+        return TWRC_SUCCESS;
+    }
+
+    if (DG == DG_CONTROL && DAT == DAT_XFERGROUP && MSG == MSG_GET) {
+        *(pTW_UINT32)pData = DG_IMAGE;
+        return TWRC_SUCCESS;
+    }
+
+    if (DG == DG_CONTROL && DAT == DAT_STATUS && MSG == MSG_GET) {
+        pTW_STATUS status = (pTW_STATUS)pData;
+        status->ConditionCode = s.conditionCode;
+        status->Data = 0;
+        s.conditionCode = TWCC_SUCCESS;
+        return TWRC_SUCCESS;
+    }
+
+    if (DG == DG_IMAGE && DAT == DAT_IMAGEINFO && MSG == MSG_GET) {
+        if (s.state < 6) return Fail(s, TWCC_SEQERROR);
+        PageFormat format = CurrentFormat(s);
+        pTW_IMAGEINFO info = (pTW_IMAGEINFO)pData;
+        memset(info, 0, sizeof(TW_IMAGEINFO));
+        WriteItem((TW_UINT8*)&info->XResolution, TWTY_FIX32, format.xResolution);
+        WriteItem((TW_UINT8*)&info->YResolution, TWTY_FIX32, format.yResolution);
+        info->ImageWidth = (TW_INT32)format.width;
+        info->ImageLength = (TW_INT32)format.height;
+        info->SamplesPerPixel = format.bitDepth == 24 ? 3 : 1;
+        for (int i = 0; i < info->SamplesPerPixel; i++) {
+            info->BitsPerSample[i] = format.bitDepth == 24 ? 8 : format.bitDepth;
+        }
+        info->BitsPerPixel = format.bitDepth;
+        info->Planar = FALSE;
+        info->PixelType = PixelTypeFor(format.bitDepth);
+        info->Compression = TWCP_NONE;
+        return TWRC_SUCCESS;
+    }
+
+    if (DG == DG_IMAGE && DAT == DAT_IMAGENATIVEXFER && MSG == MSG_GET) {
+        if (s.state != 6) return Fail(s, TWCC_SEQERROR);
+        if (CapValue(s, ICAP_XFERMECH) != TWSX_NATIVE) return Fail(s, TWCC_SEQERROR);
+        WaitForSheet(s);
+
+        PageFormat format = CurrentFormat(s);
+        TW_HANDLE handle = GlobalAlloc(GHND, DibSize(format));
+        if (!handle) return Fail(s, TWCC_LOWMEMORY);
+        WriteDib(s, format, (TW_UINT8*)GlobalLock(handle));
+        GlobalUnlock(handle);
+
+        *(TW_HANDLE*)pData = handle;
+        return TransferDone(s);
+    }
+
+    if (DG == DG_IMAGE && DAT == DAT_IMAGEMEMXFER && MSG == MSG_GET) {
+        if (s.state != 6 && s.state != 7) return Fail(s, TWCC_SEQERROR);
+        if (CapValue(s, ICAP_XFERMECH) != TWSX_MEMORY) return Fail(s, TWCC_SEQERROR);
+        if (s.state == 6) {
+            WaitForSheet(s);
+            s.rowsSent = 0;
+            s.state = 7;
+        }
+
+        PageFormat format = CurrentFormat(s);
+        pTW_IMAGEMEMXFER xfer = (pTW_IMAGEMEMXFER)pData;
+        TW_UINT32 rows = std::min(xfer->Memory.Length / format.rowBytes, format.height - s.rowsSent);
+        if (rows == 0) return Fail(s, TWCC_BADVALUE);
+
+        bool isHandle = (xfer->Memory.Flags & TWMF_HANDLE) != 0;
+        TW_UINT8* dest = isHandle ? (TW_UINT8*)GlobalLock((TW_HANDLE)xfer->Memory.TheMem) : (TW_UINT8*)xfer->Memory.TheMem;
+        if (!dest) return Fail(s, TWCC_BADVALUE);
+
+        // Memory transfers are top-down with RGB sample order
+        int side = ImagesPerSheet(s) == 2 ? (int)(s.imageIndex % 2) : 0;
+        const std::vector<TW_UINT8>& page = PageFor(s, format, side);
+        for (TW_UINT32 y = 0; y < rows; y++) {
+            const TW_UINT8* src = page.data() + (size_t)(s.rowsSent + y) * format.stride;
+            TW_UINT8* out = dest + (size_t)y * format.rowBytes;
+            if (format.bitDepth == 24) {
+                for (TW_UINT32 x = 0; x < format.width; x++) {
+                    out[x * 3] = src[x * 3 + 2];
+                    out[x * 3 + 1] = src[x * 3 + 1];
+                    out[x * 3 + 2] = src[x * 3];
+                }
+            } else {
+                memcpy(out, src, format.rowBytes);
+            }
+        }
+        if (s.rowsSent == 0) {
+            StampImageNumber(dest, (long)format.rowBytes, format, s.imageIndex + 1);
+        }
+        if (isHandle) {
+            GlobalUnlock((TW_HANDLE)xfer->Memory.TheMem);
+        }
+
+        xfer->Compression = TWCP_NONE;
+        xfer->BytesPerRow = format.rowBytes;
+        xfer->Columns = format.width;
+        xfer->Rows = rows;
+        xfer->XOffset = 0;
+        xfer->YOffset = s.rowsSent;
+        xfer->BytesWritten = rows * format.rowBytes;
+        s.rowsSent += rows;
+        return s.rowsSent >= format.height ? TWRC_XFERDONE : TWRC_SUCCESS;
+    }
+
+    if (DG == DG_IMAGE && DAT == DAT_IMAGEFILEXFER && MSG == MSG_GET) {
+        if (s.state != 6) return Fail(s, TWCC_SEQERROR);
+        if (CapValue(s, ICAP_XFERMECH) != TWSX_FILE) return Fail(s, TWCC_SEQERROR);
+        WaitForSheet(s);
+
+        PageFormat format = CurrentFormat(s);
+        std::vector<TW_UINT8> dib(DibSize(format));
+        WriteDib(s, format, dib.data());
+
+        BITMAPFILEHEADER fileHeader;
+        memset(&fileHeader, 0, sizeof(BITMAPFILEHEADER));
+        fileHeader.bfType = 0x4D42;
+        fileHeader.bfSize = (DWORD)(sizeof(BITMAPFILEHEADER) + dib.size());
+        fileHeader.bfOffBits = (DWORD)(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + format.paletteSize * sizeof(RGBQUAD));
+
+        FILE* file = fopen(s.fileXfer.FileName, "wb");
+        if (!file) return Fail(s, TWCC_FILEWRITEERROR);
+        bool written = fwrite(&fileHeader, sizeof(fileHeader), 1, file) == 1 &&
+                       fwrite(dib.data(), dib.size(), 1, file) == 1;
+        fclose(file);
+        if (!written) return Fail(s, TWCC_FILEWRITEERROR);
+        return TransferDone(s);
+    }
+
+    return Fail(s, TWCC_BADPROTOCOL);
+}
+
+TW_UINT16 HandleManager(SimState& s, pTW_IDENTITY pOrigin, TW_UINT16 DAT, TW_UINT16 MSG, TW_MEMREF pData) {
+    if (DAT == DAT_PARENT) {
+        if (MSG == MSG_OPENDSM) {
+            if (s.dsmOpen) return Fail(s, TWCC_SEQERROR);
+            if (pOrigin->Id == 0) {
+                pOrigin->Id = s.nextAppId++;
+            }
+            pOrigin->SupportedGroups |= DF_DSM2;
+            s.app = *pOrigin;
+            s.parent = pData ? *(HWND*)pData : NULL;
+            s.dsmOpen = true;
+            return TWRC_SUCCESS;
+        }
+        if (MSG == MSG_CLOSEDSM) {
+            if (!s.dsmOpen || s.state > 3) return Fail(s, TWCC_SEQERROR);
+            s.dsmOpen = false;
+            return TWRC_SUCCESS;
+        }
+        return Fail(s, TWCC_BADPROTOCOL);
+    }
+
+    if (!s.dsmOpen) {
+        return Fail(s, TWCC_SEQERROR);
+    }
+
+    if (DAT == DAT_IDENTITY) {
+        pTW_IDENTITY identity = (pTW_IDENTITY)pData;
+        switch (MSG) {
+            case MSG_GETFIRST:
+                s.enumIndex = 0;
+                // fall through
+            case MSG_GETNEXT:
+                if (s.enumIndex >= s.config.sourceCount) {
+                    return TWRC_ENDOFLIST;
+                }
+                *identity = SourceIdentity(s.enumIndex++);
+                return TWRC_SUCCESS;
+
+            case MSG_GETDEFAULT:
+            case MSG_USERSELECT:
+                if (s.config.sourceCount == 0) return Fail(s, TWCC_NODS);
+                *identity = SourceIdentity(0);
+                return TWRC_SUCCESS;
+
+            case MSG_OPENDS: {
+                if (s.state > 3) return Fail(s, TWCC_MAXCONNECTIONS);
+                if (s.config.sourceCount == 0) return Fail(s, TWCC_NODS);
+
+                TW_UINT32 index = 0;
+                if (identity->Id != 0) {
+                    if (identity->Id < kFirstSourceId || identity->Id - kFirstSourceId >= s.config.sourceCount) {
+                        return Fail(s, TWCC_NODS);
+                    }
+                    index = identity->Id - kFirstSourceId;
+                }
+
+                s.source = SourceIdentity(index);
+                *identity = s.source;
+                s.state = 4;
+                s.pendingImages = 0;
+                s.pendingMessages.clear();
+                s.deviceEvents.clear();
+                s.callbackRegistered = false;
+                s.callbackProc = NULL;
+                memset(&s.fileXfer, 0, sizeof(TW_SETUPFILEXFER));
+                strcpy_s(s.fileXfer.FileName, sizeof(s.fileXfer.FileName), "TWAIN.TMP");
+                s.fileXfer.Format = TWFF_BMP;
+                ResetCapabilities(s);
+                return TWRC_SUCCESS;
+            }
+
+            case MSG_CLOSEDS:
+                if (s.state < 4) return Fail(s, TWCC_SEQERROR);
+                s.state = 3;
+                s.callbackRegistered = false;
+                s.callbackProc = NULL;
+                s.pendingMessages.clear();
+                s.deviceEvents.clear();
+                return TWRC_SUCCESS;
+        }
+        return Fail(s, TWCC_BADPROTOCOL);
+    }
+
+    if (DAT == DAT_STATUS && MSG == MSG_GET) {
+        pTW_STATUS status = (pTW_STATUS)pData;
+        status->ConditionCode = s.conditionCode;
+        status->Data = 0;
+        s.conditionCode = TWCC_SUCCESS;
+        return TWRC_SUCCESS;
+    }
+
+    return Fail(s, TWCC_BADPROTOCOL);
+}
+
+}  // namespace
+
+void SimulatedDsm::Configure(const SimulatedScannerConfig& config) {
+    SimState& s = State();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.config = config;
+    s.pageKey = 0;
+    s.pages[0].clear();
+    s.pages[1].clear();
+}
+
+SimulatedScannerConfig SimulatedDsm::Config() {
+    SimState& s = State();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return s.config;
+}
+
+void SimulatedDsm::Enable(bool enabled) {
+    SimState& s = State();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.enabled = enabled;
+}
+
+bool SimulatedDsm::Enabled() {
+#ifndef _WIN32
+    return true;
+#else
+    SimState& s = State();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    const char* env = getenv("TWAIN_SIMULATOR");
+    return s.enabled || (env && *env && strcmp(env, "0") != 0);
+#endif
+}
+
+void SimulatedDsm::RaiseDeviceEvent(TW_UINT16 event) {
+    SimState& s = State();
+    std::vector<PendingCallback> callbacks;
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        SimCapability* requested = s.state >= 4 ? FindCap(s, CAP_DEVICEEVENT) : nullptr;
+        if (!requested || std::find(requested->values.begin(), requested->values.end(), (double)event) == requested->values.end()) {
+            return;
+        }
+
+        TW_DEVICEEVENT deviceEvent;
+        memset(&deviceEvent, 0, sizeof(TW_DEVICEEVENT));
+        deviceEvent.Event = event;
+        strcpy_s(deviceEvent.DeviceName, sizeof(deviceEvent.DeviceName), s.source.ProductName);
+        s.deviceEvents.push_back(deviceEvent);
+        Notify(s, MSG_DEVICEEVENT, callbacks);
+    }
+
+    for (auto& callback : callbacks) {
+        callback.proc(&callback.source, &callback.app, DG_CONTROL, DAT_NULL, callback.message,
+                      (TW_MEMREF)(TW_UINTPTR)callback.refCon);
+    }
+}
+
+TW_UINT32 SimulatedDsm::CallCount(TW_UINT16 dat, TW_UINT16 msg) {
+    SimState& s = State();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.callCounts.find(((TW_UINT32)dat << 16) | msg);
+    return it == s.callCounts.end() ? 0 : it->second;
+}
+
+void SimulatedDsm::FailCall(TW_UINT16 dat, TW_UINT16 msg, TW_UINT32 nth, TW_UINT16 conditionCode) {
+    SimState& s = State();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    InjectedFailure failure = { nth > 0 ? nth : 1, conditionCode };
+    s.failures[((TW_UINT32)dat << 16) | msg] = failure;
+}
+
+void SimulatedDsm::ClearFailures() {
+    SimState& s = State();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.failures.clear();
+}
+
+void SimulatedDsm::ResetCallCounts() {
+    SimState& s = State();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.callCounts.clear();
+}
+
+TW_UINT16 TW_CALLINGSTYLE SimulatedDsm::Entry(pTW_IDENTITY pOrigin, pTW_IDENTITY pDest,
+    TW_UINT32 DG, TW_UINT16 DAT, TW_UINT16 MSG, TW_MEMREF pData) {
+    SimState& s = State();
+    std::vector<PendingCallback> callbacks;
+    TW_UINT16 rc;
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        TW_UINT32 key = ((TW_UINT32)DAT << 16) | MSG;
+        s.callCounts[key]++;
+
+        auto failure = s.failures.find(key);
+        if (failure != s.failures.end() && --failure->second.remaining == 0) {
+            TW_UINT16 conditionCode = failure->second.conditionCode;
+            s.failures.erase(failure);
+            rc = Fail(s, conditionCode);
+        } else if (!pOrigin) {
+            rc = Fail(s, TWCC_BADPROTOCOL);
+        } else if (!pDest) {
+            rc = HandleManager(s, pOrigin, DAT, MSG, pData);
+        } else if (s.state < 4 || pDest->Id != s.source.Id) {
+            rc = Fail(s, TWCC_BADDEST);
+        } else {
+            rc = HandleSource(s, DG, DAT, MSG, pData, callbacks);
+        }
+    }
+
+    // Callbacks run outside the lock; the application may call back in
+    for (auto& callback : callbacks) {
+        callback.proc(&callback.source, &callback.app, DG_CONTROL, DAT_NULL, callback.message,
+                      (TW_MEMREF)(TW_UINTPTR)callback.refCon);
+    }
+    return rc;
+}
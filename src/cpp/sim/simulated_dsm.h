@@ -0,0 +1,70 @@
+#pragma once
+#include "../twain/windows_wrapper.h"
+#include "twain.h"
+
+// Scanner model served by SimulatedDsm
+struct SimulatedScannerConfig {
+    TW_UINT32 pageWidth;          // Pixels per row at resolution
+    TW_UINT32 pageHeight;         // Rows per page at resolution
+    TW_UINT16 resolution;         // Dots per inch
+    TW_UINT16 bitDepth;           // 1, 8 or 24
+    bool duplex;                  // Offers 1-pass duplex; both sides come from one sheet
+    double pagesPerMinute;        // Sheets fed per minute, 0 for no pacing
+    TW_UINT32 sheetCount;         // Sheets in the feeder for each MSG_ENABLEDS
+    TW_UINT32 sourceCount;        // Identities returned by MSG_GETFIRST/MSG_GETNEXT
+    bool closeRequestAfterScan;   // Sends MSG_CLOSEDSREQ once the feeder is empty
+    bool blankBackSides;          // Backs of duplex sheets are blank but for dust
+    bool blankPageDiscard;        // Offers ICAP_AUTODISCARDBLANKPAGES, which drops blank backs
+    double platenBorder;          // Dark platen around the document, as a fraction of each side
+    bool deviceBorderDetection;   // Offers ICAP_AUTOMATICBORDERDETECTION, which removes it
+    double skewDegrees;           // Pages are fed rotated this far, text rising to the right
+    bool deviceDeskew;            // Offers ICAP_AUTOMATICDESKEW, which feeds them straight
+    bool deviceColourDropout;     // Offers ICAP_FILTER, through which grey and bitonal pages lose the stamp
+    bool invertedBackSides;       // Backs of duplex sheets come upside down, as if flipped end over end
+    bool ignoresResolution;       // Scans at resolution whatever ICAP_XRESOLUTION is set to
+
+    // US Letter at 300 dpi, colour, simplex, one sheet
+    SimulatedScannerConfig()
+        : pageWidth(2550), pageHeight(3300), resolution(300), bitDepth(24)
+        , duplex(false), pagesPerMinute(0), sheetCount(1), sourceCount(1)
+        , closeRequestAfterScan(false), blankBackSides(false), blankPageDiscard(false)
+        , platenBorder(0), deviceBorderDetection(false), skewDegrees(0), deviceDeskew(false)
+        , deviceColourDropout(false), invertedBackSides(false), ignoresResolution(false) {}
+};
+
+// In-process Data Source Manager with one or more simulated sources behind
+// it. Entry follows the DSMENTRYPROC contract used by TwainScanner:
+// identity enumeration, MSG_OPENDS/MSG_CLOSEDS, capability negotiation,
+// native, memory and file transfers, pending transfers, DAT_CALLBACK and
+// DAT_DEVICEEVENT. Notifications are posted to the parent window's queue
+// and returned from MSG_PROCESSEVENT unless a callback is registered.
+class SimulatedDsm {
+public:
+    // Takes effect on the next MSG_ENABLEDS; sourceCount applies to the
+    // next enumeration
+    static void Configure(const SimulatedScannerConfig& config);
+    static SimulatedScannerConfig Config();
+
+    // Used in place of twain_32.dll when enabled, when TWAIN_SIMULATOR is
+    // set in the environment, and always on platforms without TWAIN
+    static void Enable(bool enabled);
+    static bool Enabled();
+
+    // Queues a TW_DEVICEEVENT on the open source if the application asked
+    // for it through CAP_DEVICEEVENT. Safe to call from any thread.
+    static void RaiseDeviceEvent(TW_UINT16 event);
+
+    // Fails the nth next DAT/MSG call with TWRC_FAILURE and conditionCode
+    // before it reaches the source, which is left as it was. Failures are
+    // one-shot; ClearFailures drops those not yet reached.
+    static void FailCall(TW_UINT16 dat, TW_UINT16 msg, TW_UINT32 nth = 1,
+        TW_UINT16 conditionCode = TWCC_OPERATIONERROR);
+    static void ClearFailures();
+
+    // Number of calls per DAT/MSG pair since the last reset
+    static TW_UINT32 CallCount(TW_UINT16 dat, TW_UINT16 msg);
+    static void ResetCallCounts();
+
+    static TW_UINT16 TW_CALLINGSTYLE Entry(pTW_IDENTITY pOrigin, pTW_IDENTITY pDest,
+        TW_UINT32 DG, TW_UINT16 DAT, TW_UINT16 MSG, TW_MEMREF pData);
+};
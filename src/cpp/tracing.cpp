@@ -0,0 +1,267 @@
+#include "tracing.h"
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> Tracer::s_Enabled(false);
+
+namespace {
+
+struct TraceEvent {
+    const char* category;
+    const char* name;
+    uint64_t start;
+    uint64_t duration;
+    TraceArg args[Tracer::kMaxArgs];
+    int argCount;
+};
+
+const size_t kChunkEvents = 1024;
+const size_t kMaxChunks = 1024;  // About 1M events per thread per session
+
+// Written by the owning thread only. count is published with release
+// after the event it covers, so the reader sees whole events.
+struct TraceChunk {
+    TraceEvent events[kChunkEvents];
+    std::atomic<size_t> count;
+    std::atomic<TraceChunk*> next;
+
+    TraceChunk() : count(0), next(nullptr) {}
+};
+
+struct ThreadBuffer {
+    uint32_t tid;
+    std::atomic<const char*> name;
+    std::atomic<uint32_t> session;   // Session the chunks belong to
+    std::atomic<uint64_t> dropped;
+    TraceChunk* head;
+    TraceChunk* tail;                // Owning thread only
+    size_t chunkCount;               // Owning thread only
+
+    ThreadBuffer(uint32_t id, const char* threadName)
+        : tid(id), name(threadName), session(0), dropped(0)
+        , head(new TraceChunk()), tail(head), chunkCount(1) {}
+
+    ~ThreadBuffer() {
+        while (head) {
+            TraceChunk* next = head->next.load(std::memory_order_relaxed);
+            delete head;
+            head = next;
+        }
+    }
+};
+
+// Buffers live for the whole process so a thread that records while a
+// session ends never writes into freed memory
+std::mutex g_RegistryMutex;
+std::vector<std::unique_ptr<ThreadBuffer>> g_Buffers;
+
+std::mutex g_SessionMutex;
+std::atomic<uint32_t> g_Session(0);
+std::string g_Path;
+uint64_t g_SessionStart = 0;
+
+// A thread gets a buffer on its first event, so naming a thread or
+// running with tracing off costs no memory
+thread_local ThreadBuffer* t_Buffer = nullptr;
+thread_local const char* t_ThreadName = nullptr;
+
+ThreadBuffer* LocalBuffer() {
+    if (!t_Buffer) {
+        std::lock_guard<std::mutex> lock(g_RegistryMutex);
+        g_Buffers.emplace_back(new ThreadBuffer((uint32_t)g_Buffers.size() + 1, t_ThreadName));
+        t_Buffer = g_Buffers.back().get();
+    }
+    return t_Buffer;
+}
+
+// First event of a new session on this thread: reuse the chunks
+void ResetBuffer(ThreadBuffer* buffer, uint32_t session) {
+    for (TraceChunk* chunk = buffer->head; chunk; chunk = chunk->next.load(std::memory_order_relaxed)) {
+        chunk->count.store(0, std::memory_order_relaxed);
+    }
+    buffer->tail = buffer->head;
+    buffer->dropped.store(0, std::memory_order_relaxed);
+    buffer->session.store(session, std::memory_order_release);
+}
+
+void WriteString(FILE* file, const char* text) {
+    fputc('"', file);
+    for (const char* c = text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', file);
+            fputc(*c, file);
+        } else if ((unsigned char)*c < 0x20) {
+            fprintf(file, "\\u%04x", (unsigned char)*c);
+        } else {
+            fputc(*c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+void WriteEvent(FILE* file, const TraceEvent& event, uint32_t tid, uint64_t sessionStart) {
+    // Events that began before Start are clipped to the session
+    uint64_t start = event.start > sessionStart ? event.start - sessionStart : 0;
+    fprintf(file, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"cat\":",
+        tid, start / 1000.0, event.duration / 1000.0);
+    WriteString(file, event.category);
+    fputs(",\"name\":", file);
+    WriteString(file, event.name);
+    if (event.argCount > 0) {
+        fputs(",\"args\":{", file);
+        for (int i = 0; i < event.argCount; i++) {
+            if (i) fputc(',', file);
+            WriteString(file, event.args[i].key);
+            fputc(':', file);
+            if (event.args[i].text) {
+                WriteString(file, event.args[i].text);
+            } else {
+                fprintf(file, "%lld", (long long)event.args[i].value);
+            }
+        }
+        fputc('}', file);
+    }
+    fputc('}', file);
+}
+
+}  // namespace
+
+uint64_t Tracer::Now() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool Tracer::Start(const std::string& path, std::string& error) {
+    std::lock_guard<std::mutex> lock(g_SessionMutex);
+    if (s_Enabled.load()) {
+        error = "A trace is already being recorded to " + g_Path;
+        return false;
+    }
+
+    // Fail now rather than after the session
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        error = "Cannot write trace file " + path;
+        return false;
+    }
+    fclose(file);
+
+    g_Path = path;
+    g_SessionStart = Now();
+    g_Session.fetch_add(1, std::memory_order_release);
+    s_Enabled.store(true, std::memory_order_release);
+    return true;
+}
+
+Tracer::Summary Tracer::Stop() {
+    Summary summary;
+    std::lock_guard<std::mutex> lock(g_SessionMutex);
+    if (!s_Enabled.load()) {
+        summary.errorMessage = "No trace is being recorded";
+        return summary;
+    }
+    s_Enabled.store(false, std::memory_order_release);
+    summary.path = g_Path;
+
+    FILE* file = fopen(g_Path.c_str(), "wb");
+    if (!file) {
+        summary.errorMessage = "Cannot write trace file " + g_Path;
+        return summary;
+    }
+
+    uint32_t session = g_Session.load(std::memory_order_acquire);
+    std::vector<ThreadBuffer*> buffers;
+    {
+        std::lock_guard<std::mutex> registry(g_RegistryMutex);
+        for (auto& buffer : g_Buffers) {
+            buffers.push_back(buffer.get());
+        }
+    }
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+    fputs("{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"scanner_addon\"}}", file);
+
+    // A thread still inside Complete may add events past the counts read
+    // here; those are left out
+    for (ThreadBuffer* buffer : buffers) {
+        if (buffer->session.load(std::memory_order_acquire) != session) {
+            continue;
+        }
+        const char* name = buffer->name.load(std::memory_order_relaxed);
+        if (name) {
+            fprintf(file, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":", buffer->tid);
+            WriteString(file, name);
+            fputs("}}", file);
+        }
+        for (TraceChunk* chunk = buffer->head; chunk; chunk = chunk->next.load(std::memory_order_acquire)) {
+            size_t count = chunk->count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < count; i++) {
+                WriteEvent(file, chunk->events[i], buffer->tid, g_SessionStart);
+            }
+            summary.eventCount += count;
+            if (count < kChunkEvents) {
+                break;
+            }
+        }
+        summary.droppedCount += buffer->dropped.load(std::memory_order_relaxed);
+    }
+
+    fputs("\n]}\n", file);
+    summary.success = fclose(file) == 0;
+    if (!summary.success) {
+        summary.errorMessage = "Failed to write trace file " + g_Path;
+    }
+    return summary;
+}
+
+void Tracer::Complete(const char* category, const char* name, uint64_t startNs, uint64_t durationNs,
+    const TraceArg* args, int argCount) {
+    // Acquire pairs with Start so the new session number is visible
+    if (!s_Enabled.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    ThreadBuffer* buffer = LocalBuffer();
+    uint32_t session = g_Session.load(std::memory_order_acquire);
+    if (buffer->session.load(std::memory_order_relaxed) != session) {
+        ResetBuffer(buffer, session);
+    }
+
+    TraceChunk* chunk = buffer->tail;
+    size_t count = chunk->count.load(std::memory_order_relaxed);
+    if (count == kChunkEvents) {
+        TraceChunk* next = chunk->next.load(std::memory_order_relaxed);
+        if (!next) {
+            if (buffer->chunkCount >= kMaxChunks) {
+                buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            next = new TraceChunk();
+            buffer->chunkCount++;
+            chunk->next.store(next, std::memory_order_release);
+        }
+        buffer->tail = chunk = next;
+        count = 0;
+    }
+
+    TraceEvent& event = chunk->events[count];
+    event.category = category;
+    event.name = name;
+    event.start = startNs;
+    event.duration = durationNs;
+    event.argCount = argCount < kMaxArgs ? argCount : kMaxArgs;
+    for (int i = 0; i < event.argCount; i++) {
+        event.args[i] = args[i];
+    }
+    chunk->count.store(count + 1, std::memory_order_release);
+}
+
+void Tracer::SetThreadName(const char* name) {
+    t_ThreadName = name;
+    if (t_Buffer) {
+        t_Buffer->name.store(name, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Opt-in recorder of Chrome trace events ("ph": "X"), written as JSON that
+// chrome://tracing and Perfetto open directly. A session runs from Start
+// to Stop and produces one file.
+//
+// Each thread appends to its own chunked buffer without locking; only the
+// first event a thread records takes a lock to register the buffer. While
+// no session is running every entry point returns after one relaxed load.
+
+// Argument of a trace event. Keys and text must be string literals.
+struct TraceArg {
+    const char* key;
+    const char* text;   // Shown instead of value when set
+    int64_t value;
+};
+
+class Tracer {
+public:
+    static const int kMaxArgs = 4;
+
+    struct Summary {
+        bool success;
+        std::string path;
+        std::string errorMessage;
+        uint64_t eventCount;
+        uint64_t droppedCount;  // Events past the per-thread cap
+
+        Summary() : success(false), eventCount(0), droppedCount(0) {}
+    };
+
+    static bool Enabled() { return s_Enabled.load(std::memory_order_relaxed); }
+
+    // Fails if a session is already running
+    static bool Start(const std::string& path, std::string& error);
+
+    // Ends the session and writes its file
+    static Summary Stop();
+
+    // Monotonic nanoseconds
+    static uint64_t Now();
+
+    // Category, name and arg strings must be string literals
+    static void Complete(const char* category, const char* name, uint64_t startNs, uint64_t durationNs,
+        const TraceArg* args = nullptr, int argCount = 0);
+
+    // Label for the calling thread in the trace; a string literal
+    static void SetThreadName(const char* name);
+
+private:
+    static std::atomic<bool> s_Enabled;
+};
+
+// Records a complete event covering its own lifetime
+class TraceScope {
+public:
+    TraceScope(const char* category, const char* name)
+        : m_Category(category), m_Name(name), m_Active(Tracer::Enabled())
+        , m_Start(m_Active ? Tracer::Now() : 0), m_ArgCount(0) {}
+
+    ~TraceScope() {
+        if (m_Active) {
+            Tracer::Complete(m_Category, m_Name, m_Start, Tracer::Now() - m_Start, m_Args, m_ArgCount);
+        }
+    }
+
+    void AddArg(const char* key, int64_t value) {
+        if (m_Active && m_ArgCount < Tracer::kMaxArgs) {
+            TraceArg arg = { key, nullptr, value };
+            m_Args[m_ArgCount++] = arg;
+        }
+    }
+
+    void AddArg(const char* key, const char* text) {
+        if (m_Active && m_ArgCount < Tracer::kMaxArgs) {
+            TraceArg arg = { key, text, 0 };
+            m_Args[m_ArgCount++] = arg;
+        }
+    }
+
+private:
+    TraceScope(const TraceScope&);
+    TraceScope& operator=(const TraceScope&);
+
+    const char* m_Category;
+    const char* m_Name;
+    bool m_Active;
+    uint64_t m_Start;
+    TraceArg m_Args[Tracer::kMaxArgs];
+    int m_ArgCount;
+};
@@ -10,5 +10,6 @@ typedef HANDLE TW_HANDLE;
 typedef LPVOID TW_MEMREF;
 typedef UINT_PTR TW_UINTPTR;
 #else
-// Non-Windows definitions if needed
-#endif
\ No newline at end of file
+// Win32 subset used by the scanner core; pairs with the simulated DSM
+#include "../platform/win32_compat.h"
+#endif
@@ -0,0 +1,217 @@
+#include "twain_thread.h"
+#include "tracing.h"
+#include <chrono>
+
+namespace {
+
+std::mutex g_DetachedMutex;
+std::condition_variable g_DetachedExited;
+size_t g_DetachedCount = 0;
+
+}  // namespace
+
+TwainThread::TwainThread()
+    : m_IdleInterval(1000)
+    , m_Stopping(false)
+    , m_Detached(false)
+{
+#ifdef _WIN32
+    m_WakeEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+#endif
+}
+
+TwainThread::~TwainThread() {
+    Stop();
+#ifdef _WIN32
+    if (m_WakeEvent) {
+        CloseHandle(m_WakeEvent);
+    }
+#endif
+}
+
+void TwainThread::Start() {
+    if (m_Thread.joinable()) {
+        return;
+    }
+    m_Stopping = false;
+    m_Thread = std::thread(&TwainThread::Main, shared_from_this());
+}
+
+void TwainThread::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stopping = true;
+    }
+    Wake();
+    if (m_Thread.joinable()) {
+        m_Thread.join();
+    }
+}
+
+void TwainThread::Detach() {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (!m_Thread.joinable()) {
+            return;
+        }
+        m_Stopping = true;
+        m_Detached = true;
+        m_Thread.detach();
+
+        std::lock_guard<std::mutex> detachedLock(g_DetachedMutex);
+        g_DetachedCount++;
+    }
+    Wake();
+}
+
+void TwainThread::RunDetached(std::function<void()> work) {
+    {
+        std::lock_guard<std::mutex> lock(g_DetachedMutex);
+        g_DetachedCount++;
+    }
+    std::thread([work]() mutable {
+        work();
+        work = nullptr;
+
+        std::lock_guard<std::mutex> lock(g_DetachedMutex);
+        g_DetachedCount--;
+        g_DetachedExited.notify_all();
+    }).detach();
+}
+
+void TwainThread::WaitForDetached() {
+    std::unique_lock<std::mutex> lock(g_DetachedMutex);
+    g_DetachedExited.wait(lock, []() { return g_DetachedCount == 0; });
+}
+
+void TwainThread::SetIdleHandler(std::function<void()> handler, unsigned intervalMs) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_IdleHandler = handler;
+    m_IdleInterval = intervalMs;
+}
+
+void TwainThread::SetMessageHandler(std::function<bool(MSG&)> handler) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_MessageHandler = handler;
+}
+
+void TwainThread::Enqueue(const char* name, std::function<void()> task) {
+    Task queued;
+    queued.name = name;
+    queued.postedAt = Tracer::Enabled() ? Tracer::Now() : 0;
+    queued.run = std::move(task);
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Tasks.push_back(std::move(queued));
+    }
+    Wake();
+}
+
+void TwainThread::Wake() {
+#ifdef _WIN32
+    SetEvent(m_WakeEvent);
+#else
+    m_Wake.notify_one();
+#endif
+}
+
+void TwainThread::PumpMessages() {
+#ifdef _WIN32
+    // Posted and sent messages for the DSM parent window and the message
+    // window, which would otherwise go unanswered between scans
+    std::function<bool(MSG&)> handler;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        handler = m_MessageHandler;
+    }
+
+    MSG msg;
+    while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+        if (handler && handler(msg)) {
+            continue;
+        }
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
+    }
+#endif
+}
+
+// Holds the thread's own reference. A detached thread drops it, which
+// may destroy this TwainThread, before it counts itself as exited.
+void TwainThread::Main(std::shared_ptr<TwainThread> self) {
+    self->Run();
+
+    bool detached;
+    {
+        std::lock_guard<std::mutex> lock(self->m_Mutex);
+        detached = self->m_Detached;
+    }
+    self.reset();
+
+    if (detached) {
+        std::lock_guard<std::mutex> lock(g_DetachedMutex);
+        g_DetachedCount--;
+        g_DetachedExited.notify_all();
+    }
+}
+
+void TwainThread::Run() {
+    typedef std::chrono::steady_clock Clock;
+
+    Tracer::SetThreadName("TWAIN thread");
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    Clock::time_point idleAt = Clock::now() + std::chrono::milliseconds(m_IdleInterval);
+
+    while (true) {
+        lock.unlock();
+        PumpMessages();
+        lock.lock();
+
+        // Drain queued work before honouring a stop request so pending
+        // cleanup tasks still run
+        if (m_Tasks.empty()) {
+            if (m_Stopping) {
+                break;
+            }
+
+            Clock::time_point now = Clock::now();
+            if (now >= idleAt) {
+                idleAt = now + std::chrono::milliseconds(m_IdleInterval);
+                if (m_IdleHandler) {
+                    std::function<void()> idle = m_IdleHandler;
+                    lock.unlock();
+                    {
+                        TraceScope scope("task", "idle");
+                        idle();
+                    }
+                    lock.lock();
+                }
+                continue;
+            }
+
+#ifdef _WIN32
+            // Wakes for a posted task, a stop request or any new message
+            DWORD timeout = (DWORD)std::chrono::duration_cast<std::chrono::milliseconds>(idleAt - now).count() + 1;
+            lock.unlock();
+            MsgWaitForMultipleObjectsEx(1, &m_WakeEvent, timeout, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+            lock.lock();
+#else
+            m_Wake.wait_until(lock, idleAt, [this]() { return m_Stopping || !m_Tasks.empty(); });
+#endif
+            continue;
+        }
+
+        Task task = std::move(m_Tasks.front());
+        m_Tasks.pop_front();
+        lock.unlock();
+        {
+            TraceScope scope("task", task.name);
+            if (task.postedAt) {
+                scope.AddArg("queuedUs", (int64_t)((Tracer::Now() - task.postedAt) / 1000));
+            }
+            task.run();
+        }
+        lock.lock();
+        idleAt = Clock::now() + std::chrono::milliseconds(m_IdleInterval);
+    }
+}
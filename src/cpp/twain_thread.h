@@ -0,0 +1,93 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "twain/windows_wrapper.h"
+
+// Single native thread that owns every DSM call for one scanner.
+// TWAIN expects the DSM, the source and its parent window to be driven
+// from one thread, so the addon posts work here instead of calling the
+// scanner from the JS thread or the libuv pool. On Windows the thread
+// also pumps its message queue between tasks, since the windows it
+// creates belong to it.
+//
+// Owned through std::shared_ptr: the running thread holds a reference
+// to itself, so an owner may drop its own without waiting for it.
+class TwainThread : public std::enable_shared_from_this<TwainThread> {
+public:
+    TwainThread();
+    ~TwainThread();
+
+    void Start();
+
+    // Runs the queued tasks, then waits for the thread to exit
+    void Stop();
+
+    // Runs the queued tasks and lets the thread exit on its own, for
+    // owners that must not block, such as a GC finalizer
+    void Detach();
+
+    // Runs work on a short-lived thread of its own, for work that does
+    // not touch the DSM. WaitForDetached waits for it too.
+    static void RunDetached(std::function<void()> work);
+
+    // Blocks until every detached thread has exited, for environment
+    // teardown
+    static void WaitForDetached();
+
+    // Queues task and returns a future for its result. Tasks run in
+    // the order they were posted. name labels the task in traces and
+    // must be a string literal.
+    template <typename F>
+    auto Post(const char* name, F task) -> std::future<decltype(task())> {
+        typedef decltype(task()) R;
+        auto packaged = std::make_shared<std::packaged_task<R()>>(std::move(task));
+        std::future<R> future = packaged->get_future();
+        Enqueue(name, [packaged]() { (*packaged)(); });
+        return future;
+    }
+
+    template <typename F>
+    auto Post(F task) -> std::future<decltype(task())> {
+        return Post("task", std::move(task));
+    }
+
+    // Runs handler every intervalMs while no task is queued
+    void SetIdleHandler(std::function<void()> handler, unsigned intervalMs);
+
+    // Offered each message pumped between tasks before it is dispatched;
+    // returns true when it consumed the message
+    void SetMessageHandler(std::function<bool(MSG&)> handler);
+
+private:
+    struct Task {
+        const char* name;
+        uint64_t postedAt;  // Tracer::Now() when tracing, else 0
+        std::function<void()> run;
+    };
+
+    void Enqueue(const char* name, std::function<void()> task);
+    static void Main(std::shared_ptr<TwainThread> self);
+    void Run();
+    void Wake();
+    void PumpMessages();
+
+    std::thread m_Thread;
+    std::mutex m_Mutex;
+#ifdef _WIN32
+    HANDLE m_WakeEvent;  // Auto-reset, waited on alongside the message queue
+#else
+    std::condition_variable m_Wake;
+#endif
+    std::deque<Task> m_Tasks;
+    std::function<void()> m_IdleHandler;
+    std::function<bool(MSG&)> m_MessageHandler;
+    unsigned m_IdleInterval;
+    bool m_Stopping;
+    bool m_Detached;
+};
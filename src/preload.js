@@ -1,4 +1,31 @@
 const { contextBridge, ipcRenderer } = require("electron");
+const fs = require("fs");
+const os = require("os");
+const path = require("path");
+
+// Traces, recordings and logs are only written here; the renderer may
+// name a file in it but not choose where it goes
+const diagnosticsDir = path.join(
+  process.env.LOCALAPPDATA || os.homedir(),
+  "TwainScanner",
+  "diagnostics"
+);
+
+const badFileName = {
+  success: false,
+  errorMessage: "Expected a file name without a directory",
+};
+
+// Full path for name, or defaultName when none is given; null unless it
+// is a plain file name
+function diagnosticsPath(name, defaultName) {
+  const fileName = name === undefined || name === null ? defaultName : name;
+  if (typeof fileName !== "string" || !/^[\w-][\w.-]*$/.test(fileName)) {
+    return null;
+  }
+  fs.mkdirSync(diagnosticsDir, { recursive: true });
+  return path.join(diagnosticsDir, fileName);
+}
 
 // Load the scanner addon
 let scannerInstance = null;
@@ -19,6 +46,23 @@ try {
 
   scannerInstance = new Scanner();
   console.log("Scanner instance created");
+
+  // Persist probed capabilities so the next launch can skip the probe
+  const cacheDir = path.join(
+    process.env.LOCALAPPDATA || os.homedir(),
+    "TwainScanner"
+  );
+  fs.mkdirSync(cacheDir, { recursive: true });
+  scannerInstance.setCapabilityCachePath(
+    path.join(cacheDir, "capabilities.cache")
+  );
+
+  // Load the DSM and enumerate sources in the background so the first
+  // initialize() only has to await the result
+  scannerInstance
+    .warmUp()
+    .then((result) => console.log("Scanner warm-up finished:", result.timings))
+    .catch((error) => console.error("Scanner warm-up failed:", error));
 } catch (error) {
   console.error("Failed to initialize scanner:", error);
 }
@@ -40,12 +84,143 @@ contextBridge.exposeInMainWorld("scanner", {
     return scannerInstance.isDuplexSupported();
   },
 
-  scan: (showUI = true) => {
+  scan: (options = true) => {
     if (!scannerInstance) {
       return Promise.reject(new Error("Scanner not initialized"));
     }
     console.log("Calling scan");
-    return scannerInstance.scan(showUI);
+    return scannerInstance.scan(options);
+  },
+
+  listDevices: (options) => {
+    if (!scannerInstance) {
+      return Promise.reject(new Error("Scanner not initialized"));
+    }
+    return scannerInstance.listDevices(options);
+  },
+
+  // callback receives { type, deviceId, deviceName, code } for arrivals,
+  // removals and status events such as paper jams
+  startDeviceMonitor: (callback, options) => {
+    if (!scannerInstance) {
+      return Promise.reject(new Error("Scanner not initialized"));
+    }
+    return scannerInstance.startDeviceMonitor(callback, options);
+  },
+
+  stopDeviceMonitor: () => {
+    if (!scannerInstance) {
+      return Promise.reject(new Error("Scanner not initialized"));
+    }
+    return scannerInstance.stopDeviceMonitor();
+  },
+
+  getCapabilities: (options) => {
+    if (!scannerInstance) {
+      return Promise.reject(new Error("Scanner not initialized"));
+    }
+    return scannerInstance.getCapabilities(options);
+  },
+
+  revalidateCapabilities: () => {
+    if (!scannerInstance) {
+      return Promise.reject(new Error("Scanner not initialized"));
+    }
+    return scannerInstance.revalidateCapabilities();
+  },
+
+  setSessionOptions: (options) => {
+    if (!scannerInstance) {
+      return Promise.reject(new Error("Scanner not initialized"));
+    }
+    return scannerInstance.setSessionOptions(options);
+  },
+
+  closeSession: () => {
+    if (!scannerInstance) {
+      return Promise.reject(new Error("Scanner not initialized"));
+    }
+    return scannerInstance.closeSession();
+  },
+
+  // Per-device stage latency histograms; { reset: true } starts a new window
+  getStats: (options) => {
+    if (!scannerInstance) {
+      return Promise.reject(new Error("Scanner not initialized"));
+    }
+    return scannerInstance.getStats(options);
+  },
+
+  resetStats: () => {
+    if (!scannerInstance) {
+      return Promise.reject(new Error("Scanner not initialized"));
+    }
+    return scannerInstance.resetStats();
+  },
+
+  // Records DSM calls, pipeline stages and thread tasks until stopTrace()
+  // and writes them as a Chrome trace (chrome://tracing or Perfetto) to
+  // name in the diagnostics directory
+  startTrace: (name) => {
+    if (!scannerInstance) {
+      return Promise.reject(new Error("Scanner not initialized"));
+    }
+    const file = diagnosticsPath(name, "scanner-trace.json");
+    return file ? scannerInstance.startTrace(file) : badFileName;
+  },
+
+  stopTrace: () => {
+    if (!scannerInstance) {
+      return Promise.reject(new Error("Scanner not initialized"));
+    }
+    return scannerInstance.stopTrace();
+  },
+
+  // Records every DSM call and the data it returns until stopRecording(),
+  // to name in the diagnostics directory
+  startRecording: (name) => {
+    if (!scannerInstance) {
+      return Promise.reject(new Error("Scanner not initialized"));
+    }
+    const file = diagnosticsPath(name, "scanner-session.twrec");
+    return file ? scannerInstance.startRecording(file) : badFileName;
+  },
+
+  stopRecording: () => {
+    if (!scannerInstance) {
+      return Promise.reject(new Error("Scanner not initialized"));
+    }
+    return scannerInstance.stopRecording();
+  },
+
+  // level ("debug", "info", "warn", "error", "off") and the console and
+  // file switches; the file is scanner.log in the diagnostics directory,
+  // rotated at the addon's default size
+  setLogOptions: (options) => {
+    if (!scannerInstance) {
+      return Promise.reject(new Error("Scanner not initialized"));
+    }
+    const { level, console: toConsole, file } = options || {};
+    const log = {};
+    if (level !== undefined) {
+      log.level = level;
+    }
+    if (typeof toConsole === "boolean") {
+      log.console = toConsole;
+    }
+    if (typeof file === "boolean") {
+      log.file = file ? diagnosticsPath("scanner.log") : null;
+    }
+    return scannerInstance.setLogOptions(log);
+  },
+
+  // callback receives arrays of { level, time, thread, deviceId, page, rc,
+  // message }; pass null to stop
+  onLog: (callback) => {
+    if (!scannerInstance) {
+      return Promise.reject(new Error("Scanner not initialized"));
+    }
+    return scannerInstance.onLog(callback);
   },
 
   cleanup: () => {
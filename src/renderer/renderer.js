@@ -22,6 +22,7 @@ async function initializeScanner() {
     updateStatus("Initializing scanner...");
 
     const result = await window.scanner.initialize();
+    console.log("Initialize timings:", result.timings);
 
     if (result.success) {
       // Check duplex support